@@ -0,0 +1,148 @@
+#include "Backend.hpp"
+#include "Graphics.hpp"
+#include "StateCache.hpp"
+
+CComPtr<ID3D11Texture2D> D3D11Backend::createTexture2D(const D3D11_TEXTURE2D_DESC &desc,
+                                                       const D3D11_SUBRESOURCE_DATA *initialData)
+{
+    CComPtr<ID3D11Texture2D> texture;
+    checkHR(device->CreateTexture2D(&desc, initialData, &texture));
+    return texture;
+}
+
+CComPtr<ID3D11Buffer> D3D11Backend::createBuffer(const D3D11_BUFFER_DESC &desc,
+                                                 const D3D11_SUBRESOURCE_DATA *initialData)
+{
+    CComPtr<ID3D11Buffer> buffer;
+    checkHR(device->CreateBuffer(&desc, initialData, &buffer));
+    return buffer;
+}
+
+void D3D11Backend::writeBuffer(ID3D11Buffer *buffer, D3D11_MAP map, UINT offset,
+                               const void *data, size_t bytes)
+{
+    D3D11_MAPPED_SUBRESOURCE mapped;
+    checkHR(context->Map(buffer, 0, map, 0, &mapped));
+    memcpy(static_cast<uint8_t *>(mapped.pData) + offset, data, bytes);
+    context->Unmap(buffer, 0);
+}
+
+void D3D11Backend::bindPipeline(const PipelineState &state)
+{
+    context->VSSetShader(state.vs, nullptr, 0);
+    context->HSSetShader(state.hs, nullptr, 0);
+    context->DSSetShader(state.ds, nullptr, 0);
+    context->PSSetShader(state.ps, nullptr, 0);
+    context->IASetPrimitiveTopology(state.primitiveTopology);
+    context->IASetInputLayout(state.inputLayout);
+    context->RSSetState(state.rasterizerState);
+    context->OMSetBlendState(state.blendState, nullptr, -1);
+    context->OMSetDepthStencilState(state.depthStencilState, state.stencilRef);
+}
+
+void D3D11Backend::setDepthStencilState(ID3D11DepthStencilState *state, UINT stencilRef)
+{
+    context->OMSetDepthStencilState(state, stencilRef);
+}
+
+void D3D11Backend::setConstantBuffer(ShaderStage stage, UINT slot, ID3D11Buffer *buffer,
+                                     UINT firstConstant, UINT numConstants)
+{
+    switch (stage)
+    {
+    case ShaderStage::VS: context1->VSSetConstantBuffers1(slot, 1, &buffer, &firstConstant, &numConstants); break;
+    case ShaderStage::HS: context1->HSSetConstantBuffers1(slot, 1, &buffer, &firstConstant, &numConstants); break;
+    case ShaderStage::DS: context1->DSSetConstantBuffers1(slot, 1, &buffer, &firstConstant, &numConstants); break;
+    case ShaderStage::PS: context1->PSSetConstantBuffers1(slot, 1, &buffer, &firstConstant, &numConstants); break;
+    }
+}
+
+void D3D11Backend::setShaderResources(ShaderStage stage, UINT slot, UINT count,
+                                      ID3D11ShaderResourceView * const *srvs)
+{
+    switch (stage)
+    {
+    case ShaderStage::VS: context->VSSetShaderResources(slot, count, srvs); break;
+    case ShaderStage::HS: context->HSSetShaderResources(slot, count, srvs); break;
+    case ShaderStage::DS: context->DSSetShaderResources(slot, count, srvs); break;
+    case ShaderStage::PS: context->PSSetShaderResources(slot, count, srvs); break;
+    }
+}
+
+void D3D11Backend::setSamplers(ShaderStage stage, UINT slot, UINT count,
+                               ID3D11SamplerState * const *samplers)
+{
+    switch (stage)
+    {
+    case ShaderStage::VS: context->VSSetSamplers(slot, count, samplers); break;
+    case ShaderStage::HS: context->HSSetSamplers(slot, count, samplers); break;
+    case ShaderStage::DS: context->DSSetSamplers(slot, count, samplers); break;
+    case ShaderStage::PS: context->PSSetSamplers(slot, count, samplers); break;
+    }
+}
+
+void D3D11Backend::setRenderTargets(UINT count, ID3D11RenderTargetView * const *rtvs,
+                                    ID3D11DepthStencilView *dsv)
+{
+    context->OMSetRenderTargets(count, rtvs, dsv);
+}
+
+void D3D11Backend::setViewport(const D3D11_VIEWPORT &viewport)
+{
+    context->RSSetViewports(1, &viewport);
+}
+
+void D3D11Backend::setUnorderedAccessView(UINT slot, ID3D11UnorderedAccessView *uav)
+{
+    context->OMSetRenderTargetsAndUnorderedAccessViews(
+        D3D11_KEEP_RENDER_TARGETS_AND_DEPTH_STENCIL, nullptr, nullptr,
+        slot, 1, &uav, nullptr);
+}
+
+void D3D11Backend::clearRenderTarget(ID3D11RenderTargetView *rtv, const float color[4])
+{
+    context->ClearRenderTargetView(rtv, color);
+}
+
+void D3D11Backend::clearDepthStencil(ID3D11DepthStencilView *dsv, UINT flags, float depth, UINT8 stencil)
+{
+    context->ClearDepthStencilView(dsv, flags, depth, stencil);
+}
+
+void D3D11Backend::draw(UINT vertexCount, UINT startVertex)
+{
+    context->Draw(vertexCount, startVertex);
+}
+
+void D3D11Backend::drawIndexed(UINT indexCount, UINT instances)
+{
+    if (instances == 1)
+        context->DrawIndexed(indexCount, 0, 0);
+    else
+        context->DrawIndexedInstanced(indexCount, instances, 0, 0, 0);
+}
+
+Backend &d3d11Backend()
+{
+    static D3D11Backend d3d11;
+    return d3d11;
+}
+
+StateCache &stateCache()
+{
+    static StateCache cache(d3d11Backend());
+    return cache;
+}
+
+thread_local Backend *backend = nullptr;
+
+BackendScope::BackendScope(Backend &b)
+    : previous(backend)
+{
+    backend = &b;
+}
+
+BackendScope::~BackendScope()
+{
+    backend = previous;
+}
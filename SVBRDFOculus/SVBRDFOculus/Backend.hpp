@@ -0,0 +1,210 @@
+#pragma once
+
+#include "Utils.hpp"
+
+#include <d3d11.h>
+#include <d3d11_1.h>
+
+#include <array>
+#include <vector>
+
+enum class ShaderStage
+{
+    VS,
+    HS,
+    DS,
+    PS,
+    Maximum = PS,
+};
+static const unsigned ShaderStages = static_cast<unsigned>(ShaderStage::Maximum) + 1;
+
+// Shaders and fixed function state set when binding a GraphicsPipeline.
+struct PipelineState
+{
+    ID3D11VertexShader      *vs;
+    ID3D11HullShader        *hs;
+    ID3D11DomainShader      *ds;
+    ID3D11PixelShader       *ps;
+    D3D11_PRIMITIVE_TOPOLOGY primitiveTopology;
+    ID3D11InputLayout       *inputLayout;
+    ID3D11RasterizerState   *rasterizerState;
+    ID3D11BlendState        *blendState;
+    ID3D11DepthStencilState *depthStencilState;
+    UINT                     stencilRef;
+};
+
+// Thin layer between the rendering helpers in Graphics.hpp and the graphics
+// API. It covers resource creation, pipeline and resource binding, render
+// targets, draws and clears, so the command stream of the renderer can be
+// recorded and measured instead of submitted.
+class Backend
+{
+public:
+    virtual ~Backend() {}
+
+    virtual CComPtr<ID3D11Texture2D> createTexture2D(const D3D11_TEXTURE2D_DESC &desc,
+                                                     const D3D11_SUBRESOURCE_DATA *initialData) = 0;
+    virtual CComPtr<ID3D11Buffer> createBuffer(const D3D11_BUFFER_DESC &desc,
+                                               const D3D11_SUBRESOURCE_DATA *initialData) = 0;
+    // Copy data to a dynamic buffer, mapping it with the given map type.
+    virtual void writeBuffer(ID3D11Buffer *buffer, D3D11_MAP map, UINT offset,
+                             const void *data, size_t bytes) = 0;
+
+    virtual void bindPipeline(const PipelineState &state) = 0;
+    virtual void setDepthStencilState(ID3D11DepthStencilState *state, UINT stencilRef) = 0;
+    virtual void setConstantBuffer(ShaderStage stage, UINT slot, ID3D11Buffer *buffer,
+                                   UINT firstConstant, UINT numConstants) = 0;
+    virtual void setShaderResources(ShaderStage stage, UINT slot, UINT count,
+                                    ID3D11ShaderResourceView * const *srvs) = 0;
+    virtual void setSamplers(ShaderStage stage, UINT slot, UINT count,
+                             ID3D11SamplerState * const *samplers) = 0;
+    virtual void setRenderTargets(UINT count, ID3D11RenderTargetView * const *rtvs,
+                                  ID3D11DepthStencilView *dsv) = 0;
+    virtual void setViewport(const D3D11_VIEWPORT &viewport) = 0;
+    // Bind a pixel shader UAV, keeping the current render targets.
+    virtual void setUnorderedAccessView(UINT slot, ID3D11UnorderedAccessView *uav) = 0;
+
+    virtual void clearRenderTarget(ID3D11RenderTargetView *rtv, const float color[4]) = 0;
+    virtual void clearDepthStencil(ID3D11DepthStencilView *dsv, UINT flags, float depth, UINT8 stencil) = 0;
+    virtual void draw(UINT vertexCount, UINT startVertex) = 0;
+    virtual void drawIndexed(UINT indexCount, UINT instances) = 0;
+};
+
+// Submits everything to the global device and immediate context.
+class D3D11Backend : public Backend
+{
+public:
+    CComPtr<ID3D11Texture2D> createTexture2D(const D3D11_TEXTURE2D_DESC &desc,
+                                             const D3D11_SUBRESOURCE_DATA *initialData) override;
+    CComPtr<ID3D11Buffer> createBuffer(const D3D11_BUFFER_DESC &desc,
+                                       const D3D11_SUBRESOURCE_DATA *initialData) override;
+    void writeBuffer(ID3D11Buffer *buffer, D3D11_MAP map, UINT offset,
+                     const void *data, size_t bytes) override;
+
+    void bindPipeline(const PipelineState &state) override;
+    void setDepthStencilState(ID3D11DepthStencilState *state, UINT stencilRef) override;
+    void setConstantBuffer(ShaderStage stage, UINT slot, ID3D11Buffer *buffer,
+                           UINT firstConstant, UINT numConstants) override;
+    void setShaderResources(ShaderStage stage, UINT slot, UINT count,
+                            ID3D11ShaderResourceView * const *srvs) override;
+    void setSamplers(ShaderStage stage, UINT slot, UINT count,
+                     ID3D11SamplerState * const *samplers) override;
+    void setRenderTargets(UINT count, ID3D11RenderTargetView * const *rtvs,
+                          ID3D11DepthStencilView *dsv) override;
+    void setViewport(const D3D11_VIEWPORT &viewport) override;
+    void setUnorderedAccessView(UINT slot, ID3D11UnorderedAccessView *uav) override;
+
+    void clearRenderTarget(ID3D11RenderTargetView *rtv, const float color[4]) override;
+    void clearDepthStencil(ID3D11DepthStencilView *dsv, UINT flags, float depth, UINT8 stencil) override;
+    void draw(UINT vertexCount, UINT startVertex) override;
+    void drawIndexed(UINT indexCount, UINT instances) override;
+};
+
+// Records the command stream along with the amount and argument bytes of
+// every kind of command. Resources are created and written using the target
+// backend, if there is one, so the renderer can run with real resources while
+// none of its commands reach the GPU. Without a target, resources are null.
+class RecordingBackend : public Backend
+{
+public:
+    enum class Command
+    {
+        CreateTexture2D,
+        CreateBuffer,
+        WriteBuffer,
+        BindPipeline,
+        SetDepthStencilState,
+        SetConstantBuffer,
+        SetShaderResources,
+        SetSamplers,
+        SetRenderTargets,
+        SetViewport,
+        SetUnorderedAccessView,
+        ClearRenderTarget,
+        ClearDepthStencil,
+        Draw,
+        DrawIndexed,
+        Maximum = DrawIndexed,
+    };
+    static const unsigned CommandKinds = static_cast<unsigned>(Command::Maximum) + 1;
+
+    struct Record
+    {
+        Command  command;
+        uint32_t bytes;   // size of the arguments, including any written data
+    };
+
+    struct Stats
+    {
+        std::array<uint64_t, CommandKinds> commands;
+        std::array<uint64_t, CommandKinds> bytes;
+
+        uint64_t count(Command c) const { return commands[static_cast<unsigned>(c)]; }
+        uint64_t totalCommands() const;
+        uint64_t totalBytes() const;
+        uint64_t draws() const;
+        // Everything that changes the bound state.
+        uint64_t stateChanges() const;
+    };
+
+    // If submit is true, commands are also passed on to the target.
+    RecordingBackend(Backend *target = nullptr, bool submit = false);
+
+    static const char *commandName(Command c);
+
+    const std::vector<Record> &records() const { return recorded; }
+    const Stats &stats() const { return counts; }
+    // Forget the recorded commands, e.g. at the start of a frame.
+    void reset();
+
+    CComPtr<ID3D11Texture2D> createTexture2D(const D3D11_TEXTURE2D_DESC &desc,
+                                             const D3D11_SUBRESOURCE_DATA *initialData) override;
+    CComPtr<ID3D11Buffer> createBuffer(const D3D11_BUFFER_DESC &desc,
+                                       const D3D11_SUBRESOURCE_DATA *initialData) override;
+    void writeBuffer(ID3D11Buffer *buffer, D3D11_MAP map, UINT offset,
+                     const void *data, size_t bytes) override;
+
+    void bindPipeline(const PipelineState &state) override;
+    void setDepthStencilState(ID3D11DepthStencilState *state, UINT stencilRef) override;
+    void setConstantBuffer(ShaderStage stage, UINT slot, ID3D11Buffer *buffer,
+                           UINT firstConstant, UINT numConstants) override;
+    void setShaderResources(ShaderStage stage, UINT slot, UINT count,
+                            ID3D11ShaderResourceView * const *srvs) override;
+    void setSamplers(ShaderStage stage, UINT slot, UINT count,
+                     ID3D11SamplerState * const *samplers) override;
+    void setRenderTargets(UINT count, ID3D11RenderTargetView * const *rtvs,
+                          ID3D11DepthStencilView *dsv) override;
+    void setViewport(const D3D11_VIEWPORT &viewport) override;
+    void setUnorderedAccessView(UINT slot, ID3D11UnorderedAccessView *uav) override;
+
+    void clearRenderTarget(ID3D11RenderTargetView *rtv, const float color[4]) override;
+    void clearDepthStencil(ID3D11DepthStencilView *dsv, UINT flags, float depth, UINT8 stencil) override;
+    void draw(UINT vertexCount, UINT startVertex) override;
+    void drawIndexed(UINT indexCount, UINT instances) override;
+
+private:
+    Backend *target;
+    bool submit;
+    std::vector<Record> recorded;
+    Stats counts;
+
+    void record(Command c, size_t bytes);
+    Backend *submitTarget() const { return submit ? target : nullptr; }
+};
+
+// The backend used by the rendering helpers on each thread. Graphics sets
+// it to the StateCache in front of D3D11Backend on the thread creating it.
+extern thread_local Backend *backend;
+Backend &d3d11Backend();
+
+// Use another backend until the end of the scope.
+class BackendScope
+{
+    Backend *previous;
+public:
+    BackendScope(Backend &b);
+    ~BackendScope();
+
+    BackendScope(const BackendScope &) = delete;
+    BackendScope &operator=(const BackendScope &) = delete;
+};
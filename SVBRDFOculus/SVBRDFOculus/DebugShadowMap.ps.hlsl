@@ -5,6 +5,7 @@ struct PSInput
     float4 worldPos : POSITION0;
     float4 uv       : TEXCOORD0;
     float4 normal   : NORMAL0;
+    float4 tangent  : TANGENT0;
     float4 svPos    : SV_Position;
 };
 
@@ -0,0 +1,623 @@
+#include "DepthRasterizer.hpp"
+#include "Parallel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#include <emmintrin.h>
+
+namespace
+{
+    // Sub-pixel precision of the D3D11 rasterizer
+    const float SubpixelSteps = 256.f;
+
+    // Clipping is only done against a guard band and w > 0. Depth is clamped
+    // instead of clipped, as the GPU shadow pass disables depth clipping.
+    const float GuardBand = 16.f;
+    const float MinW      = 1e-5f;
+
+    enum Outcode : uint8_t
+    {
+        OutsideW      = 1 << 0,
+        OutsideLeft   = 1 << 1,
+        OutsideRight  = 1 << 2,
+        OutsideBottom = 1 << 3,
+        OutsideTop    = 1 << 4,
+    };
+
+    const unsigned MaxClippedVertices = 3 + 5;
+
+    // Triangles per setup job
+    const size_t TrianglesPerChunk = 4096;
+    const unsigned MaxChunksPerFace = 64;
+
+    unsigned bitCount4(int mask)
+    {
+        static const unsigned char counts[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+        return counts[mask & 15];
+    }
+
+    __m128 laneMask(int mask)
+    {
+        static const __m128 masks[16] =
+        {
+#define LANE_MASK(m) _mm_castsi128_ps(_mm_setr_epi32(-((m) & 1), -(((m) >> 1) & 1), -(((m) >> 2) & 1), -(((m) >> 3) & 1)))
+            LANE_MASK(0),  LANE_MASK(1),  LANE_MASK(2),  LANE_MASK(3),
+            LANE_MASK(4),  LANE_MASK(5),  LANE_MASK(6),  LANE_MASK(7),
+            LANE_MASK(8),  LANE_MASK(9),  LANE_MASK(10), LANE_MASK(11),
+            LANE_MASK(12), LANE_MASK(13), LANE_MASK(14), LANE_MASK(15),
+#undef LANE_MASK
+        };
+        return masks[mask & 15];
+    }
+
+    double secondsSince(std::chrono::high_resolution_clock::time_point start)
+    {
+        auto now = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration<double>(now - start).count();
+    }
+
+    float snap(float x)
+    {
+        return std::floor(x * SubpixelSteps + .5f) / SubpixelSteps;
+    }
+
+    // Signed distances to the clipping planes, positive when inside.
+    float planeDistance(const float *v, unsigned plane)
+    {
+        float x = v[0], y = v[1], w = v[3];
+        switch (plane)
+        {
+        default:
+        case 0: return w - MinW;
+        case 1: return x + GuardBand * w;
+        case 2: return GuardBand * w - x;
+        case 3: return y + GuardBand * w;
+        case 4: return GuardBand * w - y;
+        }
+    }
+
+    uint8_t computeOutcode(const float *v)
+    {
+        uint8_t code = 0;
+        for (unsigned plane = 0; plane < 5; ++plane)
+        {
+            if (planeDistance(v, plane) < 0)
+                code |= static_cast<uint8_t>(1 << plane);
+        }
+        return code;
+    }
+
+    // Sutherland-Hodgman clipping of a convex polygon in homogeneous coordinates.
+    unsigned clipPolygon(float (*poly)[4], unsigned n, uint8_t planes)
+    {
+        float tmp[MaxClippedVertices][4];
+
+        for (unsigned plane = 0; plane < 5 && n > 0; ++plane)
+        {
+            if (!(planes & (1 << plane)))
+                continue;
+
+            unsigned m = 0;
+            for (unsigned i = 0; i < n; ++i)
+            {
+                const float *a = poly[i];
+                const float *b = poly[(i + 1) % n];
+                float da = planeDistance(a, plane);
+                float db = planeDistance(b, plane);
+
+                if (da >= 0)
+                    std::copy(a, a + 4, tmp[m++]);
+
+                if ((da >= 0) != (db >= 0))
+                {
+                    float t = da / (da - db);
+                    for (unsigned c = 0; c < 4; ++c)
+                        tmp[m][c] = a[c] + (b[c] - a[c]) * t;
+                    ++m;
+                }
+            }
+
+            n = m;
+            std::copy(&tmp[0][0], &tmp[0][0] + n * 4, &poly[0][0]);
+        }
+
+        return n;
+    }
+
+    // Equivalent to the D3D11 depth bias unit for floating point depth buffers,
+    // 2^(exponent(maxZ) - 23).
+    float depthBiasUnit(float maxZ)
+    {
+        if (maxZ <= 0)
+            return 0;
+
+        int exponent;
+        std::frexp(maxZ, &exponent);
+        return std::ldexp(1.f, exponent - 1 - 23);
+    }
+}
+
+DepthRasterizer::DepthRasterizer()
+    : positions(nullptr)
+    , positionStride(0)
+    , vertexCount(0)
+    , indices(nullptr)
+    , indexCount(0)
+    , scale(1)
+    , size(0)
+    , pitch(0)
+    , faceCount(0)
+    , tilesX(0)
+    , chunks(0)
+{
+}
+
+void DepthRasterizer::setGeometry(const float *positions, size_t positionStride, size_t vertexCount,
+                                  const uint32_t *indices, size_t indexCount,
+                                  float scale)
+{
+    this->positions      = positions;
+    this->positionStride = positionStride;
+    this->vertexCount    = vertexCount;
+    this->indices        = indices;
+    this->indexCount     = indexCount - indexCount % 3;
+    this->scale          = scale;
+}
+
+const float *DepthRasterizer::depth(unsigned face) const
+{
+    return depthBuffer.data() + static_cast<size_t>(face) * pitch * size;
+}
+
+DepthRasterizer::Stats DepthRasterizer::render(const Matrix *viewProjs, unsigned faces, unsigned resolution,
+                                               int depthBias, float slopeScaledDepthBias)
+{
+    Stats stats;
+    memset(&stats, 0, sizeof(stats));
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    size          = resolution;
+    pitch         = (resolution + 3) & ~3u;
+    faceCount     = faces;
+    tilesX        = (resolution + TileSize - 1) / TileSize;
+    unsigned tiles = tilesX * tilesX;
+
+    size_t triangles = indexCount / 3;
+    chunks = static_cast<unsigned>(std::min<size_t>(
+        MaxChunksPerFace,
+        std::max<size_t>(1, (triangles + TrianglesPerChunk - 1) / TrianglesPerChunk)));
+
+    depthBuffer.resize(static_cast<size_t>(pitch) * size * faces);
+    tileMinDepth.resize(static_cast<size_t>(tiles) * faces);
+    clipVertices.resize(vertexCount * faces);
+    outcodes.resize(vertexCount * faces);
+    chunkTriangles.resize(static_cast<size_t>(chunks) * faces);
+    bins.resize(static_cast<size_t>(chunks) * tiles * faces);
+
+    stats.triangles = triangles * faces;
+
+    if (triangles == 0 || resolution == 0)
+    {
+        std::fill(depthBuffer.begin(), depthBuffer.end(), 0.f);
+        std::fill(tileMinDepth.begin(), tileMinDepth.end(), 0.f);
+        return stats;
+    }
+
+    // Transform vertices of every face
+    {
+        static const size_t VerticesPerJob = 16384;
+        size_t jobsPerFace = (vertexCount + VerticesPerJob - 1) / VerticesPerJob;
+
+        parallelFor(0, jobsPerFace * faces, [&] (size_t job)
+        {
+            unsigned face = static_cast<unsigned>(job / jobsPerFace);
+            size_t begin  = (job % jobsPerFace) * VerticesPerJob;
+            size_t end    = std::min(vertexCount, begin + VerticesPerJob);
+            transformVertices(face, viewProjs[face], begin, end);
+        });
+    }
+
+    // Clip, cull, set up and bin the triangles
+    parallelFor(0, static_cast<size_t>(chunks) * faces, [&] (size_t job)
+    {
+        unsigned face  = static_cast<unsigned>(job / chunks);
+        unsigned chunk = static_cast<unsigned>(job % chunks);
+        setupTriangles(face, chunk, depthBias, slopeScaledDepthBias);
+    });
+
+    for (auto &t : chunkTriangles)
+        stats.trianglesBinned += t.size();
+
+    stats.setupSeconds = secondsSince(start);
+    start = std::chrono::high_resolution_clock::now();
+
+    // Rasterize the tiles
+    std::atomic<uint64_t> pixelsTested(0);
+    std::atomic<uint64_t> pixelsWritten(0);
+
+    parallelFor(0, static_cast<size_t>(tiles) * faces, [&] (size_t job)
+    {
+        unsigned face = static_cast<unsigned>(job / tiles);
+        unsigned tile = static_cast<unsigned>(job % tiles);
+
+        uint64_t tested  = 0;
+        uint64_t written = 0;
+        rasterizeTile(face, tile, tested, written);
+
+        pixelsTested  += tested;
+        pixelsWritten += written;
+    });
+
+    stats.pixelsTested  = pixelsTested;
+    stats.pixelsWritten = pixelsWritten;
+    stats.rasterSeconds = secondsSince(start);
+
+    return stats;
+}
+
+void DepthRasterizer::transformVertices(unsigned face, const Matrix &viewProj, size_t begin, size_t end)
+{
+    __m128 row0 = _mm_loadu_ps(viewProj.m[0]);
+    __m128 row1 = _mm_loadu_ps(viewProj.m[1]);
+    __m128 row2 = _mm_loadu_ps(viewProj.m[2]);
+    __m128 row3 = _mm_loadu_ps(viewProj.m[3]);
+
+    ClipVertex *clip = clipVertices.data() + face * vertexCount;
+    uint8_t *codes   = outcodes.data() + face * vertexCount;
+    auto bytes       = reinterpret_cast<const uint8_t *>(positions);
+
+    for (size_t i = begin; i < end; ++i)
+    {
+        auto p = reinterpret_cast<const float *>(bytes + i * positionStride);
+
+        __m128 v = _mm_mul_ps(_mm_set1_ps(p[0] * scale), row0);
+        v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(p[1] * scale), row1));
+        v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(p[2] * scale), row2));
+        v = _mm_add_ps(v, row3);
+
+        _mm_storeu_ps(&clip[i].x, v);
+        codes[i] = computeOutcode(&clip[i].x);
+    }
+}
+
+void DepthRasterizer::setupTriangles(unsigned face, unsigned chunk, int depthBias, float slopeScaledDepthBias)
+{
+    unsigned tiles = tilesX * tilesX;
+
+    auto &triangles = chunkTriangles[face * chunks + chunk];
+    triangles.clear();
+
+    size_t firstBin = (static_cast<size_t>(face) * chunks + chunk) * tiles;
+    for (unsigned t = 0; t < tiles; ++t)
+        bins[firstBin + t].clear();
+
+    size_t triangleCount = indexCount / 3;
+    size_t begin = triangleCount * chunk / chunks;
+    size_t end   = triangleCount * (chunk + 1) / chunks;
+
+    const ClipVertex *clip = clipVertices.data() + face * vertexCount;
+    const uint8_t *codes   = outcodes.data() + face * vertexCount;
+
+    for (size_t t = begin; t < end; ++t)
+    {
+        uint32_t i0 = indices[t * 3 + 0];
+        uint32_t i1 = indices[t * 3 + 1];
+        uint32_t i2 = indices[t * 3 + 2];
+
+        uint8_t c0 = codes[i0];
+        uint8_t c1 = codes[i1];
+        uint8_t c2 = codes[i2];
+
+        // Trivially outside of some plane
+        if (c0 & c1 & c2)
+            continue;
+
+        if ((c0 | c1 | c2) == 0)
+        {
+            setupTriangle(face, chunk, clip[i0], clip[i1], clip[i2],
+                          depthBias, slopeScaledDepthBias);
+        }
+        else
+        {
+            float poly[MaxClippedVertices][4];
+            memcpy(poly[0], &clip[i0], sizeof(poly[0]));
+            memcpy(poly[1], &clip[i1], sizeof(poly[1]));
+            memcpy(poly[2], &clip[i2], sizeof(poly[2]));
+
+            unsigned n = clipPolygon(poly, 3, c0 | c1 | c2);
+
+            // Triangle fan, which keeps the winding of the original triangle
+            for (unsigned i = 2; i < n; ++i)
+            {
+                ClipVertex a, b, c;
+                memcpy(&a, poly[0],     sizeof(a));
+                memcpy(&b, poly[i - 1], sizeof(b));
+                memcpy(&c, poly[i],     sizeof(c));
+                setupTriangle(face, chunk, a, b, c, depthBias, slopeScaledDepthBias);
+            }
+        }
+    }
+}
+
+void DepthRasterizer::setupTriangle(unsigned face, unsigned chunk,
+                                    const ClipVertex &a, const ClipVertex &b, const ClipVertex &c,
+                                    int depthBias, float slopeScaledDepthBias)
+{
+    const ClipVertex *clip[3] = { &a, &b, &c };
+
+    float res = static_cast<float>(size);
+    float x[3], y[3], z[3];
+
+    // Pixel coordinates have Y pointing down, with pixel centers at half integers.
+    for (unsigned i = 0; i < 3; ++i)
+    {
+        float rcpW = 1.f / clip[i]->w;
+        x[i] = snap((clip[i]->x * rcpW + 1) * .5f * res);
+        y[i] = snap((1 - clip[i]->y * rcpW) * .5f * res);
+        z[i] = clip[i]->z * rcpW;
+    }
+
+    // Counterclockwise triangles are front facing. Because Y points down,
+    // they have a negative area here.
+    float area = (y[2] - y[0]) * (x[1] - x[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    if (area >= 0)
+        return;
+
+    // Reorder to clockwise in pixel coordinates, so the inside of each edge is positive.
+    std::swap(x[1], x[2]);
+    std::swap(y[1], y[2]);
+    std::swap(z[1], z[2]);
+    area = -area;
+
+    Triangle tri;
+
+    float minXf = std::min(std::min(x[0], x[1]), x[2]);
+    float maxXf = std::max(std::max(x[0], x[1]), x[2]);
+    float minYf = std::min(std::min(y[0], y[1]), y[2]);
+    float maxYf = std::max(std::max(y[0], y[1]), y[2]);
+
+    // Pixel i is covered if its center i + 0.5 is inside
+    int last = static_cast<int>(size) - 1;
+    tri.minX = std::max(0,    static_cast<int>(std::ceil(minXf - .5f)));
+    tri.maxX = std::min(last, static_cast<int>(std::floor(maxXf - .5f)));
+    tri.minY = std::max(0,    static_cast<int>(std::ceil(minYf - .5f)));
+    tri.maxY = std::min(last, static_cast<int>(std::floor(maxYf - .5f)));
+
+    if (tri.minX > tri.maxX || tri.minY > tri.maxY)
+        return;
+
+    tri.topLeftEdges = 0;
+    for (unsigned e = 0; e < 3; ++e)
+    {
+        unsigned v0 = e;
+        unsigned v1 = (e + 1) % 3;
+        float dx = x[v1] - x[v0];
+        float dy = y[v1] - y[v0];
+
+        tri.edgeX0[e] = x[v0];
+        tri.edgeY0[e] = y[v0];
+        tri.edgeDX[e] = dx;
+        tri.edgeDY[e] = dy;
+
+        bool topEdge  = dy == 0 && dx > 0;
+        bool leftEdge = dy < 0;
+        if (topEdge || leftEdge)
+            tri.topLeftEdges |= 1u << e;
+    }
+
+    // Depth plane z(p) = A * p.x + B * p.y + C
+    {
+        double dx1 = x[1] - x[0], dy1 = y[1] - y[0], dz1 = z[1] - z[0];
+        double dx2 = x[2] - x[0], dy2 = y[2] - y[0], dz2 = z[2] - z[0];
+        double det = dx1 * dy2 - dx2 * dy1;
+        double A = (dz1 * dy2 - dz2 * dy1) / det;
+        double B = (dz2 * dx1 - dz1 * dx2) / det;
+        double C = z[0] - A * x[0] - B * y[0];
+
+        float maxZ = std::max(std::max(z[0], z[1]), z[2]);
+        // The slope is measured per pixel, like on the GPU.
+        float maxSlope = static_cast<float>(std::max(std::abs(A), std::abs(B)));
+        float bias = static_cast<float>(depthBias) * depthBiasUnit(maxZ)
+            + slopeScaledDepthBias * maxSlope;
+
+        tri.depthA = static_cast<float>(A);
+        tri.depthB = static_cast<float>(B);
+        tri.depthC = static_cast<float>(C) + bias;
+    }
+
+    auto &triangles = chunkTriangles[face * chunks + chunk];
+    uint32_t index  = static_cast<uint32_t>(triangles.size());
+    triangles.emplace_back(tri);
+
+    unsigned tiles = tilesX * tilesX;
+    size_t firstBin = (static_cast<size_t>(face) * chunks + chunk) * tiles;
+
+    unsigned tileMinX = tri.minX / TileSize;
+    unsigned tileMaxX = tri.maxX / TileSize;
+    unsigned tileMinY = tri.minY / TileSize;
+    unsigned tileMaxY = tri.maxY / TileSize;
+
+    for (unsigned ty = tileMinY; ty <= tileMaxY; ++ty)
+    {
+        for (unsigned tx = tileMinX; tx <= tileMaxX; ++tx)
+            bins[firstBin + ty * tilesX + tx].emplace_back(index);
+    }
+}
+
+void DepthRasterizer::rasterizeTile(unsigned face, unsigned tile, uint64_t &pixelsTested, uint64_t &pixelsWritten)
+{
+    unsigned tiles = tilesX * tilesX;
+
+    int tileX0 = static_cast<int>((tile % tilesX) * TileSize);
+    int tileY0 = static_cast<int>((tile / tilesX) * TileSize);
+    int tileX1 = std::min(tileX0 + static_cast<int>(TileSize), static_cast<int>(size)) - 1;
+    int tileY1 = std::min(tileY0 + static_cast<int>(TileSize), static_cast<int>(size)) - 1;
+
+    float *depth = depthBuffer.data() + static_cast<size_t>(face) * pitch * size;
+
+    // Clear to min depth since we are using inverse Z
+    for (int y = tileY0; y <= tileY1; ++y)
+    {
+        float *row = depth + static_cast<size_t>(y) * pitch;
+        std::fill(row + tileX0, row + tileX1 + 1, 0.f);
+    }
+
+    const __m128 laneOffsets = _mm_setr_ps(.5f, 1.5f, 2.5f, 3.5f);
+    const __m128 zeros = _mm_setzero_ps();
+    const __m128 ones  = _mm_set1_ps(1.f);
+    const __m128d zerosD = _mm_setzero_pd();
+
+    for (unsigned chunk = 0; chunk < chunks; ++chunk)
+    {
+        auto &triangles = chunkTriangles[face * chunks + chunk];
+        auto &bin = bins[(static_cast<size_t>(face) * chunks + chunk) * tiles + tile];
+
+        for (uint32_t index : bin)
+        {
+            const Triangle &tri = triangles[index];
+
+            int x0 = std::max(tri.minX, tileX0) & ~3;
+            int x1 = std::min(tri.maxX, tileX1);
+            int y0 = std::max(tri.minY, tileY0);
+            int y1 = std::min(tri.maxY, tileY1);
+
+            // Edge functions are evaluated in double precision. With snapped vertices
+            // the results are exact, so adjacent triangles never leave cracks or
+            // cover the same pixel twice.
+            __m128d laneStep[3];
+            __m128d halfStepX[3];
+            __m128d stepX[3];
+            __m128d inclusive[3];
+            for (unsigned e = 0; e < 3; ++e)
+            {
+                double dy = tri.edgeDY[e];
+                laneStep[e]  = _mm_setr_pd(0, -dy);
+                halfStepX[e] = _mm_set1_pd(-2 * dy);
+                stepX[e]     = _mm_set1_pd(-4 * dy);
+                // Top-left edges include pixels exactly on the edge
+                inclusive[e] = (tri.topLeftEdges & (1u << e))
+                    ? _mm_castsi128_pd(_mm_set1_epi32(-1))
+                    : zerosD;
+            }
+            __m128 depthStepX = _mm_set1_ps(tri.depthA * 4);
+
+            for (int y = y0; y <= y1; ++y)
+            {
+                float *row = depth + static_cast<size_t>(y) * pitch;
+
+                double rowY = static_cast<double>(y) + .5;
+                double rowX = static_cast<double>(x0) + .5;
+
+                // E(p) = (p.y - y0) * dx - (p.x - x0) * dy
+                __m128d edgeLo[3];
+                __m128d edgeHi[3];
+                for (unsigned e = 0; e < 3; ++e)
+                {
+                    double E = (rowY - tri.edgeY0[e]) * tri.edgeDX[e]
+                             - (rowX - tri.edgeX0[e]) * tri.edgeDY[e];
+                    edgeLo[e] = _mm_add_pd(_mm_set1_pd(E), laneStep[e]);
+                    edgeHi[e] = _mm_add_pd(edgeLo[e], halfStepX[e]);
+                }
+
+                __m128 px = _mm_add_ps(_mm_set1_ps(static_cast<float>(x0)), laneOffsets);
+                __m128 py = _mm_set1_ps(static_cast<float>(rowY));
+                __m128 z = _mm_add_ps(
+                    _mm_add_ps(_mm_mul_ps(_mm_set1_ps(tri.depthA), px),
+                               _mm_mul_ps(_mm_set1_ps(tri.depthB), py)),
+                    _mm_set1_ps(tri.depthC));
+
+                for (int x = x0; x <= x1; x += 4)
+                {
+                    int insideMask = 0xf;
+                    for (unsigned e = 0; e < 3; ++e)
+                    {
+                        __m128d lo = _mm_or_pd(_mm_cmpgt_pd(edgeLo[e], zerosD),
+                                               _mm_and_pd(_mm_cmpeq_pd(edgeLo[e], zerosD), inclusive[e]));
+                        __m128d hi = _mm_or_pd(_mm_cmpgt_pd(edgeHi[e], zerosD),
+                                               _mm_and_pd(_mm_cmpeq_pd(edgeHi[e], zerosD), inclusive[e]));
+                        insideMask &= _mm_movemask_pd(lo) | (_mm_movemask_pd(hi) << 2);
+
+                        edgeLo[e] = _mm_add_pd(edgeLo[e], stepX[e]);
+                        edgeHi[e] = _mm_add_pd(edgeHi[e], stepX[e]);
+                    }
+
+                    // Lanes in the row padding are never covered
+                    int validLanes = static_cast<int>(size) - x;
+                    if (validLanes < 4)
+                        insideMask &= (1 << validLanes) - 1;
+
+                    if (insideMask)
+                    {
+                        // No depth clipping, clamp to the viewport depth range instead.
+                        __m128 inside   = laneMask(insideMask);
+                        __m128 clampedZ = _mm_min_ps(_mm_max_ps(z, zeros), ones);
+                        __m128 old      = _mm_loadu_ps(row + x);
+                        __m128 pass     = _mm_and_ps(inside, _mm_cmpgt_ps(clampedZ, old));
+                        int passMask    = _mm_movemask_ps(pass);
+
+                        if (passMask)
+                        {
+                            __m128 result = _mm_or_ps(_mm_and_ps(pass, clampedZ),
+                                                      _mm_andnot_ps(pass, old));
+                            _mm_storeu_ps(row + x, result);
+                        }
+
+                        pixelsTested  += bitCount4(insideMask);
+                        pixelsWritten += bitCount4(passMask);
+                    }
+
+                    z = _mm_add_ps(z, depthStepX);
+                }
+            }
+        }
+    }
+
+    float minDepth = 1;
+    for (int y = tileY0; y <= tileY1; ++y)
+    {
+        const float *row = depth + static_cast<size_t>(y) * pitch;
+        for (int x = tileX0; x <= tileX1; ++x)
+            minDepth = std::min(minDepth, row[x]);
+    }
+    tileMinDepth[static_cast<size_t>(face) * tiles + tile] = minDepth;
+}
+
+bool DepthRasterizer::occluded(unsigned face,
+                               float minX, float minY, float maxX, float maxY,
+                               float nearestDepth) const
+{
+    if (face >= faceCount || size == 0)
+        return false;
+
+    float res = static_cast<float>(size);
+    int last  = static_cast<int>(size) - 1;
+
+    // Normalized device coordinates have Y pointing up, pixels have it pointing down.
+    int x0 = std::max(0,    static_cast<int>(std::floor((minX + 1) * .5f * res)));
+    int x1 = std::min(last, static_cast<int>(std::floor((maxX + 1) * .5f * res)));
+    int y0 = std::max(0,    static_cast<int>(std::floor((1 - maxY) * .5f * res)));
+    int y1 = std::min(last, static_cast<int>(std::floor((1 - minY) * .5f * res)));
+
+    if (x0 > x1 || y0 > y1)
+        return false;
+
+    unsigned tiles = tilesX * tilesX;
+    const float *tileMin = tileMinDepth.data() + static_cast<size_t>(face) * tiles;
+
+    for (unsigned ty = y0 / TileSize; ty <= y1 / TileSize; ++ty)
+    {
+        for (unsigned tx = x0 / TileSize; tx <= x1 / TileSize; ++tx)
+        {
+            // Inverse Z, so anything closer has a larger depth value.
+            if (nearestDepth >= tileMin[ty * tilesX + tx])
+                return false;
+        }
+    }
+
+    return true;
+}
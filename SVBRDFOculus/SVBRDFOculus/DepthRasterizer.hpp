@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Depth-only software rasterizer for square render targets, such as the shadow
+// map cube faces. It follows the same conventions as the GPU shadow pass:
+// inverse Z with a GREATER depth test and a clear value of 0, counterclockwise
+// front faces with back face culling, no depth clipping and D3D11 style depth bias.
+// Triangles are binned into screen tiles, and both the faces and the tiles
+// are processed in parallel.
+class DepthRasterizer
+{
+public:
+    static const unsigned TileSize = 64;
+
+    // Row-major 4x4 matrix using the row vector convention of DirectXMath.
+    // The layout is identical to XMFLOAT4X4.
+    struct Matrix
+    {
+        float m[4][4];
+    };
+
+    struct Stats
+    {
+        uint64_t triangles;       // input triangles over all faces
+        uint64_t trianglesBinned; // triangles left after culling and clipping
+        uint64_t pixelsTested;    // pixels covered by the binned triangles
+        uint64_t pixelsWritten;   // pixels that passed the depth test
+        double setupSeconds;
+        double rasterSeconds;
+    };
+
+    DepthRasterizer();
+
+    // Positions are 3 floats located every positionStride bytes, and are
+    // multiplied by scale before projection like in RegularMesh.vs.
+    void setGeometry(const float *positions, size_t positionStride, size_t vertexCount,
+                     const uint32_t *indices, size_t indexCount,
+                     float scale = 1);
+
+    Stats render(const Matrix *viewProjs, unsigned faces, unsigned resolution,
+                 int depthBias = 0, float slopeScaledDepthBias = 0);
+
+    unsigned resolution() const { return size; }
+    unsigned faces() const { return faceCount; }
+    // Distance in floats between rows of a face. Rows are padded to the SIMD width.
+    unsigned rowPitch() const { return pitch; }
+    const float *depth(unsigned face) const;
+
+    // Conservative occlusion test against the per-tile minimum depth. Returns true
+    // if something with the given nearest depth inside the normalized device
+    // coordinate rectangle is guaranteed to be hidden by the rasterized depth.
+    bool occluded(unsigned face,
+                  float minX, float minY, float maxX, float maxY,
+                  float nearestDepth) const;
+
+private:
+    struct ClipVertex
+    {
+        float x, y, z, w;
+    };
+
+    // Edge functions and the depth plane of a set up triangle, in pixel coordinates.
+    struct Triangle
+    {
+        float edgeX0[3];
+        float edgeY0[3];
+        float edgeDX[3];
+        float edgeDY[3];
+        float depthA;
+        float depthB;
+        float depthC;
+        int minX;
+        int minY;
+        int maxX;
+        int maxY;
+        uint32_t topLeftEdges;
+    };
+
+    const float *positions;
+    size_t positionStride;
+    size_t vertexCount;
+    const uint32_t *indices;
+    size_t indexCount;
+    float scale;
+
+    unsigned size;
+    unsigned pitch;
+    unsigned faceCount;
+    unsigned tilesX;
+    unsigned chunks;
+
+    std::vector<float> depthBuffer;
+    std::vector<float> tileMinDepth;
+    std::vector<ClipVertex> clipVertices;
+    std::vector<uint8_t> outcodes;
+    std::vector<std::vector<Triangle>> chunkTriangles;
+    std::vector<std::vector<uint32_t>> bins;
+
+    void transformVertices(unsigned face, const Matrix &viewProj, size_t begin, size_t end);
+    void setupTriangles(unsigned face, unsigned chunk, int depthBias, float slopeScaledDepthBias);
+    void setupTriangle(unsigned face, unsigned chunk,
+                       const ClipVertex &a, const ClipVertex &b, const ClipVertex &c,
+                       int depthBias, float slopeScaledDepthBias);
+    void rasterizeTile(unsigned face, unsigned tile, uint64_t &pixelsTested, uint64_t &pixelsWritten);
+};
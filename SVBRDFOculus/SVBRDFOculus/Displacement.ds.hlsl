@@ -1,8 +1,11 @@
+#include "Stereo.h.hlsl"
+
 struct VSOutput
 {
     float4 worldPos : POSITION0;
     float4 uvTess   : TEXCOORD0;
     float4 normal   : NORMAL0;
+    float4 tangent  : TANGENT0;
 };
 
 struct DSOutput
@@ -10,7 +13,9 @@ struct DSOutput
     float4 worldPos : POSITION0;
     float4 uvTess   : TEXCOORD0;
     float4 normal   : NORMAL0;
+    float4 tangent  : TANGENT0;
     float4 svPos    : SV_Position;
+    float  clip     : SV_ClipDistance0;
 };
 
 struct HSPatchConstants
@@ -24,6 +29,9 @@ cbuffer DSConstants : register(b0)
     float4x4 viewProj;
     float scale;
     float displacementMagnitude;
+    uint  stereo;
+    float heightScale;
+    float4x4 rightViewProj;
 };
 
 Texture2D<float> heightmap : register(t0);
@@ -60,11 +68,16 @@ DSOutput main(
     o.worldPos.w   = 1;
 
     o.uvTess.xy    = interpolate(v0.uvTess.xy,    v1.uvTess.xy,    v2.uvTess.xy,    barycentric);
-    o.uvTess.zw    = 0;
+    o.uvTess.z     = 0;
+    o.uvTess.w     = v0.uvTess.w; // eye
 
     o.normal.xyz   = interpolate(v0.normal.xyz,   v1.normal.xyz,   v2.normal.xyz,   barycentric);
     o.normal.w     = 0;
 
+    // The sign of the bitangent is the same for the whole patch, except on
+    // degenerate ones, where the interpolated sign is as good as any.
+    o.tangent      = interpolate(v0.tangent,      v1.tangent,      v2.tangent,      barycentric);
+
 #if 1
     float3 N   = normalize(o.normal.xyz);
 #else
@@ -78,7 +91,22 @@ DSOutput main(
     float displacement = height * displacementMagnitude;
 
 	o.worldPos.xyz += displacement * N;
-	o.svPos         = mul(o.worldPos, viewProj);
+
+    uint eye = uint(o.uvTess.w);
+    float4x4 eyeViewProj = viewProj;
+    if (eye)
+        eyeViewProj = rightViewProj;
+    float4 projPos = mul(o.worldPos, eyeViewProj);
+
+    if (stereo)
+    {
+        o.svPos = stereoEyePosition(projPos, eye, o.clip);
+    }
+    else
+    {
+        o.svPos = projPos;
+        o.clip  = 1;
+    }
 
 	return o;
 }
@@ -3,6 +3,7 @@ struct VSOutput
     float4 worldPos : POSITION0;
     float4 uvTess   : TEXCOORD0;
     float4 normal   : NORMAL0;
+    float4 tangent  : TANGENT0;
 };
 
 // Output patch constant data.
@@ -12,7 +13,187 @@ struct HSPatchConstants
 	float InsideTessFactor			: SV_InsideTessFactor; // e.g. would be Inside[2] for a quad domain
 };
 
+// Same as TessellationHSConstants in SVBRDFOculus.cpp. The factors and the
+// culling follow PatchTessellation.cpp, and the height ranges follow
+// HeightBounds.cpp, which are the CPU references.
+cbuffer HSConstants : register(b0)
+{
+    float4x4 viewProj;
+    float4x4 rightViewProj;
+    float4 eyePosition;
+    float4 rightEyePosition;
+    // Size of the viewport of one eye in pixels.
+    float2 viewportSize;
+    // Target length of the tessellated edges on the screen.
+    float edgePixels;
+    float displacementMagnitude;
+    uint2 heightmapSize;
+    // Levels of heightBounds, or 0 without a heightmap.
+    uint  heightBoundsLevels;
+};
+
+// Minimum and maximum heights of the heightmap, see HeightBounds.hpp.
+Texture2D<float2> heightBounds : register(t0);
+
 static const uint NumControlPoints = 3;
+static const float MaxFactor = 64;
+// Clip space w below which a point counts as being in the plane of the eye.
+static const float MinW = 1e-6;
+
+// The factor of the edge between a and b, before clamping to the valid range.
+float screenFactor(float3 a, float3 b, float4x4 eyeViewProj)
+{
+    float4 ca = mul(float4(a, 1), eyeViewProj);
+    float4 cb = mul(float4(b, 1), eyeViewProj);
+
+    if (ca.w < MinW || cb.w < MinW)
+        return MaxFactor;
+
+    float2 d = (ca.xy / ca.w - cb.xy / cb.w) * (.5 * viewportSize);
+    return length(d) / edgePixels;
+}
+
+float2 mergeRange(float2 a, float2 b)
+{
+    return float2(min(a.x, b.x), max(a.y, b.y));
+}
+
+// The range of the full resolution texels [t0, t1], from at most 2 x 2
+// texels of the most detailed level that covers them.
+float2 texelRange(int2 t0, int2 t1)
+{
+    int2 size = int2(heightmapSize);
+    t1 = min(t1, size - 1);
+    t0 = min(t0, t1);
+
+    uint level = 0;
+    int2 l0 = t0;
+    int2 l1 = t1;
+    for (; level + 1 < heightBoundsLevels; ++level)
+    {
+        int2 levelSize = max(size >> level, 1);
+        l0 = min(t0 >> level, levelSize - 1);
+        l1 = min(t1 >> level, levelSize - 1);
+        if (all(l1 - l0 <= 1))
+            break;
+    }
+
+    int2 levelSize = max(size >> level, 1);
+    l0 = min(t0 >> level, levelSize - 1);
+    l1 = min(t1 >> level, levelSize - 1);
+
+    float2 r = heightBounds.Load(int3(l0, level));
+    r = mergeRange(r, heightBounds.Load(int3(l1.x, l0.y, level)));
+    r = mergeRange(r, heightBounds.Load(int3(l0.x, l1.y, level)));
+    r = mergeRange(r, heightBounds.Load(int3(l1,   level)));
+    return r;
+}
+
+// The texels that bilinear sampling reads between the coordinates a and b
+// along an axis of size texels, wrapped into at most two intervals.
+uint wrappedTexels(float a, float b, int size, out int2 first, out int2 last)
+{
+    float scaled0 = a * size - .5;
+    float scaled1 = b * size - .5;
+
+    first = 0;
+    last  = size - 1;
+
+    if (!(abs(scaled0) < 1e9 && abs(scaled1) < 1e9))
+        return 1;
+
+    int t0 = int(floor(scaled0));
+    int t1 = int(floor(scaled1)) + 1;
+
+    if (t1 - t0 + 1 >= size)
+        return 1;
+
+    int start = ((t0 % size) + size) % size;
+    int end   = start + (t1 - t0);
+
+    first.x = start;
+    if (end < size)
+    {
+        last.x = end;
+        return 1;
+    }
+
+    first.y = 0;
+    last.y  = end - size;
+    return 2;
+}
+
+// The range of the displacement of the patch along the normals, in world
+// units, from the heights bilinear sampling can return around its UVs.
+float2 patchDisplacement(InputPatch<VSOutput, NumControlPoints> ip)
+{
+    if (heightBoundsLevels == 0)
+        return 0;
+
+    float2 uvMin = min(min(ip[0].uvTess.xy, ip[1].uvTess.xy), ip[2].uvTess.xy);
+    float2 uvMax = max(max(ip[0].uvTess.xy, ip[1].uvTess.xy), ip[2].uvTess.xy);
+
+    int2 firstX, lastX, firstY, lastY;
+    uint xs = wrappedTexels(uvMin.x, uvMax.x, int(heightmapSize.x), firstX, lastX);
+    uint ys = wrappedTexels(uvMin.y, uvMax.y, int(heightmapSize.y), firstY, lastY);
+
+    float2 r = texelRange(int2(firstX.x, firstY.x), int2(lastX.x, lastY.x));
+    if (xs > 1)
+        r = mergeRange(r, texelRange(int2(firstX.y, firstY.x), int2(lastX.y, lastY.x)));
+    if (ys > 1)
+        r = mergeRange(r, texelRange(int2(firstX.x, firstY.y), int2(lastX.x, lastY.y)));
+    if (xs > 1 && ys > 1)
+        r = mergeRange(r, texelRange(int2(firstX.y, firstY.y), int2(lastX.y, lastY.y)));
+
+    float a = r.x * displacementMagnitude;
+    float b = r.y * displacementMagnitude;
+    return float2(min(a, b), max(a, b));
+}
+
+// The displaced patch is bounded by the box around its vertices, grown by
+// the largest displacement, and culled if all of its corners are outside
+// the same side plane of the frustum.
+bool outsideFrustum(InputPatch<VSOutput, NumControlPoints> ip, float4x4 eyeViewProj, float2 displacement)
+{
+    float  grow = max(abs(displacement.x), abs(displacement.y));
+    float3 lo   = min(min(ip[0].worldPos.xyz, ip[1].worldPos.xyz), ip[2].worldPos.xyz) - grow;
+    float3 hi   = max(max(ip[0].worldPos.xyz, ip[1].worldPos.xyz), ip[2].worldPos.xyz) + grow;
+
+    uint outside = 0xf;
+    [unroll]
+    for (uint i = 0; i < 8; ++i)
+    {
+        float3 corner = float3(
+            (i & 1) ? hi.x : lo.x,
+            (i & 2) ? hi.y : lo.y,
+            (i & 4) ? hi.z : lo.z);
+
+        float4 c = mul(float4(corner, 1), eyeViewProj);
+
+        uint planes = 0;
+        if (c.x < -c.w) planes |= 1;
+        if (c.x >  c.w) planes |= 2;
+        if (c.y < -c.w) planes |= 4;
+        if (c.y >  c.w) planes |= 8;
+        outside &= planes;
+    }
+
+    return outside != 0;
+}
+
+// Culled if the eye is below the lowest displaced surface at every vertex.
+bool backFacing(InputPatch<VSOutput, NumControlPoints> ip, float3 eye, float2 displacement)
+{
+    [unroll]
+    for (uint i = 0; i < NumControlPoints; ++i)
+    {
+        float height = dot(ip[i].normal.xyz, eye - ip[i].worldPos.xyz);
+        if (height >= displacement.x)
+            return false;
+    }
+
+    return true;
+}
 
 // Patch Constant Function
 HSPatchConstants CalcHSPatchConstants(
@@ -21,27 +202,43 @@ HSPatchConstants CalcHSPatchConstants(
 {
 	HSPatchConstants pc;
 
-    // Tessellation factors for the vertices
+    uint eye = uint(ip[0].uvTess.w);
+    float4x4 eyeViewProj = eye ? rightViewProj : viewProj;
+    float3   eyePos      = eye ? rightEyePosition.xyz : eyePosition.xyz;
+
+    float2 displacement  = patchDisplacement(ip);
+
+    if (outsideFrustum(ip, eyeViewProj, displacement) || backFacing(ip, eyePos, displacement))
+    {
+        pc.EdgeTessFactor[0] = 0;
+        pc.EdgeTessFactor[1] = 0;
+        pc.EdgeTessFactor[2] = 0;
+        pc.InsideTessFactor  = 0;
+        return pc;
+    }
+
+    // Tessellation factors for the vertices, from the texel density.
     float t0 = ip[0].uvTess.z;
     float t1 = ip[1].uvTess.z;
     float t2 = ip[2].uvTess.z;
 
-    // Tessellation factors for the edges are the maximums
-    // of their vertices.
-    float e0 = max(t1, t2); // U=0 edge, so without v0
-    float e1 = max(t0, t2); // V=0 edge, so without v1
-    float e2 = max(t0, t1); // W=0 edge, so without v2
-
-    // The inside tessellation factor is the minimum of the
-    // vertex tessellation factors. Each vertex is guaranteed
-    // to have at least as much tessellation factor as this
-    // triangle required, so this tessellates at least as much as necessary.
-    float i  = min(min(t0, t1), t2);
-
-    pc.EdgeTessFactor[0] = e0;
-    pc.EdgeTessFactor[1] = e1;
-    pc.EdgeTessFactor[2] = e2;
-    pc.InsideTessFactor  = i;
+    // Each edge is split to about edgePixels long pieces on the screen,
+    // but no finer than the maximum of the factors of its vertices. Both
+    // patches sharing an edge get the same factor for it.
+    float s0 = screenFactor(ip[1].worldPos.xyz, ip[2].worldPos.xyz, eyeViewProj); // U=0 edge, so without v0
+    float s1 = screenFactor(ip[2].worldPos.xyz, ip[0].worldPos.xyz, eyeViewProj); // V=0 edge, so without v1
+    float s2 = screenFactor(ip[0].worldPos.xyz, ip[1].worldPos.xyz, eyeViewProj); // W=0 edge, so without v2
+
+    pc.EdgeTessFactor[0] = clamp(min(s0, max(t1, t2)), 1, MaxFactor);
+    pc.EdgeTessFactor[1] = clamp(min(s1, max(t2, t0)), 1, MaxFactor);
+    pc.EdgeTessFactor[2] = clamp(min(s2, max(t0, t1)), 1, MaxFactor);
+
+    // The inside follows the longest edge on the screen, but no finer than
+    // the minimum of the vertex factors. Each vertex is guaranteed to have
+    // at least as much tessellation factor as this triangle required, so
+    // this tessellates at least as much as necessary.
+    float i = min(max(max(s0, s1), s2), min(min(t0, t1), t2));
+    pc.InsideTessFactor = clamp(i, 1, MaxFactor);
 
 	return pc;
 }
@@ -0,0 +1,38 @@
+// Single mip level views of the previous mip level of the lighting maps
+Texture2D<float4> diffuseSource  : register(t0);
+Texture2D<float4> specularSource : register(t1);
+
+struct PSOutput
+{
+    float4 diffuse  : SV_Target0;
+    float4 specular : SV_Target1;
+};
+
+// 2x2 box filter, like GenerateMips, but only for the pixels covered
+// by the tile quads.
+PSOutput main(float4 pos : SV_Position)
+{
+    uint2 size;
+    diffuseSource.GetDimensions(size.x, size.y);
+
+    int2 src = int2(pos.xy) * 2;
+    int2 maxSrc = int2(size) - 1;
+
+    PSOutput o;
+    o.diffuse  = 0;
+    o.specular = 0;
+
+    [unroll] for (int y = 0; y < 2; ++y)
+    {
+        [unroll] for (int x = 0; x < 2; ++x)
+        {
+            int3 p = int3(min(src + int2(x, y), maxSrc), 0);
+            o.diffuse  += diffuseSource.Load(p);
+            o.specular += specularSource.Load(p);
+        }
+    }
+
+    o.diffuse  /= 4;
+    o.specular /= 4;
+    return o;
+}
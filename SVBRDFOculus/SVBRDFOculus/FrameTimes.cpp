@@ -0,0 +1,44 @@
+#include "FrameTimes.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+void FrameTimes::add(double seconds)
+{
+    samples.emplace_back(seconds);
+}
+
+void FrameTimes::clear()
+{
+    samples.clear();
+}
+
+// Nearest rank percentile of sorted samples, so the result is always one of
+// the measured frames.
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * static_cast<double>(sorted.size())));
+    rank = std::max<size_t>(rank, 1);
+    return sorted[std::min(rank, sorted.size()) - 1];
+}
+
+FrameTimes::Summary FrameTimes::summary() const
+{
+    Summary s = {};
+
+    if (samples.empty())
+        return s;
+
+    std::vector<double> sorted(samples);
+    std::sort(sorted.begin(), sorted.end());
+
+    s.frames  = sorted.size();
+    s.average = std::accumulate(sorted.begin(), sorted.end(), 0.) / static_cast<double>(sorted.size());
+    s.p50     = percentile(sorted, 50);
+    s.p90     = percentile(sorted, 90);
+    s.p99     = percentile(sorted, 99);
+    s.max     = sorted.back();
+
+    return s;
+}
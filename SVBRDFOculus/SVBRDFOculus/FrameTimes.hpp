@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Frame times collected over a measurement. The percentiles show the hitches
+// that an average hides, which matter the most in VR.
+class FrameTimes
+{
+    std::vector<double> samples;
+public:
+    struct Summary
+    {
+        size_t frames;
+        double average;
+        double p50;
+        double p90;
+        double p99;
+        double max;
+    };
+
+    void add(double seconds);
+    void clear();
+    size_t size() const { return samples.size(); }
+
+    // All zeros if there are no samples.
+    Summary summary() const;
+};
@@ -0,0 +1,107 @@
+#include "GlyphAtlas.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+GlyphAtlas::GlyphAtlas()
+    : atlasW(0)
+    , atlasH(0)
+    , maxGlyphH(0)
+{}
+
+GlyphAtlas::GlyphAtlas(const std::vector<Size> &sizes, unsigned atlasWidth, unsigned padding)
+    : glyphs(GlyphCount)
+    , atlasW(atlasWidth)
+    , atlasH(0)
+    , maxGlyphH(0)
+{
+    assert(sizes.size() == GlyphCount);
+
+    // Fill shelves left to right. A shelf is as high as its highest glyph,
+    // and a glyph that does not fit starts the next one.
+    unsigned x = padding;
+    unsigned y = padding;
+    unsigned shelfH = 0;
+
+    for (unsigned i = 0; i < GlyphCount; ++i)
+    {
+        auto &s = sizes[i];
+        assert(s.width + 2 * padding <= atlasW);
+
+        if (x + s.width + padding > atlasW)
+        {
+            x = padding;
+            y += shelfH + padding;
+            shelfH = 0;
+        }
+
+        auto &g  = glyphs[i];
+        g.x      = x;
+        g.y      = y;
+        g.width  = s.width;
+        g.height = s.height;
+
+        x += s.width + padding;
+        shelfH    = std::max(shelfH, s.height);
+        maxGlyphH = std::max(maxGlyphH, s.height);
+    }
+
+    atlasH = y + shelfH + padding;
+
+    float invW = 1.f / static_cast<float>(atlasW);
+    float invH = 1.f / static_cast<float>(atlasH);
+
+    for (auto &g : glyphs)
+    {
+        g.u0 = static_cast<float>(g.x) * invW;
+        g.v0 = static_cast<float>(g.y) * invH;
+        g.u1 = static_cast<float>(g.x + g.width)  * invW;
+        g.v1 = static_cast<float>(g.y + g.height) * invH;
+    }
+}
+
+const GlyphAtlas::Glyph &GlyphAtlas::glyph(char c) const
+{
+    assert(!glyphs.empty());
+
+    if (c < FirstChar || c > LastChar)
+        c = MissingChar;
+
+    return glyphs[c - FirstChar];
+}
+
+unsigned GlyphAtlas::textWidth(const std::string &text) const
+{
+    unsigned w = 0;
+    for (char c : text)
+        w += glyph(c).width;
+    return w;
+}
+
+unsigned GlyphAtlas::layout(const std::string &text, float x, float y, std::vector<Quad> &quads) const
+{
+    unsigned w = 0;
+
+    for (char c : text)
+    {
+        auto &g = glyph(c);
+
+        if (c != ' ')
+        {
+            Quad q;
+            q.x0 = x + static_cast<float>(w);
+            q.y0 = y;
+            q.x1 = q.x0 + static_cast<float>(g.width);
+            q.y1 = y + static_cast<float>(g.height);
+            q.u0 = g.u0;
+            q.v0 = g.v0;
+            q.u1 = g.u1;
+            q.v1 = g.v1;
+            quads.emplace_back(q);
+        }
+
+        w += g.width;
+    }
+
+    return w;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Placement of the printable ASCII glyphs of a font in a single texture,
+// and the layout of strings as one quad per glyph. The glyphs are packed
+// into shelves once, so any string can be drawn without rasterizing it.
+class GlyphAtlas
+{
+public:
+    static const char FirstChar = ' ';
+    static const char LastChar  = '~';
+    static const unsigned GlyphCount = LastChar - FirstChar + 1;
+    // Characters without a glyph are drawn using this one.
+    static const char MissingChar = '?';
+
+    struct Size
+    {
+        unsigned width;
+        unsigned height;
+    };
+
+    struct Glyph
+    {
+        // Placement in the atlas in texels. The width is also the advance.
+        unsigned x;
+        unsigned y;
+        unsigned width;
+        unsigned height;
+        float u0;
+        float v0;
+        float u1;
+        float v1;
+    };
+
+    // In pixels, with y growing downwards.
+    struct Quad
+    {
+        float x0;
+        float y0;
+        float x1;
+        float y1;
+        float u0;
+        float v0;
+        float u1;
+        float v1;
+    };
+
+    GlyphAtlas();
+    // sizes holds the rasterized size of each glyph from FirstChar to
+    // LastChar. The glyphs are separated by padding texels.
+    GlyphAtlas(const std::vector<Size> &sizes, unsigned atlasWidth, unsigned padding = 1);
+
+    unsigned width()      const { return atlasW; }
+    unsigned height()     const { return atlasH; }
+    unsigned lineHeight() const { return maxGlyphH; }
+
+    const Glyph &glyph(char c) const;
+
+    unsigned textWidth(const std::string &text) const;
+
+    // Append a quad for each visible glyph of the text, with its upper left
+    // corner at x, y. Spaces only advance. Returns the width of the text.
+    unsigned layout(const std::string &text, float x, float y, std::vector<Quad> &quads) const;
+
+private:
+    std::vector<Glyph> glyphs;
+    unsigned atlasW;
+    unsigned atlasH;
+    unsigned maxGlyphH;
+};
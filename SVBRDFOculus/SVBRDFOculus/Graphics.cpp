@@ -1,4 +1,5 @@
 #include "Graphics.hpp"
+#include "MeshSimplifier.hpp"
 
 #include <algorithm>
 #include <cmath>
@@ -14,8 +15,45 @@
 using namespace DirectX;
 
 CComPtr<ID3D11Device> device;
-CComQIPtr<ID3DUserDefinedAnnotation> annotation;
-CComPtr<ID3D11DeviceContext> context;
+thread_local CComQIPtr<ID3DUserDefinedAnnotation> annotation;
+thread_local CComPtr<ID3D11DeviceContext> context;
+thread_local CComQIPtr<ID3D11DeviceContext1> context1;
+thread_local CommandCounts commandCounts;
+
+CommandCounts CommandCounts::operator+(const CommandCounts &c) const
+{
+    CommandCounts d;
+    d.draws         = draws         + c.draws;
+    d.pipelines     = pipelines     + c.pipelines;
+    d.renderTargets = renderTargets + c.renderTargets;
+    d.bindings      = bindings      + c.bindings;
+    return d;
+}
+
+CommandCounts CommandCounts::operator-(const CommandCounts &c) const
+{
+    CommandCounts d;
+    d.draws         = draws         - c.draws;
+    d.pipelines     = pipelines     - c.pipelines;
+    d.renderTargets = renderTargets - c.renderTargets;
+    d.bindings      = bindings      - c.bindings;
+    return d;
+}
+
+static void breakOnDebugMessages()
+{
+#if defined(_DEBUG)
+    // Catch all debug layer warnings ASAP.
+    CComQIPtr<ID3D11InfoQueue> info;
+    info = device;
+    if (info)
+    {
+        info->SetBreakOnSeverity(D3D11_MESSAGE_SEVERITY_CORRUPTION, TRUE);
+        info->SetBreakOnSeverity(D3D11_MESSAGE_SEVERITY_ERROR,      TRUE);
+        info->SetBreakOnSeverity(D3D11_MESSAGE_SEVERITY_WARNING,    TRUE);
+    }
+#endif
+}
 
 Graphics::Graphics(HWND hWnd, int width, int height, DXGI_FORMAT swapChainFormat)
 {
@@ -77,18 +115,7 @@ Graphics::Graphics(HWND hWnd, int width, int height, DXGI_FORMAT swapChainFormat
         nullptr,
         &context));
 
-#if defined(_DEBUG)
-    // Catch all debug layer warnings ASAP.
-    CComQIPtr<ID3D11InfoQueue> info;
-    info = device;
-    if (info)
-    {
-        info->SetBreakOnSeverity(D3D11_MESSAGE_SEVERITY_CORRUPTION, TRUE);
-        info->SetBreakOnSeverity(D3D11_MESSAGE_SEVERITY_ERROR,      TRUE);
-        info->SetBreakOnSeverity(D3D11_MESSAGE_SEVERITY_WARNING,    TRUE);
-    }
-
-#endif
+    breakOnDebugMessages();
 
     CComPtr<ID3D11Texture2D> backBuffer;
     checkHR(swapChain.swapChain->GetBuffer(
@@ -102,13 +129,54 @@ Graphics::Graphics(HWND hWnd, int width, int height, DXGI_FORMAT swapChainFormat
     swapChain.backBuffer.name("Swap chain backbuffer");
 
     annotation = context;
+    context1   = context;
+    backend    = &stateCache();
+    stateCache().invalidate();
+}
+
+Graphics::Graphics(D3D_DRIVER_TYPE driverType)
+{
+    checkHR(CoInitializeEx(nullptr, COINIT_MULTITHREADED));
+
+    UINT flags = 0;
+#if defined(_DEBUG)
+    flags |= D3D11_CREATE_DEVICE_DEBUG;
+#endif
+
+    D3D_FEATURE_LEVEL featureLevel[1] = { D3D_FEATURE_LEVEL_11_0 };
+
+    checkHR(D3D11CreateDevice(
+        nullptr,
+        driverType,
+        nullptr,
+        flags,
+        featureLevel, 1,
+        D3D11_SDK_VERSION,
+        &device,
+        nullptr,
+        &context));
+
+    breakOnDebugMessages();
+
+    swapChain.width  = 0;
+    swapChain.height = 0;
+
+    annotation = context;
+    context1   = context;
+    backend    = &stateCache();
+    stateCache().invalidate();
 }
 
 Graphics::~Graphics()
 {
     swapChain = SwapChain();
-    context = nullptr;
-    device  = nullptr;
+    pipelineCache().clear();
+    texturePool().clear();
+    backend  = nullptr;
+    annotation = nullptr;
+    context1 = nullptr;
+    context  = nullptr;
+    device   = nullptr;
 
     CoUninitialize();
 }
@@ -204,10 +272,9 @@ Resource::Resource(const D3D11_BUFFER_DESC &bufferDesc, DXGI_FORMAT format, cons
     initial.SysMemPitch      = static_cast<UINT>(initialBytes);
     initial.SysMemSlicePitch = static_cast<UINT>(initialBytes);
 
-    checkHR(device->CreateBuffer(
-        &bufferDesc,
-        (initialData && initialBytes) ? &initial : nullptr,
-        &buffer));
+    buffer = backend->createBuffer(
+        bufferDesc,
+        (initialData && initialBytes) ? &initial : nullptr);
 
     this->format = format;
     this->stride = elementSize(bufferDesc, format);
@@ -237,10 +304,9 @@ static D3D11_TEXTURE2D_DESC fixupTextureDescriptor(D3D11_TEXTURE2D_DESC textureD
 
 Resource::Resource(const D3D11_TEXTURE2D_DESC &textureDesc, const D3D11_SUBRESOURCE_DATA *initialData)
 {
-    checkHR(device->CreateTexture2D(
-        &fixupTextureDescriptor(textureDesc),
-        initialData,
-        &texture));
+    texture = backend->createTexture2D(
+        fixupTextureDescriptor(textureDesc),
+        initialData);
     this->format = textureDesc.Format;
     this->stride = 0;
     views();
@@ -550,6 +616,171 @@ void Resource::name(const char * fmt, ...)
     va_end(ap);
 }
 
+std::vector<Resource> mipLevelViews(Resource &texture)
+{
+    auto desc = texture.textureDescriptor();
+    check(desc.ArraySize == 1 && desc.SampleDesc.Count == 1,
+          "Mip level views are only supported for plain 2D textures.");
+
+    std::vector<Resource> mips;
+    mips.reserve(desc.MipLevels);
+
+    for (UINT m = 0; m < desc.MipLevels; ++m)
+    {
+        D3D11_SHADER_RESOURCE_VIEW_DESC srvDesc;
+        zero(srvDesc);
+        srvDesc.ViewDimension             = D3D11_SRV_DIMENSION_TEXTURE2D;
+        srvDesc.Format                    = textureViewFormat(texture.format);
+        srvDesc.Texture2D.MostDetailedMip = m;
+        srvDesc.Texture2D.MipLevels       = 1;
+
+        D3D11_RENDER_TARGET_VIEW_DESC rtvDesc;
+        zero(rtvDesc);
+        rtvDesc.ViewDimension      = D3D11_RTV_DIMENSION_TEXTURE2D;
+        rtvDesc.Format             = texture.format;
+        rtvDesc.Texture2D.MipSlice = m;
+
+        D3D11_DEPTH_STENCIL_VIEW_DESC dsvDesc;
+        zero(dsvDesc);
+        dsvDesc.ViewDimension      = D3D11_DSV_DIMENSION_TEXTURE2D;
+        dsvDesc.Format             = texture.format;
+        dsvDesc.Texture2D.MipSlice = m;
+
+        Resource mip = texture;
+        mip.views(&srvDesc, nullptr, &rtvDesc, &dsvDesc);
+        mips.emplace_back(std::move(mip));
+    }
+
+    return mips;
+}
+
+static unsigned formatBytes(DXGI_FORMAT format)
+{
+    switch (format)
+    {
+    case DXGI_FORMAT_R32G32B32A32_FLOAT:
+        return 16;
+    case DXGI_FORMAT_R16G16B16A16_FLOAT:
+    case DXGI_FORMAT_R32G32_FLOAT:
+        return 8;
+    case DXGI_FORMAT_R8_UNORM:
+        return 1;
+    default:
+        return 4;
+    }
+}
+
+// Bytes of the texture, which is only needed for the statistics, so
+// the less common formats are estimated to have four bytes per texel.
+static uint64_t textureBytes(const D3D11_TEXTURE2D_DESC &desc)
+{
+    uint64_t bytes = 0;
+    unsigned w = desc.Width;
+    unsigned h = desc.Height;
+    unsigned levels = desc.MipLevels;
+    if (!levels)
+        levels = static_cast<unsigned>(std::floor(std::log2(std::max(w, h)))) + 1;
+
+    for (unsigned m = 0; m < levels; ++m)
+    {
+        bytes += static_cast<uint64_t>(std::max(1u, w >> m)) * std::max(1u, h >> m);
+    }
+
+    return bytes * formatBytes(desc.Format) * desc.SampleDesc.Count * desc.ArraySize;
+}
+
+// D3D11_TEXTURE2D_DESC has no padding, so its bytes are its key.
+static std::string textureKey(const D3D11_TEXTURE2D_DESC &desc)
+{
+    return std::string(reinterpret_cast<const char *>(&desc), sizeof(desc));
+}
+
+Resource TexturePool::acquire(const D3D11_TEXTURE2D_DESC &desc, ResourcePool::Allocation &allocation)
+{
+    bool created = false;
+    allocation = pool.acquire(textureKey(desc), textureBytes(desc), created);
+
+    if (created)
+    {
+        textures.resize(std::max<size_t>(textures.size(), allocation + 1));
+        textures[allocation] = Resource(desc);
+    }
+
+    return textures[allocation];
+}
+
+std::vector<Resource> TexturePool::acquire(const std::vector<Transient> &transients,
+                                           std::vector<ResourcePool::Allocation> &allocations)
+{
+    std::vector<ResourcePool::Transient> requests;
+    requests.reserve(transients.size());
+    for (auto &t : transients)
+        requests.push_back({ textureKey(t.desc), textureBytes(t.desc), t.firstPass, t.lastPass });
+
+    std::vector<ResourcePool::Allocation> created;
+    allocations = pool.acquire(requests, created);
+
+    for (auto a : created)
+    {
+        auto it = std::find(allocations.begin(), allocations.end(), a);
+        textures.resize(std::max<size_t>(textures.size(), a + 1));
+        textures[a] = Resource(transients[it - allocations.begin()].desc);
+    }
+
+    std::vector<Resource> resources;
+    resources.reserve(allocations.size());
+    for (auto a : allocations)
+        resources.emplace_back(textures[a]);
+
+    return resources;
+}
+
+void TexturePool::release(ResourcePool::Allocation allocation)
+{
+    pool.release(allocation);
+    destroy(pool.trim(MaxFreeBytes));
+}
+
+void TexturePool::clear()
+{
+    destroy(pool.trim(0));
+}
+
+void TexturePool::destroy(const std::vector<ResourcePool::Allocation> &allocations)
+{
+    for (auto a : allocations)
+        textures[a] = Resource();
+}
+
+TexturePool &texturePool()
+{
+    static TexturePool pool;
+    return pool;
+}
+
+Resource PooledTextures::acquire(const D3D11_TEXTURE2D_DESC &desc)
+{
+    ResourcePool::Allocation allocation;
+    Resource texture = texturePool().acquire(desc, allocation);
+    allocations.emplace_back(allocation);
+    return texture;
+}
+
+std::vector<Resource> PooledTextures::acquire(const std::vector<TexturePool::Transient> &transients)
+{
+    std::vector<ResourcePool::Allocation> acquired;
+    auto textures = texturePool().acquire(transients, acquired);
+    allocations.insert(allocations.end(), acquired.begin(), acquired.end());
+    return textures;
+}
+
+void PooledTextures::release()
+{
+    for (auto a : allocations)
+        texturePool().release(a);
+    allocations.clear();
+}
+
 Resource downloadForDebugging(Resource &buffer)
 {
     D3D11_BUFFER_DESC desc = buffer.bufferDescriptor();
@@ -850,23 +1081,70 @@ Resource loadPFMImage(const char *filename, FloatPixelBuffer *pixels)
         pixels->pixels = std::move(srcData);
     }
 
+    log("    Loaded PFM \"%s\" in %.2f ms.\n", filename, t.seconds() * 1000.0);
+    return pixelBufferTexture(*pixels);
+}
+
+bool savePFMImage(const char *filename, const FloatPixelBuffer &pixels)
+{
+    check(pixels.channels == 1 || pixels.channels == 4, "Invalid channel amount");
+
+    Timer t;
+    FILE *f = nullptr;
+    if (fopen_s(&f, filename, "wb") != 0 || !f)
+    {
+        log("Failed to save \"%s\"\n", filename);
+        return false;
+    }
+
+    // The rows are written in the order loadPFMImage() reads them, and
+    // a negative scale means little endian.
+    fprintf(f, "%s\n%d %d\n-1.0\n", pixels.channels == 1 ? "Pf" : "PF", pixels.width, pixels.height);
+
+    size_t numPixels = static_cast<size_t>(pixels.width) * pixels.height;
+    bool ok = true;
+    if (pixels.channels == 1)
+    {
+        ok = fwrite(pixels.pixels.data(), sizeof(float), numPixels, f) == numPixels;
+    }
+    else
+    {
+        std::vector<float> rgb(numPixels * 3);
+        for (size_t i = 0; i < numPixels; ++i)
+            memcpy(&rgb[i * 3], &pixels.pixels[i * 4], 3 * sizeof(float));
+        ok = fwrite(rgb.data(), sizeof(float), rgb.size(), f) == rgb.size();
+    }
+
+    ok = (fclose(f) == 0) && ok;
+    if (ok)
+        log("    Saved PFM \"%s\" in %.2f ms.\n", filename, t.seconds() * 1000.0);
+    else
+        log("Failed to save \"%s\"\n", filename);
+    return ok;
+}
+
+Resource pixelBufferTexture(const FloatPixelBuffer &pixels)
+{
+    unsigned width   = static_cast<unsigned>(pixels.width);
+    unsigned height  = static_cast<unsigned>(pixels.height);
+    size_t numPixels = static_cast<size_t>(width) * height;
+
     D3D11_TEXTURE2D_DESC texDesc;
     zero(texDesc);
     texDesc.Width = width;
     texDesc.Height = height;
     texDesc.ArraySize = 1;
     texDesc.MipLevels = 1;
-    texDesc.Format    = pixels->format();
+    texDesc.Format    = pixels.format();
     texDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
     texDesc.SampleDesc.Count   = 1;
     texDesc.SampleDesc.Quality = 0;
 
     D3D11_SUBRESOURCE_DATA initialData;
-    initialData.pSysMem          = pixels->pixels.data();
-    initialData.SysMemPitch      = static_cast<UINT>(    width * pixels->channels * sizeof(float));
-    initialData.SysMemSlicePitch = static_cast<UINT>(numPixels * pixels->channels * sizeof(float));
+    initialData.pSysMem          = pixels.pixels.data();
+    initialData.SysMemPitch      = static_cast<UINT>(    width * pixels.channels * sizeof(float));
+    initialData.SysMemSlicePitch = static_cast<UINT>(numPixels * pixels.channels * sizeof(float));
 
-    log("    Loaded PFM \"%s\" in %.2f ms.\n", filename, t.seconds() * 1000.0);
     return Resource(texDesc, &initialData);
 }
 
@@ -891,7 +1169,8 @@ Resource loadImage(const char *filename, size_t *loadedBytes)
 
 void setRenderTarget(ID3D11RenderTargetView *rtv, ID3D11DepthStencilView *dsv)
 {
-    context->OMSetRenderTargets(1, &rtv, dsv);
+    ++commandCounts.renderTargets;
+    backend->setRenderTargets(1, &rtv, dsv);
     
     D3D11_TEXTURE2D_DESC texDesc;
     if (rtv)
@@ -926,7 +1205,60 @@ void setRenderTarget(ID3D11RenderTargetView *rtv, ID3D11DepthStencilView *dsv)
     viewport.Width    = static_cast<float>(texDesc.Width);
     viewport.Height   = static_cast<float>(texDesc.Height);
 
-    context->RSSetViewports(1, &viewport);
+    backend->setViewport(viewport);
+}
+
+void setRenderTargets(std::initializer_list<ID3D11RenderTargetView *> rtvs, ID3D11DepthStencilView *dsv)
+{
+    ++commandCounts.renderTargets;
+
+    std::vector<ID3D11RenderTargetView *> views(rtvs);
+    backend->setRenderTargets(static_cast<UINT>(views.size()), views.data(), dsv);
+
+    CComPtr<ID3D11Resource> viewResource;
+    UINT mip = 0;
+
+    auto first = std::find_if(views.begin(), views.end(),
+                              [] (ID3D11RenderTargetView *rtv) { return rtv != nullptr; });
+    if (first != views.end())
+    {
+        D3D11_RENDER_TARGET_VIEW_DESC rtvDesc;
+        (*first)->GetDesc(&rtvDesc);
+        if (rtvDesc.ViewDimension == D3D11_RTV_DIMENSION_TEXTURE2D)
+            mip = rtvDesc.Texture2D.MipSlice;
+
+        (*first)->GetResource(&viewResource);
+    }
+    else if (dsv)
+    {
+        D3D11_DEPTH_STENCIL_VIEW_DESC dsvDesc;
+        dsv->GetDesc(&dsvDesc);
+        if (dsvDesc.ViewDimension == D3D11_DSV_DIMENSION_TEXTURE2D)
+            mip = dsvDesc.Texture2D.MipSlice;
+
+        dsv->GetResource(&viewResource);
+    }
+    else
+    {
+        return;
+    }
+
+    CComQIPtr<ID3D11Texture2D> viewTex;
+    viewTex = viewResource;
+
+    D3D11_TEXTURE2D_DESC texDesc;
+    viewTex->GetDesc(&texDesc);
+
+    D3D11_VIEWPORT viewport;
+    zero(viewport);
+    viewport.TopLeftX = 0;
+    viewport.TopLeftY = 0;
+    viewport.MinDepth = D3D11_MIN_DEPTH;
+    viewport.MaxDepth = D3D11_MAX_DEPTH;
+    viewport.Width    = static_cast<float>(std::max(1u, texDesc.Width  >> mip));
+    viewport.Height   = static_cast<float>(std::max(1u, texDesc.Height >> mip));
+
+    backend->setViewport(viewport);
 }
 
 void setVertexBuffers(Resource *vertexBuffer, Resource *indexBuffer)
@@ -957,6 +1289,100 @@ void setVertexBuffers(Resource *vertexBuffer, Resource *indexBuffer)
     }
 }
 
+void setViewport(unsigned x, unsigned y, unsigned width, unsigned height)
+{
+    ++commandCounts.renderTargets;
+
+    D3D11_VIEWPORT viewport;
+    zero(viewport);
+    viewport.TopLeftX = static_cast<float>(x);
+    viewport.TopLeftY = static_cast<float>(y);
+    viewport.MinDepth = D3D11_MIN_DEPTH;
+    viewport.MaxDepth = D3D11_MAX_DEPTH;
+    viewport.Width    = static_cast<float>(width);
+    viewport.Height   = static_cast<float>(height);
+
+    backend->setViewport(viewport);
+}
+
+void setShaderResources(ShaderStage stage, UINT slot, std::initializer_list<ID3D11ShaderResourceView *> srvs)
+{
+    ++commandCounts.bindings;
+    backend->setShaderResources(stage, slot, static_cast<UINT>(srvs.size()), srvs.begin());
+}
+
+void setSamplers(ShaderStage stage, UINT slot, std::initializer_list<ID3D11SamplerState *> samplers)
+{
+    ++commandCounts.bindings;
+    backend->setSamplers(stage, slot, static_cast<UINT>(samplers.size()), samplers.begin());
+}
+
+void unbindShaderResources(ShaderStage stage, std::initializer_list<UINT> slots)
+{
+    ID3D11ShaderResourceView *none[1] = { nullptr };
+
+    for (UINT slot : slots)
+    {
+        ++commandCounts.bindings;
+        backend->setShaderResources(stage, slot, 1, none);
+    }
+}
+
+void unbindSamplers(ShaderStage stage, std::initializer_list<UINT> slots)
+{
+    ID3D11SamplerState *none[1] = { nullptr };
+
+    for (UINT slot : slots)
+    {
+        ++commandCounts.bindings;
+        backend->setSamplers(stage, slot, 1, none);
+    }
+}
+
+void setUnorderedAccessView(UINT slot, ID3D11UnorderedAccessView *uav)
+{
+    ++commandCounts.bindings;
+    backend->setUnorderedAccessView(slot, uav);
+}
+
+void clearRenderTarget(ID3D11RenderTargetView *rtv, const float color[4])
+{
+    backend->clearRenderTarget(rtv, color);
+}
+
+void clearDepthStencil(ID3D11DepthStencilView *dsv, UINT flags, float depth, UINT8 stencil)
+{
+    backend->clearDepthStencil(dsv, flags, depth, stencil);
+}
+
+void draw(UINT vertexCount, UINT startVertex)
+{
+    ++commandCounts.draws;
+    backend->draw(vertexCount, startVertex);
+}
+
+void drawIndexed(UINT indexCount, UINT instances)
+{
+    ++commandCounts.draws;
+    backend->drawIndexed(indexCount, instances);
+}
+
+void waitForGPU()
+{
+    D3D11_QUERY_DESC desc;
+    zero(desc);
+    desc.Query = D3D11_QUERY_EVENT;
+
+    CComPtr<ID3D11Query> query;
+    checkHR(device->CreateQuery(&desc, &query));
+
+    context->End(query);
+
+    BOOL done = FALSE;
+    while (context->GetData(query, &done, sizeof(done), 0) == S_FALSE)
+        Sleep(0);
+}
+
 XMMATRIX projection(unsigned width, unsigned height, float nearZ, float farZ, float verticalFOV, DepthMode depthMode)
 {
     auto w = static_cast<float>(width);
@@ -987,87 +1413,74 @@ void GraphicsPipeline::initStates(D3D11_PRIMITIVE_TOPOLOGY topology,
         primitiveTopology = D3D11_PRIMITIVE_TOPOLOGY_3_CONTROL_POINT_PATCHLIST;
     }
 
+    depthStencilState          = nullptr;
+    depthStencilStateWireframe = nullptr;
+    rasterizerState            = nullptr;
+    rasterizerStateWireframe   = nullptr;
+    blendState                 = nullptr;
+
+    // The wireframe variants are created up front, so binding a pipeline
+    // never creates anything, even on the recording threads.
     if (dss)
     {
-        checkHR(device->CreateDepthStencilState(dss, &depthStencilState));
-    }
-    else
-    {
-        depthStencilState = nullptr;
+        depthStencilState = pipelineCache().depthStencilState(*dss);
+
+        D3D11_DEPTH_STENCIL_DESC dsDesc = *dss;
+        dsDesc.DepthFunc = D3D11_COMPARISON_ALWAYS;
+        depthStencilStateWireframe = pipelineCache().depthStencilState(dsDesc);
     }
 
     if (rss)
     {
-        checkHR(device->CreateRasterizerState(rss, &rasterizerState));
-    }
-    else
-    {
-        rasterizerState = nullptr;
+        rasterizerState = pipelineCache().rasterizerState(*rss);
+
+        D3D11_RASTERIZER_DESC rsDesc = *rss;
+        rsDesc.CullMode = D3D11_CULL_NONE;
+        rsDesc.FillMode = D3D11_FILL_WIREFRAME;
+        rasterizerStateWireframe = pipelineCache().rasterizerState(rsDesc);
     }
 
     if (bs)
-    {
-        checkHR(device->CreateBlendState(bs, &blendState));
-    }
-    else
-    {
-        blendState = nullptr;
-    }
+        blendState = pipelineCache().blendState(*bs);
 }
 
-void GraphicsPipeline::bind()
+PipelineState GraphicsPipeline::pipelineState(const Shader<PS> &pixelShader,
+                                              ID3D11RasterizerState *rs,
+                                              ID3D11DepthStencilState *dss) const
 {
-    context->VSSetShader(vs.shader, nullptr, 0);
-    context->HSSetShader(hs.shader, nullptr, 0);
-    context->DSSetShader(ds.shader, nullptr, 0);
-    context->PSSetShader(ps.shader, nullptr, 0);
-    context->IASetPrimitiveTopology(primitiveTopology);
-    context->IASetInputLayout(inputLayout);
-    context->RSSetState(rasterizerState);
-    context->OMSetBlendState(blendState, nullptr, -1);
-    context->OMSetDepthStencilState(depthStencilState, 0);
+    PipelineState state;
+    state.vs                = vs.shader;
+    state.hs                = hs.shader;
+    state.ds                = ds.shader;
+    state.ps                = pixelShader.shader;
+    state.primitiveTopology = primitiveTopology;
+    state.inputLayout       = inputLayout;
+    state.rasterizerState   = rs;
+    state.blendState        = blendState;
+    state.depthStencilState = dss;
+    state.stencilRef        = 0;
+    return state;
 }
 
-void GraphicsPipeline::bindWireframe()
+void GraphicsPipeline::bind()
 {
-    if (!rasterizerStateWireframe)
-    {
-        check(!!rasterizerState, "Cannot use wireframe rendering without a rasterizer state.");
-
-        D3D11_RASTERIZER_DESC rsDesc;
-        zero(rsDesc);
-        rasterizerState->GetDesc(&rsDesc);
-        rsDesc.CullMode = D3D11_CULL_NONE;
-        rsDesc.FillMode = D3D11_FILL_WIREFRAME;
-
-        checkHR(device->CreateRasterizerState(&rsDesc, &rasterizerStateWireframe));
-    }
-
-    if (!depthStencilStateWireframe)
-    {
-        if (depthStencilState)
-        {
-            D3D11_DEPTH_STENCIL_DESC dsDesc;
-            zero(dsDesc);
-            depthStencilState->GetDesc(&dsDesc);
-            dsDesc.DepthFunc = D3D11_COMPARISON_ALWAYS;
+    ++commandCounts.pipelines;
+    backend->bindPipeline(pipelineState(ps, rasterizerState, depthStencilState));
+}
 
-            checkHR(device->CreateDepthStencilState(&dsDesc, &depthStencilStateWireframe));
-        }
-    }
+void GraphicsPipeline::setStencilRef(UINT stencilRef)
+{
+    backend->setDepthStencilState(depthStencilState, stencilRef);
+}
 
-    if (!psWireframe)
-        psWireframe = ps;
+void GraphicsPipeline::bindWireframe()
+{
+    check(!!rasterizerStateWireframe, "Cannot use wireframe rendering without a rasterizer state.");
 
-    context->VSSetShader(vs.shader, nullptr, 0);
-    context->HSSetShader(hs.shader, nullptr, 0);
-    context->DSSetShader(ds.shader, nullptr, 0);
-    context->PSSetShader(psWireframe.shader, nullptr, 0);
-    context->IASetPrimitiveTopology(primitiveTopology);
-    context->IASetInputLayout(inputLayout);
-    context->RSSetState(rasterizerStateWireframe);
-    context->OMSetBlendState(blendState, nullptr, -1);
-    context->OMSetDepthStencilState(depthStencilStateWireframe, 0);
+    ++commandCounts.pipelines;
+    backend->bindPipeline(pipelineState(psWireframe ? psWireframe : ps,
+                                        rasterizerStateWireframe,
+                                        depthStencilStateWireframe));
 }
 
 FloatPixelBuffer::FloatPixelBuffer(int width, int height, int channels)
@@ -1111,45 +1524,115 @@ float &FloatPixelBuffer::operator()(int x, int y, int ch)
     return operator()(x, y)[ch];
 }
 
-ConstantBuffers::CB ConstantBuffers::get(size_t size)
+const uint32_t ConstantBuffers::DefaultBufferSize;
+
+ConstantBuffers::ConstantBuffers(uint32_t bufferSize)
+    : ring(bufferSize)
+{
+    D3D11_FEATURE_DATA_D3D11_OPTIONS options;
+    zero(options);
+    checkHR(device->CheckFeatureSupport(D3D11_FEATURE_D3D11_OPTIONS, &options, sizeof(options)));
+    check(context1 && options.ConstantBufferOffsetting && options.MapNoOverwriteOnDynamicConstantBuffer,
+          "Direct3D 11.1 constant buffer offsets are not supported");
+
+    D3D11_BUFFER_DESC cbDesc;
+    zero(cbDesc);
+    cbDesc.BindFlags            = D3D11_BIND_CONSTANT_BUFFER;
+    cbDesc.ByteWidth            = ring.bufferSize();
+    cbDesc.MiscFlags            = 0;
+    cbDesc.CPUAccessFlags       = D3D11_CPU_ACCESS_WRITE;
+    cbDesc.Usage                = D3D11_USAGE_DYNAMIC;
+
+    buffer = backend->createBuffer(cbDesc, nullptr);
+}
+
+void ConstantBuffers::beginFrame()
+{
+    ring.beginFrame();
+}
+
+ConstantBuffers::CB ConstantBuffers::allocate(const void *data, size_t size)
 {
-    auto sizePow2 = roundUpToPowerOf2(size);
-    auto &sizeClass = sizeClasses[sizePow2];
+    auto a = ring.allocate(static_cast<uint32_t>(size));
+    check(a.valid(), "Constant buffer too large");
+
+    backend->writeBuffer(buffer,
+                         a.discard ? D3D11_MAP_WRITE_DISCARD : D3D11_MAP_WRITE_NO_OVERWRITE,
+                         a.offset, data, size);
 
     CB cb;
+    cb.buffer        = buffer;
+    cb.firstConstant = a.offset / 16;
+    cb.numConstants  = a.size / 16;
+    return cb;
+}
 
-    for (auto &b : sizeClass)
-    {
-        // If the reference count is 1, the only reference is the
-        // one in the size class vector, and the buffer is thus unused.
-        if (b.use_count() == 1)
-        {
-            cb = b;
-        }
-    }
+DeferredContext::DeferredContext(uint32_t constantBufferSize)
+    : cache(d3d11Backend())
+    , cb(constantBufferSize)
+{
+    checkHR(device->CreateDeferredContext(0, &deferred));
+    deferred1          = deferred;
+    deferredAnnotation = deferred;
 
-    if (!cb)
-    {
-        cb = std::make_shared<CComPtr<ID3D11Buffer>>();
+    zero(counts);
+    zero(binds);
+}
 
-        D3D11_BUFFER_DESC cbDesc;
-        zero(cbDesc);
-        cbDesc.BindFlags            = D3D11_BIND_CONSTANT_BUFFER;
-        cbDesc.ByteWidth            = std::max(16U, static_cast<UINT>(sizePow2));
-        cbDesc.StructureByteStride  = cbDesc.ByteWidth;
-        cbDesc.MiscFlags            = 0;
-        cbDesc.CPUAccessFlags       = D3D11_CPU_ACCESS_WRITE;
-        cbDesc.Usage                = D3D11_USAGE_DYNAMIC;
+void DeferredContext::record(const std::function<void(ConstantBuffers &cb)> &f)
+{
+    check(!commandList, "The previous command list has not been executed.");
 
-        checkHR(device->CreateBuffer(
-            &cbDesc,
-            nullptr,
-            &(*cb)));
+    CComPtr<ID3D11DeviceContext> previousContext            = context;
+    CComQIPtr<ID3D11DeviceContext1> previousContext1        = context1;
+    CComQIPtr<ID3DUserDefinedAnnotation> previousAnnotation = annotation;
+    Backend *previousBackend     = backend;
+    CommandCounts previousCounts = commandCounts;
 
-        sizeClass.emplace_back(cb);
-    }
+    context    = deferred;
+    context1   = deferred1;
+    annotation = deferredAnnotation;
+    backend    = &cache;
+    zero(commandCounts);
 
-    return cb;
+    // Every command list starts from the default state.
+    cache.invalidate();
+    StateCache::Stats bindsBefore = cache.stats();
+
+    cb.beginFrame();
+    f(cb);
+
+    checkHR(deferred->FinishCommandList(FALSE, &commandList));
+
+    counts = commandCounts;
+    binds  = cache.stats() - bindsBefore;
+
+    context       = previousContext;
+    context1      = previousContext1;
+    annotation    = previousAnnotation;
+    backend       = previousBackend;
+    commandCounts = previousCounts;
+}
+
+void DeferredContext::execute()
+{
+    check(!!commandList, "There is no recorded command list to execute.");
+
+    context->ExecuteCommandList(commandList, FALSE);
+    commandList = nullptr;
+
+    commandCounts = commandCounts + counts;
+    // Without restoring the state, the immediate context is left in the
+    // default state, which the state cache must also forget.
+    stateCache().invalidate();
+}
+
+bool driverCommandLists()
+{
+    D3D11_FEATURE_DATA_THREADING threading;
+    zero(threading);
+    checkHR(device->CheckFeatureSupport(D3D11_FEATURE_THREADING, &threading, sizeof(threading)));
+    return !!threading.DriverCommandLists;
 }
 
 D3D11_TEXTURE2D_DESC texture2DDesc(unsigned width, unsigned height, DXGI_FORMAT format)
@@ -1225,6 +1708,125 @@ void gpuMarker(const wchar_t *fmt, ...)
     }
 }
 
+PipelineStatisticsQuery::PipelineStatisticsQuery()
+    : issued(0)
+    , retrieved(0)
+{
+    D3D11_QUERY_DESC desc;
+    zero(desc);
+    desc.Query = D3D11_QUERY_PIPELINE_STATISTICS;
+
+    for (auto &q : queries)
+        checkHR(device->CreateQuery(&desc, &q));
+}
+
+void PipelineStatisticsQuery::begin()
+{
+    // If the GPU is too far behind, the oldest result is dropped.
+    if (issued - retrieved >= Latency)
+        ++retrieved;
+
+    context->Begin(queries[issued % Latency]);
+}
+
+void PipelineStatisticsQuery::end()
+{
+    context->End(queries[issued % Latency]);
+    ++issued;
+}
+
+bool PipelineStatisticsQuery::read(D3D11_QUERY_DATA_PIPELINE_STATISTICS &statistics)
+{
+    bool found = false;
+
+    while (retrieved < issued)
+    {
+        HRESULT hr = context->GetData(queries[retrieved % Latency],
+                                      &statistics, sizeof(statistics),
+                                      D3D11_ASYNC_GETDATA_DONOTFLUSH);
+        if (hr == S_FALSE)
+            break;
+        checkHR(hr);
+
+        found = true;
+        ++retrieved;
+    }
+
+    return found;
+}
+
+GPUTimerQuery::GPUTimerQuery()
+    : issued(0)
+    , retrieved(0)
+{
+    D3D11_QUERY_DESC disjointDesc;
+    zero(disjointDesc);
+    disjointDesc.Query = D3D11_QUERY_TIMESTAMP_DISJOINT;
+
+    D3D11_QUERY_DESC timestampDesc;
+    zero(timestampDesc);
+    timestampDesc.Query = D3D11_QUERY_TIMESTAMP;
+
+    for (auto &s : spans)
+    {
+        checkHR(device->CreateQuery(&disjointDesc,  &s.disjoint));
+        checkHR(device->CreateQuery(&timestampDesc, &s.begin));
+        checkHR(device->CreateQuery(&timestampDesc, &s.end));
+    }
+}
+
+void GPUTimerQuery::begin()
+{
+    // If the GPU is too far behind, the oldest result is dropped.
+    if (issued - retrieved >= Latency)
+        ++retrieved;
+
+    auto &s = spans[issued % Latency];
+    context->Begin(s.disjoint);
+    context->End(s.begin);
+}
+
+void GPUTimerQuery::end()
+{
+    auto &s = spans[issued % Latency];
+    context->End(s.end);
+    context->End(s.disjoint);
+    ++issued;
+}
+
+bool GPUTimerQuery::read(double &seconds)
+{
+    bool found = false;
+
+    while (retrieved < issued)
+    {
+        auto &s = spans[retrieved % Latency];
+
+        D3D11_QUERY_DATA_TIMESTAMP_DISJOINT disjoint;
+        HRESULT hr = context->GetData(s.disjoint, &disjoint, sizeof(disjoint),
+                                      D3D11_ASYNC_GETDATA_DONOTFLUSH);
+        if (hr == S_FALSE)
+            break;
+        checkHR(hr);
+
+        // The timestamps are done by the time the disjoint query is.
+        UINT64 beginTicks = 0;
+        UINT64 endTicks   = 0;
+        checkHR(context->GetData(s.begin, &beginTicks, sizeof(beginTicks), D3D11_ASYNC_GETDATA_DONOTFLUSH));
+        checkHR(context->GetData(s.end,   &endTicks,   sizeof(endTicks),   D3D11_ASYNC_GETDATA_DONOTFLUSH));
+
+        ++retrieved;
+
+        if (disjoint.Disjoint || disjoint.Frequency == 0)
+            continue;
+
+        seconds = static_cast<double>(endTicks - beginTicks) / static_cast<double>(disjoint.Frequency);
+        found   = true;
+    }
+
+    return found;
+}
+
 struct ObjFile
 {
     std::vector<float3> positions;
@@ -1433,6 +2035,61 @@ void computeVertexNormals(std::vector<Vertex>& vertices, const std::vector<uint3
         t.seconds() * 1000.0);
 }
 
+void computeAreaWeightedNormals(std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices)
+{
+    std::vector<XMFLOAT3> sums(vertices.size(), XMFLOAT3(0, 0, 0));
+
+    size_t lastTriangleStart = indices.size() - 3;
+    for (size_t i = 0; i <= lastTriangleStart; i += 3)
+    {
+        auto A = loadFloat3(vertices[indices[i + 0]].pos);
+        auto B = loadFloat3(vertices[indices[i + 1]].pos);
+        auto C = loadFloat3(vertices[indices[i + 2]].pos);
+
+        // The length of the unnormalized normal is twice the area.
+        auto N = XMVector3Cross(XMVectorSubtract(B, A), XMVectorSubtract(C, A));
+
+        for (size_t k = 0; k < 3; ++k)
+        {
+            auto &sum = sums[indices[i + k]];
+            XMStoreFloat3(&sum, XMVectorAdd(N, XMLoadFloat3(&sum)));
+        }
+    }
+
+    for (size_t i = 0; i < vertices.size(); ++i)
+        storeFloat3(vertices[i].normal, XMVector3Normalize(XMLoadFloat3(&sums[i])));
+}
+
+void computeTangentFrames(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices)
+{
+    static_assert(sizeof(Vertex) % sizeof(float) == 0, "Vertex must be a whole number of floats");
+
+    if (vertices.empty())
+        return;
+
+    TangentFrames::Mesh mesh;
+    mesh.positions   = vertices[0].pos.data();
+    mesh.normals     = vertices[0].normal.data();
+    mesh.uvs         = vertices[0].uv.data();
+    mesh.stride      = sizeof(Vertex) / sizeof(float);
+    mesh.vertexCount = vertices.size();
+    mesh.indices     = indices.data();
+    mesh.indexCount  = indices.size();
+
+    TangentFrames frames(mesh);
+
+    // Reserve first, so that the copied vertices are not moved under us.
+    vertices.reserve(vertices.size() + frames.splitVertices().size());
+    for (uint32_t v : frames.splitVertices())
+        vertices.emplace_back(vertices[v]);
+
+    auto &quaternions = frames.frames();
+    for (size_t i = 0; i < vertices.size(); ++i)
+        vertices[i].tangentFrame = quaternions[i];
+
+    indices = frames.indices();
+}
+
 void computeTessellationFactors(std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices, float tessellationTriangleArea)
 {
     for (auto &v : vertices)
@@ -1501,12 +2158,70 @@ void computeTessellationFactors(std::vector<Vertex>& vertices, const std::vector
     log("Tessellation min/avg/max: %f / %f / %f\n", min, avg, max);
 }
 
-Mesh loadMesh(const std::vector<std::string> &objFilenames,
-              MeshLoadMode loadMode,
-              float tessellationTriangleArea)
+// Each LOD of a loaded mesh has about half the triangles of the previous
+// one, and there are LODs until they would have fewer triangles than this,
+// or until the simplification runs out of collapses.
+static const unsigned MaxMeshLods     = 6;
+static const unsigned MinLodTriangles = 256;
+
+static std::vector<MeshLod> simplifyMesh(const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices)
 {
+    std::vector<MeshLod> lods;
+    if (vertices.empty())
+        return lods;
+
     Timer t;
 
+    MeshSimplifier::Mesh mesh;
+    mesh.positions   = vertices[0].pos.data();
+    mesh.stride      = sizeof(Vertex) / sizeof(float);
+    mesh.vertexCount = vertices.size();
+    mesh.indices     = indices.data();
+    mesh.indexCount  = indices.size();
+
+    MeshSimplifier simplifier(mesh);
+
+    log("Prepared mesh simplification in %.2f ms.\n", t.seconds() * 1000.0);
+
+    size_t triangles = indices.size() / 3;
+    while (lods.size() < MaxMeshLods && triangles / 2 >= MinLodTriangles)
+    {
+        Timer level;
+        unsigned passes = simplifier.passes();
+        size_t simplified = simplifier.simplify(triangles / 2);
+
+        // Not worth another draw if the collapses ran out.
+        if (simplified > triangles * 9 / 10)
+            break;
+
+        MeshLod lod;
+        lod.indices     = simplifier.indices();
+        lod.indexAmount = static_cast<unsigned>(lod.indices.size());
+        lod.error       = simplifier.error();
+
+        log("LOD %u: %u triangles (%.1f%% of the full mesh), error %g, in %.2f ms with %u passes.\n",
+            static_cast<unsigned>(lods.size() + 1),
+            static_cast<unsigned>(simplified),
+            100.0 * simplified / (indices.size() / 3),
+            lod.error,
+            level.seconds() * 1000.0,
+            simplifier.passes() - passes);
+
+        lods.emplace_back(std::move(lod));
+        triangles = simplified;
+    }
+
+    log("Simplified mesh to %u LODs in %.2f ms.\n",
+        static_cast<unsigned>(lods.size()), t.seconds() * 1000.0);
+
+    return lods;
+}
+
+Mesh loadMeshGeometry(const std::vector<std::string> &objFilenames,
+                      MeshLoadMode loadMode,
+                      float tessellationTriangleArea)
+{
+
     size_t approxTotalVerts   = 0;
     size_t approxTotalIndices = 0;
 
@@ -1587,29 +2302,60 @@ Mesh loadMesh(const std::vector<std::string> &objFilenames,
     computeTessellationFactors(vertices, indices, tessellationTriangleArea);
     computeVertexNormals(vertices, indices);
 
+    {
+        Timer tangents;
+        size_t loadedVertices = vertices.size();
+        computeTangentFrames(vertices, indices);
+        log("Computed tangent frames in %.2f ms, split %u vertices on mirrored UV seams.\n",
+            tangents.seconds() * 1000.0,
+            static_cast<unsigned>(vertices.size() - loadedVertices));
+    }
+
     m.vertexAmount = static_cast<unsigned>(vertices.size());
     m.indexAmount  = static_cast<unsigned>(indices.size());
     m.indexFormat  = DXGI_FORMAT_R32_UINT;
     m.inputLayoutDesc = Vertex::inputLayoutDesc();
     m.scale = scale;
 
+    m.lods = simplifyMesh(vertices, indices);
+
+    m.vertices = std::move(vertices);
+    m.indices  = std::move(indices);
+
+    return m;
+}
+
+Mesh loadMesh(const std::vector<std::string> &objFilenames,
+              MeshLoadMode loadMode,
+              float tessellationTriangleArea)
+{
+    Timer t;
+
+    Mesh m = loadMeshGeometry(objFilenames, loadMode, tessellationTriangleArea);
+
     {
         D3D11_BUFFER_DESC vbDesc;
         zero(vbDesc);
-        vbDesc.ByteWidth           = static_cast<UINT>(sizeBytes(vertices));
+        vbDesc.ByteWidth           = static_cast<UINT>(sizeBytes(m.vertices));
         vbDesc.StructureByteStride = sizeof(Vertex);
         vbDesc.Usage               = D3D11_USAGE_IMMUTABLE;
         vbDesc.BindFlags           = D3D11_BIND_VERTEX_BUFFER;
-        m.vertexBuffer = Resource(vbDesc, DXGI_FORMAT_UNKNOWN, vertices.data(), sizeBytes(vertices));
+        m.vertexBuffer = Resource(vbDesc, DXGI_FORMAT_UNKNOWN, m.vertices.data(), sizeBytes(m.vertices));
     }
 
     {
         D3D11_BUFFER_DESC ibDesc;
         zero(ibDesc);
-        ibDesc.ByteWidth = static_cast<UINT>(sizeBytes(indices));
+        ibDesc.ByteWidth = static_cast<UINT>(sizeBytes(m.indices));
         ibDesc.Usage     = D3D11_USAGE_IMMUTABLE;
         ibDesc.BindFlags = D3D11_BIND_INDEX_BUFFER;
-        m.indexBuffer = Resource(ibDesc, DXGI_FORMAT_R32_UINT, indices.data(), sizeBytes(indices));
+        m.indexBuffer = Resource(ibDesc, DXGI_FORMAT_R32_UINT, m.indices.data(), sizeBytes(m.indices));
+
+        for (auto &lod : m.lods)
+        {
+            ibDesc.ByteWidth = static_cast<UINT>(sizeBytes(lod.indices));
+            lod.indexBuffer  = Resource(ibDesc, DXGI_FORMAT_R32_UINT, lod.indices.data(), sizeBytes(lod.indices));
+        }
     }
 
     log("Loaded mesh with %u vertices and %u indices (%u triangles) in %.2f ms.\n",
@@ -1620,7 +2366,6 @@ Mesh loadMesh(const std::vector<std::string> &objFilenames,
 
 CComPtr<ID3D11SamplerState> samplerPoint(D3D11_TEXTURE_ADDRESS_MODE mode)
 {
-    CComPtr<ID3D11SamplerState> bilinear;
     D3D11_SAMPLER_DESC bilinearDesc;
     zero(bilinearDesc);
     bilinearDesc.AddressU = mode;
@@ -1629,13 +2374,11 @@ CComPtr<ID3D11SamplerState> samplerPoint(D3D11_TEXTURE_ADDRESS_MODE mode)
     bilinearDesc.Filter   = D3D11_FILTER_MIN_MAG_MIP_POINT;
     bilinearDesc.MinLOD   = 0;
     bilinearDesc.MaxLOD   = D3D11_FLOAT32_MAX;
-    checkHR(device->CreateSamplerState(&bilinearDesc, &bilinear));
-    return bilinear;
+    return pipelineCache().samplerState(bilinearDesc);
 }
 
 CComPtr<ID3D11SamplerState> samplerBilinear(D3D11_TEXTURE_ADDRESS_MODE mode)
 {
-    CComPtr<ID3D11SamplerState> bilinear;
     D3D11_SAMPLER_DESC bilinearDesc;
     zero(bilinearDesc);
     bilinearDesc.AddressU = mode;
@@ -1644,13 +2387,11 @@ CComPtr<ID3D11SamplerState> samplerBilinear(D3D11_TEXTURE_ADDRESS_MODE mode)
     bilinearDesc.Filter   = D3D11_FILTER_MIN_MAG_LINEAR_MIP_POINT;
     bilinearDesc.MinLOD   = 0;
     bilinearDesc.MaxLOD   = D3D11_FLOAT32_MAX;
-    checkHR(device->CreateSamplerState(&bilinearDesc, &bilinear));
-    return bilinear;
+    return pipelineCache().samplerState(bilinearDesc);
 }
 
 CComPtr<ID3D11SamplerState> samplerAnisotropic(unsigned maxAnisotropy, D3D11_TEXTURE_ADDRESS_MODE mode)
 {
-    CComPtr<ID3D11SamplerState> aniso;
     D3D11_SAMPLER_DESC anisoDesc;
     zero(anisoDesc);
     anisoDesc.AddressU = mode;
@@ -1660,8 +2401,7 @@ CComPtr<ID3D11SamplerState> samplerAnisotropic(unsigned maxAnisotropy, D3D11_TEX
     anisoDesc.MaxAnisotropy = maxAnisotropy;
     anisoDesc.MinLOD   = 0;
     anisoDesc.MaxLOD   = D3D11_FLOAT32_MAX;
-    checkHR(device->CreateSamplerState(&anisoDesc, &aniso));
-    return aniso;
+    return pipelineCache().samplerState(anisoDesc);
 }
 
 XMMATRIX cubeMapFaceViewRH(CubeMapFace face, XMVECTOR eyePosition)
@@ -1797,6 +2537,7 @@ void Oculus::createOutputTextures(DXGI_FORMAT format)
         e.session = session;
         e.fov = hmd.DefaultEyeFov[eye];
         e.size = ovr_GetFovTextureSize(session, static_cast<ovrEyeType>(eye), e.fov, 1.f);
+        e.viewport = e.size;
 
         D3D11_TEXTURE2D_DESC desc = texture2DDesc(e.size.w, e.size.h, format);
         desc.BindFlags = D3D11_BIND_RENDER_TARGET;
@@ -1891,7 +2632,7 @@ ovrLayerEyeFov Oculus::frame()
         f.Fov[eye]            = e.fov;
         f.Viewport[eye].Pos.x = 0;
         f.Viewport[eye].Pos.y = 0;
-        f.Viewport[eye].Size  = e.size;
+        f.Viewport[eye].Size  = e.viewport;
         f.RenderPose[eye]     = e.pose;
         f.SensorSampleTime    = sensorSampleTime;
     }
@@ -1925,5 +2666,6 @@ std::vector<D3D11_INPUT_ELEMENT_DESC> Vertex::inputLayoutDesc()
         { "NORMAL",   0, DXGI_FORMAT_R32G32B32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
         { "TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT,    0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
         { "COLOR",    0, DXGI_FORMAT_R32_FLOAT,       0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 }, // tessellation factor
+        { "TANGENT",  0, DXGI_FORMAT_R16G16B16A16_SNORM, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 }, // tangent frame quaternion
     };
 }
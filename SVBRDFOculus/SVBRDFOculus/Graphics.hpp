@@ -1,6 +1,12 @@
 #pragma once
 
 #include "Utils.hpp"
+#include "Backend.hpp"
+#include "RingAllocator.hpp"
+#include "StateCache.hpp"
+#include "PipelineCache.hpp"
+#include "ResourcePool.hpp"
+#include "TangentFrames.hpp"
 
 #include <d3d11.h>
 #include <d3d11_1.h>
@@ -18,8 +24,12 @@
 #include <initializer_list>
 
 extern CComPtr<ID3D11Device> device;
-extern CComQIPtr<ID3DUserDefinedAnnotation> annotation;
-extern CComPtr<ID3D11DeviceContext> context;
+// The current context of each thread. The thread that creates Graphics uses
+// the immediate context, and other threads use deferred contexts while they
+// record command lists with DeferredContext.
+extern thread_local CComQIPtr<ID3DUserDefinedAnnotation> annotation;
+extern thread_local CComPtr<ID3D11DeviceContext> context;
+extern thread_local CComQIPtr<ID3D11DeviceContext1> context1;
 
 using DirectX::XM_PI;
 
@@ -62,6 +72,63 @@ struct Resource
 
 #define RESOURCE_DEBUG_NAME(res) (res).name("%s", #res)
 
+// Views of every mip level of a 2D texture separately. Each one has the shader
+// resource, render target and depth stencil views of just that level, depending
+// on the bind flags of the texture.
+std::vector<Resource> mipLevelViews(Resource &texture);
+
+// The textures of a ResourcePool, created with the device when there is no
+// free texture with the same descriptor. Released textures are kept for
+// reuse up to MaxFreeBytes. Only used by the thread that owns Graphics.
+class TexturePool
+{
+public:
+    static const uint64_t MaxFreeBytes = 256ull << 20;
+
+    struct Transient
+    {
+        D3D11_TEXTURE2D_DESC desc;
+        unsigned firstPass;
+        unsigned lastPass;
+    };
+
+    Resource acquire(const D3D11_TEXTURE2D_DESC &desc, ResourcePool::Allocation &allocation);
+    std::vector<Resource> acquire(const std::vector<Transient> &transients,
+                                  std::vector<ResourcePool::Allocation> &allocations);
+    void release(ResourcePool::Allocation allocation);
+
+    const ResourcePool::Stats &stats() const { return pool.stats(); }
+
+    // Release every free texture, e.g. before the device is destroyed.
+    void clear();
+
+private:
+    void destroy(const std::vector<ResourcePool::Allocation> &allocations);
+
+    ResourcePool pool;
+    std::vector<Resource> textures;
+};
+
+TexturePool &texturePool();
+
+// Textures of the pool that one owner holds, and returns to it together.
+// The textures must not be used after they have been returned.
+class PooledTextures
+{
+    std::vector<ResourcePool::Allocation> allocations;
+public:
+    PooledTextures() {}
+    PooledTextures(const PooledTextures &) = delete;
+    PooledTextures &operator=(const PooledTextures &) = delete;
+    ~PooledTextures() { release(); }
+
+    Resource acquire(const D3D11_TEXTURE2D_DESC &desc);
+    // Textures that are only used by a range of passes, aliased with each
+    // other when their descriptors are equal and their passes do not overlap.
+    std::vector<Resource> acquire(const std::vector<TexturePool::Transient> &transients);
+    void release();
+};
+
 struct SwapChain
 {
     int width;
@@ -75,12 +142,34 @@ struct Graphics
     SwapChain swapChain;
 
     Graphics(HWND hWnd, int width, int height, DXGI_FORMAT swapChainFormat = DXGI_FORMAT_R8G8B8A8_UNORM);
+    // Create just a device, without a window or a swap chain.
+    explicit Graphics(D3D_DRIVER_TYPE driverType);
     ~Graphics();
 
     void maximumLatency(unsigned frames);
     void present(bool vSync = true);
 };
 
+// CPU side counts of the rendering commands issued through the helpers in
+// this file, used for comparing the submission cost of rendering paths.
+struct CommandCounts
+{
+    uint64_t draws;
+    uint64_t pipelines;      // GraphicsPipeline binds
+    uint64_t renderTargets;  // render target and viewport changes
+    uint64_t bindings;       // resources, samplers and constant buffers bound
+
+    uint64_t total() const
+    {
+        return draws + pipelines + renderTargets + bindings;
+    }
+
+    CommandCounts operator+(const CommandCounts &c) const;
+    CommandCounts operator-(const CommandCounts &c) const;
+};
+// Counted separately for each thread, like the current context.
+extern thread_local CommandCounts commandCounts;
+
 template <typename T>
 class Binding
 {
@@ -89,6 +178,7 @@ public:
     Binding(T *t = nullptr)
     {
         storage[0] = t;
+        ++commandCounts.bindings;
     }
 
     operator T * const *()
@@ -103,43 +193,92 @@ Binding<T> bind(CComPtr<T> &t)
     return Binding<T>(t);
 }
 
+// Constants are sub-allocated from one large dynamic buffer, and bound using
+// Direct3D 11.1 constant buffer offsets. The first write of each frame
+// discards the buffer, and the rest map it with
+// D3D11_MAP_WRITE_NO_OVERWRITE, so the constants of earlier draws stay intact.
 class ConstantBuffers
 {
 public:
-    typedef std::shared_ptr<CComPtr<ID3D11Buffer>> CB;
-private:
+    static const uint32_t DefaultBufferSize = 1024 * 1024;
 
-    std::unordered_map<size_t, std::vector<CB>> sizeClasses;
+    // Range of a buffer, in 16 byte constants as expected by *SetConstantBuffers1.
+    struct CB
+    {
+        ID3D11Buffer *buffer;
+        UINT firstConstant;
+        UINT numConstants;
+    };
+private:
+    RingAllocator ring;
+    CComPtr<ID3D11Buffer> buffer;
 
-    CB get(size_t size);
+    CB allocate(const void *data, size_t size);
 public:
+    ConstantBuffers(uint32_t bufferSize = DefaultBufferSize);
+
+    // Start sub-allocating the constants of the next frame.
+    void beginFrame();
 
     template <typename T>
     CB write(const T &t)
     {
-        auto cb = get(sizeof(t));
-        D3D11_MAPPED_SUBRESOURCE mapped;
-        context->Map(*cb, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped);
-        memcpy(mapped.pData, &t, sizeof(t));
-        context->Unmap(*cb, 0);
-        return cb;
+        return allocate(&t, sizeof(t));
     }
+
+    const RingAllocator::Stats &frameStats() const { return ring.frameStats(); }
+    const RingAllocator::Stats &lastFrameStats() const { return ring.lastFrameStats(); }
 };
 
-inline Binding<ID3D11Buffer> bind(ConstantBuffers::CB &cb)
+inline void setConstantBuffer(ShaderStage stage, UINT slot, const ConstantBuffers::CB &cb)
 {
-    return Binding<ID3D11Buffer>(*cb);
+    ++commandCounts.bindings;
+    backend->setConstantBuffer(stage, slot, cb.buffer, cb.firstConstant, cb.numConstants);
 }
 
+// A deferred context for recording a command list on any thread, using the
+// same helpers as the immediate context. The constants and the state cache
+// of the immediate context are not thread safe, so each deferred context
+// has its own.
+class DeferredContext
+{
+    CComPtr<ID3D11DeviceContext> deferred;
+    CComQIPtr<ID3D11DeviceContext1> deferred1;
+    CComQIPtr<ID3DUserDefinedAnnotation> deferredAnnotation;
+    StateCache cache;
+    CComPtr<ID3D11CommandList> commandList;
+    CommandCounts counts;
+    StateCache::Stats binds;
+public:
+    // Every command list discards the constant buffer when it starts,
+    // which renames it, so one buffer is enough.
+    ConstantBuffers cb;
+
+    DeferredContext(uint32_t constantBufferSize = ConstantBuffers::DefaultBufferSize);
+
+    // Record a command list by calling f on the calling thread, with the
+    // deferred context as the current context of the thread.
+    void record(const std::function<void(ConstantBuffers &cb)> &f);
+    // Execute the recorded command list on the immediate context, which
+    // resets the state of the immediate context.
+    void execute();
+
+    // Counts of the last recorded command list.
+    const CommandCounts &listCommands() const { return counts; }
+    const StateCache::Stats &listBinds() const { return binds; }
+};
+
+// True if the driver records command lists itself, instead of the runtime
+// emulating them, so recording in parallel pays off.
+bool driverCommandLists();
+
 struct CS {
     typedef ID3D11ComputeShader type;
 
     template <typename Bytecode>
     static CComPtr<type> load(const Bytecode &bytecode)
     {
-        CComPtr<type> shader;
-        checkHR(device->CreateComputeShader(dataPtr(bytecode), sizeBytes(bytecode), nullptr, &shader));
-        return shader;
+        return pipelineCache().computeShader(dataPtr(bytecode), sizeBytes(bytecode));
     }
 };
 
@@ -149,9 +288,7 @@ struct VS {
     template <typename Bytecode>
     static CComPtr<type> load(const Bytecode &bytecode)
     {
-        CComPtr<type> shader;
-        checkHR(device->CreateVertexShader(dataPtr(bytecode), sizeBytes(bytecode), nullptr, &shader));
-        return shader;
+        return pipelineCache().vertexShader(dataPtr(bytecode), sizeBytes(bytecode));
     }
 };
 
@@ -161,9 +298,7 @@ struct HS {
     template <typename Bytecode>
     static CComPtr<type> load(const Bytecode &bytecode)
     {
-        CComPtr<type> shader;
-        checkHR(device->CreateHullShader(dataPtr(bytecode), sizeBytes(bytecode), nullptr, &shader));
-        return shader;
+        return pipelineCache().hullShader(dataPtr(bytecode), sizeBytes(bytecode));
     }
 };
 
@@ -173,9 +308,7 @@ struct DS {
     template <typename Bytecode>
     static CComPtr<type> load(const Bytecode &bytecode)
     {
-        CComPtr<type> shader;
-        checkHR(device->CreateDomainShader(dataPtr(bytecode), sizeBytes(bytecode), nullptr, &shader));
-        return shader;
+        return pipelineCache().domainShader(dataPtr(bytecode), sizeBytes(bytecode));
     }
 };
 
@@ -185,9 +318,7 @@ struct PS {
     template <typename Bytecode>
     static CComPtr<type> load(const Bytecode &bytecode)
     {
-        CComPtr<type> shader;
-        checkHR(device->CreatePixelShader(dataPtr(bytecode), sizeBytes(bytecode), nullptr, &shader));
-        return shader;
+        return pipelineCache().pixelShader(dataPtr(bytecode), sizeBytes(bytecode));
     }
 };
 
@@ -269,6 +400,13 @@ struct GraphicsPipeline
 
     void bind();
     void bindWireframe();
+    // Change the stencil reference value of the bound pipeline.
+    void setStencilRef(UINT stencilRef);
+
+private:
+    PipelineState pipelineState(const Shader<PS> &pixelShader,
+                                ID3D11RasterizerState *rs,
+                                ID3D11DepthStencilState *dss) const;
 };
 
 Resource downloadForDebugging(Resource &buffer);
@@ -325,8 +463,64 @@ public:
 };
 void gpuMarker(const wchar_t *fmt, ...);
 
+// Pipeline statistics of a span of GPU work. Results become available a few
+// frames later, and are polled without stalling the CPU.
+class PipelineStatisticsQuery
+{
+public:
+    static const unsigned Latency = 4;
+
+    PipelineStatisticsQuery();
+
+    void begin();
+    void end();
+
+    // Returns true and the statistics of the most recent finished span, if
+    // any finished since the previous call.
+    bool read(D3D11_QUERY_DATA_PIPELINE_STATISTICS &statistics);
+
+private:
+    std::array<CComPtr<ID3D11Query>, Latency> queries;
+    uint64_t issued;
+    uint64_t retrieved;
+};
+
+// GPU time of a span of GPU work, measured with timestamps. Like the pipeline
+// statistics, the results become available a few frames later.
+class GPUTimerQuery
+{
+public:
+    static const unsigned Latency = 4;
+
+    GPUTimerQuery();
+
+    void begin();
+    void end();
+
+    // Returns true and the time of the most recent finished span, if any
+    // finished since the previous call. Spans during which the GPU clock
+    // changed are skipped.
+    bool read(double &seconds);
+
+private:
+    struct Span
+    {
+        CComPtr<ID3D11Query> disjoint;
+        CComPtr<ID3D11Query> begin;
+        CComPtr<ID3D11Query> end;
+    };
+
+    std::array<Span, Latency> spans;
+    uint64_t issued;
+    uint64_t retrieved;
+};
+
 Resource loadImage(const char *filename, size_t *loadedBytes = nullptr);
 Resource loadPFMImage(const char *filename, FloatPixelBuffer *pixels = nullptr);
+// Writes 1 channel buffers as grayscale and 4 channel ones as RGB.
+bool savePFMImage(const char *filename, const FloatPixelBuffer &pixels);
+// A shader resource texture with the contents of the buffer.
+Resource pixelBufferTexture(const FloatPixelBuffer &pixels);
 
 void setRenderTarget(ID3D11RenderTargetView *rtv, ID3D11DepthStencilView *dsv = nullptr);
 inline void setRenderTarget(Resource &renderTarget, Resource *depthBuffer = nullptr)
@@ -337,8 +531,23 @@ inline void setDepthOnly(Resource &depthBuffer)
 {
     setRenderTarget(nullptr, depthBuffer.dsv);
 }
+// Bind multiple render targets, null entries are allowed. The viewport covers
+// the mip level of the first non-null render target view, or of the depth
+// stencil view if there are no render targets.
+void setRenderTargets(std::initializer_list<ID3D11RenderTargetView *> rtvs, ID3D11DepthStencilView *dsv = nullptr);
 
 void setVertexBuffers(Resource *vertexBuffer, Resource *indexBuffer);
+// Set the viewport to a rectangle of the current render target.
+void setViewport(unsigned x, unsigned y, unsigned width, unsigned height);
+
+void clearRenderTarget(ID3D11RenderTargetView *rtv, const float color[4]);
+void clearDepthStencil(ID3D11DepthStencilView *dsv, UINT flags, float depth, UINT8 stencil = 0);
+
+void draw(UINT vertexCount, UINT startVertex = 0);
+void drawIndexed(UINT indexCount, UINT instances = 1);
+
+// Flush the context and block until the GPU has finished all submitted work.
+void waitForGPU();
 
 enum class DepthMode
 {
@@ -353,16 +562,13 @@ DirectX::XMMATRIX projection(unsigned width, unsigned height, float nearZ, float
 D3D11_TEXTURE2D_DESC texture2DDesc(unsigned width, unsigned height, DXGI_FORMAT format);
 D3D11_DEPTH_STENCIL_DESC depthStencilDesc(DepthMode depthMode, bool writeDepth, bool depthTest = true);
 
-template <typename ResourcePtr>
-void unbindResources(void (__stdcall ID3D11DeviceContext::*bindFunction)(UINT slot, UINT count, ResourcePtr *), std::initializer_list<UINT> slots)
-{
-    ResourcePtr none[1] = { nullptr };
-
-    for (UINT slot : slots)
-    {
-        (context->*bindFunction)(slot, 1, none);
-    }
-}
+// Bind views and samplers to consecutive slots starting from the given one.
+void setShaderResources(ShaderStage stage, UINT slot, std::initializer_list<ID3D11ShaderResourceView *> srvs);
+void setSamplers(ShaderStage stage, UINT slot, std::initializer_list<ID3D11SamplerState *> samplers);
+void unbindShaderResources(ShaderStage stage, std::initializer_list<UINT> slots);
+void unbindSamplers(ShaderStage stage, std::initializer_list<UINT> slots);
+// Bind a pixel shader UAV, keeping the current render targets.
+void setUnorderedAccessView(UINT slot, ID3D11UnorderedAccessView *uav);
 
 struct Vertex
 {
@@ -370,8 +576,9 @@ struct Vertex
     float3 normal;
     float2 uv;
     float tessellation;
+    TangentFrames::Quaternion tangentFrame;
 
-    // Don't compare normals or tessellation, as those are procedurally generated upon load
+    // Don't compare normals, tessellation or tangent frames, as those are procedurally generated upon load
     bool operator==(const Vertex &v) const
     {
         return pos == v.pos && uv == v.uv;
@@ -382,6 +589,27 @@ struct Vertex
 
 void computeVertexNormals(std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices);
 
+// Like computeVertexNormals(), but weights the triangles by their areas. For
+// a heightfield, the x and y of the sums are then linear in the heights, so
+// the heights and the normals can be scaled together exactly afterwards.
+void computeAreaWeightedNormals(std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices);
+
+// Generate the tangent frames of the vertices from their normals and UVs. The
+// vertices on mirrored UV seams are split, which appends copies of them and
+// changes the indices.
+void computeTangentFrames(std::vector<Vertex> &vertices, std::vector<uint32_t> &indices);
+
+// A simplified version of a mesh, which indexes the same vertices.
+struct MeshLod
+{
+    std::vector<uint32_t> indices;
+    Resource indexBuffer;
+    unsigned indexAmount;
+    // How far the simplified surface can be from the full one, in the
+    // units of the vertices.
+    float error;
+};
+
 struct Mesh
 {
     std::string name;
@@ -395,6 +623,13 @@ struct Mesh
     Resource indexBuffer;
     float scale;
 
+    // CPU copies of the geometry, for e.g. software rasterization
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices;
+
+    // Successively coarser levels of detail, not including the full mesh.
+    std::vector<MeshLod> lods;
+
     bool valid() const
     {
         return vertexBuffer.buffer && indexBuffer.buffer;
@@ -409,6 +644,10 @@ enum class MeshLoadMode
 Mesh loadMesh(const std::vector<std::string> &objFilenames,
               MeshLoadMode loadMode = MeshLoadMode::Normal,
               float tessellationTriangleArea = 0);
+// Load only the CPU side geometry of the mesh, without creating any GPU buffers.
+Mesh loadMeshGeometry(const std::vector<std::string> &objFilenames,
+                      MeshLoadMode loadMode = MeshLoadMode::Normal,
+                      float tessellationTriangleArea = 0);
 
 inline Mesh loadMesh(std::string objFilename)
 {
@@ -449,6 +688,9 @@ struct Oculus
         unsigned number;
         ovrSession session;
         ovrSizei size;
+        // The part of the swap textures that is rendered and shown, which
+        // is smaller than size when the resolution is lowered.
+        ovrSizei viewport;
         ovrFovPort fov;
         ovrSwapTextureSet *swapTextureSet;
         std::vector<Resource> swapTargets;
@@ -0,0 +1,174 @@
+#include "HeightBounds.hpp"
+#include "Parallel.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace
+{
+    HeightBounds::Range merge(HeightBounds::Range a, HeightBounds::Range b)
+    {
+        HeightBounds::Range r;
+        r.min = std::min(a.min, b.min);
+        r.max = std::max(a.max, b.max);
+        return r;
+    }
+
+    // The texels that bilinear sampling reads between the coordinates a and
+    // b along an axis of size texels, wrapped into at most two intervals
+    // [first[i], last[i]]. Returns the amount of intervals.
+    unsigned wrappedTexels(float a, float b, unsigned size, int first[2], int last[2])
+    {
+        float scaled0 = a * static_cast<float>(size) - .5f;
+        float scaled1 = b * static_cast<float>(size) - .5f;
+
+        // Coordinates that do not fit in an int cover the whole axis anyway.
+        if (!(std::abs(scaled0) < 1e9f && std::abs(scaled1) < 1e9f))
+        {
+            first[0] = 0;
+            last[0]  = static_cast<int>(size) - 1;
+            return 1;
+        }
+
+        int t0 = static_cast<int>(std::floor(scaled0));
+        int t1 = static_cast<int>(std::floor(scaled1)) + 1;
+
+        int n = static_cast<int>(size);
+        if (t1 - t0 + 1 >= n)
+        {
+            first[0] = 0;
+            last[0]  = n - 1;
+            return 1;
+        }
+
+        int start = ((t0 % n) + n) % n;
+        int end   = start + (t1 - t0);
+
+        first[0] = start;
+        if (end < n)
+        {
+            last[0] = end;
+            return 1;
+        }
+
+        last[0]  = n - 1;
+        first[1] = 0;
+        last[1]  = end - n;
+        return 2;
+    }
+}
+
+HeightBounds::HeightBounds(const float *heights, unsigned width, unsigned height, unsigned stride)
+{
+    assert(width > 0 && height > 0 && stride > 0);
+
+    Level top;
+    top.width  = width;
+    top.height = height;
+    top.ranges.resize(static_cast<size_t>(width) * height);
+
+    parallelFor(0, height, [&](size_t y)
+    {
+        const float *src = heights + y * width * stride;
+        Range *dst       = top.ranges.data() + y * width;
+        for (unsigned x = 0; x < width; ++x)
+        {
+            dst[x].min = src[x * stride];
+            dst[x].max = src[x * stride];
+        }
+    }, 16);
+
+    levels.emplace_back(std::move(top));
+
+    while (levels.back().width > 1 || levels.back().height > 1)
+        levels.emplace_back(downsample(levels.back()));
+}
+
+HeightBounds::Level HeightBounds::downsample(const Level &src) const
+{
+    Level dst;
+    dst.width  = std::max(1u, src.width  / 2);
+    dst.height = std::max(1u, src.height / 2);
+    dst.ranges.resize(static_cast<size_t>(dst.width) * dst.height);
+
+    parallelFor(0, dst.height, [&](size_t yIndex)
+    {
+        unsigned y = static_cast<unsigned>(yIndex);
+
+        // The last texel also covers the odd one out.
+        unsigned y0 = 2 * y;
+        unsigned y1 = (y + 1 == dst.height) ? src.height - 1 : 2 * y + 1;
+
+        for (unsigned x = 0; x < dst.width; ++x)
+        {
+            unsigned x0 = 2 * x;
+            unsigned x1 = (x + 1 == dst.width) ? src.width - 1 : 2 * x + 1;
+
+            Range r = src(x0, y0);
+            for (unsigned sy = y0; sy <= y1; ++sy)
+                for (unsigned sx = x0; sx <= x1; ++sx)
+                    r = merge(r, src(sx, sy));
+
+            dst.ranges[y * dst.width + x] = r;
+        }
+    }, 16);
+
+    return dst;
+}
+
+HeightBounds::Range HeightBounds::texels(unsigned x0, unsigned y0, unsigned x1, unsigned y1) const
+{
+    assert(x0 <= x1 && y0 <= y1);
+
+    x1 = std::min(x1, width()  - 1);
+    y1 = std::min(y1, height() - 1);
+    x0 = std::min(x0, x1);
+    y0 = std::min(y0, y1);
+
+    unsigned l = 0;
+    for (; l + 1 < levelCount(); ++l)
+    {
+        auto &level = levels[l];
+        unsigned lx0 = std::min(x0 >> l, level.width  - 1);
+        unsigned lx1 = std::min(x1 >> l, level.width  - 1);
+        unsigned ly0 = std::min(y0 >> l, level.height - 1);
+        unsigned ly1 = std::min(y1 >> l, level.height - 1);
+        if (lx1 - lx0 <= 1 && ly1 - ly0 <= 1)
+            break;
+    }
+
+    auto &level = levels[l];
+    unsigned lx0 = std::min(x0 >> l, level.width  - 1);
+    unsigned lx1 = std::min(x1 >> l, level.width  - 1);
+    unsigned ly0 = std::min(y0 >> l, level.height - 1);
+    unsigned ly1 = std::min(y1 >> l, level.height - 1);
+
+    Range r = level(lx0, ly0);
+    r = merge(r, level(lx1, ly0));
+    r = merge(r, level(lx0, ly1));
+    r = merge(r, level(lx1, ly1));
+    return r;
+}
+
+HeightBounds::Range HeightBounds::rect(float u0, float v0, float u1, float v1) const
+{
+    int firstX[2], lastX[2];
+    int firstY[2], lastY[2];
+    unsigned xs = wrappedTexels(std::min(u0, u1), std::max(u0, u1), width(),  firstX, lastX);
+    unsigned ys = wrappedTexels(std::min(v0, v1), std::max(v0, v1), height(), firstY, lastY);
+
+    Range r = texels(firstX[0], firstY[0], lastX[0], lastY[0]);
+    for (unsigned j = 0; j < ys; ++j)
+        for (unsigned i = 0; i < xs; ++i)
+            r = merge(r, texels(firstX[i], firstY[j], lastX[i], lastY[j]));
+    return r;
+}
+
+HeightBounds::Range HeightBounds::triangle(const float uv0[2], const float uv1[2], const float uv2[2]) const
+{
+    return rect(std::min(std::min(uv0[0], uv1[0]), uv2[0]),
+                std::min(std::min(uv0[1], uv1[1]), uv2[1]),
+                std::max(std::max(uv0[0], uv1[0]), uv2[0]),
+                std::max(std::max(uv0[1], uv1[1]), uv2[1]));
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <vector>
+
+// Conservative ranges of a heightmap over regions of it, for bounding
+// anything displaced by it. Each level holds the minimum and maximum heights
+// of 2 x 2 texels of the level above, with the sizes of a Direct3D mip chain,
+// so it can also be uploaded as a texture. The last texel of an odd row or
+// column is folded into the last texel of the next level, so level k texel
+// min(x >> k, width - 1) covers full resolution texel x.
+class HeightBounds
+{
+public:
+    // Same layout as DXGI_FORMAT_R32G32_FLOAT.
+    struct Range
+    {
+        float min;
+        float max;
+    };
+
+    struct Level
+    {
+        unsigned width;
+        unsigned height;
+        std::vector<Range> ranges;
+
+        const Range &operator()(unsigned x, unsigned y) const { return ranges[y * width + x]; }
+    };
+
+    // Build every level down to 1 x 1 from a width x height heightfield,
+    // whose consecutive samples are stride floats apart. The levels are
+    // built in parallel over rows.
+    HeightBounds(const float *heights, unsigned width, unsigned height, unsigned stride);
+
+    unsigned levelCount() const { return static_cast<unsigned>(levels.size()); }
+    const Level &level(unsigned i) const { return levels[i]; }
+    unsigned width()  const { return levels[0].width; }
+    unsigned height() const { return levels[0].height; }
+
+    // The range of the whole heightmap.
+    Range range() const { return levels.back().ranges[0]; }
+
+    // The range of the full resolution texels [x0, x1] x [y0, y1], from at
+    // most 2 x 2 texels of the most detailed level that covers them.
+    Range texels(unsigned x0, unsigned y0, unsigned x1, unsigned y1) const;
+
+    // The range of the heights that bilinear sampling with wrapping can
+    // return inside the UV rectangle, where UV (0, 0) is the top left corner
+    // of the first texel and (1, 1) is the bottom right corner of the last.
+    Range rect(float u0, float v0, float u1, float v1) const;
+
+    // The range inside a triangle with the given UVs, which is that of the
+    // rectangle around it.
+    Range triangle(const float uv0[2], const float uv1[2], const float uv2[2]) const;
+
+private:
+    Level downsample(const Level &src) const;
+
+    std::vector<Level> levels;
+};
@@ -0,0 +1,58 @@
+#include "HeightDerivatives.hpp"
+#include "Parallel.hpp"
+
+#include <cassert>
+#include <cmath>
+
+HeightDerivatives::HeightDerivatives(const float *heights, unsigned width, unsigned height, unsigned stride)
+    : mapWidth(width)
+    , mapHeight(height)
+{
+    assert(width > 0 && height > 0 && stride > 0);
+
+    texels.resize(static_cast<size_t>(width) * height);
+
+    // Central differences span two texels, which are 2 / width apart in U.
+    float uScale = .5f * static_cast<float>(width);
+    float vScale = .5f * static_cast<float>(height);
+
+    parallelFor(0, height, [&](size_t yIndex)
+    {
+        unsigned y     = static_cast<unsigned>(yIndex);
+        unsigned above = y == 0 ? height - 1 : y - 1;
+        unsigned below = y + 1 == height ? 0 : y + 1;
+
+        auto h = [&](unsigned x, unsigned row)
+        {
+            return heights[(static_cast<size_t>(row) * width + x) * stride];
+        };
+
+        Derivative *dst = texels.data() + static_cast<size_t>(y) * width;
+        for (unsigned x = 0; x < width; ++x)
+        {
+            unsigned left  = x == 0 ? width - 1 : x - 1;
+            unsigned right = x + 1 == width ? 0 : x + 1;
+
+            dst[x].du = (h(right, y) - h(left, y)) * uScale;
+            dst[x].dv = (h(x, below) - h(x, above)) * vScale;
+        }
+    }, 16);
+}
+
+void HeightDerivatives::displacedNormal(const float normal[3], const float gradU[3], const float gradV[3],
+                                        const Derivative &d, float magnitude, float result[3])
+{
+    // The displaced surface is a heightfield over the tangent plane, whose
+    // normal leans against the gradient of the displacement.
+    float n[3];
+    float length2 = 0;
+    for (unsigned k = 0; k < 3; ++k)
+    {
+        n[k]     = normal[k] - magnitude * (d.du * gradU[k] + d.dv * gradV[k]);
+        length2 += n[k] * n[k];
+    }
+
+    float invLength = 1.f / std::sqrt(length2);
+    for (unsigned k = 0; k < 3; ++k)
+        result[k] = n[k] * invLength;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <vector>
+
+// Derivatives of a heightmap with respect to the texture coordinates, from
+// which the pixel shader computes the normals of the displaced surface
+// instead of interpolating them from its vertices, so that the shading does
+// not depend on how finely the surface is tessellated. The derivatives are
+// central differences with wrapping, like the sampling of the heightmap.
+class HeightDerivatives
+{
+public:
+    // Same layout as DXGI_FORMAT_R32G32_FLOAT.
+    struct Derivative
+    {
+        // Change of the height per unit of U and V.
+        float du;
+        float dv;
+    };
+
+    // Differentiate a width x height heightfield, whose consecutive samples
+    // are stride floats apart, in parallel over rows.
+    HeightDerivatives(const float *heights, unsigned width, unsigned height, unsigned stride);
+
+    unsigned width()  const { return mapWidth; }
+    unsigned height() const { return mapHeight; }
+    const std::vector<Derivative> &derivatives() const { return texels; }
+    const Derivative &operator()(unsigned x, unsigned y) const { return texels[y * mapWidth + x]; }
+
+    // The normal of a surface displaced by magnitude * height along its
+    // unit normal, as in displacedNormal() of Lighting.h.hlsl. gradU and
+    // gradV are the gradients of U and V along the undisplaced surface,
+    // i.e. the tangent vectors that give the change of U and V per unit of
+    // distance in each direction.
+    static void displacedNormal(const float normal[3], const float gradU[3], const float gradV[3],
+                                const Derivative &d, float magnitude, float result[3]);
+
+private:
+    unsigned mapWidth;
+    unsigned mapHeight;
+    std::vector<Derivative> texels;
+};
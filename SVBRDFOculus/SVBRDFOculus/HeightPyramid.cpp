@@ -0,0 +1,222 @@
+#include "HeightPyramid.hpp"
+#include "Parallel.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace
+{
+    const double Pi = 3.14159265358979323846;
+
+    double sinc(double x)
+    {
+        if (x == 0)
+            return 1;
+        return std::sin(Pi * x) / (Pi * x);
+    }
+
+    // Weights of the source texels 2 * i - taps / 2 + 1 ... 2 * i + taps / 2
+    // for the destination texel i, whose center is halfway between the
+    // source texels 2 * i and 2 * i + 1. The filters are stretched to twice
+    // their width, as the destination texels are twice as large.
+    std::vector<float> filterWeights(HeightPyramid::Filter filter)
+    {
+        std::vector<double> w;
+
+        switch (filter)
+        {
+        default:
+        case HeightPyramid::Filter::Box:
+            w = { 1, 1 };
+            break;
+        case HeightPyramid::Filter::Tent:
+            for (int k = -2; k < 2; ++k)
+            {
+                double x = (k + .5) / 2;
+                w.emplace_back(1 - std::abs(x));
+            }
+            break;
+        case HeightPyramid::Filter::Lanczos:
+            for (int k = -4; k < 4; ++k)
+            {
+                double x = (k + .5) / 2;
+                w.emplace_back(sinc(x) * sinc(x / 2));
+            }
+            break;
+        }
+
+        double sum = 0;
+        for (double x : w)
+            sum += x;
+
+        std::vector<float> weights;
+        for (double x : w)
+            weights.emplace_back(static_cast<float>(x / sum));
+        return weights;
+    }
+
+    unsigned clampIndex(int i, unsigned size)
+    {
+        return static_cast<unsigned>(std::min(std::max(i, 0), static_cast<int>(size) - 1));
+    }
+}
+
+HeightPyramid::HeightPyramid(const float *heights, unsigned width, unsigned height, unsigned stride,
+                             Filter filter)
+    : levelFilter(filter)
+{
+    assert(width > 0 && height > 0 && stride > 0);
+
+    Level top;
+    top.width  = width;
+    top.height = height;
+    top.heights.resize(static_cast<size_t>(width) * height);
+
+    parallelFor(0, height, [&](size_t y)
+    {
+        const float *src = heights + y * width * stride;
+        float *dst       = top.heights.data() + y * width;
+        for (unsigned x = 0; x < width; ++x)
+            dst[x] = src[x * stride];
+    }, 16);
+
+    levels.emplace_back(std::move(top));
+
+    auto weights = filterWeights(filter);
+
+    while (levels.back().width > 1 || levels.back().height > 1)
+        levels.emplace_back(downsample(levels.back(), weights));
+
+    minH = levels[0].heights[0];
+    maxH = levels[0].heights[0];
+
+    for (auto &l : levels)
+    {
+        auto range = std::minmax_element(l.heights.begin(), l.heights.end());
+        minH = std::min(minH, *range.first);
+        maxH = std::max(maxH, *range.second);
+    }
+}
+
+HeightPyramid::Level HeightPyramid::downsample(const Level &src, const std::vector<float> &weights) const
+{
+    // A dimension that is already 1 is kept, and the last texel of an odd
+    // dimension only contributes through the filter taps.
+    bool halveX = src.width  > 1;
+    bool halveY = src.height > 1;
+
+    Level dst;
+    dst.width  = halveX ? src.width  / 2 : 1;
+    dst.height = halveY ? src.height / 2 : 1;
+    dst.heights.resize(static_cast<size_t>(dst.width) * dst.height);
+
+    int taps  = static_cast<int>(weights.size());
+    int first = 1 - taps / 2;
+
+    // Filter the rows first, into dst.width x src.height.
+    std::vector<float> rows(static_cast<size_t>(dst.width) * src.height);
+
+    parallelFor(0, src.height, [&](size_t y)
+    {
+        const float *srcRow = src.heights.data() + y * src.width;
+        float *dstRow       = rows.data() + y * dst.width;
+
+        for (unsigned x = 0; x < dst.width; ++x)
+        {
+            if (!halveX)
+            {
+                dstRow[x] = srcRow[x];
+                continue;
+            }
+
+            float sum = 0;
+            for (int k = 0; k < taps; ++k)
+                sum += weights[k] * srcRow[clampIndex(2 * static_cast<int>(x) + first + k, src.width)];
+            dstRow[x] = sum;
+        }
+    }, 16);
+
+    parallelFor(0, dst.height, [&](size_t y)
+    {
+        float *dstRow = dst.heights.data() + y * dst.width;
+
+        if (!halveY)
+        {
+            std::copy(rows.begin(), rows.begin() + dst.width, dstRow);
+            return;
+        }
+
+        std::fill(dstRow, dstRow + dst.width, 0.f);
+
+        for (int k = 0; k < taps; ++k)
+        {
+            unsigned srcY     = clampIndex(2 * static_cast<int>(y) + first + k, src.height);
+            const float *row  = rows.data() + static_cast<size_t>(srcY) * dst.width;
+            float w           = weights[k];
+
+            for (unsigned x = 0; x < dst.width; ++x)
+                dstRow[x] += w * row[x];
+        }
+    }, 16);
+
+    return dst;
+}
+
+unsigned HeightPyramid::levelForStep(unsigned step) const
+{
+    assert(step > 0);
+
+    unsigned level = 0;
+    while ((2u << level) <= step && level + 1 < levelCount())
+        ++level;
+    return level;
+}
+
+std::vector<float> HeightPyramid::grid(unsigned step, unsigned &gridWidth, unsigned &gridHeight) const
+{
+    assert(step > 0);
+
+    gridWidth  = width()  / step;
+    gridHeight = height() / step;
+
+    std::vector<float> heights(static_cast<size_t>(gridWidth) * gridHeight);
+
+    unsigned l   = levelForStep(step);
+    auto &src    = levels[l];
+    // The spacing of the vertices in texels of the level, between 1 and 2.
+    float scale  = static_cast<float>(step) / static_cast<float>(1u << l);
+    bool aligned = scale == 1.f;
+
+    parallelFor(0, gridHeight, [&](size_t y)
+    {
+        float *dst = heights.data() + y * gridWidth;
+
+        if (aligned)
+        {
+            unsigned srcY = std::min(static_cast<unsigned>(y), src.height - 1);
+            for (unsigned x = 0; x < gridWidth; ++x)
+                dst[x] = src(std::min(x, src.width - 1), srcY);
+            return;
+        }
+
+        float fy    = static_cast<float>(y) * scale;
+        unsigned y0 = std::min(static_cast<unsigned>(fy), src.height - 1);
+        unsigned y1 = std::min(y0 + 1, src.height - 1);
+        float ty    = fy - static_cast<float>(y0);
+
+        for (unsigned x = 0; x < gridWidth; ++x)
+        {
+            float fx    = static_cast<float>(x) * scale;
+            unsigned x0 = std::min(static_cast<unsigned>(fx), src.width - 1);
+            unsigned x1 = std::min(x0 + 1, src.width - 1);
+            float tx    = fx - static_cast<float>(x0);
+
+            float top    = src(x0, y0) + (src(x1, y0) - src(x0, y0)) * tx;
+            float bottom = src(x0, y1) + (src(x1, y1) - src(x0, y1)) * tx;
+            dst[x] = top + (bottom - top) * ty;
+        }
+    }, 16);
+
+    return heights;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <vector>
+
+// Prefiltered levels of a heightmap, each half the size of the previous one,
+// so that meshes with vertices further apart than the heightmap texels can
+// sample heights that are filtered for their spacing instead of aliasing.
+// It is built once per heightmap.
+class HeightPyramid
+{
+public:
+    // Separable filters for halving the resolution, from the cheapest and
+    // blurriest to the sharpest.
+    enum class Filter
+    {
+        // 2 taps, the average of each 2 x 2 block.
+        Box,
+        // 4 taps, the triangle filter of bilinear interpolation.
+        Tent,
+        // 8 taps, windowed sinc with two lobes.
+        Lanczos,
+    };
+
+    struct Level
+    {
+        unsigned width;
+        unsigned height;
+        std::vector<float> heights;
+
+        float operator()(unsigned x, unsigned y) const { return heights[y * width + x]; }
+    };
+
+    // Build every level down to 1 x 1 from a width x height heightfield,
+    // whose consecutive samples are stride floats apart. The levels are
+    // built in parallel over rows.
+    HeightPyramid(const float *heights, unsigned width, unsigned height, unsigned stride,
+                  Filter filter = Filter::Lanczos);
+
+    Filter filter() const { return levelFilter; }
+    unsigned levelCount() const { return static_cast<unsigned>(levels.size()); }
+    const Level &level(unsigned i) const { return levels[i]; }
+    unsigned width()  const { return levels[0].width; }
+    unsigned height() const { return levels[0].height; }
+
+    // The range of the heights over every level. The sharper filters can
+    // overshoot the full resolution heights, so this bounds any surface
+    // built from the pyramid.
+    float minHeight() const { return minH; }
+    float maxHeight() const { return maxH; }
+
+    // The most detailed level whose texels are no more than step full
+    // resolution texels apart.
+    unsigned levelForStep(unsigned step) const;
+
+    // Heights for a grid with a vertex every step full resolution texels,
+    // with (width / step) x (height / step) vertices, taken from the level
+    // for the step. Steps that are not powers of two are interpolated
+    // bilinearly from that level.
+    std::vector<float> grid(unsigned step, unsigned &gridWidth, unsigned &gridHeight) const;
+
+private:
+    Level downsample(const Level &src, const std::vector<float> &weights) const;
+
+    Filter levelFilter;
+    std::vector<Level> levels;
+    float minH;
+    float maxH;
+};
@@ -0,0 +1,640 @@
+#include "HeightReconstruction.hpp"
+#include "Parallel.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <cmath>
+
+namespace
+{
+    // Smallest grid dimension worth coarsening further.
+    const unsigned MinCoarseSize = 4;
+    const unsigned PreSmoothing  = 2;
+    const unsigned PostSmoothing = 1;
+    const unsigned BlockRows     = 32;
+    // Fine rows in the taps of a coarse row.
+    const unsigned CachedRows    = 4;
+    const double CoarsestTolerance = 1e-6;
+    // The coarsest grid is small unless the map is very elongated, in which
+    // case an approximate solution is still a good enough correction.
+    const unsigned MaxCoarsestIterations = 200;
+    // V-cycles normally reduce the residual tenfold.
+    const double StagnationRatio   = .5;
+    // The residual of a converged solution is about the rounding error of
+    // its Laplacian, which grows with the heights.
+    const double RoundingResidual  = 3 * FLT_EPSILON;
+
+    unsigned wrapPrevious(unsigned i, unsigned size)
+    {
+        return i == 0 ? size - 1 : i - 1;
+    }
+
+    unsigned wrapNext(unsigned i, unsigned size)
+    {
+        return i + 1 == size ? 0 : i + 1;
+    }
+
+    // Odd sizes round up, so the coarse texels are at most twice as large.
+    unsigned coarseSize(unsigned size)
+    {
+        return (size + 1) / 2;
+    }
+
+    // 5-point Laplacian of u at (x, y), in units of texels.
+    float laplacian(const float *u, unsigned x, unsigned y, unsigned width, unsigned height)
+    {
+        const float *row   = u + static_cast<size_t>(y) * width;
+        const float *above = u + static_cast<size_t>(wrapPrevious(y, height)) * width;
+        const float *below = u + static_cast<size_t>(wrapNext(y, height)) * width;
+        return row[wrapPrevious(x, width)] + row[wrapNext(x, width)]
+             + above[x] + below[x] - 4 * row[x];
+    }
+
+    // Sums of n floats and of their products in double. The independent
+    // partial sums let the additions overlap instead of waiting for each
+    // other.
+    double rowSum(const float *a, size_t n)
+    {
+        double s[4] = {};
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+            for (unsigned k = 0; k < 4; ++k)
+                s[k] += a[i + k];
+        for (; i < n; ++i)
+            s[0] += a[i];
+        return (s[0] + s[1]) + (s[2] + s[3]);
+    }
+
+    double rowDot(const float *a, const float *b, size_t n)
+    {
+        double s[4] = {};
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+            for (unsigned k = 0; k < 4; ++k)
+                s[k] += static_cast<double>(a[i + k]) * b[i + k];
+        for (; i < n; ++i)
+            s[0] += static_cast<double>(a[i]) * b[i];
+        return (s[0] + s[1]) + (s[2] + s[3]);
+    }
+
+    // Row y of f - Laplacian(u).
+    void residualRow(const float *u, const float *f, unsigned y, unsigned width, unsigned height, float *r)
+    {
+        const float *rhs   = f + static_cast<size_t>(y) * width;
+        const float *row   = u + static_cast<size_t>(y) * width;
+        const float *above = u + static_cast<size_t>(wrapPrevious(y, height)) * width;
+        const float *below = u + static_cast<size_t>(wrapNext(y, height)) * width;
+
+        r[0] = rhs[0] - laplacian(u, 0, y, width, height);
+        for (unsigned x = 1; x + 1 < width; ++x)
+            r[x] = rhs[x] - (row[x - 1] + row[x + 1] + above[x] + below[x] - 4 * row[x]);
+        if (width > 1)
+            r[width - 1] = rhs[width - 1] - laplacian(u, width - 1, y, width, height);
+    }
+
+    // Call f(begin, end) for blocks of rows in parallel, for the passes that
+    // keep the last rows they touched in the cache.
+    template <typename F>
+    void forBlocks(unsigned height, F &&f)
+    {
+        unsigned blocks = (height + BlockRows - 1) / BlockRows;
+        parallelFor(0, blocks, [&](size_t b)
+        {
+            unsigned begin = static_cast<unsigned>(b) * BlockRows;
+            f(begin, std::min(height, begin + BlockRows));
+        });
+    }
+
+    // Sum of f(y) over the rows, accumulated in parallel.
+    template <typename F>
+    double sumRows(unsigned height, F &&f)
+    {
+        std::vector<double> rows(height);
+        parallelFor(0, height, [&](size_t y)
+        {
+            rows[y] = f(static_cast<unsigned>(y));
+        }, 16);
+
+        double sum = 0;
+        for (double r : rows)
+            sum += r;
+        return sum;
+    }
+
+    void removeMean(std::vector<float> &v, unsigned width, unsigned height)
+    {
+        double sum = sumRows(height, [&](unsigned y)
+        {
+            return rowSum(v.data() + static_cast<size_t>(y) * width, width);
+        });
+
+        float mean = static_cast<float>(sum / (static_cast<double>(width) * height));
+        parallelFor(0, height, [&](size_t y)
+        {
+            float *row = v.data() + y * width;
+            for (unsigned x = 0; x < width; ++x)
+                row[x] -= mean;
+        }, 16);
+    }
+}
+
+HeightReconstruction::Settings HeightReconstruction::defaultSettings()
+{
+    Settings s;
+    s.minNormalZ = .05f;
+    s.tolerance  = 1e-4f;
+    s.maxCycles  = 20;
+    return s;
+}
+
+HeightReconstruction::HeightReconstruction(const float *normals, unsigned width, unsigned height, unsigned stride,
+                                           const Settings &settings)
+    : mapWidth(width)
+    , mapHeight(height)
+{
+    assert(width > 0 && height > 0 && stride >= 3);
+
+    solveStats.levels   = 0;
+    solveStats.cycles   = 0;
+    solveStats.residual = 0;
+
+    Grid top;
+    top.width  = width;
+    top.height = height;
+    top.u.resize(static_cast<size_t>(width) * height, 0.f);
+    top.f.resize(static_cast<size_t>(width) * height);
+
+    // The heights minimizing the squared error between their differences
+    // and the gradient halfway between the texels solve the 5-point Poisson
+    // equation with the central difference divergence.
+    std::vector<double> blockNorms((height + BlockRows - 1) / BlockRows);
+    forBlocks(height, [&](unsigned begin, unsigned end)
+    {
+        // The height grows against the X and Y of the normal, in texels of
+        // height per texel. The slopes along Y are also needed for the rows
+        // next to the block.
+        unsigned rows = end - begin;
+        thread_local std::vector<float> slopes;
+        slopes.resize(static_cast<size_t>(2 * rows + 2) * width);
+        float *sx = slopes.data();
+        float *sy = sx + static_cast<size_t>(rows) * width;
+
+        for (unsigned i = 0; i < rows + 2; ++i)
+        {
+            unsigned y     = (begin + i + height - 1) % height;
+            const float *n = normals + static_cast<size_t>(y) * width * stride;
+            float *dy      = sy + static_cast<size_t>(i) * width;
+            float *dx      = i > 0 && i <= rows ? sx + static_cast<size_t>(i - 1) * width : nullptr;
+            for (unsigned x = 0; x < width; ++x, n += stride)
+            {
+                float scale = -1.f / std::max(n[2], settings.minNormalZ);
+                dy[x]       = n[1] * scale;
+                if (dx)
+                    dx[x] = n[0] * scale;
+            }
+        }
+
+        double sum = 0;
+        for (unsigned i = 0; i < rows; ++i)
+        {
+            const float *dx    = sx + static_cast<size_t>(i) * width;
+            const float *above = sy + static_cast<size_t>(i) * width;
+            const float *below = sy + static_cast<size_t>(i + 2) * width;
+            float *f           = top.f.data() + static_cast<size_t>(begin + i) * width;
+
+            auto divergence = [&](unsigned x, float left, float right)
+            {
+                f[x] = .5f * (right - left + below[x] - above[x]);
+            };
+
+            divergence(0, dx[width - 1], dx[wrapNext(0, width)]);
+            for (unsigned x = 1; x + 1 < width; ++x)
+                divergence(x, dx[x - 1], dx[x + 1]);
+            if (width > 1)
+                divergence(width - 1, dx[width - 2], dx[0]);
+
+            sum += rowDot(f, f, width);
+        }
+        blockNorms[begin / BlockRows] = sum;
+    });
+
+    double fNorm = 0;
+    for (double n : blockNorms)
+        fNorm += n;
+    fNorm = std::sqrt(fNorm);
+
+    grids.emplace_back(std::move(top));
+    for (;;)
+    {
+        auto &g = grids.back();
+        if (coarseSize(g.width) < MinCoarseSize || coarseSize(g.height) < MinCoarseSize)
+            break;
+
+        Grid coarse;
+        coarse.width  = coarseSize(g.width);
+        coarse.height = coarseSize(g.height);
+        coarse.u.resize(static_cast<size_t>(coarse.width) * coarse.height, 0.f);
+        coarse.f.resize(static_cast<size_t>(coarse.width) * coarse.height);
+        coarse.columns = interpolation(g.width, coarse.width);
+        coarse.rows    = interpolation(g.height, coarse.height);
+        grids.emplace_back(std::move(coarse));
+    }
+    solveStats.levels = static_cast<unsigned>(grids.size());
+
+    // Full multigrid: restrict the equation to every level, solve the
+    // coarsest, and refine the solution with a V-cycle per level.
+    for (size_t l = 0; l + 1 < grids.size(); ++l)
+        restrictResidual(grids[l], grids[l + 1], false);
+
+    solveCoarsest(grids.back());
+    for (size_t l = grids.size() - 1; l > 0; --l)
+    {
+        prolongate(grids[l], grids[l - 1], false);
+        vCycle(static_cast<unsigned>(l - 1));
+    }
+
+    // Full multigrid normally leaves a residual as small as the rounding
+    // errors, so there is nothing left for V-cycles to reduce.
+    Residual r   = residual(grids[0]);
+    double limit = std::max(settings.tolerance * fNorm, RoundingResidual * r.solutionNorm);
+    for (;;)
+    {
+        solveStats.residual = fNorm > 0 ? static_cast<float>(r.norm / fNorm) : 0.f;
+        if (r.norm <= limit || solveStats.cycles >= settings.maxCycles)
+            break;
+
+        vCycle(0);
+        ++solveStats.cycles;
+
+        // A cycle that barely helps has hit the rounding error of floats.
+        double previous = r.norm;
+        r = residual(grids[0]);
+        if (r.norm > StagnationRatio * previous)
+        {
+            solveStats.residual = fNorm > 0 ? static_cast<float>(r.norm / fNorm) : 0.f;
+            break;
+        }
+    }
+
+    result = std::move(grids[0].u);
+    grids  = std::vector<Grid>();
+
+    // The last residual was of the final heights. Remove their mean and
+    // convert them to units of U in one pass.
+    float mean       = static_cast<float>(r.solutionSum / (static_cast<double>(width) * height));
+    float toUnitsOfU = 1.f / static_cast<float>(width);
+    parallelFor(0, height, [&](size_t y)
+    {
+        float *row = result.data() + y * width;
+        for (unsigned x = 0; x < width; ++x)
+            row[x] = (row[x] - mean) * toUnitsOfU;
+    }, 16);
+}
+
+void HeightReconstruction::smooth(Grid &grid, unsigned sweeps) const
+{
+    unsigned width  = grid.width;
+    unsigned height = grid.height;
+    float *u        = grid.u.data();
+    const float *f  = grid.f.data();
+
+    auto updateRow = [&](unsigned y, unsigned color)
+    {
+        float *row   = u + static_cast<size_t>(y) * width;
+        float *above = u + static_cast<size_t>(wrapPrevious(y, height)) * width;
+        float *below = u + static_cast<size_t>(wrapNext(y, height)) * width;
+        const float *rhs = f + static_cast<size_t>(y) * width;
+
+        auto update = [&](unsigned x, float left, float right)
+        {
+            row[x] = .25f * (left + right + above[x] + below[x] - rhs[x]);
+        };
+
+        // Only the first and last texels wrap around.
+        unsigned x = (y + color) % 2;
+        if (x == 0)
+        {
+            update(0, row[width - 1], row[1]);
+            x = 2;
+        }
+        for (; x + 1 < width; x += 2)
+            update(x, row[x - 1], row[x + 1]);
+        if (x == width - 1)
+            update(x, row[x - 1], row[0]);
+    };
+
+    // The colors only alternate across the wrap on even sized grids. With
+    // an odd height, the first and the last rows are of the same color, so
+    // the last row is updated after the others instead of alongside them.
+    // With an odd width, each row is updated by one thread anyway.
+    unsigned blockedRows = height - height % 2;
+
+    for (unsigned s = 0; s < sweeps; ++s)
+    {
+        // The second color of a row only depends on the first color of its
+        // neighbours, so it follows one row behind while they are still in
+        // the cache. The first and last rows of each block wait for the
+        // neighbouring blocks.
+        forBlocks(blockedRows, [&](unsigned begin, unsigned end)
+        {
+            for (unsigned y = begin; y < end; ++y)
+            {
+                updateRow(y, 0);
+                if (y > begin + 1)
+                    updateRow(y - 1, 1);
+            }
+        });
+
+        if (blockedRows < height)
+            updateRow(height - 1, 0);
+
+        forBlocks(blockedRows, [&](unsigned begin, unsigned end)
+        {
+            updateRow(begin, 1);
+            if (end - 1 > begin)
+                updateRow(end - 1, 1);
+        });
+
+        if (blockedRows < height)
+            updateRow(height - 1, 1);
+    }
+}
+
+HeightReconstruction::Residual HeightReconstruction::residual(const Grid &grid) const
+{
+    std::vector<Residual> rows(grid.height);
+    parallelFor(0, grid.height, [&](size_t y)
+    {
+        thread_local std::vector<float> r;
+        r.resize(grid.width);
+        residualRow(grid.u.data(), grid.f.data(), static_cast<unsigned>(y), grid.width, grid.height, r.data());
+
+        const float *u = grid.u.data() + y * grid.width;
+        rows[y].norm         = rowDot(r.data(), r.data(), grid.width);
+        rows[y].solutionNorm = rowDot(u, u, grid.width);
+        rows[y].solutionSum  = rowSum(u, grid.width);
+    }, 16);
+
+    Residual total = {};
+    for (auto &row : rows)
+    {
+        total.norm         += row.norm;
+        total.solutionNorm += row.solutionNorm;
+        total.solutionSum  += row.solutionSum;
+    }
+    total.norm         = std::sqrt(total.norm);
+    total.solutionNorm = std::sqrt(total.solutionNorm);
+    return total;
+}
+
+HeightReconstruction::Interpolation HeightReconstruction::interpolation(unsigned fineSize, unsigned coarseSize)
+{
+    Interpolation in;
+    in.lower.resize(fineSize);
+    in.upper.resize(fineSize);
+    in.weight.resize(fineSize);
+    in.start.assign(coarseSize + 1, 0);
+
+    // Position of the fine texel centers in coarse texels, where the first
+    // coarse texel center is at 0.
+    double scale = static_cast<double>(coarseSize) / fineSize;
+    for (unsigned i = 0; i < fineSize; ++i)
+    {
+        double c      = (i + .5) * scale - .5;
+        double lower  = std::floor(c);
+        int j         = static_cast<int>(lower);
+        in.lower[i]   = j < 0 ? coarseSize - 1 : static_cast<unsigned>(j);
+        in.upper[i]   = wrapNext(in.lower[i], coarseSize);
+        in.weight[i]  = static_cast<float>(c - lower);
+        ++in.start[in.lower[i] + 1];
+        ++in.start[in.upper[i] + 1];
+    }
+
+    for (unsigned j = 0; j < coarseSize; ++j)
+        in.start[j + 1] += in.start[j];
+
+    std::vector<unsigned> next(in.start.begin(), in.start.end() - 1);
+    in.taps.resize(in.start.back());
+    for (unsigned i = 0; i < fineSize; ++i)
+    {
+        Tap lower = { i, 1 - in.weight[i] };
+        Tap upper = { i, in.weight[i] };
+        in.taps[next[in.lower[i]]++] = lower;
+        in.taps[next[in.upper[i]]++] = upper;
+    }
+
+    return in;
+}
+
+void HeightReconstruction::restrictResidual(const Grid &fine, Grid &coarse, bool hasSolution) const
+{
+    // The transpose of the interpolation. Its weights add up to the area of
+    // a coarse texel in fine ones, which is also how much larger the coarse
+    // Laplacian is than the fine one for the same heights.
+    const Interpolation &columns = coarse.columns;
+    const Interpolation &rows    = coarse.rows;
+    unsigned cw = coarse.width;
+
+    forBlocks(coarse.height, [&](unsigned begin, unsigned end)
+    {
+        // The residual rows are computed as they are needed instead of
+        // being stored. Consecutive coarse rows share half of their fine
+        // rows, so the last few are kept.
+        thread_local std::vector<float> residuals;
+        thread_local std::vector<float> blended;
+        unsigned cachedRows[CachedRows];
+        std::fill(cachedRows, cachedRows + CachedRows, ~0u);
+        residuals.resize(static_cast<size_t>(CachedRows) * fine.width);
+        blended.resize(fine.width);
+
+        auto fineRow = [&](unsigned fy)
+        {
+            if (!hasSolution)
+                return fine.f.data() + static_cast<size_t>(fy) * fine.width;
+
+            unsigned slot = fy % CachedRows;
+            float *r      = residuals.data() + static_cast<size_t>(slot) * fine.width;
+            if (cachedRows[slot] != fy)
+            {
+                residualRow(fine.u.data(), fine.f.data(), fy, fine.width, fine.height, r);
+                cachedRows[slot] = fy;
+            }
+            return static_cast<const float *>(r);
+        };
+
+        for (unsigned y = begin; y < end; ++y)
+        {
+            // The fine rows are blended first, so that the gather along the
+            // row is done once per coarse texel.
+            float *b = blended.data();
+            std::fill(b, b + fine.width, 0.f);
+            for (unsigned t = rows.start[y]; t < rows.start[y + 1]; ++t)
+            {
+                const float *src = fineRow(rows.taps[t].fine);
+                float wy         = rows.taps[t].weight;
+                for (unsigned x = 0; x < fine.width; ++x)
+                    b[x] += wy * src[x];
+            }
+
+            float *f = coarse.f.data() + static_cast<size_t>(y) * cw;
+            float *u = coarse.u.data() + static_cast<size_t>(y) * cw;
+            if (fine.width == 2 * cw)
+            {
+                // The common even sizes have the same weights for every texel.
+                unsigned last = fine.width - 1;
+                f[0] = .25f * (b[last] + b[2]) + .75f * (b[0] + b[1]);
+                for (unsigned x = 1; x + 1 < cw; ++x)
+                    f[x] = .25f * (b[2 * x - 1] + b[2 * x + 2]) + .75f * (b[2 * x] + b[2 * x + 1]);
+                f[cw - 1] = .25f * (b[last - 2] + b[0]) + .75f * (b[last - 1] + b[last]);
+            }
+            else
+            {
+                for (unsigned x = 0; x < cw; ++x)
+                {
+                    float sum = 0;
+                    for (unsigned k = columns.start[x]; k < columns.start[x + 1]; ++k)
+                        sum += columns.taps[k].weight * b[columns.taps[k].fine];
+                    f[x] = sum;
+                }
+            }
+
+            std::fill(u, u + cw, 0.f);
+        }
+    });
+}
+
+void HeightReconstruction::prolongate(const Grid &coarse, Grid &fine, bool add) const
+{
+    // Bilinear interpolation between the coarse texel centers. The coarse
+    // rows are first blended vertically, and then horizontally.
+    const Interpolation &columns = coarse.columns;
+    const Interpolation &rows    = coarse.rows;
+    unsigned cw = coarse.width;
+
+    parallelFor(0, fine.height, [&](size_t y)
+    {
+        const float *c0 = coarse.u.data() + static_cast<size_t>(rows.lower[y]) * cw;
+        const float *c1 = coarse.u.data() + static_cast<size_t>(rows.upper[y]) * cw;
+        float wy        = rows.weight[y];
+        float *dst      = fine.u.data() + y * fine.width;
+
+        thread_local std::vector<float> blended;
+        blended.resize(cw);
+        for (unsigned x = 0; x < cw; ++x)
+            blended[x] = c0[x] + wy * (c1[x] - c0[x]);
+
+        const float *b = blended.data();
+        thread_local std::vector<float> interpolated;
+        interpolated.resize(fine.width);
+        float *v = interpolated.data();
+        if (fine.width == 2 * cw)
+        {
+            // The common even sizes have the same weights for every texel.
+            v[0] = .75f * b[0] + .25f * b[cw - 1];
+            for (unsigned x = 0; x + 1 < cw; ++x)
+            {
+                v[2 * x + 1] = .75f * b[x] + .25f * b[x + 1];
+                v[2 * x + 2] = .75f * b[x + 1] + .25f * b[x];
+            }
+            v[fine.width - 1] = .75f * b[cw - 1] + .25f * b[0];
+        }
+        else
+        {
+            for (unsigned x = 0; x < fine.width; ++x)
+            {
+                float b0 = b[columns.lower[x]];
+                v[x]     = b0 + columns.weight[x] * (b[columns.upper[x]] - b0);
+            }
+        }
+
+        if (add)
+        {
+            for (unsigned x = 0; x < fine.width; ++x)
+                dst[x] += v[x];
+        }
+        else
+        {
+            std::copy(v, v + fine.width, dst);
+        }
+    }, 16);
+}
+
+void HeightReconstruction::solveCoarsest(Grid &grid) const
+{
+    // Conjugate gradients on -Laplacian, which is positive definite for
+    // the heights that average to zero. The right hand side of a periodic
+    // problem averages to zero too, up to rounding.
+    unsigned width  = grid.width;
+    unsigned height = grid.height;
+    size_t n        = grid.u.size();
+
+    removeMean(grid.f, width, height);
+    std::fill(grid.u.begin(), grid.u.end(), 0.f);
+
+    auto dot = [&](const std::vector<float> &a, const std::vector<float> &b)
+    {
+        return sumRows(height, [&](unsigned y)
+        {
+            size_t row = static_cast<size_t>(y) * width;
+            return rowDot(a.data() + row, b.data() + row, width);
+        });
+    };
+
+    // r = b - A u, with b = -f and u = 0.
+    std::vector<float> r(n);
+    for (size_t i = 0; i < n; ++i)
+        r[i] = -grid.f[i];
+
+    std::vector<float> p  = r;
+    std::vector<float> ap(n);
+
+    double rr      = dot(r, r);
+    double limit   = CoarsestTolerance * CoarsestTolerance * rr;
+
+    for (unsigned i = 0; i < MaxCoarsestIterations && rr > limit; ++i)
+    {
+        parallelFor(0, height, [&](size_t y)
+        {
+            for (unsigned x = 0; x < width; ++x)
+                ap[y * width + x] = -laplacian(p.data(), x, static_cast<unsigned>(y), width, height);
+        }, 16);
+
+        double pap = dot(p, ap);
+        if (!(pap > 0))
+            break;
+
+        float alpha = static_cast<float>(rr / pap);
+        for (size_t k = 0; k < n; ++k)
+        {
+            grid.u[k] += alpha * p[k];
+            r[k]      -= alpha * ap[k];
+        }
+
+        double rrNext = dot(r, r);
+        float beta    = static_cast<float>(rrNext / rr);
+        rr            = rrNext;
+
+        for (size_t k = 0; k < n; ++k)
+            p[k] = r[k] + beta * p[k];
+    }
+
+    removeMean(grid.u, width, height);
+}
+
+void HeightReconstruction::vCycle(unsigned level)
+{
+    auto &grid = grids[level];
+
+    if (level + 1 == grids.size())
+    {
+        solveCoarsest(grid);
+        return;
+    }
+
+    smooth(grid, PreSmoothing);
+    restrictResidual(grid, grids[level + 1], true);
+    vCycle(level + 1);
+    prolongate(grids[level + 1], grid, true);
+    smooth(grid, PostSmoothing);
+}
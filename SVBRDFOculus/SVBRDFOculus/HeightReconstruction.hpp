@@ -0,0 +1,111 @@
+#pragma once
+
+#include <vector>
+
+// A heightmap integrated from a tangent space normal map, for materials that
+// only come with normals. The normals give the gradient of the height, and
+// the heights whose gradient is closest to it in the least squares sense
+// solve the Poisson equation, Laplacian(h) = divergence(gradient).
+//
+// The equation is solved with multigrid: V-cycles of red-black Gauss-Seidel
+// smoothing over a hierarchy of half sized grids, started from the solution
+// of the coarsest grid (full multigrid), with every pass parallel over rows.
+// Odd sizes round up, and the coarse texels are stretched a little to cover
+// the same area. The boundaries wrap around like the textures do, so the
+// heights tile, and any gradient that does not tile is spread over the whole
+// map as small errors instead of becoming a slope.
+class HeightReconstruction
+{
+public:
+    struct Settings
+    {
+        // Normals with a smaller Z are clamped to it, so that the almost
+        // vertical ones do not give unbounded slopes.
+        float minNormalZ;
+        // Stop once the residual is this small relative to the divergence,
+        // or as small as the rounding errors of floats allow.
+        float tolerance;
+        // Stop after this many V-cycles on the full resolution grid anyway.
+        unsigned maxCycles;
+    };
+
+    struct Stats
+    {
+        unsigned levels;
+        unsigned cycles;
+        // Final residual relative to the divergence.
+        float residual;
+    };
+
+    static Settings defaultSettings();
+
+    // Integrate a width x height normal map, whose consecutive normals are
+    // stride floats apart. The X and Y of the normals point towards +U and
+    // +V, and V grows with the rows. The heights are in the units of the
+    // width of the map, i.e. of U, and average to zero.
+    HeightReconstruction(const float *normals, unsigned width, unsigned height, unsigned stride,
+                         const Settings &settings = defaultSettings());
+
+    unsigned width()  const { return mapWidth; }
+    unsigned height() const { return mapHeight; }
+    const std::vector<float> &heights() const { return result; }
+    const Stats &stats() const { return solveStats; }
+
+private:
+    struct Tap
+    {
+        unsigned fine;
+        float weight;
+    };
+
+    // Linear interpolation along one axis from the texel centers of a
+    // coarser grid, whose texels are stretched to cover the same length.
+    // Fine texel i is (1 - weight[i]) * coarse[lower[i]] + weight[i] *
+    // coarse[upper[i]], wrapping around. The restriction is its transpose,
+    // where coarse texel j gathers taps[start[j]] to taps[start[j + 1] - 1].
+    struct Interpolation
+    {
+        std::vector<unsigned> lower;
+        std::vector<unsigned> upper;
+        std::vector<float> weight;
+        std::vector<unsigned> start;
+        std::vector<Tap> taps;
+    };
+
+    struct Grid
+    {
+        unsigned width;
+        unsigned height;
+        // Current solution and right hand side of Laplacian(u) = f.
+        std::vector<float> u;
+        std::vector<float> f;
+        // From this grid to the next finer one, empty on the finest.
+        Interpolation columns;
+        Interpolation rows;
+    };
+
+    struct Residual
+    {
+        // L2 norms of the residual and of the solution.
+        double norm;
+        double solutionNorm;
+        double solutionSum;
+    };
+
+    static Interpolation interpolation(unsigned fineSize, unsigned coarseSize);
+
+    void smooth(Grid &grid, unsigned sweeps) const;
+    Residual residual(const Grid &grid) const;
+    // Without a solution, i.e. with a fine u that is still zero, the
+    // residual is f.
+    void restrictResidual(const Grid &fine, Grid &coarse, bool hasSolution) const;
+    void prolongate(const Grid &coarse, Grid &fine, bool add) const;
+    void solveCoarsest(Grid &grid) const;
+    void vCycle(unsigned level);
+
+    unsigned mapWidth;
+    unsigned mapHeight;
+    std::vector<Grid> grids;
+    std::vector<float> result;
+    Stats solveStats;
+};
@@ -0,0 +1,473 @@
+#include "HeightfieldMesh.hpp"
+#include "Parallel.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+
+namespace
+{
+    // Triangles this many splits below the two root triangles are
+    // extracted in parallel.
+    const unsigned ParallelDepth = 8;
+
+    struct Triangle
+    {
+        int ax, ay;
+        int bx, by;
+        int cx, cy;
+    };
+
+    bool isPowerOfTwo(unsigned x)
+    {
+        return x != 0 && (x & (x - 1)) == 0;
+    }
+}
+
+unsigned HeightfieldMesh::gridSize(unsigned samples)
+{
+    unsigned cells = 1;
+    while (cells + 1 < samples)
+        cells *= 2;
+    return cells + 1;
+}
+
+std::vector<float> HeightfieldMesh::resample(const float *heights,
+                                             unsigned width, unsigned height, unsigned stride,
+                                             unsigned size)
+{
+    assert(width > 0 && height > 0 && size > 1);
+
+    std::vector<float> grid(static_cast<size_t>(size) * size);
+
+    double scaleX = static_cast<double>(width  - 1) / (size - 1);
+    double scaleY = static_cast<double>(height - 1) / (size - 1);
+
+    auto sample = [&](unsigned x, unsigned y)
+    {
+        return heights[(static_cast<size_t>(y) * width + x) * stride];
+    };
+
+    parallelFor(0, size, [&](size_t y)
+    {
+        double fy  = static_cast<double>(y) * scaleY;
+        unsigned y0 = std::min(static_cast<unsigned>(fy), height - 1);
+        unsigned y1 = std::min(y0 + 1, height - 1);
+        float ty    = static_cast<float>(fy - y0);
+
+        for (unsigned x = 0; x < size; ++x)
+        {
+            double fx  = static_cast<double>(x) * scaleX;
+            unsigned x0 = std::min(static_cast<unsigned>(fx), width - 1);
+            unsigned x1 = std::min(x0 + 1, width - 1);
+            float tx    = static_cast<float>(fx - x0);
+
+            float top    = sample(x0, y0) + (sample(x1, y0) - sample(x0, y0)) * tx;
+            float bottom = sample(x0, y1) + (sample(x1, y1) - sample(x0, y1)) * tx;
+            grid[y * size + x] = top + (bottom - top) * ty;
+        }
+    }, 16);
+
+    return grid;
+}
+
+HeightfieldMesh::HeightfieldMesh(std::vector<float> heights, unsigned size)
+    : gridDim(size)
+    , heights(std::move(heights))
+    , errors(static_cast<size_t>(size) * size, 0.f)
+{
+    assert(size >= 3 && isPowerOfTwo(size - 1));
+    assert(this->heights.size() == errors.size());
+
+    computeErrors();
+}
+
+float HeightfieldMesh::rootError() const
+{
+    unsigned center = gridDim / 2;
+    return errors[center * gridDim + center];
+}
+
+// The right triangle with the hypotenuse from a to b, and the right angle at c.
+float HeightfieldMesh::triangleError(int ax, int ay, int bx, int by, int cx, int cy) const
+{
+    float ha = height(ax, ay);
+    float hb = height(bx, by);
+    float hc = height(cx, cy);
+
+    // Along the hypotenuse, the heights are interpolated linearly from a
+    // to b, and towards c, linearly from the midpoint m to c. Twice the
+    // coordinates are used for m, so that everything stays in integers.
+    int64_t abx = bx - ax;
+    int64_t aby = by - ay;
+    int64_t abLength = abx * abx + aby * aby;
+    int64_t mx2 = ax + bx;
+    int64_t my2 = ay + by;
+    int64_t mcx = 2 * cx - mx2;
+    int64_t mcy = 2 * cy - my2;
+    int64_t mcLength = mcx * mcx + mcy * mcy;
+
+    float hm = (ha + hb) / 2;
+    float invAB = 1.f / static_cast<float>(abLength);
+    float invMC = 1.f / static_cast<float>(mcLength);
+
+    int x0 = std::min(std::min(ax, bx), cx);
+    int x1 = std::max(std::max(ax, bx), cx);
+    int y0 = std::min(std::min(ay, by), cy);
+    int y1 = std::max(std::max(ay, by), cy);
+
+    float maxError = 0;
+
+    for (int y = y0; y <= y1; ++y)
+    {
+        for (int x = x0; x <= x1; ++x)
+        {
+            int64_t t = (x - ax) * abx + (y - ay) * aby;
+            int64_t w = (2 * x - mx2) * mcx + (2 * y - my2) * mcy;
+
+            // Inside, if not behind the hypotenuse and the distance from the
+            // midpoint along it shrinks towards c.
+            if (w < 0 || std::abs(2 * t - abLength) * mcLength > (mcLength - w) * abLength)
+                continue;
+
+            float plane = ha
+                + (hb - ha) * (static_cast<float>(t) * invAB)
+                + (hc - hm) * (static_cast<float>(w) * invMC);
+
+            maxError = std::max(maxError, std::abs(height(x, y) - plane));
+        }
+    }
+
+    return maxError;
+}
+
+// The error of the diamond centered at x, y, where s is the largest power
+// of two dividing both. If both x / s and y / s are odd, the point is the
+// center of a square with sides of 2 * s, split by the diagonal through the
+// center of the square twice its size. Otherwise, it is the midpoint of an
+// edge of 2 * s along the axis of the odd coordinate.
+float HeightfieldMesh::diamondError(int x, int y, int s) const
+{
+    int size = static_cast<int>(gridDim);
+    bool oddX = ((x / s) & 1) != 0;
+    bool oddY = ((y / s) & 1) != 0;
+
+    int ax, ay, bx, by, c1x, c1y, c2x, c2y;
+
+    if (oddX && oddY)
+    {
+        int i = (x - s) / (2 * s);
+        int j = (y - s) / (2 * s);
+
+        if (((i ^ j) & 1) == 0)
+        {
+            ax  = x - s; ay  = y - s;
+            bx  = x + s; by  = y + s;
+            c1x = x + s; c1y = y - s;
+            c2x = x - s; c2y = y + s;
+        }
+        else
+        {
+            ax  = x + s; ay  = y - s;
+            bx  = x - s; by  = y + s;
+            c1x = x - s; c1y = y - s;
+            c2x = x + s; c2y = y + s;
+        }
+    }
+    else if (oddX)
+    {
+        ax  = x - s; ay  = y;
+        bx  = x + s; by  = y;
+        c1x = x;     c1y = y - s;
+        c2x = x;     c2y = y + s;
+    }
+    else
+    {
+        ax  = x;     ay  = y - s;
+        bx  = x;     by  = y + s;
+        c1x = x - s; c1y = y;
+        c2x = x + s; c2y = y;
+    }
+
+    auto inside = [size](int px, int py)
+    {
+        return px >= 0 && py >= 0 && px < size && py < size;
+    };
+
+    float e = 0;
+    if (inside(c1x, c1y))
+        e = std::max(e, triangleError(ax, ay, bx, by, c1x, c1y));
+    if (inside(c2x, c2y))
+        e = std::max(e, triangleError(ax, ay, bx, by, c2x, c2y));
+    return e;
+}
+
+void HeightfieldMesh::computeErrors()
+{
+    int size = static_cast<int>(gridDim);
+    int cells = size - 1;
+
+    auto error = [&](int x, int y) -> float &
+    {
+        return errors[static_cast<size_t>(y) * gridDim + x];
+    };
+
+    auto childError = [&](int x, int y)
+    {
+        return (x >= 0 && y >= 0 && x < size && y < size) ? error(x, y) : 0.f;
+    };
+
+    // Every diamond only depends on the diamonds of its two triangles' halves,
+    // which are the edge midpoints for the squares of the same step, and the
+    // squares of half the step for the edge midpoints. Diamonds of the same
+    // kind and step do not overlap, so each pass is parallel over rows.
+    for (int s = 1; s < cells; s *= 2)
+    {
+        int h = s / 2;
+
+        // Edge midpoints. Even rows have horizontal hypotenuses at odd
+        // columns, and odd rows vertical ones at even columns.
+        parallelFor(0, cells / s + 1, [&](size_t row)
+        {
+            int y = static_cast<int>(row) * s;
+            int firstX = (row & 1) ? 0 : s;
+
+            for (int x = firstX; x <= cells; x += 2 * s)
+            {
+                float e = diamondError(x, y, s);
+
+                if (h > 0)
+                {
+                    e = std::max(e, childError(x - h, y - h));
+                    e = std::max(e, childError(x + h, y - h));
+                    e = std::max(e, childError(x - h, y + h));
+                    e = std::max(e, childError(x + h, y + h));
+                }
+
+                error(x, y) = e;
+            }
+        });
+
+        // Square centers.
+        parallelFor(0, cells / (2 * s), [&](size_t row)
+        {
+            int y = (2 * static_cast<int>(row) + 1) * s;
+
+            for (int x = s; x < cells; x += 2 * s)
+            {
+                float e = diamondError(x, y, s);
+                e = std::max(e, error(x - s, y));
+                e = std::max(e, error(x + s, y));
+                e = std::max(e, error(x, y - s));
+                e = std::max(e, error(x, y + s));
+                error(x, y) = e;
+            }
+        });
+    }
+}
+
+void HeightfieldMesh::emit(int ax, int ay, int bx, int by, int cx, int cy,
+                           std::vector<uint32_t> &triangles) const
+{
+    // The y axis points down the rows, so counterclockwise as drawn has
+    // a negative cross product.
+    int64_t cross = static_cast<int64_t>(bx - ax) * (cy - ay)
+                  - static_cast<int64_t>(by - ay) * (cx - ax);
+    if (cross > 0)
+    {
+        std::swap(bx, cx);
+        std::swap(by, cy);
+    }
+
+    triangles.emplace_back(static_cast<uint32_t>(ay * static_cast<int>(gridDim) + ax));
+    triangles.emplace_back(static_cast<uint32_t>(by * static_cast<int>(gridDim) + bx));
+    triangles.emplace_back(static_cast<uint32_t>(cy * static_cast<int>(gridDim) + cx));
+}
+
+void HeightfieldMesh::extract(float maxError,
+                              int ax, int ay, int bx, int by, int cx, int cy,
+                              std::vector<uint32_t> &triangles, float &maxTriangleError) const
+{
+    int mx = (ax + bx) / 2;
+    int my = (ay + by) / 2;
+
+    // Triangles with legs of one cell have no midpoint to split at.
+    bool leaf = std::abs(ax - cx) + std::abs(ay - cy) <= 1;
+
+    if (!leaf && errors[static_cast<size_t>(my) * gridDim + mx] > maxError)
+    {
+        extract(maxError, cx, cy, ax, ay, mx, my, triangles, maxTriangleError);
+        extract(maxError, bx, by, cx, cy, mx, my, triangles, maxTriangleError);
+    }
+    else
+    {
+        if (!leaf)
+            maxTriangleError = std::max(maxTriangleError, triangleError(ax, ay, bx, by, cx, cy));
+        emit(ax, ay, bx, by, cx, cy, triangles);
+    }
+}
+
+HeightfieldMesh::Triangulation HeightfieldMesh::triangulate(float maxError) const
+{
+    int cells = static_cast<int>(gridDim) - 1;
+
+    // Split the triangles above the parallel depth serially, so that the
+    // rest of the work is spread over independent subtrees. Triangles that
+    // are not split before that are emitted right away.
+    std::vector<uint32_t> topTriangles;
+    float topError = 0;
+
+    std::vector<Triangle> subtrees;
+    std::vector<std::pair<Triangle, unsigned>> stack;
+    stack.push_back({ { cells, cells, 0, 0, 0, cells }, 0 });
+    stack.push_back({ { 0, 0, cells, cells, cells, 0 }, 0 });
+
+    while (!stack.empty())
+    {
+        Triangle t      = stack.back().first;
+        unsigned depth  = stack.back().second;
+        stack.pop_back();
+
+        int mx = (t.ax + t.bx) / 2;
+        int my = (t.ay + t.by) / 2;
+        bool leaf = std::abs(t.ax - t.cx) + std::abs(t.ay - t.cy) <= 1;
+
+        if (depth == ParallelDepth)
+        {
+            subtrees.emplace_back(t);
+        }
+        else if (!leaf && errors[static_cast<size_t>(my) * gridDim + mx] > maxError)
+        {
+            // Pushed in reverse, so the subtrees come out in the same order
+            // as a recursive traversal would visit them.
+            stack.push_back({ { t.bx, t.by, t.cx, t.cy, mx, my }, depth + 1 });
+            stack.push_back({ { t.cx, t.cy, t.ax, t.ay, mx, my }, depth + 1 });
+        }
+        else
+        {
+            if (!leaf)
+                topError = std::max(topError, triangleError(t.ax, t.ay, t.bx, t.by, t.cx, t.cy));
+            emit(t.ax, t.ay, t.bx, t.by, t.cx, t.cy, topTriangles);
+        }
+    }
+
+    std::vector<std::vector<uint32_t>> subtreeTriangles(subtrees.size());
+    std::vector<float> subtreeErrors(subtrees.size(), 0.f);
+
+    parallelFor(0, subtrees.size(), [&](size_t i)
+    {
+        auto &t = subtrees[i];
+        extract(maxError, t.ax, t.ay, t.bx, t.by, t.cx, t.cy, subtreeTriangles[i], subtreeErrors[i]);
+    });
+
+    Triangulation mesh;
+    mesh.maxError = topError;
+
+    size_t indexCount = topTriangles.size();
+    for (size_t i = 0; i < subtrees.size(); ++i)
+    {
+        indexCount    += subtreeTriangles[i].size();
+        mesh.maxError  = std::max(mesh.maxError, subtreeErrors[i]);
+    }
+
+    // Number the used grid points in the order they appear.
+    static const uint32_t Unused = std::numeric_limits<uint32_t>::max();
+    std::vector<uint32_t> remap(static_cast<size_t>(gridDim) * gridDim, Unused);
+    mesh.indices.reserve(indexCount);
+
+    auto append = [&](const std::vector<uint32_t> &triangles)
+    {
+        for (uint32_t g : triangles)
+        {
+            uint32_t &index = remap[g];
+            if (index == Unused)
+            {
+                index = static_cast<uint32_t>(mesh.vertices.size());
+                mesh.vertices.emplace_back(g);
+            }
+            mesh.indices.emplace_back(index);
+        }
+    };
+
+    append(topTriangles);
+    for (auto &triangles : subtreeTriangles)
+        append(triangles);
+
+    return mesh;
+}
+
+float uniformGridError(const float *heights,
+                       unsigned width, unsigned height, unsigned stride,
+                       const float *grid, unsigned step)
+{
+    assert(step > 0);
+
+    unsigned W = width  / step;
+    unsigned H = height / step;
+
+    if (W < 2 || H < 2)
+        return 0;
+
+    auto sample = [&](unsigned x, unsigned y)
+    {
+        return heights[(static_cast<size_t>(y) * width + x) * stride];
+    };
+
+    std::vector<float> rowErrors(H - 1, 0.f);
+    float invStep = 1.f / static_cast<float>(step);
+
+    parallelFor(0, H - 1, [&](size_t qy)
+    {
+        float rowError = 0;
+
+        for (unsigned qx = 0; qx < W - 1; ++qx)
+        {
+            unsigned x0 = qx * step;
+            unsigned y0 = static_cast<unsigned>(qy) * step;
+
+            const float *vertex = grid + qy * W + qx;
+            float hA = vertex[0];
+            float hB = vertex[1];
+            float hC = vertex[W];
+            float hD = vertex[W + 1];
+
+            // Same diagonals as in initCPUDisplacementMapped(): B to C
+            // for even quads, A to D for odd ones.
+            bool even = ((qx + qy) % 2) == 0;
+
+            for (unsigned y = 0; y <= step; ++y)
+            {
+                float fy = static_cast<float>(y) * invStep;
+
+                for (unsigned x = 0; x <= step; ++x)
+                {
+                    float fx = static_cast<float>(x) * invStep;
+                    float h;
+
+                    if (even)
+                    {
+                        if (fx + fy <= 1)
+                            h = hA + fx * (hB - hA) + fy * (hC - hA);
+                        else
+                            h = hD + (1 - fx) * (hC - hD) + (1 - fy) * (hB - hD);
+                    }
+                    else
+                    {
+                        if (fx >= fy)
+                            h = hA + fx * (hB - hA) + fy * (hD - hB);
+                        else
+                            h = hA + fy * (hC - hA) + fx * (hD - hC);
+                    }
+
+                    rowError = std::max(rowError, std::abs(sample(x0 + x, y0 + y) - h));
+                }
+            }
+        }
+
+        rowErrors[qy] = rowError;
+    });
+
+    return *std::max_element(rowErrors.begin(), rowErrors.end());
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Adaptive triangulation of a heightfield as a right triangulated irregular
+// network (RTIN). The heights are sampled on a square grid of 2^k + 1 points
+// per side, which is split recursively into right triangles along their
+// hypotenuses. Each grid point gets the error of the diamond it is the center
+// of, which is the largest vertical distance of the samples in the two
+// triangles sharing the hypotenuse from those triangles, and at least the
+// error of the diamonds below it. A triangle is split if the error of its
+// hypotenuse midpoint is above the requested bound, so both triangles sharing
+// a hypotenuse are always split together, and the mesh has no cracks.
+class HeightfieldMesh
+{
+public:
+    struct Triangulation
+    {
+        // Grid indices (y * size + x) of the vertices, in the order of
+        // their first use.
+        std::vector<uint32_t> vertices;
+        // Three indices into vertices per triangle, counterclockwise when
+        // the first row of the grid is at the top.
+        std::vector<uint32_t> indices;
+        // Largest vertical distance of the samples from the triangles.
+        float maxError;
+
+        size_t triangleCount() const { return indices.size() / 3; }
+    };
+
+    // The smallest valid grid size with at least this many points per side.
+    static unsigned gridSize(unsigned samples);
+
+    // Resample a width x height heightfield bilinearly into a size x size
+    // grid, so that the corners of both coincide. Consecutive samples of
+    // the source are stride floats apart.
+    static std::vector<float> resample(const float *heights,
+                                       unsigned width, unsigned height, unsigned stride,
+                                       unsigned size);
+
+    // heights holds size x size samples in rows, and size must be 2^k + 1.
+    // The errors are computed in parallel.
+    HeightfieldMesh(std::vector<float> heights, unsigned size);
+
+    unsigned size() const { return gridDim; }
+    float height(unsigned x, unsigned y) const { return heights[y * gridDim + x]; }
+    // The error of the two triangle mesh covering the whole grid.
+    float rootError() const;
+
+    // The coarsest mesh whose error is at most maxError. Disjoint parts of
+    // the mesh are extracted in parallel.
+    Triangulation triangulate(float maxError) const;
+
+private:
+    float triangleError(int ax, int ay, int bx, int by, int cx, int cy) const;
+    float diamondError(int x, int y, int s) const;
+    void computeErrors();
+    void extract(float maxError,
+                 int ax, int ay, int bx, int by, int cx, int cy,
+                 std::vector<uint32_t> &triangles, float &maxTriangleError) const;
+    void emit(int ax, int ay, int bx, int by, int cx, int cy,
+              std::vector<uint32_t> &triangles) const;
+
+    unsigned gridDim;
+    std::vector<float> heights;
+    std::vector<float> errors;
+};
+
+// The largest vertical distance of a width x height heightfield from the
+// uniform grid initCPUDisplacementMapped() builds from it, which has a vertex
+// every step samples and alternating diagonals. Consecutive samples are
+// stride floats apart. The grid holds the (width / step) x (height / step)
+// vertex heights, which may be filtered. The samples past the last full
+// step are not covered by the grid and are ignored.
+float uniformGridError(const float *heights,
+                       unsigned width, unsigned height, unsigned stride,
+                       const float *grid, unsigned step);
@@ -0,0 +1,114 @@
+#include "JobGraph.hpp"
+#include "Parallel.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <mutex>
+
+JobGraph::Job JobGraph::add(const char *name,
+                            std::function<void()> f,
+                            std::vector<Job> dependencies,
+                            Thread thread)
+{
+    Job job = jobs.size();
+
+    for (Job d : dependencies)
+    {
+        assert(d < job && "Dependencies must be added before their dependents.");
+        (void)d;
+    }
+
+    Node node;
+    node.name         = name;
+    node.f            = std::move(f);
+    node.dependencies = std::move(dependencies);
+    node.thread       = thread;
+    jobs.emplace_back(std::move(node));
+
+    return job;
+}
+
+void JobGraph::addDependency(Job job, Job dependency)
+{
+    assert(job < jobs.size());
+    assert(dependency < job && "Dependencies must be added before their dependents.");
+    jobs[job].dependencies.push_back(dependency);
+}
+
+void JobGraph::run()
+{
+    // Dependencies that have not finished, and the jobs waiting for each job.
+    std::vector<size_t> waiting(jobs.size());
+    std::vector<std::vector<Job>> dependents(jobs.size());
+
+    std::vector<Job> readyAny;
+    std::vector<Job> readyCaller;
+
+    auto makeReady = [&] (Job j)
+    {
+        (jobs[j].thread == Thread::Caller ? readyCaller : readyAny).push_back(j);
+    };
+
+    for (Job j = 0; j < jobs.size(); ++j)
+    {
+        waiting[j] = jobs[j].dependencies.size();
+        for (Job d : jobs[j].dependencies)
+            dependents[d].push_back(j);
+        if (waiting[j] == 0)
+            makeReady(j);
+    }
+
+    std::mutex mutex;
+    std::condition_variable finishedJob;
+    size_t finished = 0;
+
+    auto take = [] (std::vector<Job> &ready)
+    {
+        auto first = std::min_element(ready.begin(), ready.end());
+        Job j = *first;
+        ready.erase(first);
+        return j;
+    };
+
+    // Run ready jobs until every job has finished. As every dependency
+    // comes before its dependents, some job is always ready or running.
+    auto schedule = [&] (bool caller)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (finished < jobs.size())
+        {
+            Job j;
+            if (caller && !readyCaller.empty())
+                j = take(readyCaller);
+            else if (!readyAny.empty())
+                j = take(readyAny);
+            else
+            {
+                finishedJob.wait(lock);
+                continue;
+            }
+
+            lock.unlock();
+            jobs[j].f();
+            lock.lock();
+
+            ++finished;
+            for (Job d : dependents[j])
+            {
+                if (--waiting[d] == 0)
+                    makeReady(d);
+            }
+            finishedJob.notify_all();
+        }
+    };
+
+    parallelForWithCaller(0, hardwareThreads() - 1,
+                          [&] (size_t) { schedule(false); },
+                          [&] { schedule(true); });
+}
+
+void JobGraph::clear()
+{
+    jobs.clear();
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+// Jobs with dependencies between them, run on the worker threads of
+// parallelFor(). A job runs once every job it depends on has finished.
+// Dependencies must be added before the jobs depending on them, so the
+// graph can never have cycles.
+class JobGraph
+{
+public:
+    typedef size_t Job;
+
+    enum class Thread
+    {
+        // Any worker thread, including the one calling run().
+        Any,
+        // Only the thread calling run(), e.g. for jobs using the immediate
+        // context. Of the ones that are ready, the first added runs first.
+        Caller,
+    };
+
+    Job add(const char *name,
+            std::function<void()> f,
+            std::vector<Job> dependencies = {},
+            Thread thread = Thread::Any);
+    void addDependency(Job job, Job dependency);
+
+    size_t size() const { return jobs.size(); }
+    const char *name(Job job) const { return jobs[job].name; }
+
+    // Run every job, and return once all of them have finished. Jobs start
+    // as soon as their dependencies have finished, so the calling thread
+    // runs its jobs while the workers run theirs, and only takes other jobs
+    // when none of its own are ready. Jobs run with parallelFor() busy, so
+    // any parallelFor() calls they make run serially.
+    void run();
+    void clear();
+
+private:
+    struct Node
+    {
+        const char *name;
+        std::function<void()> f;
+        std::vector<Job> dependencies;
+        Thread thread;
+    };
+
+    std::vector<Node> jobs;
+};
@@ -24,6 +24,12 @@ cbuffer PSConstants : register(b0)
     uint   normalMode;
     uint   useNormalMapping;
     uint   numLights;
+    // Displacement of NormalDisplaced, which is along ConstantUp instead of
+    // the interpolated normal if flatDisplacementBase is set.
+    float  displacementMagnitude;
+    uint   flatDisplacementBase;
+    // Camera of the right eye with single pass stereo
+    float4 rightCameraPosition;
 };
 
 struct Light
@@ -35,6 +41,9 @@ struct Light
 };
 StructuredBuffer<Light> lights : register(t4);
 
+// Derivatives of the heightmap with respect to UV.
+Texture2D<float2> heightDerivativeMap : register(t10);
+
 static const uint TonemapIdentity    = 0;
 static const uint TonemapReinhard    = 1;
 static const uint TonemapReinhardMod = 2;
@@ -42,6 +51,7 @@ static const uint TonemapReinhardMod = 2;
 static const uint NormalInterpolated  = 0;
 static const uint NormalReconstructed = 1;
 static const uint NormalConstant      = 2;
+static const uint NormalDisplaced     = 3;
 
 static const float3 ConstantUp = float3(0, 0, 1);
 
@@ -339,11 +349,20 @@ Lighting computeLightingEnvironment(Material mat,
     return l;
 }
 
+// Radiance split into the view independent diffuse term
+// and the view dependent specular term.
+struct Radiance
+{
+    float3 diffuse;
+    float3 specular;
+};
+
 // V and L must be in the same space that N is in.
-float3 evaluateLight(Material mat,
-                     Lighting l,       // Lighting environment at the point
-                     Light light,      // The world space position, color and intensity of the light
-                     float shadowTerm) // Shadow term for the light, multiplies the direct light but not the ambient
+Radiance evaluateLightSplit(Material mat,
+                            Lighting l,       // Lighting environment at the point
+                            Light light,      // The world space position, color and intensity of the light
+                            float shadowTerm, // Shadow term for the light, multiplies the direct light but not the ambient
+                            bool includeSpecular = true)
 {
     float3 V = l.V;
     float3 N = l.N;
@@ -355,44 +374,47 @@ float3 evaluateLight(Material mat,
     // the normal mapped one.
     bool isBackFacing = dot(l.pt.normalWorld, L) < 0;
 
-    // H = halfway vector
-    float3 H = normalize(V + L);
-    float3 H_ = rotateWith(l.toNormalOriented, H);
-    // h = tangent plane parametrized half-vector
-    float2 h = H_.xy / H_.z;
+    // Evaluate BRDF 
+    float3 diffuse  = l.diffuseCoeff;
+    float3 specular = 0;
 
-    float2x2 S = l.S;
-    // mul(v, M) treats v as a row vector, so it is equivalent to v^T * M
-    float2 hT_S   = mul(h, S);
-    float  hT_S_h = mul(hT_S, h);  
+    if (includeSpecular)
+    {
+        // H = halfway vector
+        float3 H = normalize(V + L);
+        float3 H_ = rotateWith(l.toNormalOriented, H);
+        // h = tangent plane parametrized half-vector
+        float2 h = H_.xy / H_.z;
 
-    // Microfacet distribution
-    // Aittala et al. (2015) Equation (1) 
-    float D = exp(-pow(abs(hT_S_h), mat.alpha / 2));
+        float2x2 S = l.S;
+        // mul(v, M) treats v as a row vector, so it is equivalent to v^T * M
+        float2 hT_S   = mul(h, S);
+        float  hT_S_h = mul(hT_S, h);  
 
-    float F = fresnelSchlick(mat.F0, V, H);
+        // Microfacet distribution
+        // Aittala et al. (2015) Equation (1) 
+        float D = exp(-pow(abs(hT_S_h), mat.alpha / 2));
+
+        float F = fresnelSchlick(mat.F0, V, H);
 
-    // Evaluate BRDF 
-    float3 diffuse = l.diffuseCoeff;
 #if BRDF_MODE == BRDF_BRADY_ET_AL
-    // Brady et al. (2014) Equation (9)
-    float3 specular = mat.specularAlbedo * D * F / (4 * dot(L, H));
+        // Brady et al. (2014) Equation (9)
+        specular = mat.specularAlbedo * D * F / (4 * dot(L, H));
 #elif BRDF_MODE == BRDF_AITTALA
-    // Differences from Brady et al. result from incorporating
-    // constant coefficients into the albedos, and from dropping
-    // the Fresnel term from the optimizer entirely.
-    float3 specular = mat.specularAlbedo * D * F / (mat.F0 * dot(L, H));
+        // Differences from Brady et al. result from incorporating
+        // constant coefficients into the albedos, and from dropping
+        // the Fresnel term from the optimizer entirely.
+        specular = mat.specularAlbedo * D * F / (mat.F0 * dot(L, H));
 #else
 #error Undefined BRDF mode!
 #endif
+    }
 
 #if defined(DEBUG_ONLY_DIFFUSE_LIGHT)
     diffuse = 1;
     specular = 0;
 #endif
 
-    float3 reflectance = (diffuse + specular);
-
     float distance    = length(L);
     float attenuation = 1 / (distance * distance) * light.falloffMultiplier;
     float cosineTerm  = max(0, dot(N, L));
@@ -400,13 +422,25 @@ float3 evaluateLight(Material mat,
     // Incident radiance of the light
     float3 L_i = light.color * shadowTerm;
 
-    float3 radiance = isBackFacing
+    float3 irradiance = isBackFacing
         ? 0
-        : (L_i * attenuation * cosineTerm * reflectance);
+        : (L_i * attenuation * cosineTerm);
 
+    Radiance radiance;
+    radiance.diffuse  = irradiance * diffuse;
+    radiance.specular = irradiance * specular;
     return radiance;
 }
 
+float3 evaluateLight(Material mat,
+                     Lighting l,
+                     Light light,
+                     float shadowTerm)
+{
+    Radiance radiance = evaluateLightSplit(mat, l, light, shadowTerm);
+    return radiance.diffuse + radiance.specular;
+}
+
 // Gamma encoding approximation
 float3 gamma(float3 linearColor)
 {
@@ -465,31 +499,26 @@ float3 toneMap(float3 linearRGB, uint mode, float maxLuminance)
     }
 }
 
-void reconstructTangentFrame(inout Point pt, float2 uv, float3 dp1, float3 dp2)
+// Build the tangent frame around the normal from the interpolated vertex
+// tangent, whose w is the sign of the bitangent, see TangentFrame.h.hlsl.
+// The tangent is made orthogonal to the normal again, which may have been
+// changed from the one the tangent was generated for.
+void orthogonalTangentFrame(inout Point pt, float4 tangentWorld)
 {
     float3 N = pt.normalWorld;
+    float3 T = tangentWorld.xyz - N * dot(N, tangentWorld.xyz);
 
-    // Optimized tangent frame reconstruction code originally from:
-    // http://www.thetenthplanet.de/archives/1180
-    // Modified a bit to suit this program
+    // Any tangent is better than none if the normal turned all the way to it.
+    if (dot(T, T) < 1e-12)
+        T = abs(N.z) < .9 ? cross(float3(0, 0, 1), N) : cross(N, float3(0, 1, 0));
 
-    float2 duv1 =  ddx_fine( uv );
-    float2 duv2 = -ddy_fine( uv );
- 
-    // solve the linear system
-    float3 dp2perp = cross( dp2, N );
-    float3 dp1perp = cross( N, dp1 );
-    float3 T = dp2perp * duv1.x + dp1perp * duv2.x;
-    float3 B = dp2perp * duv1.y + dp1perp * duv2.y;
- 
     T = normalize(T);
-    B = normalize(B);
 
     pt.tangentWorld   = T;
-    pt.bitangentWorld = B;
+    pt.bitangentWorld = cross(N, T) * (tangentWorld.w < 0 ? -1 : 1);
 }
 
-Point pointReconstructNormal(float3 positionWorld, float2 uv)
+Point pointReconstructNormal(float3 positionWorld, float4 tangentWorld)
 {
     Point pt;
     pt.positionWorld = positionWorld;
@@ -502,24 +531,47 @@ Point pointReconstructNormal(float3 positionWorld, float2 uv)
 
 	pt.normalWorld = normalize(cross(dp1, dp2));
 
-    reconstructTangentFrame(pt, uv, dp1, dp2);
+    orthogonalTangentFrame(pt, tangentWorld);
 
     return pt;
 }
 
-Point pointWithNormal(float3 positionWorld, float3 normalWorld, float2 uv)
+// The normal of the surface displaced along N by displacementMagnitude times
+// the heightmap, which leans against the gradient of the displacement along
+// the undisplaced surface. The gradients of U and V along it are solved from
+// the screen space derivatives, as unlike the directions of the vertex
+// tangents, their lengths depend on how the texture is stretched. Only the
+// parts of the derivatives that are perpendicular to N matter, so they can
+// come from the displaced positions. Same as HeightDerivatives::displacedNormal().
+float3 displacedNormal(float3 positionWorld, float3 N, float2 uv)
+{
+    float2 dh = heightDerivativeMap.Sample(materialSampler, uv);
+
+    float3 dp1  =  ddx_fine( positionWorld );
+    float3 dp2  = -ddy_fine( positionWorld );
+    float2 duv1 =  ddx_fine( uv );
+    float2 duv2 = -ddy_fine( uv );
+
+    float3 dp2perp = cross( dp2, N );
+    float3 dp1perp = cross( N, dp1 );
+    float  det     = dot( dp1, dp2perp );
+
+    if (abs(det) < 1e-20)
+        return N;
+
+    float3 gradU = (dp2perp * duv1.x + dp1perp * duv2.x) / det;
+    float3 gradV = (dp2perp * duv1.y + dp1perp * duv2.y) / det;
+
+    return normalize(N - displacementMagnitude * (dh.x * gradU + dh.y * gradV));
+}
+
+Point pointWithNormal(float3 positionWorld, float3 normalWorld, float4 tangentWorld)
 {
     Point pt;
     pt.positionWorld = positionWorld;
 	pt.normalWorld   = normalWorld;
 
-    float3 p = pt.positionWorld;
-
-    // get edge vectors of the pixel triangle
-    float3 dp1  =  ddx_fine( p );
-    float3 dp2  = -ddy_fine( p );
-
-    reconstructTangentFrame(pt, uv, dp1, dp2);
+    orthogonalTangentFrame(pt, tangentWorld);
 
     return pt;
 }
@@ -538,7 +590,29 @@ float3 colorize(float x, float min, float max)
     }
 }
 
-float3 lighting(float3 positionWorld, float3 normalWorld, float2 uv)
+// Which terms lightingSplit() evaluates
+static const uint LightingDiffuse  = 1;
+static const uint LightingSpecular = 2;
+static const uint LightingAll      = LightingDiffuse | LightingSpecular;
+
+// Shadow terms of this many first lights can be stored in a texture, so
+// they can be computed once and reused for both eyes.
+static const uint StoredShadowLights = 4;
+
+float3 eyePosition(float eye)
+{
+    return (eye > 0.5) ? rightCameraPosition.xyz : cameraPosition.xyz;
+}
+
+// The shadow terms of the first StoredShadowLights lights are returned
+// in shadowTerms. If useStoredShadows is true, they are not computed
+// but taken from shadowTerms instead. The tangent is the interpolated
+// vertex tangent, with the sign of the bitangent in w.
+Radiance lightingSplit(float3 positionWorld, float3 normalWorld, float4 tangentWorld, float2 uv,
+                       uint terms,
+                       bool useStoredShadows,
+                       inout float4 shadowTerms,
+                       float eye = 0)
 {
     static const float dielectricF0 = 0.04;
 
@@ -551,29 +625,66 @@ float3 lighting(float3 positionWorld, float3 normalWorld, float2 uv)
     {
     default:
     case NormalInterpolated:
-        pt = pointWithNormal(positionWorld, normalWorld, uv);
+        pt = pointWithNormal(positionWorld, normalWorld, tangentWorld);
         break;
     case NormalReconstructed:
-        pt = pointReconstructNormal(positionWorld, uv);
+        pt = pointReconstructNormal(positionWorld, tangentWorld);
         break;
     case NormalConstant:
-        pt = pointWithNormal(positionWorld, ConstantUp, uv);
+        pt = pointWithNormal(positionWorld, ConstantUp, tangentWorld);
+        break;
+    case NormalDisplaced:
+        pt = pointWithNormal(positionWorld,
+                             displacedNormal(positionWorld,
+                                             flatDisplacementBase ? ConstantUp : normalWorld,
+                                             uv),
+                             tangentWorld);
         break;
     }
 
-    Lighting lighting = computeLightingEnvironment(mat, pt, cameraPosition.xyz);
+    Lighting lighting = computeLightingEnvironment(mat, pt, eyePosition(eye));
+
+    if (!(terms & LightingDiffuse))
+        lighting.diffuseCoeff = 0;
 
-    float3 radianceHDR = ambientLight.rgb * lighting.diffuseCoeff;
+    Radiance radianceHDR;
+    radianceHDR.diffuse  = ambientLight.rgb * lighting.diffuseCoeff;
+    radianceHDR.specular = 0;
+
+    float stored[StoredShadowLights] = { shadowTerms.x, shadowTerms.y, shadowTerms.z, shadowTerms.w };
 
     for (uint i = 0; i < numLights; ++i)
     {
         Light light = lights[i];
-        float shadowTerm = evaluateShadowTerm(pt, light, i);
-        float3 lightRadianceHDR = evaluateLight(mat, lighting, light, shadowTerm);
-        radianceHDR += lightRadianceHDR;
+        float shadowTerm;
+        if (useStoredShadows && i < StoredShadowLights)
+        {
+            shadowTerm = stored[i];
+        }
+        else
+        {
+            shadowTerm = evaluateShadowTerm(pt, light, i);
+            if (i < StoredShadowLights)
+                stored[i] = shadowTerm;
+        }
+
+        Radiance lightRadianceHDR = evaluateLightSplit(mat, lighting, light, shadowTerm,
+                                                       (terms & LightingSpecular) != 0);
+        radianceHDR.diffuse  += lightRadianceHDR.diffuse;
+        radianceHDR.specular += lightRadianceHDR.specular;
     }
 
+    shadowTerms = float4(stored[0], stored[1], stored[2], stored[3]);
+
     return radianceHDR;
 }
 
+float3 lighting(float3 positionWorld, float3 normalWorld, float4 tangentWorld, float2 uv, float eye = 0)
+{
+    float4 shadowTerms = 1;
+    Radiance radianceHDR = lightingSplit(positionWorld, normalWorld, tangentWorld, uv,
+                                         LightingAll, false, shadowTerms, eye);
+    return radianceHDR.diffuse + radianceHDR.specular;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,39 @@
+#ifndef SVBRDF_LIGHTING_FEEDBACK_H_HLSL
+#define SVBRDF_LIGHTING_FEEDBACK_H_HLSL
+
+// Finest mip level each lighting tile is sampled at, cleared to 0xffffffff
+// every frame and read back by the CPU to decide which tiles to shade.
+RWStructuredBuffer<uint> lightingFeedback : register(u1);
+
+cbuffer FeedbackConstants : register(b2)
+{
+    float2 lightingMapSize;
+    float  tileSize;
+    uint   tilesX;
+    uint   tilesY;
+    // Pixel of each 2x2 quad that records feedback this frame
+    uint2  feedbackPixel;
+};
+
+void recordFeedback(Texture2D<float4> lightingMap, SamplerState smp, float2 pixel, float2 uv)
+{
+    // Needs derivatives, so compute before any divergent control flow.
+    float lod = lightingMap.CalculateLevelOfDetail(smp, uv);
+
+    // Only a quarter of the pixels record each frame, the CPU combines
+    // the feedback of several frames anyway.
+    if (any((uint2(pixel) & 1) != feedbackPixel))
+        return;
+
+    // The lighting maps are sampled with wrapping.
+    uint2 tile  = uint2(frac(uv) * lightingMapSize / tileSize);
+    tile        = min(tile, uint2(tilesX, tilesY) - 1);
+    uint  index = tile.y * tilesX + tile.x;
+    uint  level = uint(max(0, lod));
+
+    // Most pixels of a tile agree, so avoid the atomic when possible.
+    if (lightingFeedback[index] > level)
+        InterlockedMin(lightingFeedback[index], level);
+}
+
+#endif
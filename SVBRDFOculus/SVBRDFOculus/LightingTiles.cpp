@@ -0,0 +1,356 @@
+#include "LightingTiles.hpp"
+
+#include <algorithm>
+
+namespace
+{
+    // Default for how far a camera can move before its specular lighting
+    // is considered out of date, in world units.
+    const float DefaultCameraThreshold = 0.005f;
+
+    unsigned divideRoundUp(unsigned a, unsigned b)
+    {
+        return (a + b - 1) / b;
+    }
+}
+
+const uint32_t LightingFeedback::NotSampled;
+const unsigned LightingTileScheduler::NotResident;
+
+LightingFeedback::LightingFeedback(unsigned tilesX, unsigned tilesY,
+                                   unsigned viewCount, unsigned history)
+    : tilesX(tilesX)
+    , tilesY(tilesY)
+    , views(std::max(1u, viewCount))
+    , combined(tilesX * tilesY, NotSampled)
+{
+    for (auto &v : views)
+    {
+        v.frames.resize(std::max(1u, history));
+        v.next    = 0;
+        v.count   = 0;
+        v.sampled = 0;
+        v.aggregated.resize(tileCount(), NotSampled);
+    }
+}
+
+void LightingFeedback::add(unsigned view, const uint32_t *tileLevels)
+{
+    auto &v = views.at(view);
+
+    v.frames[v.next].assign(tileLevels, tileLevels + tileCount());
+    v.next  = (v.next + 1) % v.frames.size();
+    v.count = std::min(v.count + 1, static_cast<unsigned>(v.frames.size()));
+
+    aggregate(view);
+}
+
+bool LightingFeedback::hasFeedback(unsigned view) const
+{
+    return views.at(view).count > 0;
+}
+
+void LightingFeedback::aggregate(unsigned view)
+{
+    auto &v = views[view];
+
+    std::vector<uint32_t> finest(tileCount(), NotSampled);
+    for (unsigned f = 0; f < v.count; ++f)
+    {
+        auto &frame = v.frames[f];
+        for (unsigned t = 0; t < tileCount(); ++t)
+            finest[t] = std::min(finest[t], frame[t]);
+    }
+
+    v.sampled = static_cast<unsigned>(
+        std::count_if(finest.begin(), finest.end(),
+                      [] (uint32_t l) { return l != NotSampled; }));
+
+    // Tiles next to sampled ones are likely to come into view soon.
+    v.aggregated = finest;
+    for (unsigned y = 0; y < tilesY; ++y)
+    {
+        for (unsigned x = 0; x < tilesX; ++x)
+        {
+            uint32_t l = finest[y * tilesX + x];
+            if (l == NotSampled)
+                continue;
+
+            unsigned x0 = (x > 0) ? x - 1 : x;
+            unsigned y0 = (y > 0) ? y - 1 : y;
+            unsigned x1 = std::min(x + 1, tilesX - 1);
+            unsigned y1 = std::min(y + 1, tilesY - 1);
+
+            for (unsigned ny = y0; ny <= y1; ++ny)
+            {
+                for (unsigned nx = x0; nx <= x1; ++nx)
+                {
+                    auto &n = v.aggregated[ny * tilesX + nx];
+                    n = std::min(n, l + 1);
+                }
+            }
+        }
+    }
+
+    for (unsigned t = 0; t < tileCount(); ++t)
+    {
+        uint32_t l = NotSampled;
+        for (auto &w : views)
+            l = std::min(l, w.aggregated[t]);
+        combined[t] = l;
+    }
+}
+
+LightingTileScheduler::LightingTileScheduler(unsigned width, unsigned height,
+                                             unsigned viewCount, unsigned levels,
+                                             unsigned tileSize)
+    : size(std::max(1u, tileSize))
+    , columns(0)
+    , rows(0)
+    , levelCount(std::max(1u, levels))
+    , cameraDistance(DefaultCameraThreshold)
+    , hasLightingHash(false)
+    , lightingHash(0)
+    , views(std::max(1u, viewCount))
+{
+    columns = divideRoundUp(width,  size);
+    rows    = divideRoundUp(height, size);
+
+    for (unsigned y = 0; y < height; y += size)
+    {
+        for (unsigned x = 0; x < width; x += size)
+        {
+            Tile t;
+            t.rect.x0 = x;
+            t.rect.y0 = y;
+            t.rect.x1 = std::min(width,  x + size);
+            t.rect.y1 = std::min(height, y + size);
+            t.diffuseLevel = NotResident;
+            t.diffuseDirty = true;
+            t.specularLevel.resize(views.size());
+            t.specularDirty.resize(views.size());
+            t.lastShaded.resize(views.size());
+            tiles.emplace_back(std::move(t));
+        }
+    }
+
+    invalidate();
+}
+
+LightingTileScheduler::Rect LightingTileScheduler::tileRect(unsigned tile) const
+{
+    return tiles.at(tile).rect;
+}
+
+LightingTileScheduler::Rect LightingTileScheduler::tileRect(unsigned tile, unsigned level) const
+{
+    Rect r = tiles.at(tile).rect;
+    unsigned scale = 1u << level;
+
+    r.x0 = r.x0 / scale;
+    r.y0 = r.y0 / scale;
+    r.x1 = divideRoundUp(r.x1, scale);
+    r.y1 = divideRoundUp(r.y1, scale);
+
+    return r;
+}
+
+void LightingTileScheduler::invalidate()
+{
+    for (auto &v : views)
+    {
+        v.hasCamera = false;
+        v.frame     = 0;
+    }
+
+    for (auto &t : tiles)
+    {
+        t.diffuseLevel = NotResident;
+        t.diffuseDirty = true;
+        std::fill(t.specularLevel.begin(), t.specularLevel.end(), NotResident);
+        std::fill(t.specularDirty.begin(), t.specularDirty.end(), true);
+        std::fill(t.lastShaded.begin(),    t.lastShaded.end(),    0);
+    }
+
+    hasLightingHash = false;
+    lastStats = Stats();
+    lastStats.tiles = tileCount();
+}
+
+void LightingTileScheduler::update(unsigned view, const Inputs &inputs)
+{
+    auto &v = views.at(view);
+
+    if (!hasLightingHash || inputs.lightingHash != lightingHash)
+    {
+        // Lights and materials affect both terms for every view.
+        for (auto &t : tiles)
+        {
+            t.diffuseDirty = true;
+            std::fill(t.specularDirty.begin(), t.specularDirty.end(), true);
+        }
+
+        hasLightingHash = true;
+        lightingHash    = inputs.lightingHash;
+    }
+
+    float distanceSquared = 0;
+    for (unsigned i = 0; i < 3; ++i)
+    {
+        float d = inputs.cameraPosition[i] - v.cameraPosition[i];
+        distanceSquared += d * d;
+    }
+
+    if (!v.hasCamera || distanceSquared > cameraDistance * cameraDistance)
+    {
+        for (auto &t : tiles)
+            t.specularDirty[view] = true;
+
+        v.hasCamera = true;
+        std::copy(inputs.cameraPosition, inputs.cameraPosition + 3, v.cameraPosition);
+    }
+}
+
+std::vector<LightingTileScheduler::TileUpdate> LightingTileScheduler::schedule(unsigned view, uint64_t texelBudget,
+                                                                               const LightingFeedback *feedback)
+{
+    auto &v = views.at(view);
+    ++v.frame;
+
+    if (feedback && !feedback->hasFeedback(view))
+        feedback = nullptr;
+
+    struct Candidate
+    {
+        unsigned tile;
+        bool     forced;
+        bool     diffuse;
+        unsigned level;
+        uint64_t lastShaded;
+    };
+
+    std::vector<Candidate> candidates;
+
+    lastStats = Stats();
+    lastStats.tiles = tileCount();
+
+    for (unsigned i = 0; i < tileCount(); ++i)
+    {
+        auto &t = tiles[i];
+
+        lastStats.fullResolutionTexels += t.rect.texels();
+
+        Candidate c;
+        c.tile       = i;
+        c.lastShaded = t.lastShaded[view];
+
+        if (t.diffuseLevel == NotResident || t.specularLevel[view] == NotResident)
+        {
+            // Nothing at all to display yet, so shade regardless of visibility.
+            c.forced  = true;
+            c.diffuse = t.diffuseLevel == NotResident || t.diffuseDirty;
+            c.level   = 0;
+            candidates.emplace_back(c);
+            continue;
+        }
+
+        unsigned requested = feedback ? feedback->level(view, i) : 0;
+        if (requested == LightingFeedback::NotSampled)
+            continue;
+
+        requested = std::min(requested, levelCount - 1);
+
+        ++lastStats.visibleTiles;
+        lastStats.requestedTexels += tileRect(i, requested).texels();
+
+        bool diffuse  = t.diffuseDirty        || t.diffuseLevel        > requested;
+        bool specular = t.specularDirty[view] || t.specularLevel[view] > requested;
+
+        if (!diffuse && !specular)
+            continue;
+
+        c.forced  = false;
+        c.diffuse = diffuse;
+        c.level   = requested;
+
+        // The diffuse lighting is shared, so shade it finely enough for all views.
+        if (diffuse && feedback)
+            c.level = std::min(c.level, std::min(feedback->level(i), levelCount - 1));
+
+        candidates.emplace_back(c);
+    }
+
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [] (const Candidate &a, const Candidate &b)
+    {
+        if (a.forced != b.forced)
+            return a.forced;
+        if (a.diffuse != b.diffuse)
+            return a.diffuse;
+        return a.lastShaded < b.lastShaded;
+    });
+
+    std::vector<TileUpdate> updates;
+    uint64_t texels = 0;
+
+    for (auto &c : candidates)
+    {
+        auto &t = tiles[c.tile];
+        uint64_t tileTexels = tileRect(c.tile, c.level).texels();
+
+        if (!c.forced && !updates.empty() && texels + tileTexels > texelBudget)
+            break;
+
+        TileUpdate u;
+        u.tile    = c.tile;
+        u.rect    = t.rect;
+        u.shading = c.diffuse ? Shading::DiffuseAndSpecular : Shading::Specular;
+        u.level   = c.level;
+        updates.emplace_back(u);
+
+        texels += tileTexels;
+
+        if (c.diffuse)
+        {
+            t.diffuseLevel = c.level;
+            t.diffuseDirty = false;
+        }
+        t.specularLevel[view] = c.level;
+        t.specularDirty[view] = false;
+        t.lastShaded[view]    = v.frame;
+    }
+
+    lastStats.shadedTiles  = static_cast<unsigned>(updates.size());
+    lastStats.shadedTexels = texels;
+
+    uint64_t oldest = v.frame;
+    for (auto &t : tiles)
+    {
+        if (t.diffuseDirty)
+            ++lastStats.diffuseDirty;
+        if (t.specularDirty[view])
+            ++lastStats.specularDirty;
+        if (t.diffuseDirty || t.specularDirty[view])
+            oldest = std::min(oldest, t.lastShaded[view]);
+    }
+    lastStats.oldestTileFrames = static_cast<unsigned>(v.frame - oldest);
+
+    return updates;
+}
+
+std::vector<unsigned> LightingTileScheduler::residency(unsigned view) const
+{
+    std::vector<unsigned> counts(levelCount + 1);
+
+    for (auto &t : tiles)
+    {
+        // Sampling needs both terms, so the coarser one decides.
+        unsigned level = std::max(t.diffuseLevel, t.specularLevel.at(view));
+        if (level == NotResident)
+            ++counts.back();
+        else
+            ++counts[std::min(level, levelCount - 1)];
+    }
+
+    return counts;
+}
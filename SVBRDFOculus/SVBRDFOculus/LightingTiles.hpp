@@ -0,0 +1,180 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Aggregates the sampling feedback of the texture space lighting maps. The
+// GPU records the finest mip level each tile is sampled at, per view, and the
+// results arrive a few frames later. Feedback is combined over a short history
+// and dilated to the neighbouring tiles to hide that latency.
+class LightingFeedback
+{
+public:
+    // Level of tiles that were not sampled, also used by the GPU for clearing.
+    static const uint32_t NotSampled = 0xffffffff;
+    static const unsigned DefaultHistory = 4;
+
+    LightingFeedback(unsigned tilesX = 0, unsigned tilesY = 0,
+                     unsigned views = 1, unsigned history = DefaultHistory);
+
+    // Add the feedback of a view for one frame, one level per tile.
+    void add(unsigned view, const uint32_t *tileLevels);
+
+    bool hasFeedback(unsigned view) const;
+
+    // Finest level the view needs for the tile, or NotSampled. Tiles next
+    // to sampled ones are requested one level coarser than their neighbour.
+    uint32_t level(unsigned view, unsigned tile) const { return views.at(view).aggregated[tile]; }
+    // Finest level any view needs for the tile.
+    uint32_t level(unsigned tile) const { return combined.at(tile); }
+
+    unsigned tileCount() const { return tilesX * tilesY; }
+    // Tiles the view has sampled during the history, without the dilation.
+    unsigned sampledTiles(unsigned view) const { return views.at(view).sampled; }
+
+private:
+    struct ViewFeedback
+    {
+        std::vector<std::vector<uint32_t>> frames;
+        unsigned next;
+        unsigned count;
+        unsigned sampled;
+        std::vector<uint32_t> aggregated;
+    };
+
+    unsigned tilesX;
+    unsigned tilesY;
+    std::vector<ViewFeedback> views;
+    std::vector<uint32_t> combined;
+
+    void aggregate(unsigned view);
+};
+
+// Bookkeeping for the tiles of the texture space lighting maps. Tracks which
+// tiles have out of date lighting and picks the ones to shade each frame
+// within a texel budget, so relighting is amortized over several frames.
+// The diffuse term is view independent and shared by all views, whereas the
+// specular term is tracked separately for every view. With feedback, only
+// the tiles a view actually samples are relit, at the mip level it needs.
+class LightingTileScheduler
+{
+public:
+    static const unsigned DefaultTileSize = 256;
+    // Level of tiles without any valid lighting.
+    static const unsigned NotResident = 0xffffffff;
+
+    enum class Shading
+    {
+        DiffuseAndSpecular,
+        Specular,
+    };
+
+    // Texel rectangle, the maximum coordinates are exclusive.
+    struct Rect
+    {
+        unsigned x0, y0;
+        unsigned x1, y1;
+
+        uint64_t texels() const { return uint64_t(x1 - x0) * (y1 - y0); }
+    };
+
+    struct TileUpdate
+    {
+        unsigned tile;
+        Rect     rect;    // at mip level 0
+        Shading  shading;
+        unsigned level;   // mip level to shade at
+    };
+
+    // Everything the lighting of a single view depends on.
+    struct Inputs
+    {
+        // Hash of the view independent inputs, i.e. the lights, shadows and
+        // material parameters. Any change relights the whole map.
+        uint64_t lightingHash;
+        // Only moving the camera by more than the camera threshold
+        // invalidates the specular term of the view.
+        float cameraPosition[3];
+    };
+
+    struct Stats
+    {
+        unsigned tiles;
+        unsigned visibleTiles;         // tiles the view samples according to the feedback
+        unsigned diffuseDirty;         // tiles still waiting for diffuse lighting
+        unsigned specularDirty;        // tiles still waiting for specular lighting of the view
+        unsigned shadedTiles;          // tiles picked by the last schedule() call
+        uint64_t shadedTexels;
+        uint64_t requestedTexels;      // texels of the visible tiles at their requested levels
+        uint64_t fullResolutionTexels; // texels of all tiles at level 0
+        unsigned oldestTileFrames;     // frames since the stalest dirty tile of the view was shaded
+    };
+
+    LightingTileScheduler(unsigned width = 0, unsigned height = 0,
+                          unsigned views = 1, unsigned levels = 1,
+                          unsigned tileSize = DefaultTileSize);
+
+    unsigned tileCount() const { return static_cast<unsigned>(tiles.size()); }
+    unsigned tilesX() const { return columns; }
+    unsigned tilesY() const { return rows; }
+    unsigned tileSize() const { return size; }
+    unsigned levels() const { return levelCount; }
+    Rect tileRect(unsigned tile) const;
+    // Texels covered by the tile on the given mip level, rounded outwards.
+    Rect tileRect(unsigned tile, unsigned level) const;
+
+    float cameraThreshold() const { return cameraDistance; }
+    void setCameraThreshold(float distance) { cameraDistance = distance; }
+
+    // Forget all lighting, so every tile gets shaded again without regard
+    // to the budget.
+    void invalidate();
+
+    // Compare the inputs of a view against the previous ones, and mark
+    // the tiles dirty accordingly.
+    void update(unsigned view, const Inputs &inputs);
+
+    // Pick the tiles to shade for the view this frame, and consider them shaded.
+    // Tiles that have never been shaded are always included at full resolution,
+    // the rest are picked until the texel budget runs out, diffuse relighting
+    // first and then the least recently shaded tiles. At least one dirty tile
+    // is always picked so a small budget cannot stall the updates.
+    // Without feedback for the view, every tile is considered visible at level 0.
+    std::vector<TileUpdate> schedule(unsigned view, uint64_t texelBudget,
+                                     const LightingFeedback *feedback = nullptr);
+
+    const Stats &stats() const { return lastStats; }
+
+    // Amount of tiles whose lighting for the view is valid down to each mip
+    // level. The last element counts the tiles without valid lighting.
+    std::vector<unsigned> residency(unsigned view) const;
+
+private:
+    struct ViewState
+    {
+        bool     hasCamera;
+        float    cameraPosition[3];
+        uint64_t frame;
+    };
+
+    struct Tile
+    {
+        Rect     rect;
+        unsigned diffuseLevel;
+        bool     diffuseDirty;
+        std::vector<unsigned> specularLevel;
+        std::vector<bool>     specularDirty;
+        std::vector<uint64_t> lastShaded;
+    };
+
+    unsigned size;
+    unsigned columns;
+    unsigned rows;
+    unsigned levelCount;
+    float    cameraDistance;
+    bool     hasLightingHash;
+    uint64_t lightingHash;
+    std::vector<ViewState> views;
+    std::vector<Tile> tiles;
+    Stats lastStats;
+};
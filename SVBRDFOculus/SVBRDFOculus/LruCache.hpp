@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <utility>
+
+// Values that are expensive to rebuild, kept in memory up to a budget of
+// bytes, and dropped least recently used first when it is exceeded. The
+// caller gives the size of each value, which may include memory the value
+// only references, e.g. GPU buffers. Keys need operator<.
+template <typename Key, typename Value>
+class LruCache
+{
+public:
+    struct Stats
+    {
+        uint64_t bytes;      // size of the cached values
+        uint64_t hits;       // finds that returned a value
+        uint64_t misses;     // finds that did not
+        uint64_t evictions;  // values dropped to stay in the budget
+    };
+
+    explicit LruCache(uint64_t maxBytes)
+        : budget(maxBytes)
+    {
+        counts = Stats();
+    }
+
+    // The value of the key, which becomes the most recently used one,
+    // or nullptr if it is not cached. The pointer stays valid until the
+    // value is evicted.
+    Value *find(const Key &key)
+    {
+        auto it = index.find(key);
+        if (it == index.end())
+        {
+            ++counts.misses;
+            return nullptr;
+        }
+
+        ++counts.hits;
+        entries.splice(entries.begin(), entries, it->second);
+        return &it->second->value;
+    }
+
+    // Cache the value as the most recently used one, replacing any earlier
+    // value of the key, and evict the least recently used values until the
+    // rest fit the budget. A value larger than the whole budget is not
+    // cached, and false is returned.
+    bool insert(const Key &key, Value value, uint64_t bytes)
+    {
+        erase(key);
+
+        if (bytes > budget)
+            return false;
+
+        entries.push_front(Entry { key, std::move(value), bytes });
+        index.emplace(key, entries.begin());
+        counts.bytes += bytes;
+
+        evict(budget);
+        return true;
+    }
+
+    void erase(const Key &key)
+    {
+        auto it = index.find(key);
+        if (it == index.end())
+            return;
+
+        counts.bytes -= it->second->bytes;
+        entries.erase(it->second);
+        index.erase(it);
+    }
+
+    void clear()
+    {
+        entries.clear();
+        index.clear();
+        counts.bytes = 0;
+    }
+
+    void setMaxBytes(uint64_t maxBytes)
+    {
+        budget = maxBytes;
+        evict(budget);
+    }
+
+    uint64_t maxBytes() const { return budget; }
+    size_t size() const { return entries.size(); }
+    const Stats &stats() const { return counts; }
+
+private:
+    struct Entry
+    {
+        Key key;
+        Value value;
+        uint64_t bytes;
+    };
+
+    void evict(uint64_t maxBytes)
+    {
+        while (counts.bytes > maxBytes)
+        {
+            assert(!entries.empty());
+            auto &last = entries.back();
+            counts.bytes -= last.bytes;
+            index.erase(last.key);
+            entries.pop_back();
+            ++counts.evictions;
+        }
+    }
+
+    // Most recently used first.
+    std::list<Entry> entries;
+    std::map<Key, typename std::list<Entry>::iterator> index;
+    uint64_t budget;
+    Stats counts;
+};
@@ -0,0 +1,575 @@
+#include "MeshSimplifier.hpp"
+#include "Parallel.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+
+namespace
+{
+    const uint32_t Invalid = ~0u;
+
+    // Normals of triangles that would turn by more than about 75 degrees
+    // count as turning over.
+    const float MinNormalCosine = .25f;
+
+    // The open edges also get planes perpendicular to their triangles, so
+    // that the borders and seams do not move away from themselves.
+    const float OpenEdgeWeight = 2.f;
+
+    void subtract(const float *a, const float *b, float r[3])
+    {
+        r[0] = a[0] - b[0];
+        r[1] = a[1] - b[1];
+        r[2] = a[2] - b[2];
+    }
+
+    void cross(const float a[3], const float b[3], float r[3])
+    {
+        r[0] = a[1] * b[2] - a[2] * b[1];
+        r[1] = a[2] * b[0] - a[0] * b[2];
+        r[2] = a[0] * b[1] - a[1] * b[0];
+    }
+
+    float dot(const float a[3], const float b[3])
+    {
+        return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+    }
+
+    struct PositionKey
+    {
+        float p[3];
+
+        bool operator==(const PositionKey &other) const
+        {
+            return std::memcmp(p, other.p, sizeof(p)) == 0;
+        }
+    };
+
+    struct PositionHash
+    {
+        size_t operator()(const PositionKey &k) const
+        {
+            uint32_t bits[3];
+            std::memcpy(bits, k.p, sizeof(bits));
+            return (bits[0] * 73856093u) ^ (bits[1] * 19349663u) ^ (bits[2] * 83492791u);
+        }
+    };
+}
+
+MeshSimplifier::MeshSimplifier(const Mesh &mesh)
+    : positions(mesh.positions)
+    , stride(mesh.stride)
+    , vertexCount(mesh.vertexCount)
+    , adjacencyValid(false)
+    , maxError(0)
+    , passCount(0)
+{
+    assert(mesh.stride >= 3 && mesh.indexCount % 3 == 0);
+
+    // Triangles that are already degenerate would only get in the way.
+    current.reserve(mesh.indexCount);
+    for (size_t i = 0; i < mesh.indexCount; i += 3)
+    {
+        uint32_t a = mesh.indices[i + 0];
+        uint32_t b = mesh.indices[i + 1];
+        uint32_t c = mesh.indices[i + 2];
+        assert(a < vertexCount && b < vertexCount && c < vertexCount);
+
+        if (a != b && b != c && a != c)
+        {
+            current.push_back(a);
+            current.push_back(b);
+            current.push_back(c);
+        }
+    }
+
+    wedges.resize(vertexCount);
+    {
+        std::unordered_map<PositionKey, uint32_t, PositionHash> first(vertexCount);
+        for (uint32_t v = 0; v < vertexCount; ++v)
+        {
+            PositionKey key;
+            std::memcpy(key.p, position(v), sizeof(key.p));
+
+            auto inserted = first.emplace(key, v);
+            if (inserted.second)
+            {
+                wedges[v] = v;
+            }
+            else
+            {
+                uint32_t f = inserted.first->second;
+                wedges[v]  = wedges[f];
+                wedges[f]  = v;
+            }
+        }
+    }
+
+    buildAdjacency();
+
+    openIns.resize(vertexCount);
+    openOuts.resize(vertexCount);
+    parallelFor(0, vertexCount, [&](size_t v)
+    {
+        openEdges(static_cast<uint32_t>(v), openIns[v], openOuts[v]);
+    }, 1024);
+
+    kinds.resize(vertexCount);
+    quadrics.resize(vertexCount);
+    parallelFor(0, vertexCount, [&](size_t vIndex)
+    {
+        uint32_t v = static_cast<uint32_t>(vIndex);
+
+        uint32_t in  = openIns[v];
+        uint32_t out = openOuts[v];
+        auto single = [](uint32_t other, uint32_t self) { return other != Invalid && other != self; };
+
+        Kind kind = Kind::Locked;
+        if (cornerStart[v] == cornerStart[v + 1])
+        {
+            kind = Kind::Locked;
+        }
+        else if (wedges[v] == v)
+        {
+            // Edges that copies of the vertices close, like the ones to the
+            // separate pole vertices of each column of a UV sphere, are not
+            // borders. Collapsing across them would only flatten triangles
+            // onto the other copies, which keepsOrientation() rejects.
+            bool closedIn  = in == Invalid || (single(in, v) && closedByPosition(in, v));
+            bool closedOut = out == Invalid || (single(out, v) && closedByPosition(v, out));
+            if (closedIn && closedOut)
+                kind = Kind::Manifold;
+            else if (!closedIn && !closedOut && single(in, v) && single(out, v))
+                kind = Kind::Border;
+        }
+        else if (wedges[wedges[v]] == v)
+        {
+            // The open edges of the two sides of a seam run in opposite
+            // directions between the same positions.
+            uint32_t w = wedges[v];
+            if (single(in, v) && single(out, v) &&
+                single(openIns[w], w) && single(openOuts[w], w) &&
+                samePosition(in, openOuts[w]) && samePosition(out, openIns[w]))
+            {
+                kind = Kind::Seam;
+            }
+        }
+        kinds[v] = kind;
+
+        Quadric &q = quadrics[v];
+        std::memset(&q, 0, sizeof(q));
+
+        for (uint32_t k = cornerStart[v]; k < cornerStart[v + 1]; ++k)
+        {
+            uint32_t c = corners[k];
+            const uint32_t *tri = current.data() + c / 3 * 3;
+            uint32_t next = tri[(c + 1) % 3];
+            uint32_t prev = tri[(c + 2) % 3];
+
+            float e1[3], e2[3], n[3];
+            subtract(position(next), position(v), e1);
+            subtract(position(prev), position(v), e2);
+            cross(e1, e2, n);
+
+            float length = std::sqrt(dot(n, n));
+            if (length == 0)
+                continue;
+            for (auto &x : n)
+                x /= length;
+
+            addPlane(q, n, -dot(n, position(v)), .5f * length);
+
+            // Both the edge from v and the edge to it can be open.
+            const uint32_t ends[2][2] = { { v, next }, { prev, v } };
+            for (auto &end : ends)
+            {
+                uint32_t a = end[0];
+                uint32_t b = end[1];
+
+                if (kind == Kind::Manifold || hasEdge(b, a))
+                    continue;
+
+                float e[3], m[3];
+                subtract(position(b), position(a), e);
+                cross(e, n, m);
+                float mLength = std::sqrt(dot(m, m));
+                if (mLength == 0)
+                    continue;
+                for (auto &x : m)
+                    x /= mLength;
+
+                addPlane(q, m, -dot(m, position(a)), OpenEdgeWeight * dot(e, e));
+            }
+        }
+    }, 1024);
+}
+
+size_t MeshSimplifier::simplify(size_t targetTriangles, float maxAllowedError)
+{
+    std::vector<Collapse> best(vertexCount);
+    std::vector<Collapse> order;
+    std::vector<Collapse> selected;
+    std::vector<uint32_t> remap(vertexCount);
+
+    // Only the vertices whose triangles changed in the previous pass need
+    // their open edges and collapses found again. Those are the ones next
+    // to the collapses, which are marked as touched.
+    std::vector<uint8_t> touched(vertexCount, 1);
+
+    float maxCost = maxAllowedError * maxAllowedError;
+
+    while (triangleCount() > targetTriangles)
+    {
+        if (!adjacencyValid)
+            buildAdjacency();
+
+        parallelFor(0, vertexCount, [&](size_t v)
+        {
+            if (touched[v])
+                openEdges(static_cast<uint32_t>(v), openIns[v], openOuts[v]);
+        }, 1024);
+
+        // The collapses of a seam also depend on the other side of it.
+        parallelFor(0, vertexCount, [&](size_t v)
+        {
+            if (touched[v] || (kinds[v] == Kind::Seam && touched[wedges[v]]))
+                best[v] = bestCollapse(static_cast<uint32_t>(v));
+        }, 1024);
+
+        order.clear();
+        for (auto &c : best)
+        {
+            if (c.to != Invalid && c.cost <= maxCost)
+                order.push_back(c);
+        }
+
+        std::sort(order.begin(), order.end(), [](const Collapse &a, const Collapse &b)
+        {
+            return a.cost < b.cost || (a.cost == b.cost && a.from < b.from);
+        });
+
+        // Only the cheapest third is considered in one pass, so that the
+        // collapses happen roughly in the order of their cost, even though
+        // the neighbors of each one wait for the next pass.
+        order.resize(std::min(order.size(), (order.size() + 2) / 3));
+
+        // The collapses of a pass must not share any triangles, so that they
+        // can be applied in parallel and still keep their orientations.
+        std::fill(touched.begin(), touched.end(), 0);
+        selected.clear();
+
+        size_t toRemove = triangleCount() - targetTriangles;
+        size_t removed  = 0;
+
+        auto untouched = [&](uint32_t v)
+        {
+            for (uint32_t k = cornerStart[v]; k < cornerStart[v + 1]; ++k)
+            {
+                const uint32_t *tri = current.data() + corners[k] / 3 * 3;
+                if (touched[tri[0]] || touched[tri[1]] || touched[tri[2]])
+                    return false;
+            }
+            return true;
+        };
+
+        auto touch = [&](uint32_t v)
+        {
+            for (uint32_t k = cornerStart[v]; k < cornerStart[v + 1]; ++k)
+            {
+                const uint32_t *tri = current.data() + corners[k] / 3 * 3;
+                touched[tri[0]] = touched[tri[1]] = touched[tri[2]] = 1;
+            }
+        };
+
+        for (auto &c : order)
+        {
+            if (removed >= toRemove)
+                break;
+
+            bool seam = kinds[c.from] == Kind::Seam;
+            uint32_t w = wedges[c.from];
+
+            if (!untouched(c.from) || (seam && !untouched(w)))
+                continue;
+
+            touch(c.from);
+            if (seam)
+                touch(w);
+
+            selected.push_back(c);
+            removed += c.removedTriangles;
+        }
+
+        if (selected.empty())
+            break;
+
+        for (uint32_t v = 0; v < vertexCount; ++v)
+            remap[v] = v;
+
+        parallelFor(0, selected.size(), [&](size_t i)
+        {
+            const Collapse &c = selected[i];
+            remap[c.from] = c.to;
+            add(quadrics[c.to], quadrics[c.from]);
+
+            if (kinds[c.from] == Kind::Seam)
+            {
+                uint32_t w  = wedges[c.from];
+                uint32_t to = c.to == openOuts[c.from] ? openIns[w] : openOuts[w];
+                remap[w] = to;
+                add(quadrics[to], quadrics[w]);
+            }
+        }, 256);
+
+        for (auto &c : selected)
+            maxError = std::max(maxError, std::sqrt(c.cost));
+
+        // Remap the corners and drop the triangles that collapsed.
+        size_t triangles = triangleCount();
+        std::vector<uint8_t> keep(triangles);
+        parallelFor(0, triangles, [&](size_t t)
+        {
+            uint32_t *tri = current.data() + t * 3;
+            tri[0] = remap[tri[0]];
+            tri[1] = remap[tri[1]];
+            tri[2] = remap[tri[2]];
+            keep[t] = tri[0] != tri[1] && tri[1] != tri[2] && tri[0] != tri[2];
+        }, 4096);
+
+        size_t kept = 0;
+        for (size_t t = 0; t < triangles; ++t)
+        {
+            if (!keep[t])
+                continue;
+            if (kept != t)
+                std::copy(current.begin() + t * 3, current.begin() + t * 3 + 3, current.begin() + kept * 3);
+            ++kept;
+        }
+        current.resize(kept * 3);
+
+        adjacencyValid = false;
+        ++passCount;
+    }
+
+    return triangleCount();
+}
+
+void MeshSimplifier::addPlane(Quadric &q, const float n[3], float d, float weight)
+{
+    q.a00 += weight * n[0] * n[0];
+    q.a11 += weight * n[1] * n[1];
+    q.a22 += weight * n[2] * n[2];
+    q.a01 += weight * n[0] * n[1];
+    q.a02 += weight * n[0] * n[2];
+    q.a12 += weight * n[1] * n[2];
+    q.b0  += weight * n[0] * d;
+    q.b1  += weight * n[1] * d;
+    q.b2  += weight * n[2] * d;
+    q.c   += weight * d * d;
+    q.weight += weight;
+}
+
+void MeshSimplifier::add(Quadric &q, const Quadric &other)
+{
+    q.a00 += other.a00;
+    q.a11 += other.a11;
+    q.a22 += other.a22;
+    q.a01 += other.a01;
+    q.a02 += other.a02;
+    q.a12 += other.a12;
+    q.b0  += other.b0;
+    q.b1  += other.b1;
+    q.b2  += other.b2;
+    q.c   += other.c;
+    q.weight += other.weight;
+}
+
+float MeshSimplifier::evaluate(const Quadric &q, const float p[3])
+{
+    float x = p[0];
+    float y = p[1];
+    float z = p[2];
+
+    float r = q.a00 * x * x + q.a11 * y * y + q.a22 * z * z
+            + 2 * (q.a01 * x * y + q.a02 * x * z + q.a12 * y * z)
+            + 2 * (q.b0 * x + q.b1 * y + q.b2 * z)
+            + q.c;
+
+    // The squared distance, averaged over the planes.
+    return q.weight > 0 ? std::max(0.f, r) / q.weight : 0;
+}
+
+bool MeshSimplifier::samePosition(uint32_t a, uint32_t b) const
+{
+    return std::memcmp(position(a), position(b), 3 * sizeof(float)) == 0;
+}
+
+void MeshSimplifier::buildAdjacency()
+{
+    cornerStart.assign(vertexCount + 1, 0);
+    for (uint32_t v : current)
+        ++cornerStart[v + 1];
+    for (size_t v = 0; v < vertexCount; ++v)
+        cornerStart[v + 1] += cornerStart[v];
+
+    corners.resize(current.size());
+    {
+        std::vector<uint32_t> next(cornerStart.begin(), cornerStart.end() - 1);
+        for (size_t c = 0; c < current.size(); ++c)
+            corners[next[current[c]]++] = static_cast<uint32_t>(c);
+    }
+
+    adjacencyValid = true;
+}
+
+bool MeshSimplifier::hasEdge(uint32_t a, uint32_t b) const
+{
+    for (uint32_t k = cornerStart[a]; k < cornerStart[a + 1]; ++k)
+    {
+        uint32_t c = corners[k];
+        if (current[c / 3 * 3 + (c + 1) % 3] == b)
+            return true;
+    }
+    return false;
+}
+
+bool MeshSimplifier::closedByPosition(uint32_t a, uint32_t b) const
+{
+    uint32_t bCopy = b;
+    do
+    {
+        uint32_t aCopy = a;
+        do
+        {
+            if (hasEdge(bCopy, aCopy))
+                return true;
+            aCopy = wedges[aCopy];
+        } while (aCopy != a);
+        bCopy = wedges[bCopy];
+    } while (bCopy != b);
+
+    return false;
+}
+
+void MeshSimplifier::openEdges(uint32_t v, uint32_t &openIn, uint32_t &openOut) const
+{
+    openIn  = Invalid;
+    openOut = Invalid;
+
+    auto record = [&](uint32_t &edge, uint32_t other)
+    {
+        edge = (edge == Invalid || edge == other) ? other : v;
+    };
+
+    for (uint32_t k = cornerStart[v]; k < cornerStart[v + 1]; ++k)
+    {
+        uint32_t c = corners[k];
+        const uint32_t *tri = current.data() + c / 3 * 3;
+        uint32_t next = tri[(c + 1) % 3];
+        uint32_t prev = tri[(c + 2) % 3];
+
+        if (!hasEdge(next, v))
+            record(openOut, next);
+        if (!hasEdge(v, prev))
+            record(openIn, prev);
+    }
+}
+
+bool MeshSimplifier::keepsOrientation(uint32_t v, uint32_t t, uint32_t &removed) const
+{
+    const float *pv = position(v);
+    const float *pt = position(t);
+
+    removed = 0;
+    for (uint32_t k = cornerStart[v]; k < cornerStart[v + 1]; ++k)
+    {
+        uint32_t c = corners[k];
+        const uint32_t *tri = current.data() + c / 3 * 3;
+        uint32_t a = tri[(c + 1) % 3];
+        uint32_t b = tri[(c + 2) % 3];
+
+        if (a == t || b == t)
+        {
+            ++removed;
+            continue;
+        }
+
+        float ea[3], eb[3], n0[3], n1[3];
+        subtract(position(a), pv, ea);
+        subtract(position(b), pv, eb);
+        cross(ea, eb, n0);
+        subtract(position(a), pt, ea);
+        subtract(position(b), pt, eb);
+        cross(ea, eb, n1);
+
+        float l0 = dot(n0, n0);
+        if (l0 == 0)
+            continue;
+        if (dot(n0, n1) <= MinNormalCosine * std::sqrt(l0 * dot(n1, n1)))
+            return false;
+    }
+
+    return true;
+}
+
+MeshSimplifier::Collapse MeshSimplifier::bestCollapse(uint32_t v) const
+{
+    Collapse best = { v, Invalid, 0, 0 };
+
+    Kind kind = kinds[v];
+    if (kind == Kind::Locked || cornerStart[v] == cornerStart[v + 1])
+        return best;
+
+    // Only one side of a seam proposes its collapses.
+    uint32_t w = wedges[v];
+    if (kind == Kind::Seam && w < v)
+        return best;
+
+    Quadric q = quadrics[v];
+    if (kind == Kind::Seam)
+        add(q, quadrics[w]);
+
+    for (uint32_t k = cornerStart[v]; k < cornerStart[v + 1]; ++k)
+    {
+        uint32_t c = corners[k];
+        const uint32_t *tri = current.data() + c / 3 * 3;
+        const uint32_t candidates[2] = { tri[(c + 1) % 3], tri[(c + 2) % 3] };
+
+        for (uint32_t t : candidates)
+        {
+            uint32_t seamTarget = Invalid;
+            if (kind != Kind::Manifold)
+            {
+                bool alongOpenEdge = t == openOuts[v] || t == openIns[v];
+                if (!alongOpenEdge || openOuts[v] == v || openIns[v] == v)
+                    continue;
+            }
+            if (kind == Kind::Seam)
+            {
+                seamTarget = t == openOuts[v] ? openIns[w] : openOuts[w];
+                if (seamTarget == Invalid || seamTarget == w || !samePosition(seamTarget, t))
+                    continue;
+            }
+
+            float cost = evaluate(q, position(t));
+            if (best.to != Invalid && cost >= best.cost)
+                continue;
+
+            uint32_t removed     = 0;
+            uint32_t seamRemoved = 0;
+            if (!keepsOrientation(v, t, removed))
+                continue;
+            if (kind == Kind::Seam && !keepsOrientation(w, seamTarget, seamRemoved))
+                continue;
+
+            best.to   = t;
+            best.cost = cost;
+            best.removedTriangles = removed + seamRemoved;
+        }
+    }
+
+    return best;
+}
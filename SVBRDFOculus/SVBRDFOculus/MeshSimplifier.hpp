@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Simplification of triangle meshes by quadric error edge collapses, for
+// the LODs of the loaded meshes. The collapses move a vertex onto one of its
+// neighbors instead of creating new vertices, so the simplified meshes are
+// just new indices into the same vertices, and their UVs and other
+// attributes stay exact.
+//
+// UV seams and other attribute discontinuities show up as vertices that
+// share their position. Such vertices only collapse along the seam, and
+// together with their copy on the other side of it, so the seam does not
+// open. Borders of open meshes only collapse along themselves, and anything
+// more complicated stays put. Edges that are only open because the triangles
+// on their two sides use different copies of a vertex, like at the poles of
+// a UV sphere, are not borders.
+//
+// Each pass finds the cheapest collapse of every vertex in parallel, takes
+// the cheapest ones whose neighborhoods do not overlap, and applies them in
+// parallel, until the mesh has few enough triangles.
+class MeshSimplifier
+{
+public:
+    struct Mesh
+    {
+        // Consecutive positions are stride floats apart, so that they can
+        // point into an interleaved vertex buffer.
+        const float *positions;
+        size_t stride;
+        size_t vertexCount;
+        const uint32_t *indices;
+        size_t indexCount;
+    };
+
+    explicit MeshSimplifier(const Mesh &mesh);
+
+    // Continue simplifying until at most targetTriangles remain, or until
+    // no collapse is possible without an error over maxError. Returns the
+    // number of triangles. Calling it again with smaller targets gives
+    // successively coarser levels of detail.
+    size_t simplify(size_t targetTriangles, float maxError = 1e30f);
+
+    const std::vector<uint32_t> &indices() const { return current; }
+    size_t triangleCount() const { return current.size() / 3; }
+    // The largest distance from the original surface of the collapses so
+    // far, as estimated by the quadrics, in the units of the positions.
+    float error() const { return maxError; }
+    unsigned passes() const { return passCount; }
+
+private:
+    // Sum of squared distances to planes, weighted by area.
+    struct Quadric
+    {
+        float a00, a11, a22;
+        float a01, a02, a12;
+        float b0, b1, b2;
+        float c;
+        float weight;
+    };
+
+    enum class Kind : uint8_t
+    {
+        Manifold, // collapses in any direction
+        Border,   // collapses along the open border of the mesh
+        Seam,     // collapses along the seam, together with its copy
+        Locked,   // does not collapse
+    };
+
+    struct Collapse
+    {
+        uint32_t from;
+        uint32_t to;
+        float cost;
+        uint32_t removedTriangles;
+    };
+
+    static void addPlane(Quadric &q, const float n[3], float d, float weight);
+    static void add(Quadric &q, const Quadric &other);
+    static float evaluate(const Quadric &q, const float p[3]);
+
+    const float *position(uint32_t v) const { return positions + v * stride; }
+    bool samePosition(uint32_t a, uint32_t b) const;
+
+    void buildAdjacency();
+    bool hasEdge(uint32_t a, uint32_t b) const;
+    // Whether a triangle has the edge from b to a between any copies of
+    // them, so that the edge from a to b is closed even if it is open.
+    bool closedByPosition(uint32_t a, uint32_t b) const;
+    // The vertices at the other ends of the open edges to and from v, i.e.
+    // edges with no triangle on their other side. Invalid if there are none,
+    // and v itself if there are several.
+    void openEdges(uint32_t v, uint32_t &openIn, uint32_t &openOut) const;
+    // Whether moving v to the position of t keeps the triangles of v that do
+    // not contain t from turning over, and how many triangles do contain t.
+    bool keepsOrientation(uint32_t v, uint32_t t, uint32_t &removed) const;
+    Collapse bestCollapse(uint32_t v) const;
+
+    const float *positions;
+    size_t stride;
+    size_t vertexCount;
+
+    std::vector<uint32_t> current;
+    std::vector<Quadric> quadrics;
+    std::vector<Kind> kinds;
+    // The next vertex with the same position, in a cycle.
+    std::vector<uint32_t> wedges;
+    std::vector<uint32_t> openIns;
+    std::vector<uint32_t> openOuts;
+
+    // The corners of each vertex, as offsets into current.
+    std::vector<uint32_t> cornerStart;
+    std::vector<uint32_t> corners;
+    bool adjacencyValid;
+
+    float maxError;
+    unsigned passCount;
+};
@@ -0,0 +1,14 @@
+Texture2D<float4> overlay   : register(t0);
+SamplerState overlaySampler : register(s0);
+
+struct PSInput
+{
+    float4 color : COLOR0;
+    float2 uv    : TEXCOORD0;
+};
+
+// The overlay already has premultiplied alpha.
+float4 main(PSInput i) : SV_Target
+{
+    return overlay.Sample(overlaySampler, i.uv) * i.color;
+}
@@ -0,0 +1,177 @@
+#include "Parallel.hpp"
+
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    thread_local bool insideParallelFor = false;
+
+    class ThreadPool
+    {
+        std::vector<std::thread> workers;
+
+        std::mutex submitMutex;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+        uint64_t generation;
+        size_t pending;
+        bool quit;
+
+        const std::function<void(size_t)> *f;
+        size_t end;
+        size_t grainSize;
+        std::atomic<size_t> next;
+
+        void work()
+        {
+            for (;;)
+            {
+                size_t i = next.fetch_add(grainSize);
+                if (i >= end)
+                    break;
+
+                size_t chunkEnd = std::min(end, i + grainSize);
+                for (; i < chunkEnd; ++i)
+                    (*f)(i);
+            }
+        }
+
+        void workerLoop()
+        {
+            insideParallelFor = true;
+
+            uint64_t seenGeneration = 0;
+
+            for (;;)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake.wait(lock, [&] { return quit || generation != seenGeneration; });
+                    if (quit)
+                        return;
+                    seenGeneration = generation;
+                }
+
+                work();
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (--pending == 0)
+                        done.notify_one();
+                }
+            }
+        }
+
+    public:
+        ThreadPool()
+            : generation(0)
+            , pending(0)
+            , quit(false)
+            , f(nullptr)
+            , end(0)
+            , grainSize(1)
+            , next(0)
+        {
+            unsigned threads = hardwareThreads();
+            for (unsigned i = 1; i < threads; ++i)
+                workers.emplace_back([this] { workerLoop(); });
+        }
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                quit = true;
+            }
+            wake.notify_all();
+
+            for (auto &w : workers)
+                w.join();
+        }
+
+        bool run(size_t begin, size_t end, const std::function<void(size_t)> &f, size_t grainSize,
+                 const std::function<void()> *callerTask = nullptr)
+        {
+            if (workers.empty())
+                return false;
+
+            std::unique_lock<std::mutex> submit(submitMutex, std::try_to_lock);
+            if (!submit.owns_lock())
+                return false;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                this->f         = &f;
+                this->end       = end;
+                this->grainSize = grainSize;
+                next            = begin;
+                pending         = workers.size();
+                ++generation;
+            }
+            wake.notify_all();
+
+            insideParallelFor = true;
+            if (callerTask)
+                (*callerTask)();
+            work();
+            insideParallelFor = false;
+
+            // Wait for every worker to check in, so none of them can touch
+            // the job after we return.
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [&] { return pending == 0; });
+            this->f = nullptr;
+
+            return true;
+        }
+    };
+
+    ThreadPool &threadPool()
+    {
+        static ThreadPool pool;
+        return pool;
+    }
+}
+
+unsigned hardwareThreads()
+{
+    static unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    return threads;
+}
+
+void parallelFor(size_t begin, size_t end,
+                 const std::function<void(size_t)> &f,
+                 size_t grainSize)
+{
+    if (begin >= end)
+        return;
+
+    grainSize = std::max<size_t>(1, grainSize);
+
+    bool serial = insideParallelFor || (end - begin) <= grainSize;
+
+    if (serial || !threadPool().run(begin, end, f, grainSize))
+    {
+        for (size_t i = begin; i < end; ++i)
+            f(i);
+    }
+}
+
+void parallelForWithCaller(size_t begin, size_t end,
+                           const std::function<void(size_t)> &f,
+                           const std::function<void()> &callerTask)
+{
+    if (begin >= end || insideParallelFor || !threadPool().run(begin, end, f, 1, &callerTask))
+    {
+        callerTask();
+        for (size_t i = begin; i < end; ++i)
+            f(i);
+    }
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+// Amount of threads parallelFor() uses, including the calling thread.
+unsigned hardwareThreads();
+
+// Call f(i) for every i in [begin, end) using a persistent pool of worker threads.
+// The calling thread participates, and the call returns once every index has
+// been processed. Indices are handed out in chunks of grainSize. Nested calls
+// and calls made while another parallelFor() is running execute serially
+// on the calling thread.
+void parallelFor(size_t begin, size_t end,
+                 const std::function<void(size_t)> &f,
+                 size_t grainSize = 1);
+
+// Like parallelFor(), but the calling thread first runs callerTask, and only
+// takes indices once it returns. This keeps the calling thread available for
+// work that has to stay on it, such as using the immediate context, while the
+// workers process the indices. If the workers are busy, callerTask runs first
+// and then every index, serially.
+void parallelForWithCaller(size_t begin, size_t end,
+                           const std::function<void(size_t)> &f,
+                           const std::function<void()> &callerTask);
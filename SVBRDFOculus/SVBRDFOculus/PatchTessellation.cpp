@@ -0,0 +1,133 @@
+#include "PatchTessellation.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+const float PatchTessellation::MaxFactor = 64;
+
+namespace
+{
+    // Clip space w below which a point counts as being in the plane of the eye.
+    const float MinW = 1e-6f;
+
+    struct Clip
+    {
+        float x, y, z, w;
+    };
+
+    Clip project(const float p[3], const PatchTessellation::Matrix &m)
+    {
+        Clip c;
+        c.x = p[0] * m.m[0][0] + p[1] * m.m[1][0] + p[2] * m.m[2][0] + m.m[3][0];
+        c.y = p[0] * m.m[0][1] + p[1] * m.m[1][1] + p[2] * m.m[2][1] + m.m[3][1];
+        c.z = p[0] * m.m[0][2] + p[1] * m.m[1][2] + p[2] * m.m[2][2] + m.m[3][2];
+        c.w = p[0] * m.m[0][3] + p[1] * m.m[1][3] + p[2] * m.m[2][3] + m.m[3][3];
+        return c;
+    }
+
+    float clampFactor(float f)
+    {
+        return std::min(std::max(f, 1.f), PatchTessellation::MaxFactor);
+    }
+}
+
+float PatchTessellation::screenFactor(const Vertex &a, const Vertex &b,
+                                      const View &view, const Settings &settings)
+{
+    Clip ca = project(a.pos, view.viewProj);
+    Clip cb = project(b.pos, view.viewProj);
+
+    if (ca.w < MinW || cb.w < MinW)
+        return MaxFactor;
+
+    float dx = (ca.x / ca.w - cb.x / cb.w) * (.5f * view.width);
+    float dy = (ca.y / ca.w - cb.y / cb.w) * (.5f * view.height);
+
+    return std::sqrt(dx * dx + dy * dy) / settings.edgePixels;
+}
+
+bool PatchTessellation::outsideFrustum(const Vertex patch[3], const View &view, const Settings &settings)
+{
+    float grow = std::max(std::abs(settings.minDisplacement), std::abs(settings.maxDisplacement));
+
+    float lo[3];
+    float hi[3];
+    for (unsigned k = 0; k < 3; ++k)
+    {
+        lo[k] = std::min(std::min(patch[0].pos[k], patch[1].pos[k]), patch[2].pos[k]) - grow;
+        hi[k] = std::max(std::max(patch[0].pos[k], patch[1].pos[k]), patch[2].pos[k]) + grow;
+    }
+
+    // Bits of the planes each corner is outside of, which are
+    // left, right, bottom and top.
+    unsigned outside = 0xf;
+    for (unsigned i = 0; i < 8; ++i)
+    {
+        float corner[3] = {
+            (i & 1) ? hi[0] : lo[0],
+            (i & 2) ? hi[1] : lo[1],
+            (i & 4) ? hi[2] : lo[2],
+        };
+
+        Clip c = project(corner, view.viewProj);
+
+        unsigned planes = 0;
+        if (c.x < -c.w) planes |= 1;
+        if (c.x >  c.w) planes |= 2;
+        if (c.y < -c.w) planes |= 4;
+        if (c.y >  c.w) planes |= 8;
+        outside &= planes;
+    }
+
+    return outside != 0;
+}
+
+bool PatchTessellation::backFacing(const Vertex patch[3], const View &view, const Settings &settings)
+{
+    for (unsigned i = 0; i < 3; ++i)
+    {
+        auto &v = patch[i];
+
+        float height = 0;
+        for (unsigned k = 0; k < 3; ++k)
+            height += v.normal[k] * (view.eye[k] - v.pos[k]);
+
+        if (height >= settings.minDisplacement)
+            return false;
+    }
+
+    return true;
+}
+
+PatchTessellation::Factors PatchTessellation::compute(const Vertex patch[3], const View &view, const Settings &settings)
+{
+    Factors f;
+
+    if (outsideFrustum(patch, view, settings) || backFacing(patch, view, settings))
+    {
+        f.edge[0] = 0;
+        f.edge[1] = 0;
+        f.edge[2] = 0;
+        f.inside  = 0;
+        return f;
+    }
+
+    float largestScreen = 0;
+    for (unsigned i = 0; i < 3; ++i)
+    {
+        auto &a = patch[(i + 1) % 3];
+        auto &b = patch[(i + 2) % 3];
+
+        float screen  = screenFactor(a, b, view, settings);
+        float density = std::max(a.factor, b.factor);
+        f.edge[i]     = clampFactor(std::min(screen, density));
+        largestScreen = std::max(largestScreen, screen);
+    }
+
+    // The density limit of the inside is the smallest vertex factor, which
+    // every triangle around the vertices requires.
+    float density = std::min(std::min(patch[0].factor, patch[1].factor), patch[2].factor);
+    f.inside = clampFactor(std::min(largestScreen, density));
+
+    return f;
+}
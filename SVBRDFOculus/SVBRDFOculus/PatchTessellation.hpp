@@ -0,0 +1,81 @@
+#pragma once
+
+// Tessellation factors and culling of the displaced triangle patches, as
+// done by Displacement.hs.hlsl, which follows this line by line.
+//
+// Each edge is split so that its pieces are about a given amount of pixels
+// long on the screen, but never finer than the factors of its vertices,
+// which come from the texel density of the heightmap. Shared edges get the
+// same factor from both of their patches, so the mesh has no cracks.
+// Patches whose displaced surface cannot be visible get zero factors, which
+// drops them before the domain shader: those outside the frustum, and those
+// whose every vertex is behind the lowest displaced surface seen from the eye.
+class PatchTessellation
+{
+public:
+    // The largest factor Direct3D 11 allows.
+    static const float MaxFactor;
+
+    // Row-major 4x4 matrix using the row vector convention of DirectXMath.
+    // The layout is identical to XMFLOAT4X4.
+    struct Matrix
+    {
+        float m[4][4];
+    };
+
+    struct View
+    {
+        Matrix viewProj;
+        // World space position of the eye or the light.
+        float eye[3];
+        // Size of the viewport in pixels.
+        float width;
+        float height;
+    };
+
+    struct Settings
+    {
+        // Target length of the tessellated edges on the screen.
+        float edgePixels;
+        // Range of the displacement along the normals of the patch, in
+        // world units, e.g. HeightBounds::triangle() of its UVs times the
+        // displacement magnitude.
+        float minDisplacement;
+        float maxDisplacement;
+    };
+
+    // A control point, in world space before the displacement.
+    struct Vertex
+    {
+        float pos[3];
+        float normal[3];
+        // The factor required by the texel density.
+        float factor;
+    };
+
+    struct Factors
+    {
+        // Edge i is the one opposite to vertex i, as with SV_TessFactor.
+        float edge[3];
+        float inside;
+
+        bool culled() const { return edge[0] <= 0; }
+    };
+
+    // The factor of the edge between a and b, before clamping to the valid
+    // range. Edges crossing the plane of the eye are only limited by the
+    // factors of their vertices.
+    static float screenFactor(const Vertex &a, const Vertex &b,
+                              const View &view, const Settings &settings);
+
+    // True if the displaced patch is completely outside one of the side
+    // planes of the frustum. The patch is bounded by the box around its
+    // vertices, grown by the largest displacement.
+    static bool outsideFrustum(const Vertex patch[3], const View &view, const Settings &settings);
+
+    // True if the eye is below the lowest displaced surface at every vertex,
+    // so only the back faces of the patch could face it.
+    static bool backFacing(const Vertex patch[3], const View &view, const Settings &settings);
+
+    static Factors compute(const Vertex patch[3], const View &view, const Settings &settings);
+};
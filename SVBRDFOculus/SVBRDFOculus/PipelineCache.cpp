@@ -0,0 +1,219 @@
+#include "PipelineCache.hpp"
+#include "Graphics.hpp"
+
+namespace
+{
+    void appendBytes(std::string &key, const void *data, size_t bytes)
+    {
+        key.append(static_cast<const char *>(data), bytes);
+    }
+
+    // Only for values without padding, whose bytes are all meaningful.
+    template <typename T>
+    void append(std::string &key, const T &value)
+    {
+        appendBytes(key, &value, sizeof(value));
+    }
+
+    void append(std::string &key, const D3D11_DEPTH_STENCILOP_DESC &op)
+    {
+        append(key, op.StencilFailOp);
+        append(key, op.StencilDepthFailOp);
+        append(key, op.StencilPassOp);
+        append(key, op.StencilFunc);
+    }
+
+    // The depth stencil and blend descriptors have padding after their
+    // 8-bit masks, so they are keyed one field at a time.
+    std::string descKey(const D3D11_DEPTH_STENCIL_DESC &desc)
+    {
+        std::string key;
+        append(key, desc.DepthEnable);
+        append(key, desc.DepthWriteMask);
+        append(key, desc.DepthFunc);
+        append(key, desc.StencilEnable);
+        append(key, desc.StencilReadMask);
+        append(key, desc.StencilWriteMask);
+        append(key, desc.FrontFace);
+        append(key, desc.BackFace);
+        return key;
+    }
+
+    std::string descKey(const D3D11_BLEND_DESC &desc)
+    {
+        std::string key;
+        append(key, desc.AlphaToCoverageEnable);
+        append(key, desc.IndependentBlendEnable);
+        for (auto &rt : desc.RenderTarget)
+        {
+            append(key, rt.BlendEnable);
+            append(key, rt.SrcBlend);
+            append(key, rt.DestBlend);
+            append(key, rt.BlendOp);
+            append(key, rt.SrcBlendAlpha);
+            append(key, rt.DestBlendAlpha);
+            append(key, rt.BlendOpAlpha);
+            append(key, rt.RenderTargetWriteMask);
+        }
+        return key;
+    }
+
+    std::string bytecodeKey(const void *bytecode, size_t bytes)
+    {
+        std::string key;
+        appendBytes(key, bytecode, bytes);
+        return key;
+    }
+}
+
+template <typename T, typename Create>
+CComPtr<T> PipelineCache::find(Objects<T> &objects, std::string key, Create &&create)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = objects.find(key);
+    if (it != objects.end())
+    {
+        ++counts.reused;
+        return it->second;
+    }
+
+    CComPtr<T> object;
+    checkHR(create(&object));
+    ++counts.created;
+
+    objects.emplace(std::move(key), object);
+    return object;
+}
+
+CComPtr<ID3D11VertexShader> PipelineCache::vertexShader(const void *bytecode, size_t bytes)
+{
+    return find(vertexShaders, bytecodeKey(bytecode, bytes), [&] (ID3D11VertexShader **shader)
+    {
+        return device->CreateVertexShader(bytecode, bytes, nullptr, shader);
+    });
+}
+
+CComPtr<ID3D11HullShader> PipelineCache::hullShader(const void *bytecode, size_t bytes)
+{
+    return find(hullShaders, bytecodeKey(bytecode, bytes), [&] (ID3D11HullShader **shader)
+    {
+        return device->CreateHullShader(bytecode, bytes, nullptr, shader);
+    });
+}
+
+CComPtr<ID3D11DomainShader> PipelineCache::domainShader(const void *bytecode, size_t bytes)
+{
+    return find(domainShaders, bytecodeKey(bytecode, bytes), [&] (ID3D11DomainShader **shader)
+    {
+        return device->CreateDomainShader(bytecode, bytes, nullptr, shader);
+    });
+}
+
+CComPtr<ID3D11PixelShader> PipelineCache::pixelShader(const void *bytecode, size_t bytes)
+{
+    return find(pixelShaders, bytecodeKey(bytecode, bytes), [&] (ID3D11PixelShader **shader)
+    {
+        return device->CreatePixelShader(bytecode, bytes, nullptr, shader);
+    });
+}
+
+CComPtr<ID3D11ComputeShader> PipelineCache::computeShader(const void *bytecode, size_t bytes)
+{
+    return find(computeShaders, bytecodeKey(bytecode, bytes), [&] (ID3D11ComputeShader **shader)
+    {
+        return device->CreateComputeShader(bytecode, bytes, nullptr, shader);
+    });
+}
+
+CComPtr<ID3D11InputLayout> PipelineCache::inputLayout(const D3D11_INPUT_ELEMENT_DESC *elements, size_t count,
+                                                      const void *vsBytecode, size_t bytes)
+{
+    // The semantic names are compared by their contents, not their addresses.
+    std::string key;
+    for (size_t i = 0; i < count; ++i)
+    {
+        auto &e = elements[i];
+        key.append(e.SemanticName);
+        key.push_back('\0');
+        append(key, e.SemanticIndex);
+        append(key, e.Format);
+        append(key, e.InputSlot);
+        append(key, e.AlignedByteOffset);
+        append(key, e.InputSlotClass);
+        append(key, e.InstanceDataStepRate);
+    }
+    appendBytes(key, vsBytecode, bytes);
+
+    return find(inputLayouts, std::move(key), [&] (ID3D11InputLayout **layout)
+    {
+        return device->CreateInputLayout(elements, static_cast<UINT>(count),
+                                         vsBytecode, bytes, layout);
+    });
+}
+
+CComPtr<ID3D11DepthStencilState> PipelineCache::depthStencilState(const D3D11_DEPTH_STENCIL_DESC &desc)
+{
+    return find(depthStencilStates, descKey(desc), [&] (ID3D11DepthStencilState **state)
+    {
+        return device->CreateDepthStencilState(&desc, state);
+    });
+}
+
+CComPtr<ID3D11RasterizerState> PipelineCache::rasterizerState(const D3D11_RASTERIZER_DESC &desc)
+{
+    std::string key;
+    append(key, desc);
+
+    return find(rasterizerStates, std::move(key), [&] (ID3D11RasterizerState **state)
+    {
+        return device->CreateRasterizerState(&desc, state);
+    });
+}
+
+CComPtr<ID3D11BlendState> PipelineCache::blendState(const D3D11_BLEND_DESC &desc)
+{
+    return find(blendStates, descKey(desc), [&] (ID3D11BlendState **state)
+    {
+        return device->CreateBlendState(&desc, state);
+    });
+}
+
+CComPtr<ID3D11SamplerState> PipelineCache::samplerState(const D3D11_SAMPLER_DESC &desc)
+{
+    std::string key;
+    append(key, desc);
+
+    return find(samplerStates, std::move(key), [&] (ID3D11SamplerState **state)
+    {
+        return device->CreateSamplerState(&desc, state);
+    });
+}
+
+PipelineCache::Stats PipelineCache::stats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return counts;
+}
+
+void PipelineCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    vertexShaders.clear();
+    hullShaders.clear();
+    domainShaders.clear();
+    pixelShaders.clear();
+    computeShaders.clear();
+    inputLayouts.clear();
+    depthStencilStates.clear();
+    rasterizerStates.clear();
+    blendStates.clear();
+    samplerStates.clear();
+}
+
+PipelineCache &pipelineCache()
+{
+    static PipelineCache cache;
+    return cache;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "Utils.hpp"
+
+#include <d3d11.h>
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Process wide cache of shaders, input layouts and state objects, keyed by
+// their bytecode and descriptors. Recreating pipelines, e.g. when the
+// renderer is reconfigured, then only creates the objects that have not
+// been used before. It can be used from any thread.
+class PipelineCache
+{
+public:
+    struct Stats
+    {
+        uint64_t created;   // objects created with the device
+        uint64_t reused;    // lookups that found an existing object
+    };
+
+    CComPtr<ID3D11VertexShader>  vertexShader (const void *bytecode, size_t bytes);
+    CComPtr<ID3D11HullShader>    hullShader   (const void *bytecode, size_t bytes);
+    CComPtr<ID3D11DomainShader>  domainShader (const void *bytecode, size_t bytes);
+    CComPtr<ID3D11PixelShader>   pixelShader  (const void *bytecode, size_t bytes);
+    CComPtr<ID3D11ComputeShader> computeShader(const void *bytecode, size_t bytes);
+
+    CComPtr<ID3D11InputLayout> inputLayout(const D3D11_INPUT_ELEMENT_DESC *elements, size_t count,
+                                           const void *vsBytecode, size_t bytes);
+
+    CComPtr<ID3D11DepthStencilState> depthStencilState(const D3D11_DEPTH_STENCIL_DESC &desc);
+    CComPtr<ID3D11RasterizerState>   rasterizerState(const D3D11_RASTERIZER_DESC &desc);
+    CComPtr<ID3D11BlendState>        blendState(const D3D11_BLEND_DESC &desc);
+    CComPtr<ID3D11SamplerState>      samplerState(const D3D11_SAMPLER_DESC &desc);
+
+    Stats stats();
+
+    // Release every cached object, so that the device can be destroyed.
+    void clear();
+
+private:
+    template <typename T>
+    using Objects = std::unordered_map<std::string, CComPtr<T>>;
+
+    template <typename T, typename Create>
+    CComPtr<T> find(Objects<T> &objects, std::string key, Create &&create);
+
+    std::mutex mutex;
+    Stats counts = {};
+
+    Objects<ID3D11VertexShader>      vertexShaders;
+    Objects<ID3D11HullShader>        hullShaders;
+    Objects<ID3D11DomainShader>      domainShaders;
+    Objects<ID3D11PixelShader>       pixelShaders;
+    Objects<ID3D11ComputeShader>     computeShaders;
+    Objects<ID3D11InputLayout>       inputLayouts;
+    Objects<ID3D11DepthStencilState> depthStencilStates;
+    Objects<ID3D11RasterizerState>   rasterizerStates;
+    Objects<ID3D11BlendState>        blendStates;
+    Objects<ID3D11SamplerState>      samplerStates;
+};
+
+PipelineCache &pipelineCache();
@@ -0,0 +1,196 @@
+#include "Backend.hpp"
+
+#include <numeric>
+
+const unsigned RecordingBackend::CommandKinds;
+
+uint64_t RecordingBackend::Stats::totalCommands() const
+{
+    return std::accumulate(commands.begin(), commands.end(), uint64_t(0));
+}
+
+uint64_t RecordingBackend::Stats::totalBytes() const
+{
+    return std::accumulate(bytes.begin(), bytes.end(), uint64_t(0));
+}
+
+uint64_t RecordingBackend::Stats::draws() const
+{
+    return count(Command::Draw) + count(Command::DrawIndexed);
+}
+
+uint64_t RecordingBackend::Stats::stateChanges() const
+{
+    return count(Command::BindPipeline)
+        + count(Command::SetDepthStencilState)
+        + count(Command::SetConstantBuffer)
+        + count(Command::SetShaderResources)
+        + count(Command::SetSamplers)
+        + count(Command::SetRenderTargets)
+        + count(Command::SetViewport)
+        + count(Command::SetUnorderedAccessView);
+}
+
+RecordingBackend::RecordingBackend(Backend *target, bool submit)
+    : target(target)
+    , submit(submit)
+{
+    reset();
+}
+
+const char *RecordingBackend::commandName(Command c)
+{
+    switch (c)
+    {
+    case Command::CreateTexture2D:        return "CreateTexture2D";
+    case Command::CreateBuffer:           return "CreateBuffer";
+    case Command::WriteBuffer:            return "WriteBuffer";
+    case Command::BindPipeline:           return "BindPipeline";
+    case Command::SetDepthStencilState:   return "SetDepthStencilState";
+    case Command::SetConstantBuffer:      return "SetConstantBuffer";
+    case Command::SetShaderResources:     return "SetShaderResources";
+    case Command::SetSamplers:            return "SetSamplers";
+    case Command::SetRenderTargets:       return "SetRenderTargets";
+    case Command::SetViewport:            return "SetViewport";
+    case Command::SetUnorderedAccessView: return "SetUnorderedAccessView";
+    case Command::ClearRenderTarget:      return "ClearRenderTarget";
+    case Command::ClearDepthStencil:      return "ClearDepthStencil";
+    case Command::Draw:                   return "Draw";
+    case Command::DrawIndexed:            return "DrawIndexed";
+    default:                              return "Unknown";
+    }
+}
+
+void RecordingBackend::reset()
+{
+    recorded.clear();
+    counts.commands.fill(0);
+    counts.bytes.fill(0);
+}
+
+void RecordingBackend::record(Command c, size_t bytes)
+{
+    Record r;
+    r.command = c;
+    r.bytes   = static_cast<uint32_t>(bytes);
+    recorded.emplace_back(r);
+
+    ++counts.commands[static_cast<unsigned>(c)];
+    counts.bytes[static_cast<unsigned>(c)] += bytes;
+}
+
+CComPtr<ID3D11Texture2D> RecordingBackend::createTexture2D(const D3D11_TEXTURE2D_DESC &desc,
+                                                           const D3D11_SUBRESOURCE_DATA *initialData)
+{
+    record(Command::CreateTexture2D, sizeof(desc));
+    if (!target)
+        return nullptr;
+    return target->createTexture2D(desc, initialData);
+}
+
+CComPtr<ID3D11Buffer> RecordingBackend::createBuffer(const D3D11_BUFFER_DESC &desc,
+                                                     const D3D11_SUBRESOURCE_DATA *initialData)
+{
+    record(Command::CreateBuffer, sizeof(desc) + (initialData ? desc.ByteWidth : 0));
+    if (!target)
+        return nullptr;
+    return target->createBuffer(desc, initialData);
+}
+
+void RecordingBackend::writeBuffer(ID3D11Buffer *buffer, D3D11_MAP map, UINT offset,
+                                   const void *data, size_t bytes)
+{
+    // Writes are needed for the contents of the resources to stay valid,
+    // so they always go through.
+    record(Command::WriteBuffer, bytes);
+    if (target && buffer)
+        target->writeBuffer(buffer, map, offset, data, bytes);
+}
+
+void RecordingBackend::bindPipeline(const PipelineState &state)
+{
+    record(Command::BindPipeline, sizeof(state));
+    if (auto t = submitTarget())
+        t->bindPipeline(state);
+}
+
+void RecordingBackend::setDepthStencilState(ID3D11DepthStencilState *state, UINT stencilRef)
+{
+    record(Command::SetDepthStencilState, sizeof(state) + sizeof(stencilRef));
+    if (auto t = submitTarget())
+        t->setDepthStencilState(state, stencilRef);
+}
+
+void RecordingBackend::setConstantBuffer(ShaderStage stage, UINT slot, ID3D11Buffer *buffer,
+                                         UINT firstConstant, UINT numConstants)
+{
+    record(Command::SetConstantBuffer, sizeof(slot) + sizeof(buffer) + sizeof(firstConstant) + sizeof(numConstants));
+    if (auto t = submitTarget())
+        t->setConstantBuffer(stage, slot, buffer, firstConstant, numConstants);
+}
+
+void RecordingBackend::setShaderResources(ShaderStage stage, UINT slot, UINT count,
+                                          ID3D11ShaderResourceView * const *srvs)
+{
+    record(Command::SetShaderResources, sizeof(slot) + sizeof(count) + count * sizeof(*srvs));
+    if (auto t = submitTarget())
+        t->setShaderResources(stage, slot, count, srvs);
+}
+
+void RecordingBackend::setSamplers(ShaderStage stage, UINT slot, UINT count,
+                                   ID3D11SamplerState * const *samplers)
+{
+    record(Command::SetSamplers, sizeof(slot) + sizeof(count) + count * sizeof(*samplers));
+    if (auto t = submitTarget())
+        t->setSamplers(stage, slot, count, samplers);
+}
+
+void RecordingBackend::setRenderTargets(UINT count, ID3D11RenderTargetView * const *rtvs,
+                                        ID3D11DepthStencilView *dsv)
+{
+    record(Command::SetRenderTargets, sizeof(count) + count * sizeof(*rtvs) + sizeof(dsv));
+    if (auto t = submitTarget())
+        t->setRenderTargets(count, rtvs, dsv);
+}
+
+void RecordingBackend::setViewport(const D3D11_VIEWPORT &viewport)
+{
+    record(Command::SetViewport, sizeof(viewport));
+    if (auto t = submitTarget())
+        t->setViewport(viewport);
+}
+
+void RecordingBackend::setUnorderedAccessView(UINT slot, ID3D11UnorderedAccessView *uav)
+{
+    record(Command::SetUnorderedAccessView, sizeof(slot) + sizeof(uav));
+    if (auto t = submitTarget())
+        t->setUnorderedAccessView(slot, uav);
+}
+
+void RecordingBackend::clearRenderTarget(ID3D11RenderTargetView *rtv, const float color[4])
+{
+    record(Command::ClearRenderTarget, sizeof(rtv) + 4 * sizeof(float));
+    if (auto t = submitTarget())
+        t->clearRenderTarget(rtv, color);
+}
+
+void RecordingBackend::clearDepthStencil(ID3D11DepthStencilView *dsv, UINT flags, float depth, UINT8 stencil)
+{
+    record(Command::ClearDepthStencil, sizeof(dsv) + sizeof(flags) + sizeof(depth) + sizeof(stencil));
+    if (auto t = submitTarget())
+        t->clearDepthStencil(dsv, flags, depth, stencil);
+}
+
+void RecordingBackend::draw(UINT vertexCount, UINT startVertex)
+{
+    record(Command::Draw, sizeof(vertexCount) + sizeof(startVertex));
+    if (auto t = submitTarget())
+        t->draw(vertexCount, startVertex);
+}
+
+void RecordingBackend::drawIndexed(UINT indexCount, UINT instances)
+{
+    record(Command::DrawIndexed, sizeof(indexCount) + sizeof(instances));
+    if (auto t = submitTarget())
+        t->drawIndexed(indexCount, instances);
+}
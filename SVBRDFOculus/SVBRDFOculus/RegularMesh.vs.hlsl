@@ -1,9 +1,13 @@
+#include "Stereo.h.hlsl"
+#include "TangentFrame.h.hlsl"
+
 struct Vertex
 {
     float3 pos    : POSITION0;
     float3 normal : NORMAL0;
     float2 uv     : TEXCOORD0;
     float  tess   : COLOR0;
+    float4 frame  : TANGENT0;
 };
 
 struct VSOutput
@@ -11,7 +15,9 @@ struct VSOutput
     float4 worldPos : POSITION0;
     float4 uvTess   : TEXCOORD0;
     float4 normal   : NORMAL0;
+    float4 tangent  : TANGENT0;
     float4 svPos    : SV_Position;
+    float  clip     : SV_ClipDistance0;
 };
 
 cbuffer VSConstants : register(b0)
@@ -19,17 +25,39 @@ cbuffer VSConstants : register(b0)
     float4x4 viewProj;
     float scale;
     float displacementMagnitude;
+    uint  stereo;
+    // The CPU displaced meshes have unit heights, which are scaled here
+    // along with the normals, so the displacement magnitude can change
+    // without rebuilding them.
+    float heightScale;
+    float4x4 rightViewProj;
 };
 
-VSOutput main(Vertex v)
+VSOutput main(Vertex v, uint instance : SV_InstanceID)
 {
     VSOutput o;
-    float4 pos = float4(scale * v.pos, 1);
-    float4 projPos = mul(pos, viewProj);
+    // The eye is passed on in uvTess.w for the later stages.
+    uint eye = stereo ? instance : 0;
+    float4x4 eyeViewProj = viewProj;
+    if (eye)
+        eyeViewProj = rightViewProj;
+
+    float4 pos = float4(scale * float3(v.pos.xy, v.pos.z * heightScale), 1);
+    float4 projPos = mul(pos, eyeViewProj);
     // Vertex position and normal are already in world space.
     o.worldPos = pos;
-    o.uvTess   = float4(v.uv, v.tess, 0);
-    o.svPos    = projPos;
-    o.normal   = float4(v.normal, 0);
+    o.uvTess   = float4(v.uv, v.tess, eye);
+    o.normal   = float4(normalize(float3(v.normal.xy * heightScale, v.normal.z)), 0);
+    o.tangent  = scaledFrameTangent(v.frame, heightScale);
+
+    if (stereo)
+    {
+        o.svPos = stereoEyePosition(projPos, eye, o.clip);
+    }
+    else
+    {
+        o.svPos = projPos;
+        o.clip  = 1;
+    }
 	return o;
 }
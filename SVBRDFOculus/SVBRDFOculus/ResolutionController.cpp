@@ -0,0 +1,124 @@
+#include "ResolutionController.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+ResolutionController::Settings ResolutionController::defaultSettings(double budgetSeconds, unsigned maxAALevel)
+{
+    Settings s;
+    s.budgetSeconds  = budgetSeconds;
+    s.minScale       = .5f;
+    s.maxScale       = 1.f;
+    s.scaleStep      = .05f;
+    s.lowerThreshold = .7;
+    s.upperThreshold = .9;
+    s.aaThreshold    = .35;
+    s.windowFrames   = 15;
+    s.maxAALevel     = maxAALevel;
+    return s;
+}
+
+ResolutionController::ResolutionController(const Settings &settings)
+    : config(settings)
+{
+    assert(config.budgetSeconds > 0);
+    assert(config.scaleStep > 0);
+    assert(config.minScale > 0 && config.minScale <= config.maxScale);
+    assert(config.lowerThreshold < config.upperThreshold);
+    assert(config.windowFrames > 0);
+
+    reset();
+}
+
+void ResolutionController::reset()
+{
+    cpuTimes.clear();
+    gpuTimes.clear();
+    currentScale   = quantize(config.maxScale);
+    currentAALevel = config.maxAALevel;
+    settling       = false;
+    isCpuBound     = false;
+}
+
+float ResolutionController::quantize(float scale) const
+{
+    // Round down, but not below the minimum, so the result stays in bounds
+    // even if the bounds are not multiples of the step.
+    float steps = std::floor(scale / config.scaleStep + 1e-3f);
+    float q     = steps * config.scaleStep;
+    return std::min(config.maxScale, std::max(config.minScale, q));
+}
+
+bool ResolutionController::addFrame(double cpuSeconds, double gpuSeconds)
+{
+    cpuTimes.add(cpuSeconds);
+    gpuTimes.add(gpuSeconds);
+
+    if (gpuTimes.size() < config.windowFrames)
+        return false;
+
+    double cpuLoad = cpuTimes.summary().p90 / config.budgetSeconds;
+    double gpuLoad = gpuTimes.summary().p90 / config.budgetSeconds;
+    cpuTimes.clear();
+    gpuTimes.clear();
+
+    isCpuBound = cpuLoad > config.upperThreshold && cpuLoad >= gpuLoad;
+
+    if (settling)
+    {
+        settling = false;
+        return false;
+    }
+
+    bool changed = decide(cpuLoad, gpuLoad);
+    settling = changed;
+    return changed;
+}
+
+bool ResolutionController::decide(double cpuLoad, double gpuLoad)
+{
+    if (gpuLoad > config.upperThreshold)
+    {
+        if (isCpuBound)
+            return false;
+
+        // A level of antialiasing saves more than the scale could without
+        // a visible drop in resolution.
+        if (currentAALevel > 0)
+        {
+            --currentAALevel;
+            return true;
+        }
+
+        if (currentScale > config.minScale)
+        {
+            double target = (config.lowerThreshold + config.upperThreshold) / 2;
+            float scaled  = currentScale * static_cast<float>(std::sqrt(target / gpuLoad));
+            // Always go down at least one step.
+            currentScale  = quantize(std::min(scaled, currentScale - config.scaleStep));
+            return true;
+        }
+
+        return false;
+    }
+
+    // Raising the quality would only push a frame bound by the CPU further
+    // over the budget, if the GPU then becomes the bottleneck.
+    if (gpuLoad < config.lowerThreshold && cpuLoad < config.upperThreshold)
+    {
+        if (currentScale < config.maxScale)
+        {
+            currentScale = quantize(currentScale + config.scaleStep);
+            return true;
+        }
+
+        if (currentAALevel < config.maxAALevel && gpuLoad < config.aaThreshold)
+        {
+            ++currentAALevel;
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "FrameTimes.hpp"
+
+// Chooses the render resolution scale, and optionally the antialiasing level,
+// from measured frame times, so that the frames fit in the frame budget of
+// the display. It only depends on the times it is given, so recorded traces
+// can be replayed through it on the CPU.
+//
+// The times are collected over windows of frames, and the 90th percentile of
+// each window is compared to the budget. The GPU time is assumed to scale with
+// the amount of pixels, so the scale is lowered right away to bring the GPU
+// time to the middle of the band between the thresholds, but only raised one
+// step at a time. Antialiasing is lowered before the scale, one level at a
+// time, as each level costs much more than a scale step, and it is only
+// raised again once the scale is at its maximum. The window right after a
+// change is skipped, as its GPU times may still come from frames before it.
+// Lowering the resolution does not help frames that are bound by the CPU,
+// so those are left alone.
+class ResolutionController
+{
+public:
+    struct Settings
+    {
+        double budgetSeconds;
+        float minScale;
+        float maxScale;
+        // The scale is always a multiple of this.
+        float scaleStep;
+        // Fractions of the budget. Above the upper one, the quality is
+        // lowered, and below the lower one, raised.
+        double lowerThreshold;
+        double upperThreshold;
+        // Antialiasing is only raised below this fraction of the budget,
+        // as each level costs much more than a scale step.
+        double aaThreshold;
+        unsigned windowFrames;
+        // Antialiasing levels from 0 to this are used, from the cheapest to
+        // the most expensive. Zero leaves the antialiasing alone.
+        unsigned maxAALevel;
+    };
+
+    static Settings defaultSettings(double budgetSeconds, unsigned maxAALevel = 0);
+
+    explicit ResolutionController(const Settings &settings);
+
+    // Add the CPU and GPU times of a frame. Returns true if the scale or
+    // the antialiasing level changed.
+    bool addFrame(double cpuSeconds, double gpuSeconds);
+
+    // Start over from the highest quality, e.g. after the scene changed.
+    void reset();
+
+    const Settings &settings() const { return config; }
+    float scale() const { return currentScale; }
+    unsigned aaLevel() const { return currentAALevel; }
+    // True if the previous window went over the budget on the CPU, which
+    // changing the resolution does not help.
+    bool cpuBound() const { return isCpuBound; }
+
+private:
+    float quantize(float scale) const;
+    bool decide(double cpuLoad, double gpuLoad);
+
+    Settings config;
+    FrameTimes cpuTimes;
+    FrameTimes gpuTimes;
+    float currentScale;
+    unsigned currentAALevel;
+    bool settling;
+    bool isCpuBound;
+};
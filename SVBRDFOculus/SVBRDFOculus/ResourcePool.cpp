@@ -0,0 +1,175 @@
+#include "ResourcePool.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <numeric>
+
+ResourcePool::ResourcePool()
+    : releases(0)
+    , counts()
+{}
+
+ResourcePool::Allocation ResourcePool::acquire(const std::string &key, uint64_t bytes, bool &created)
+{
+    // Prefer the most recently released allocation, as the least recently
+    // released ones are the first to be trimmed.
+    Allocation found = static_cast<Allocation>(entries.size());
+    for (Allocation a = 0; a < entries.size(); ++a)
+    {
+        auto &e = entries[a];
+        if (!e.live || e.users > 0 || e.key != key)
+            continue;
+
+        if (found == entries.size() || e.released > entries[found].released)
+            found = a;
+    }
+
+    created = found == entries.size();
+
+    if (created)
+    {
+        Entry e;
+        e.key      = key;
+        e.bytes    = bytes;
+        e.users    = 0;
+        e.released = 0;
+        e.live     = true;
+
+        if (deadEntries.empty())
+        {
+            entries.emplace_back(std::move(e));
+        }
+        else
+        {
+            found = deadEntries.back();
+            deadEntries.pop_back();
+            entries[found] = std::move(e);
+        }
+
+        counts.currentBytes += bytes;
+        counts.peakBytes     = std::max(counts.peakBytes, counts.currentBytes);
+        ++counts.created;
+    }
+    else
+    {
+        ++counts.reused;
+    }
+
+    auto &e = entries[found];
+    e.users = 1;
+    counts.usedBytes += e.bytes;
+
+    return found;
+}
+
+std::vector<ResourcePool::Allocation> ResourcePool::acquire(const std::vector<Transient> &transients,
+                                                            std::vector<Allocation> &created)
+{
+    std::vector<Allocation> allocations(transients.size());
+
+    // Assigning the resources in the order of their first passes to any
+    // allocation that is no longer in use needs the least allocations.
+    std::vector<size_t> order(transients.size());
+    std::iota(order.begin(), order.end(), size_t(0));
+    std::stable_sort(order.begin(), order.end(), [&] (size_t a, size_t b)
+    {
+        return transients[a].firstPass < transients[b].firstPass;
+    });
+
+    struct Slot
+    {
+        const std::string *key;
+        Allocation allocation;
+        unsigned lastPass;
+    };
+    std::vector<Slot> slots;
+
+    for (size_t i : order)
+    {
+        auto &t = transients[i];
+        assert(t.firstPass <= t.lastPass);
+
+        auto slot = std::find_if(slots.begin(), slots.end(), [&] (const Slot &s)
+        {
+            return *s.key == t.key && s.lastPass < t.firstPass;
+        });
+
+        if (slot != slots.end())
+        {
+            auto &e = entries[slot->allocation];
+            ++e.users;
+            counts.aliasedBytes += e.bytes;
+            slot->lastPass = t.lastPass;
+            allocations[i] = slot->allocation;
+        }
+        else
+        {
+            bool isNew = false;
+            Allocation a = acquire(t.key, t.bytes, isNew);
+            if (isNew)
+                created.emplace_back(a);
+
+            slots.push_back({ &t.key, a, t.lastPass });
+            allocations[i] = a;
+        }
+    }
+
+    return allocations;
+}
+
+void ResourcePool::release(Allocation allocation)
+{
+    assert(allocation < entries.size());
+
+    auto &e = entries[allocation];
+    assert(e.live && e.users > 0);
+
+    --e.users;
+
+    if (e.users > 0)
+    {
+        counts.aliasedBytes -= e.bytes;
+    }
+    else
+    {
+        counts.usedBytes -= e.bytes;
+        e.released = ++releases;
+    }
+}
+
+std::vector<ResourcePool::Allocation> ResourcePool::trim(uint64_t maxFreeBytes)
+{
+    std::vector<Allocation> freeEntries;
+    for (Allocation a = 0; a < entries.size(); ++a)
+    {
+        if (entries[a].live && entries[a].users == 0)
+            freeEntries.emplace_back(a);
+    }
+
+    std::sort(freeEntries.begin(), freeEntries.end(), [&] (Allocation a, Allocation b)
+    {
+        return entries[a].released < entries[b].released;
+    });
+
+    std::vector<Allocation> destroyed;
+    for (Allocation a : freeEntries)
+    {
+        if (counts.freeBytes() <= maxFreeBytes)
+            break;
+
+        auto &e = entries[a];
+        counts.currentBytes -= e.bytes;
+        e.live = false;
+        e.key.clear();
+        deadEntries.emplace_back(a);
+        destroyed.emplace_back(a);
+    }
+
+    return destroyed;
+}
+
+unsigned ResourcePool::users(Allocation allocation) const
+{
+    assert(allocation < entries.size());
+    return entries[allocation].users;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Bookkeeping of pooled GPU allocations. Allocations are identified by the
+// key of their descriptor, and the caller keeps the actual resource of each
+// one.
+//
+// Released allocations stay in the pool, and later requests with the same
+// key reuse them, e.g. when the renderer is reconfigured back and forth.
+// The transient resources of a frame, which are only used by a range of its
+// passes, can be requested together, and the ones with the same key whose
+// pass ranges do not overlap then alias the same allocation.
+class ResourcePool
+{
+public:
+    typedef unsigned Allocation;
+
+    struct Transient
+    {
+        std::string key;
+        uint64_t bytes;
+        // The first and the last pass using the resource, inclusive.
+        unsigned firstPass;
+        unsigned lastPass;
+    };
+
+    struct Stats
+    {
+        uint64_t currentBytes;  // all live allocations, used or free
+        uint64_t peakBytes;     // highest currentBytes so far
+        uint64_t usedBytes;     // allocations with at least one user
+        uint64_t aliasedBytes;  // bytes not allocated thanks to aliasing
+        uint64_t created;       // allocations created so far
+        uint64_t reused;        // requests served with a free allocation
+
+        uint64_t freeBytes() const { return currentBytes - usedBytes; }
+    };
+
+    ResourcePool();
+
+    // An allocation for a resource that lives until it is released. Sets
+    // created if the caller has to create the resource of the allocation.
+    Allocation acquire(const std::string &key, uint64_t bytes, bool &created);
+
+    // An allocation for each transient resource, in the same order. A shared
+    // allocation is released once for each resource that it was returned for.
+    // The allocations whose resources have to be created are added to created.
+    std::vector<Allocation> acquire(const std::vector<Transient> &transients,
+                                    std::vector<Allocation> &created);
+
+    void release(Allocation allocation);
+
+    // Destroy free allocations, least recently released first, until at most
+    // maxFreeBytes are free. Returns the destroyed allocations, whose
+    // resources the caller should release. Their indices are reused later.
+    std::vector<Allocation> trim(uint64_t maxFreeBytes);
+
+    const Stats &stats() const { return counts; }
+    // Amount of users of the allocation, zero if it is free.
+    unsigned users(Allocation allocation) const;
+
+private:
+    struct Entry
+    {
+        std::string key;
+        uint64_t bytes;
+        unsigned users;
+        uint64_t released;
+        bool live;
+    };
+
+    std::vector<Entry> entries;
+    std::vector<Allocation> deadEntries;
+    uint64_t releases;
+    Stats counts;
+};
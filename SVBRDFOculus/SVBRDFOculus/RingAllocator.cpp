@@ -0,0 +1,60 @@
+#include "RingAllocator.hpp"
+
+const uint32_t RingAllocator::Alignment;
+
+RingAllocator::RingAllocator(uint32_t bufferSize)
+    : size(bufferSize - bufferSize % Alignment)
+    , head(0)
+    , used(false)
+{
+    current = Stats();
+    last    = Stats();
+}
+
+uint32_t RingAllocator::alignedSize(uint32_t size)
+{
+    return (size + Alignment - 1) / Alignment * Alignment;
+}
+
+void RingAllocator::beginFrame()
+{
+    last = current;
+
+    current = Stats();
+    current.frame = last.frame + 1;
+
+    head = 0;
+    used = false;
+}
+
+RingAllocator::Allocation RingAllocator::allocate(uint32_t bytes)
+{
+    Allocation a = Allocation();
+
+    uint32_t aligned = alignedSize(bytes > 0 ? bytes : 1);
+    if (aligned > size)
+        return a;
+
+    a.discard = !used;
+
+    if (aligned > size - head)
+    {
+        // Start over from the beginning. Discarding gives the frame fresh
+        // memory, while the draws so far keep using the old contents.
+        head      = 0;
+        a.discard = true;
+        ++current.wraps;
+    }
+
+    a.offset = head;
+    a.size   = aligned;
+
+    head += aligned;
+    used  = true;
+
+    ++current.allocations;
+    current.bytesWritten   += bytes;
+    current.bytesAllocated += aligned;
+
+    return a;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+
+// Bump pointer sub-allocation of per-frame data, such as shader constants,
+// from one fixed size buffer. Each frame starts by discarding the buffer,
+// so the driver hands out fresh memory while earlier frames are still in
+// flight, and one buffer is enough. Allocating is O(1) and never creates
+// resources.
+class RingAllocator
+{
+public:
+    // Required by constant buffer offsets, which are given in multiples
+    // of 16 constants of 16 bytes.
+    static const uint32_t Alignment = 256;
+
+    struct Allocation
+    {
+        uint32_t offset;   // in bytes, a multiple of Alignment
+        uint32_t size;     // in bytes, a multiple of Alignment
+        // The buffer contents have to be discarded before writing, because
+        // this is the first allocation from it this frame, or the frame ran
+        // out of space and started over.
+        bool     discard;
+
+        bool valid() const { return size > 0; }
+    };
+
+    struct Stats
+    {
+        uint64_t frame;
+        unsigned allocations;
+        uint64_t bytesWritten;    // as requested
+        uint64_t bytesAllocated;  // including the alignment
+        unsigned wraps;           // times the frame ran out of space and started over
+    };
+
+    RingAllocator(uint32_t bufferSize = 0);
+
+    static uint32_t alignedSize(uint32_t size);
+
+    uint32_t bufferSize() const { return size; }
+
+    // Start the next frame from the beginning of the buffer.
+    void beginFrame();
+
+    // Returns an invalid allocation if the size does not fit in the buffer.
+    Allocation allocate(uint32_t bytes);
+
+    const Stats &frameStats() const { return current; }
+    // Stats of the previous, completed frame.
+    const Stats &lastFrameStats() const { return last; }
+
+private:
+    uint32_t size;
+    uint32_t head;
+    bool     used;
+    Stats    current;
+    Stats    last;
+};
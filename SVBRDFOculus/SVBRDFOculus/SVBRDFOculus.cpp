@@ -1,5 +1,21 @@
-#include "Utils.hpp"
+﻿#include "Utils.hpp"
 #include "Graphics.hpp"
+#include "DepthRasterizer.hpp"
+#include "LightingTiles.hpp"
+#include "Parallel.hpp"
+#include "ShadingCost.hpp"
+#include "StateCache.hpp"
+#include "JobGraph.hpp"
+#include "TripleBuffer.hpp"
+#include "FrameTimes.hpp"
+#include "GlyphAtlas.hpp"
+#include "ResolutionController.hpp"
+#include "HeightfieldMesh.hpp"
+#include "HeightPyramid.hpp"
+#include "HeightBounds.hpp"
+#include "HeightReconstruction.hpp"
+#include "HeightDerivatives.hpp"
+#include "LruCache.hpp"
 
 #include "RegularMesh.vs.h"
 #include "Displacement.hs.h"
@@ -8,10 +24,14 @@
 #include "TextureSpaceMesh.vs.h"
 #include "TextureSpaceLighting.ps.h"
 #include "SampleLightingFromTexture.ps.h"
+#include "SharedDiffuseLighting.ps.h"
+#include "TileQuads.vs.h"
+#include "DownsampleLighting.ps.h"
 #include "LightIndicator.vs.h"
 #include "LightIndicator.ps.h"
 #include "Text.vs.h"
 #include "Text.ps.h"
+#include "Overlay.ps.h"
 #include "Wireframe.ps.h"
 #include "UnprojectShadowMap.vs.h"
 
@@ -25,11 +45,21 @@
 #include <string>
 #include <algorithm>
 #include <type_traits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <unordered_map>
+#include <limits>
+#include <tuple>
 
 using namespace DirectX;
 
 static const unsigned DefaultWindowWidth  = 1600;
 static const unsigned DefaultWindowHeight =  900;
+static const unsigned DefaultHeadlessFrames = 100;
+// Used for the frame budget if the headset does not report its refresh rate.
+static const double DefaultRefreshRate = 75;
 static const float NearZ = .1f;
 static const float FarZ  = 40.f;
 static const float ShadowNearZ =   .1f;
@@ -40,17 +70,37 @@ static const float ShadowSSDepthBias = -1.f;
 static const unsigned MaxLights = 1024;
 static const unsigned ShadowPcfTaps = 4;
 static const unsigned ShadowKernelWidth = 2;
+// Shadow maps of CPU displaced meshes use vertices this many levels further
+// apart in the heightmap pyramid, and those of loaded meshes this many LODs
+// coarser than their projected size alone would choose.
+static const unsigned ShadowGeometryLodBias = 1;
+// Loaded meshes are drawn with the coarsest LOD whose error is at most this
+// many pixels on the screen.
+static const float LodErrorPixels = 1.f;
 static const float CtrlMultiplier = 5;
 static const float LightPosExtent = FarZ;
 static const float LightPosIncrement = 0.05f;
 static const float LightMaxIntensity = 50.f;
 static const float MaxTessellation = 64.f;
+// Target length of the GPU tessellated edges on the screen.
+static const float TessellationEdgePixels = 8.f;
+static const float MinDisplacementDensity = .5f;
+static const float MaxDisplacementDensity = 64.f;
+static const float DisplacementDensityStep = 2.f;
+static const HeightPyramid::Filter HeightPyramidFilter = HeightPyramid::Filter::Lanczos;
+// Heightmaps integrated from the normals of materials without one are saved
+// next to the maps under this name, and reused while newer than the normals.
+static const char IntegratedHeightMapName[] = "map_height_integrated.pfm";
+// Memory for the displaced meshes of earlier configurations.
+static const uint64_t DisplacedMeshCacheBytes = 256 * 1024 * 1024;
+static const float DefaultLightingBudget = 1.f;
 
 static const char CameraButtons[] = "WASD&%('";
 
 //#define DEBUG_SHADOW_MAPS
 //#define DEBUG_SHADOW_MATRICES
 //#define DEBUG_SHADOW_TEXEL_UNPROJECT
+//#define DEBUG_SHADOW_CPU_RASTERIZER
 #define SHADOW_USE_COMPARISON_SAMPLER
 
 #define ENUM_VALUE_TOSTRING(Enum, Value) case Enum::Value: return #Value;
@@ -59,7 +109,8 @@ enum class LightingMode
 {
     ForwardLighting,
     TextureSpaceLighting,
-    Maximum = TextureSpaceLighting,
+    SharedDiffuseLighting,
+    Maximum = SharedDiffuseLighting,
 };
 
 enum class TextureSpaceLightingPrecision
@@ -75,7 +126,8 @@ enum class DisplacementMode
     NoDisplacement,
     GPUDisplacementMapping,
     CPUDisplacementMapping,
-    Maximum = CPUDisplacementMapping,
+    AdaptiveDisplacementMapping,
+    Maximum = AdaptiveDisplacementMapping,
 };
 
 enum class MeshMode
@@ -90,7 +142,10 @@ enum class NormalMode
     InterpolatedNormals,
     ReconstructedNormals,
     ConstantNormal,
-    Maximum = ConstantNormal,
+    // Interpolated normals, or the constant one for the CPU displaced
+    // meshes, tilted per pixel by the derivatives of the heightmap.
+    DisplacedNormals,
+    Maximum = DisplacedNormals,
 };
 
 enum class ShadowMode
@@ -117,10 +172,19 @@ enum class AntialiasingMode
     Maximum = MSAA4x,
 };
 
+enum class DynamicResolution
+{
+    Disabled,
+    Scale,
+    ScaleAndAA,
+    Maximum = ScaleAndAA,
+};
+
 const char *enumToString(LightingMode mode) {
     switch (mode) {
         ENUM_VALUE_TOSTRING(LightingMode, ForwardLighting)
         ENUM_VALUE_TOSTRING(LightingMode, TextureSpaceLighting)
+        ENUM_VALUE_TOSTRING(LightingMode, SharedDiffuseLighting)
     }
     return nullptr;
 }
@@ -129,6 +193,15 @@ const char *enumToString(DisplacementMode mode) {
         ENUM_VALUE_TOSTRING(DisplacementMode, NoDisplacement)
         ENUM_VALUE_TOSTRING(DisplacementMode, CPUDisplacementMapping)
         ENUM_VALUE_TOSTRING(DisplacementMode, GPUDisplacementMapping)
+        ENUM_VALUE_TOSTRING(DisplacementMode, AdaptiveDisplacementMapping)
+    }
+    return nullptr;
+}
+const char *enumToString(HeightPyramid::Filter filter) {
+    switch (filter) {
+        ENUM_VALUE_TOSTRING(HeightPyramid::Filter, Box)
+        ENUM_VALUE_TOSTRING(HeightPyramid::Filter, Tent)
+        ENUM_VALUE_TOSTRING(HeightPyramid::Filter, Lanczos)
     }
     return nullptr;
 }
@@ -144,6 +217,7 @@ const char *enumToString(NormalMode mode) {
         ENUM_VALUE_TOSTRING(NormalMode, InterpolatedNormals)
         ENUM_VALUE_TOSTRING(NormalMode, ReconstructedNormals)
         ENUM_VALUE_TOSTRING(NormalMode, ConstantNormal)
+        ENUM_VALUE_TOSTRING(NormalMode, DisplacedNormals)
     }
     return nullptr;
 }
@@ -171,6 +245,30 @@ const char *enumToString(AntialiasingMode mode) {
     }
     return nullptr;
 }
+const char *enumToString(DynamicResolution mode) {
+    switch (mode) {
+    case DynamicResolution::Disabled:   return "Disabled";
+    case DynamicResolution::Scale:      return "Scale";
+    case DynamicResolution::ScaleAndAA: return "Scale and AA";
+    }
+    return nullptr;
+}
+
+// The antialiasing modes from the cheapest to the most expensive, which is
+// the order the resolution controller steps through them in.
+static const AntialiasingMode AntialiasingByCost[] =
+{
+    AntialiasingMode::NoAA,
+    AntialiasingMode::MSAA4x,
+    AntialiasingMode::SSAA2x,
+    AntialiasingMode::SSAA4x,
+};
+
+unsigned antialiasingLevel(AntialiasingMode mode)
+{
+    auto it = std::find(std::begin(AntialiasingByCost), std::end(AntialiasingByCost), mode);
+    return static_cast<unsigned>(it - std::begin(AntialiasingByCost));
+}
 
 float toDegrees(float rad)
 {
@@ -240,6 +338,8 @@ struct RenderingState
     int shadowDepthBias;
     // Shadow map slope scaled depth bias.
     float shadowSSDepthBias;
+    // Millions of texels relit per view each frame with texture space lighting.
+    float lightingBudget;
     // All lights in the scene.
     std::vector<Light> lights;
 
@@ -266,6 +366,8 @@ struct RenderingState
         shadowDepthBias   = ShadowDepthBias;
         shadowSSDepthBias = ShadowSSDepthBias;
 
+        lightingBudget = DefaultLightingBudget;
+
         lights.emplace_back();
         lights[0].positionWorld[0] = 3.f;
         lights[0].positionWorld[1] = 3.f;
@@ -345,6 +447,10 @@ struct RenderingState
         fprintf_s(f, "shadow_depth_bias              %d\n", shadowDepthBias);
         fprintf_s(f, "shadow_slope_scaled_depth_bias %f\n", shadowSSDepthBias);
 
+        fprintf_s(f, "\n");
+
+        fprintf_s(f, "lighting_budget %f    # Millions of texels relit per frame with texture space lighting\n", lightingBudget);
+
         for (auto &l : lights)
         {
             fprintf_s(f, "\n");
@@ -479,6 +585,10 @@ struct RenderingState
             {
                 shadowSSDepthBias = f3[0];
             }
+            else if (sscanf_s(line, "lighting_budget %f", &f3[0]) == 1)
+            {
+                lightingBudget = f3[0];
+            }
             else if (sscanf_s(line, "light_position %f %f %f", &f3[0], &f3[1], &f3[2]) == 3)
             {
                 if (!lights.empty())
@@ -543,6 +653,14 @@ struct SVBRDF
     Resource normals;
     Resource heightMap;
     FloatPixelBuffer heightMapCPU;
+    // Prefiltered levels of heightMapCPU for the CPU displaced meshes.
+    std::shared_ptr<const HeightPyramid> heightPyramid;
+    // Height ranges of heightMapCPU over its regions, and the same as an
+    // R32G32 texture with a level per mip.
+    std::shared_ptr<const HeightBounds> heightBounds;
+    Resource heightBoundsMap;
+    // HeightDerivatives of heightMapCPU for the displaced normals.
+    Resource heightDerivativeMap;
     float alpha;
 
     bool valid() const
@@ -551,6 +669,70 @@ struct SVBRDF
     }
 };
 
+Resource heightBoundsTexture(const HeightBounds &bounds)
+{
+    D3D11_TEXTURE2D_DESC desc;
+    zero(desc);
+    desc.Width            = bounds.width();
+    desc.Height           = bounds.height();
+    desc.MipLevels        = bounds.levelCount();
+    desc.ArraySize        = 1;
+    desc.Format           = DXGI_FORMAT_R32G32_FLOAT;
+    desc.SampleDesc.Count = 1;
+    desc.Usage            = D3D11_USAGE_IMMUTABLE;
+    desc.BindFlags        = D3D11_BIND_SHADER_RESOURCE;
+
+    std::vector<D3D11_SUBRESOURCE_DATA> levels(bounds.levelCount());
+    for (unsigned i = 0; i < bounds.levelCount(); ++i)
+    {
+        auto &level = bounds.level(i);
+        zero(levels[i]);
+        levels[i].pSysMem     = level.ranges.data();
+        levels[i].SysMemPitch = static_cast<UINT>(level.width * sizeof(HeightBounds::Range));
+    }
+
+    return Resource(desc, levels.data());
+}
+
+Resource heightDerivativeTexture(const HeightDerivatives &derivatives)
+{
+    D3D11_TEXTURE2D_DESC desc;
+    zero(desc);
+    desc.Width            = derivatives.width();
+    desc.Height           = derivatives.height();
+    desc.MipLevels        = 1;
+    desc.ArraySize        = 1;
+    desc.Format           = DXGI_FORMAT_R32G32_FLOAT;
+    desc.SampleDesc.Count = 1;
+    desc.Usage            = D3D11_USAGE_IMMUTABLE;
+    desc.BindFlags        = D3D11_BIND_SHADER_RESOURCE;
+
+    D3D11_SUBRESOURCE_DATA initialData;
+    zero(initialData);
+    initialData.pSysMem     = derivatives.derivatives().data();
+    initialData.SysMemPitch = static_cast<UINT>(derivatives.width() * sizeof(HeightDerivatives::Derivative));
+
+    return Resource(desc, &initialData);
+}
+
+FloatPixelBuffer integrateHeightMap(const FloatPixelBuffer &normals)
+{
+    Timer t;
+    HeightReconstruction reconstruction(normals.pixels.data(),
+                                        static_cast<unsigned>(normals.width),
+                                        static_cast<unsigned>(normals.height),
+                                        static_cast<unsigned>(normals.channels));
+
+    FloatPixelBuffer heights(normals.width, normals.height, 1);
+    heights.pixels = reconstruction.heights();
+
+    auto &stats = reconstruction.stats();
+    log("Integrated %d x %d heightmap from normals with %u levels and %u V-cycles (residual %.2g) in %.2f ms\n",
+        heights.width, heights.height, stats.levels, stats.cycles, stats.residual, t.seconds() * 1000);
+
+    return heights;
+}
+
 SVBRDF loadSVBRDF(std::string rootPath, std::string name)
 {
     SVBRDF svbrdf;
@@ -567,6 +749,7 @@ SVBRDF loadSVBRDF(std::string rootPath, std::string name)
     std::string specShapePath  = mapPath + "map_spec_shape.pfm";
     std::string normalPath     = mapPath + "map_normal.pfm";
     std::string paramsPath     = mapPath + "map_params.dat";
+    std::string integratedPath = mapPath + IntegratedHeightMapName;
 
     size_t bytes = 0;
 
@@ -574,7 +757,10 @@ SVBRDF loadSVBRDF(std::string rootPath, std::string name)
     svbrdf.diffuseAlbedo  = loadImage(diffusePath.c_str(), &bytes);
     svbrdf.specularAlbedo = loadImage(specularPath.c_str(), &bytes);
     svbrdf.specularShape  = loadImage(specShapePath.c_str(), &bytes);
-    svbrdf.normals        = loadImage(normalPath.c_str(), &bytes);
+    // The normals stay on the CPU in case the heightmap is integrated from them.
+    FloatPixelBuffer normalPixels;
+    svbrdf.normals        = loadPFMImage(normalPath.c_str(), &normalPixels);
+    bytes += normalPixels.bytes();
 
     RESOURCE_DEBUG_NAME(svbrdf.diffuseAlbedo);
     RESOURCE_DEBUG_NAME(svbrdf.specularAlbedo);
@@ -586,15 +772,73 @@ SVBRDF loadSVBRDF(std::string rootPath, std::string name)
     if (!heightMapFiles.empty())
         heightMapPath = heightMapFiles.at(0);
 
-    if (heightMapPath.empty())
+    uint64_t integratedTime = fileModificationTime(integratedPath);
+
+    if (!heightMapPath.empty())
+    {
+        svbrdf.heightMap = loadPFMImage(heightMapPath.c_str(), &svbrdf.heightMapCPU);
+    }
+    else if (integratedTime != 0 && integratedTime >= fileModificationTime(normalPath))
+    {
+        log("Using heightmap integrated earlier from the normals of \"%s\".\n", name.c_str());
+        svbrdf.heightMap = loadPFMImage(integratedPath.c_str(), &svbrdf.heightMapCPU);
+    }
+    else if (normalPixels.width > 0 && normalPixels.height > 0)
+    {
+        log("Could not find heightmap for \"%s\". Integrating it from the normals.\n", name.c_str());
+        svbrdf.heightMapCPU = integrateHeightMap(normalPixels);
+        svbrdf.heightMap    = pixelBufferTexture(svbrdf.heightMapCPU);
+        savePFMImage(integratedPath.c_str(), svbrdf.heightMapCPU);
+    }
+
+    normalPixels = FloatPixelBuffer();
+
+    if (!svbrdf.heightMap.valid())
     {
         log("Could not find heightmap for \"%s\". Displacement mapping disabled.\n", name.c_str());
     }
     else
     {
-        svbrdf.heightMap = loadPFMImage(heightMapPath.c_str(), &svbrdf.heightMapCPU);
         bytes += svbrdf.heightMapCPU.bytes();
         RESOURCE_DEBUG_NAME(svbrdf.heightMap);
+
+        if (svbrdf.heightMapCPU.width > 0 && svbrdf.heightMapCPU.height > 0)
+        {
+            Timer pyramidTime;
+            svbrdf.heightPyramid = std::make_shared<HeightPyramid>(
+                svbrdf.heightMapCPU.pixels.data(),
+                static_cast<unsigned>(svbrdf.heightMapCPU.width),
+                static_cast<unsigned>(svbrdf.heightMapCPU.height),
+                static_cast<unsigned>(svbrdf.heightMapCPU.channels),
+                HeightPyramidFilter);
+            log("Built %u level %s heightmap pyramid in %.2f ms\n",
+                svbrdf.heightPyramid->levelCount(), enumToString(HeightPyramidFilter),
+                pyramidTime.seconds() * 1000);
+
+            Timer boundsTime;
+            svbrdf.heightBounds = std::make_shared<HeightBounds>(
+                svbrdf.heightMapCPU.pixels.data(),
+                static_cast<unsigned>(svbrdf.heightMapCPU.width),
+                static_cast<unsigned>(svbrdf.heightMapCPU.height),
+                static_cast<unsigned>(svbrdf.heightMapCPU.channels));
+            svbrdf.heightBoundsMap = heightBoundsTexture(*svbrdf.heightBounds);
+            RESOURCE_DEBUG_NAME(svbrdf.heightBoundsMap);
+
+            auto range = svbrdf.heightBounds->range();
+            log("Built %u level heightmap bounds with heights %.3f ... %.3f in %.2f ms\n",
+                svbrdf.heightBounds->levelCount(), range.min, range.max,
+                boundsTime.seconds() * 1000);
+
+            Timer derivativeTime;
+            HeightDerivatives derivatives(
+                svbrdf.heightMapCPU.pixels.data(),
+                static_cast<unsigned>(svbrdf.heightMapCPU.width),
+                static_cast<unsigned>(svbrdf.heightMapCPU.height),
+                static_cast<unsigned>(svbrdf.heightMapCPU.channels));
+            svbrdf.heightDerivativeMap = heightDerivativeTexture(derivatives);
+            RESOURCE_DEBUG_NAME(svbrdf.heightDerivativeMap);
+            log("Built heightmap derivatives in %.2f ms\n", derivativeTime.seconds() * 1000);
+        }
     }
 
     {
@@ -1068,14 +1312,47 @@ static CComPtr<ID3D11InputLayout> inputLayoutFor(const VS &vs)
 {
     auto inputElements = Vertex::inputLayoutDesc();
 
-    CComPtr<ID3D11InputLayout> layout;
+    return pipelineCache().inputLayout(inputElements.data(), inputElements.size(),
+                                       vs, sizeBytes(vs));
+}
+
+static XMMATRIX shadowCubeFaceViewProj(XMVECTOR lightPosition, unsigned faceIndex)
+{
+    auto face = static_cast<CubeMapFace>(faceIndex);
+
+    auto view = cubeMapFaceViewRH(face, lightPosition);
+    auto proj = cubeMapFaceProjRH(ShadowNearZ, ShadowFarZ, DepthMode::InverseDepth);
 
-    checkHR(device->CreateInputLayout(inputElements.data(),
-                                      static_cast<UINT>(inputElements.size()),
-                                      vs, sizeBytes(vs),
-                                      &layout));
+    return XMMatrixMultiply(view, proj);
+}
+
+static DepthRasterizer::Matrix rasterizerMatrix(const XMMATRIX &m)
+{
+    XMFLOAT4X4 f;
+    XMStoreFloat4x4(&f, m);
+
+    DepthRasterizer::Matrix r;
+    memcpy(r.m, f.m, sizeof(r.m));
+    return r;
+}
+
+// FNV-1a, for detecting changes in plain data.
+static uint64_t hashBytes(const void *data, size_t bytes, uint64_t hash = 14695981039346656037ull)
+{
+    auto p = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < bytes; ++i)
+    {
+        hash ^= p[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
 
-    return layout;
+template <typename T>
+static uint64_t hashValue(const T &t, uint64_t hash)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "Only plain data can be hashed.");
+    return hashBytes(&t, sizeof(t), hash);
 }
 
 class LightIndicator
@@ -1110,21 +1387,99 @@ public:
 
         lightIndicator.bind();
         auto vsCB = cb.write(constants);
-        context->VSSetConstantBuffers(0, 1, bind(vsCB));
-        context->Draw(12, 0);
+        setConstantBuffer(ShaderStage::VS, 0, vsCB);
+        draw(12);
+    }
+};
+
+// The printable ASCII glyphs of the overlay font at one point size. They
+// are rasterized once, and shared by every TextManager using that size.
+class FontAtlas
+{
+public:
+    static const unsigned AtlasW = 256;
+
+    GlyphAtlas glyphs;
+    Resource texture;
+
+    FontAtlas(int pointSize)
+    {
+        FontRasterizer fontRasterizer({"Consolas", "Courier New"}, pointSize);
+
+        std::vector<FontRasterizer::TextPixels> glyphPixels;
+        std::vector<GlyphAtlas::Size> sizes;
+        glyphPixels.reserve(GlyphAtlas::GlyphCount);
+        sizes.reserve(GlyphAtlas::GlyphCount);
+
+        for (unsigned i = 0; i < GlyphAtlas::GlyphCount; ++i)
+        {
+            char c = static_cast<char>(GlyphAtlas::FirstChar + i);
+            glyphPixels.emplace_back(fontRasterizer.renderText(std::string(1, c)));
+            sizes.push_back({ glyphPixels.back().width, glyphPixels.back().height });
+        }
+
+        glyphs = GlyphAtlas(sizes, AtlasW);
+
+        // The padding between the glyphs stays black, which is transparent.
+        FontRasterizer::TextPixels atlasPixels(glyphs.width(), glyphs.height());
+        for (unsigned i = 0; i < GlyphAtlas::GlyphCount; ++i)
+        {
+            auto &src = glyphPixels[i];
+            auto &g   = glyphs.glyph(static_cast<char>(GlyphAtlas::FirstChar + i));
+
+            for (unsigned y = 0; y < src.height; ++y)
+            {
+                memcpy(atlasPixels.pixels.data() + (g.y + y) * atlasPixels.rowPitch()
+                                                 + g.x * FontRasterizer::TextPixels::BytesPerPixel,
+                       src.pixels.data() + y * src.rowPitch(),
+                       src.rowPitch());
+            }
+        }
+
+        auto atlasDesc = texture2DDesc(glyphs.width(), glyphs.height(), DXGI_FORMAT_B8G8R8A8_UNORM);
+        atlasDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+        atlasDesc.Usage     = D3D11_USAGE_IMMUTABLE;
+
+        D3D11_SUBRESOURCE_DATA atlasData;
+        zero(atlasData);
+        atlasData.pSysMem     = atlasPixels.pixels.data();
+        atlasData.SysMemPitch = atlasPixels.rowPitch();
+
+        texture = Resource(atlasDesc, &atlasData);
+        RESOURCE_DEBUG_NAME(texture);
+    }
+
+    static std::shared_ptr<FontAtlas> forPointSize(int pointSize)
+    {
+        static std::mutex mutex;
+        static std::unordered_map<int, std::weak_ptr<FontAtlas>> atlases;
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto atlas = atlases[pointSize].lock();
+        if (!atlas)
+        {
+            atlas = std::make_shared<FontAtlas>(pointSize);
+            atlases[pointSize] = atlas;
+        }
+
+        return atlas;
     }
 };
 
 class TextManager
 {
 public:
-    static const unsigned TextCacheW = 256;
-    static const unsigned TextCacheH = 2048;
+    static const int FontPointSize = 12;
 
     static const unsigned MaxTextLen = 256;
-    static const unsigned MaxTexts   = 256;
+    static const unsigned MaxGlyphs  = 8192;
     static const unsigned RowMargin  = 2;
     static const unsigned ColMargin  = 16;
+    // Each text reserves room for a multiple of this many glyphs, so that
+    // most changes to it can be written over its old glyphs.
+    static const unsigned GlyphSlotAlignment = 16;
+    static const unsigned OverlayAlignment   = 128;
 
     typedef char TextBuffer[MaxTextLen];
     typedef std::function<void(TextBuffer &)> TextUpdateCallback;
@@ -1134,24 +1489,26 @@ private:
     {
         std::string text;
         TextUpdateCallback updateText;
-        float2 uvUpperLeft;
-        float2 uvLowerRight;
         unsigned width;
-        unsigned height;
-        int cacheY;
         float3 color;
+        // Upper left corner in the overlay, and the quads reserved for
+        // the glyphs in the vertex buffer.
+        uint2 coords;
+        unsigned firstGlyph;
+        unsigned glyphCapacity;
+        bool dirty;
 
         Text()
         {
-            uvUpperLeft   = { 0, 0 };
-            uvLowerRight  = { 0, 0 };
-            width = 0;
-            height = 0;
-            cacheY = -1;
+            width  = 0;
             color  = {0, 0, 0};
+            coords = {0, 0};
+            firstGlyph    = 0;
+            glyphCapacity = 0;
+            dirty  = true;
         }
 
-        bool update()
+        bool update(const GlyphAtlas &glyphs)
         {
             char textBuffer[MaxTextLen] = {0};
             if (updateText)
@@ -1159,7 +1516,9 @@ private:
                 updateText(textBuffer);
                 if (text != textBuffer)
                 {
-                    text = textBuffer;
+                    text  = textBuffer;
+                    width = glyphs.textWidth(text);
+                    dirty = true;
                     return true;
                 }
             }
@@ -1167,22 +1526,32 @@ private:
             return false;
         }
 
-        bool isCached() const
+        unsigned visibleGlyphs() const
         {
-            return cacheY >= 0;
+            return static_cast<unsigned>(std::count_if(text.begin(), text.end(), [] (char c)
+            {
+                return c != ' ';
+            }));
         }
     };
 
 private:
 
-    FontRasterizer fontRasterizer;
-    Resource textCache;
+    std::shared_ptr<FontAtlas> font;
     Resource vertexBuffer;
     Resource indexBuffer;
+    Resource quadBuffer;
     GraphicsPipeline textPipeline;
+    GraphicsPipeline overlayPipeline;
     CComPtr<ID3D11SamplerState> textSampler;
+    CComPtr<ID3D11SamplerState> overlaySampler;
     std::vector<std::vector<Text>> columns;
-    unsigned nextFreeCacheY;
+
+    // All the text is drawn into the overlay only when some of it changes,
+    // and every view then just draws the overlay.
+    PooledTextures overlayTextures;
+    Resource overlay;
+    uint2 overlaySize;
 
     struct Vertex
     {
@@ -1200,16 +1569,25 @@ private:
         }
     };
 
+    // A copy of the vertex buffer, and the glyphs of one text at a time.
+    std::vector<Vertex> vertices;
+    std::vector<GlyphAtlas::Quad> quads;
+    unsigned reservedGlyphs;
+    unsigned drawnGlyphs;
+    // Set when the texts have to be assigned new quads.
+    bool layoutDirty;
+
 public:
     TextManager(unsigned columns = 1)
-        : fontRasterizer({"Consolas", "Courier New"}, 12)
+        : font(FontAtlas::forPointSize(FontPointSize))
         , columns(columns)
+        , reservedGlyphs(0)
+        , drawnGlyphs(0)
+        , layoutDirty(true)
     {
-        auto textCacheDesc = texture2DDesc(TextCacheW, TextCacheH, DXGI_FORMAT_B8G8R8A8_UNORM);
-        textCacheDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
-        textCache = Resource(textCacheDesc);
-        textSampler = samplerBilinear();
-        nextFreeCacheY = 0;
+        textSampler    = samplerBilinear();
+        overlaySampler = samplerPoint();
+        overlaySize    = {0, 0};
 
         // Premultiplied alpha
         D3D11_BLEND_DESC blendDesc;
@@ -1232,22 +1610,65 @@ public:
             &blendDesc);
         textPipeline.inputLayout = inputLayoutFor<Vertex>(text_vs);
 
+        overlayPipeline = GraphicsPipeline(
+            text_vs, overlay_ps,
+            D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST,
+            nullptr,
+            &rasterizerDesc(true),
+            &blendDesc);
+        overlayPipeline.inputLayout = textPipeline.inputLayout;
+
+        // Only the glyphs of changed texts are written, so the vertices
+        // are updated with UpdateSubresource instead of being mapped.
         D3D11_BUFFER_DESC vbDesc = {0};
         vbDesc.StructureByteStride = sizeof(Vertex);
-        vbDesc.ByteWidth      = MaxTexts * 4 * sizeof(Vertex);
+        vbDesc.ByteWidth      = MaxGlyphs * 4 * sizeof(Vertex);
         vbDesc.BindFlags      = D3D11_BIND_VERTEX_BUFFER;
-        vbDesc.Usage          = D3D11_USAGE_DYNAMIC;
-        vbDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+        vbDesc.Usage          = D3D11_USAGE_DEFAULT;
+
+        vertexBuffer = Resource(vbDesc, DXGI_FORMAT_UNKNOWN);
+
+        // Every glyph is a quad, so the indices never change.
+        std::vector<uint16_t> indices;
+        indices.reserve(MaxGlyphs * 6);
+        for (unsigned i = 0; i < MaxGlyphs; ++i)
+        {
+            uint16_t iBase = static_cast<uint16_t>(i * 4);
+            indices.push_back(iBase + 0);
+            indices.push_back(iBase + 1);
+            indices.push_back(iBase + 2);
+            indices.push_back(iBase + 1);
+            indices.push_back(iBase + 3);
+            indices.push_back(iBase + 2);
+        }
 
         D3D11_BUFFER_DESC ibDesc = {0};
         ibDesc.StructureByteStride = sizeof(uint16_t);
-        ibDesc.ByteWidth      = MaxTexts * 4 * 2 * sizeof(uint16_t);
+        ibDesc.ByteWidth      = static_cast<UINT>(sizeBytes(indices));
         ibDesc.BindFlags      = D3D11_BIND_INDEX_BUFFER;
-        ibDesc.Usage          = D3D11_USAGE_DYNAMIC;
-        ibDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+        ibDesc.Usage          = D3D11_USAGE_IMMUTABLE;
 
-        vertexBuffer = Resource(vbDesc, DXGI_FORMAT_UNKNOWN);
-        indexBuffer  = Resource(ibDesc, DXGI_FORMAT_R16_UINT);
+        indexBuffer = Resource(ibDesc, DXGI_FORMAT_R16_UINT, indices.data(), sizeBytes(indices));
+
+        // The overlay covers the viewport it is drawn in.
+        Vertex quad[] =
+        {
+            { { -1,  1 }, { 0, 0 }, { 1, 1, 1, 1 } },
+            { { -1, -1 }, { 0, 1 }, { 1, 1, 1, 1 } },
+            { {  1,  1 }, { 1, 0 }, { 1, 1, 1, 1 } },
+            { {  1, -1 }, { 1, 1 }, { 1, 1, 1, 1 } },
+        };
+
+        D3D11_BUFFER_DESC quadDesc = {0};
+        quadDesc.StructureByteStride = sizeof(Vertex);
+        quadDesc.ByteWidth      = sizeof(quad);
+        quadDesc.BindFlags      = D3D11_BIND_VERTEX_BUFFER;
+        quadDesc.Usage          = D3D11_USAGE_IMMUTABLE;
+
+        quadBuffer = Resource(quadDesc, DXGI_FORMAT_UNKNOWN, quad, sizeof(quad));
+
+        vertices.reserve(MaxGlyphs * 4);
+        quads.reserve(MaxTextLen);
     }
 
     void clear()
@@ -1255,7 +1676,7 @@ public:
         auto numColumns = columns.size();
         columns.clear();
         columns.resize(numColumns);
-        nextFreeCacheY = 0;
+        layoutDirty = true;
     }
 
     void addCallback(unsigned column, int row, TextUpdateCallback updater, float3 color = {1, 1, 1})
@@ -1271,7 +1692,8 @@ public:
         auto &txt = col[row];
         txt.updateText = std::move(updater);
         txt.color = color;
-        txt.update();
+        txt.update(font->glyphs);
+        layoutDirty = true;
     }
 
     void addText(unsigned column, int row, const std::string &text, float3 color = {1, 1, 1})
@@ -1332,199 +1754,202 @@ public:
         addCallback(column, row, [=](TextBuffer &textBuffer) { textBuffer[0] = '\0'; });
     }
 
-    void updateTextCache()
+    // Mark every text as changed, so the next update rewrites all of them.
+    void invalidate()
+    {
+        layoutDirty = true;
+    }
+
+    // Update the texts, and redraw the overlay if any of them changed.
+    // This should be done once per frame, before rendering the overlay.
+    // Returns true if the overlay was redrawn.
+    bool update()
     {
-        GPUScope scope(L"Update text cache");
+        auto &glyphs = font->glyphs;
 
+        bool changed = layoutDirty;
         for (auto &col : columns)
         {
             for (auto &txt : col)
-            {
-                bool updateCache = txt.update() || !txt.isCached();
+                changed = txt.update(glyphs) || changed;
+        }
 
-                if (txt.text.empty())
-                    continue;
+        if (!changed)
+            return false;
 
-                if (updateCache)
-                {
-                    auto textPixels = fontRasterizer.renderText(txt.text);
+        // Changing the width of a column moves the texts in the next ones,
+        // and a text with more glyphs than it has room for needs new quads.
+        uint2 coords = {0, 0};
+        uint2 size   = {0, 0};
+        drawnGlyphs = 0;
 
-                    if (txt.height == 0)
-                    {
-                        txt.height = textPixels.height;
-                    }
-                    else
-                    {
-                        check(txt.height == textPixels.height, "Text height changed unexpectedly.");
-                    }
+        for (auto &col : columns)
+        {
+            coords[1] = 0;
 
-                    txt.width  = textPixels.width;
+            unsigned colWidth = 0;
 
-                    if (txt.cacheY < 0)
-                    {
-                        txt.cacheY = nextFreeCacheY;
-                        nextFreeCacheY += txt.height;
-                        check(nextFreeCacheY <= TextCacheH, "Out of text cache space.");
-                    }
+            for (auto &txt : col)
+            {
+                colWidth = std::max(colWidth, txt.width);
 
-                    D3D11_BOX dstBox = {0};
-                    dstBox.left   = 0;
-                    dstBox.top    = txt.cacheY;
-                    dstBox.front  = 0;
-                    dstBox.right  = dstBox.left + txt.width;
-                    dstBox.bottom = dstBox.top + txt.height;
-                    dstBox.back   = 1;
-                    context->UpdateSubresource(textCache.texture,
-                                               0, &dstBox,
-                                               textPixels.pixels.data(),
-                                               textPixels.rowPitch(), 0);
-
-                    static const float CacheW = static_cast<float>(TextCacheW);
-                    static const float CacheH = static_cast<float>(TextCacheH);
-
-                    txt.uvUpperLeft[0]  = 0;
-                    txt.uvUpperLeft[1]  = static_cast<float>(txt.cacheY) / CacheH;
-                    txt.uvLowerRight[0] = static_cast<float>(txt.width) / CacheW;
-                    txt.uvLowerRight[1] = static_cast<float>(txt.cacheY + txt.height) / CacheH;
+                if (txt.coords != coords)
+                {
+                    txt.coords = coords;
+                    txt.dirty  = true;
                 }
+
+                unsigned visible = txt.visibleGlyphs();
+                if (visible > txt.glyphCapacity)
+                    layoutDirty = true;
+                drawnGlyphs += visible;
+
+                // Empty rows are as high as the others.
+                coords[1] += glyphs.lineHeight() + RowMargin;
             }
+
+            size[0]    = coords[0] + colWidth;
+            size[1]    = std::max(size[1], coords[1]);
+            coords[0] += colWidth + ColMargin;
         }
-    }
 
-    void render(Resource &renderTarget, uint2 offset)
-    {
-        uint2 coords = offset;
+        if (size[0] > overlaySize[0] || size[1] > overlaySize[1])
+        {
+            overlaySize[0] = std::max(overlaySize[0], divRoundUp(std::max(size[0], 1u), OverlayAlignment) * OverlayAlignment);
+            overlaySize[1] = std::max(overlaySize[1], divRoundUp(std::max(size[1], 1u), OverlayAlignment) * OverlayAlignment);
 
-        std::vector<Vertex> vertices;
-        std::vector<uint16_t> indices;
+            auto overlayDesc = texture2DDesc(overlaySize[0], overlaySize[1], DXGI_FORMAT_R8G8B8A8_UNORM_SRGB);
+            overlayDesc.BindFlags = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
 
-        size_t numTexts = 0;
-        unsigned maxRowHeight = RowMargin;
+            overlayTextures.release();
+            overlay = overlayTextures.acquire(overlayDesc);
+            RESOURCE_DEBUG_NAME(overlay);
 
-        for (auto &col : columns)
+            // The vertices are in the NDC of the overlay.
+            layoutDirty = true;
+        }
+
+        if (layoutDirty)
         {
-            numTexts += col.size();
-            for (auto &txt : col)
-                maxRowHeight = std::max(maxRowHeight, txt.height);
+            reservedGlyphs = 0;
+            for (auto &col : columns)
+            {
+                for (auto &txt : col)
+                {
+                    txt.firstGlyph    = reservedGlyphs;
+                    txt.glyphCapacity = divRoundUp(std::max(txt.visibleGlyphs(), 1u),
+                                                   GlyphSlotAlignment) * GlyphSlotAlignment;
+                    txt.dirty         = true;
+                    reservedGlyphs   += txt.glyphCapacity;
+                }
+            }
+
+            check(reservedGlyphs <= MaxGlyphs, "Out of text glyph space.");
+            vertices.resize(reservedGlyphs * 4);
         }
 
-        vertices.reserve(numTexts * 4);
-        indices.reserve(numTexts * 6);
+        // From overlay pixels to NDC
+        float scaleX =  2.f / static_cast<float>(overlaySize[0]);
+        float scaleY = -2.f / static_cast<float>(overlaySize[1]);
 
-        float rtW = static_cast<float>(renderTarget.textureDescriptor().Width);
-        float rtH = static_cast<float>(renderTarget.textureDescriptor().Height);
+        unsigned firstDirty = reservedGlyphs;
+        unsigned endDirty   = 0;
 
         for (auto &col : columns)
         {
-            coords[1] = offset[1];
-
-            unsigned rowHeight;
-            unsigned colWidth = 0;
-
             for (auto &txt : col)
             {
-                colWidth = std::max(colWidth, txt.width);
+                if (!txt.dirty)
+                    continue;
 
-                if (!txt.text.empty())
-                {
-                    rowHeight = txt.height;
-
-                    float x0UV = static_cast<float>(coords[0])  / rtW;
-                    float y0UV = static_cast<float>(coords[1])  / rtH;
-                    float x1UV = x0UV + static_cast<float>(txt.width)  / rtW;
-                    float y1UV = y0UV + static_cast<float>(txt.height) / rtH;
-
-                    float x0NDC =   x0UV * 2 - 1;
-                    float y0NDC = -(y0UV * 2 - 1);
-                    float x1NDC =   x1UV * 2 - 1;
-                    float y1NDC = -(y1UV * 2 - 1);
-
-                    float H = (y0NDC - y1NDC) / 2.f * rtH;
-
-                    Vertex v0;
-                    Vertex v1;
-                    Vertex v2;
-                    Vertex v3;
-
-                    v0.pos[0] = x0NDC;
-                    v0.pos[1] = y0NDC;
-                    v1.pos[0] = x0NDC;
-                    v1.pos[1] = y1NDC;
-                    v2.pos[0] = x1NDC;
-                    v2.pos[1] = y0NDC;
-                    v3.pos[0] = x1NDC;
-                    v3.pos[1] = y1NDC;
-
-                    v0.uv     = txt.uvUpperLeft;
-                    v1.uv[0]  = txt.uvUpperLeft[0];
-                    v1.uv[1]  = txt.uvLowerRight[1];
-                    v2.uv[0]  = txt.uvLowerRight[0];
-                    v2.uv[1]  = txt.uvUpperLeft[1];
-                    v3.uv     = txt.uvLowerRight;
-
-                    float4 c;
-                    c[0] = txt.color[0];
-                    c[1] = txt.color[1];
-                    c[2] = txt.color[2];
-                    c[3] = 1;
-
-                    v0.color = c;
-                    v1.color = c;
-                    v2.color = c;
-                    v3.color = c;
-
-                    uint16_t iBase = static_cast<uint16_t>(vertices.size());
-                    uint16_t i0    = iBase + 0;
-                    uint16_t i1    = iBase + 1;
-                    uint16_t i2    = iBase + 2;
-                    uint16_t i3    = iBase + 1;
-                    uint16_t i4    = iBase + 3;
-                    uint16_t i5    = iBase + 2;
-
-                    vertices.emplace_back(v0);
-                    vertices.emplace_back(v1);
-                    vertices.emplace_back(v2);
-                    vertices.emplace_back(v3);
-
-                    indices.emplace_back(i0);
-                    indices.emplace_back(i1);
-                    indices.emplace_back(i2);
-                    indices.emplace_back(i3);
-                    indices.emplace_back(i4);
-                    indices.emplace_back(i5);
-                }
-                else
+                quads.clear();
+                glyphs.layout(txt.text,
+                              static_cast<float>(txt.coords[0]),
+                              static_cast<float>(txt.coords[1]),
+                              quads);
+
+                float4 c;
+                c[0] = txt.color[0];
+                c[1] = txt.color[1];
+                c[2] = txt.color[2];
+                c[3] = 1;
+
+                auto v = vertices.begin() + txt.firstGlyph * 4;
+
+                for (auto &q : quads)
                 {
-                    rowHeight = maxRowHeight;
+                    float x0 = q.x0 * scaleX - 1;
+                    float y0 = q.y0 * scaleY + 1;
+                    float x1 = q.x1 * scaleX - 1;
+                    float y1 = q.y1 * scaleY + 1;
+
+                    *v++ = { { x0, y0 }, { q.u0, q.v0 }, c };
+                    *v++ = { { x0, y1 }, { q.u0, q.v1 }, c };
+                    *v++ = { { x1, y0 }, { q.u1, q.v0 }, c };
+                    *v++ = { { x1, y1 }, { q.u1, q.v1 }, c };
                 }
 
-                coords[1] += rowHeight + RowMargin;
+                // The unused quads are degenerate, so they are not rasterized.
+                std::fill(v, vertices.begin() + (txt.firstGlyph + txt.glyphCapacity) * 4, Vertex {});
+
+                firstDirty = std::min(firstDirty, txt.firstGlyph);
+                endDirty   = std::max(endDirty,   txt.firstGlyph + txt.glyphCapacity);
+                txt.dirty  = false;
             }
+        }
 
-            coords[0] += colWidth + ColMargin;
+        layoutDirty = false;
+
+        if (firstDirty < endDirty)
+        {
+            D3D11_BOX dstBox = {0};
+            dstBox.left   = firstDirty * 4 * sizeof(Vertex);
+            dstBox.right  = endDirty   * 4 * sizeof(Vertex);
+            dstBox.bottom = 1;
+            dstBox.back   = 1;
+            context->UpdateSubresource(vertexBuffer.buffer, 0, &dstBox,
+                                       vertices.data() + firstDirty * 4, 0, 0);
         }
 
-        D3D11_MAPPED_SUBRESOURCE mapped;
+        {
+            GPUScope scope(L"Draw text overlay");
+
+            static const float Transparent[] = { 0, 0, 0, 0 };
+            clearRenderTarget(overlay.rtv, Transparent);
+            setRenderTarget(overlay);
+
+            textPipeline.bind();
+            setVertexBuffers(&vertexBuffer, &indexBuffer);
+            setShaderResources(ShaderStage::PS, 0, { font->texture.srv });
+            setSamplers(ShaderStage::PS, 0, { textSampler });
+            drawIndexed(reservedGlyphs * 6);
+
+            setRenderTarget(nullptr);
+        }
 
-        checkHR(context->Map(vertexBuffer.buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped));
-        memcpy(mapped.pData, vertices.data(), sizeBytes(vertices));
-        context->Unmap(vertexBuffer.buffer, 0);
+        return true;
+    }
 
-        checkHR(context->Map(indexBuffer.buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped));
-        memcpy(mapped.pData, indices.data(), sizeBytes(indices));
-        context->Unmap(indexBuffer.buffer, 0);
+    // Glyphs drawn into the overlay by the last update.
+    unsigned glyphCount() const
+    {
+        return drawnGlyphs;
+    }
 
-        UINT strides[] = { sizeof(Vertex) };
-        UINT offsets[] = { 0 };
+    // Draw the overlay with its upper left corner at offset.
+    void render(Resource &renderTarget, uint2 offset)
+    {
+        if (!overlay)
+            return;
 
         setRenderTarget(renderTarget);
+        setViewport(offset[0], offset[1], overlaySize[0], overlaySize[1]);
 
-        textPipeline.bind();
-        context->IASetVertexBuffers(0, 1, bind(vertexBuffer.buffer), strides, offsets);
-        context->IASetIndexBuffer(indexBuffer.buffer, DXGI_FORMAT_R16_UINT, 0);
-        context->PSSetShaderResources(0, 1, bind(textCache.srv));
-        context->PSSetSamplers(0, 1, bind(textSampler));
-        context->DrawIndexed(static_cast<UINT>(indices.size()), 0, 0);
+        overlayPipeline.bind();
+        setVertexBuffers(&quadBuffer, &indexBuffer);
+        setShaderResources(ShaderStage::PS, 0, { overlay.srv });
+        setSamplers(ShaderStage::PS, 0, { overlaySampler });
+        drawIndexed(6);
 
         setRenderTarget(nullptr);
     }
@@ -1674,6 +2099,15 @@ public:
         }
     }
 
+    Mesh loadGeometry(int index) const
+    {
+        if (paths.empty())
+            return Mesh();
+
+        auto meshFiles = searchFiles(paths[index], "*.obj");
+        return loadMeshGeometry(meshFiles, MeshLoadMode::SwapYZ);
+    }
+
     static void retessellate(Mesh &mesh, float tessellationTriangleArea = 0)
     {
         Mesh newMesh = loadMesh(mesh.objFiles, MeshLoadMode::SwapYZ, tessellationTriangleArea);
@@ -1699,6 +2133,171 @@ float computeTargetTriangleArea(const SVBRDF &svbrdf, float displacementDensity)
     return targetTriangleArea;
 }
 
+// Build the uniform displacement mapped grid from W x H vertex heights, in
+// parallel over rows. The positions and normals are computed four vertices
+// at a time. The normals come from the central height differences of the
+// grid, which are the same as the normals of a smooth surface through the
+// vertices, so no pass over the triangles is needed. So do the tangent
+// frames: the tangent follows U, i.e. x, over the surface, and the
+// bitangent sign is negative, as V grows towards -y.
+void generateDisplacedGrid(const std::vector<float> &grid, unsigned W, unsigned H,
+                           float xDim, float yDim,
+                           float displacementMagnitude, float tessellation,
+                           std::vector<Vertex> &vertices, std::vector<uint32_t> &indices)
+{
+    check(W >= 2 && H >= 2, "Heightmap too small for the displacement density");
+    check(grid.size() == static_cast<size_t>(W) * H, "Invalid displacement grid");
+
+    const unsigned quadsX = W - 1;
+    const unsigned quadsY = H - 1;
+
+    vertices.resize(static_cast<size_t>(W) * H);
+    indices.resize(static_cast<size_t>(quadsX) * quadsY * 6);
+
+    const float maxX = static_cast<float>(W - 1);
+    const float maxY = static_cast<float>(H - 1);
+
+    // World space distance between neighboring vertices along x and y.
+    const float stepX = 2 * xDim / maxX;
+    const float stepY = 2 * yDim / maxY;
+
+    // Rows are padded to whole vectors, and with one clamped height on each
+    // side for the differences.
+    const unsigned paddedW = divRoundUp(W, 4u) * 4;
+
+    // The differences span two vertices, except at the edges.
+    std::vector<float> invSpanX(paddedW, .5f);
+    invSpanX[0]     = 1;
+    invSpanX[W - 1] = 1;
+
+    auto loadRow = [&](unsigned y, float *row)
+    {
+        const float *src = grid.data() + static_cast<size_t>(y) * W;
+        std::copy(src, src + W, row + 1);
+        row[0] = row[1];
+        for (unsigned x = W + 1; x < paddedW + 2; ++x)
+            row[x] = row[W];
+    };
+
+    parallelFor(0, H, [&](size_t yIndex)
+    {
+        unsigned y = static_cast<unsigned>(yIndex);
+
+        std::vector<float> rows((paddedW + 2) * 3);
+        float *above = rows.data();
+        float *row   = above + paddedW + 2;
+        float *below = row   + paddedW + 2;
+
+        loadRow(y > 0 ? y - 1 : y, above);
+        loadRow(y, row);
+        loadRow(y + 1 < H ? y + 1 : y, below);
+
+        float v           = static_cast<float>(y) / maxY;
+        float invSpanY    = (y == 0 || y == H - 1) ? 1.f : .5f;
+        Vertex *rowVertices = vertices.data() + static_cast<size_t>(y) * W;
+
+        const XMVECTOR lane        = XMVectorSet(0, 1, 2, 3);
+        const XMVECTOR uScale      = XMVectorReplicate(1.f / maxX);
+        const XMVECTOR magnitude   = XMVectorReplicate(displacementMagnitude);
+        const XMVECTOR normalX     = XMVectorReplicate(-stepY * displacementMagnitude);
+        const XMVECTOR normalY     = XMVectorReplicate( stepX * displacementMagnitude * invSpanY);
+        const XMVECTOR normalZ     = XMVectorReplicate( stepX * stepY);
+        const XMVECTOR tangentX    = XMVectorReplicate(stepX);
+
+        XMFLOAT4 px, pz, pu, nx, ny, nz, tx, tz;
+
+        for (unsigned x = 0; x < W; x += 4)
+        {
+            XMVECTOR left   = XMLoadFloat4(reinterpret_cast<const XMFLOAT4 *>(row   + x));
+            XMVECTOR center = XMLoadFloat4(reinterpret_cast<const XMFLOAT4 *>(row   + x + 1));
+            XMVECTOR right  = XMLoadFloat4(reinterpret_cast<const XMFLOAT4 *>(row   + x + 2));
+            XMVECTOR up     = XMLoadFloat4(reinterpret_cast<const XMFLOAT4 *>(above + x + 1));
+            XMVECTOR down   = XMLoadFloat4(reinterpret_cast<const XMFLOAT4 *>(below + x + 1));
+            XMVECTOR span   = XMLoadFloat4(reinterpret_cast<const XMFLOAT4 *>(invSpanX.data() + x));
+
+            XMVECTOR u  = XMVectorMultiply(XMVectorAdd(XMVectorReplicate(static_cast<float>(x)), lane), uScale);
+            XMVECTOR vx = XMVectorScale(XMVectorSubtract(XMVectorAdd(u, u), g_XMOne), xDim);
+            XMVECTOR vz = XMVectorMultiply(center, magnitude);
+
+            // The cross product of the tangents along x and y, which is
+            // (-dz/dx * stepY, dz/dy * stepX, stepX * stepY), with y flipped
+            // as the rows go down.
+            XMVECTOR dx = XMVectorMultiply(XMVectorSubtract(right, left), span);
+            XMVECTOR dy = XMVectorSubtract(down, up);
+            XMVECTOR n0 = XMVectorMultiply(dx, normalX);
+            XMVECTOR n1 = XMVectorMultiply(dy, normalY);
+            XMVECTOR n2 = normalZ;
+            XMVECTOR invLength = XMVectorReciprocalSqrt(
+                XMVectorMultiplyAdd(n0, n0, XMVectorMultiplyAdd(n1, n1, XMVectorMultiply(n2, n2))));
+
+            XMStoreFloat4(&px, vx);
+            XMStoreFloat4(&pz, vz);
+            XMStoreFloat4(&pu, u);
+            XMStoreFloat4(&nx, XMVectorMultiply(n0, invLength));
+            XMStoreFloat4(&ny, XMVectorMultiply(n1, invLength));
+            XMStoreFloat4(&nz, XMVectorMultiply(n2, invLength));
+
+            // The tangent along x, (stepX, 0, dz/dx * stepX), is orthogonal
+            // to the normal.
+            XMVECTOR t2 = XMVectorMultiply(dx, magnitude);
+            XMVECTOR invTangentLength = XMVectorReciprocalSqrt(
+                XMVectorMultiplyAdd(t2, t2, XMVectorMultiply(tangentX, tangentX)));
+            XMStoreFloat4(&tx, XMVectorMultiply(tangentX, invTangentLength));
+            XMStoreFloat4(&tz, XMVectorMultiply(t2, invTangentLength));
+
+            const float *lanes[8] = { &px.x, &pz.x, &pu.x, &nx.x, &ny.x, &nz.x, &tx.x, &tz.x };
+            unsigned count = std::min(4u, W - x);
+            for (unsigned i = 0; i < count; ++i)
+            {
+                Vertex &vert = rowVertices[x + i];
+                vert.pos[0]    = lanes[0][i];
+                vert.pos[1]    = (((1.f - v) * 2) - 1) * yDim;
+                vert.pos[2]    = lanes[1][i];
+                vert.normal[0] = lanes[3][i];
+                vert.normal[1] = lanes[4][i];
+                vert.normal[2] = lanes[5][i];
+                vert.uv[0]     = lanes[2][i];
+                vert.uv[1]     = v;
+                vert.tessellation = tessellation;
+
+                float tangent[3] = { lanes[6][i], 0, lanes[7][i] };
+                vert.tangentFrame = TangentFrames::encode(tangent, vert.normal.data(), -1);
+            }
+        }
+
+        if (y == quadsY)
+            return;
+
+        uint32_t *quad = indices.data() + static_cast<size_t>(y) * quadsX * 6;
+
+        for (unsigned qx = 0; qx < quadsX; ++qx, quad += 6)
+        {
+            // even quads:    odd quads:
+            // A---B          A---B
+            // |  /|          |\  |
+            // | / |          | \ |
+            // |/  |          |  \|
+            // C---D          C---D
+            uint32_t A = y * W + qx;
+            uint32_t B = A + 1;
+            uint32_t C = A + W;
+            uint32_t D = C + 1;
+
+            // Counterclockwise triangles
+            if (((y + qx) % 2) == 0)
+            {
+                quad[0] = A; quad[1] = C; quad[2] = B;
+                quad[3] = B; quad[4] = C; quad[5] = D;
+            }
+            else
+            {
+                quad[0] = A; quad[1] = D; quad[2] = B;
+                quad[3] = A; quad[4] = C; quad[5] = D;
+            }
+        }
+    }, 4);
+}
+
 class SVBRDFRenderer final 
 {
 public:
@@ -1721,31 +2320,133 @@ public:
         float shadowSSDepthBias;
         bool  wireframe;
         bool  tessellation;
+        // Index of the eye being rendered, or 0 without VR.
+        unsigned view;
+        // Render both eyes side by side with one instanced draw. The above
+        // camera is then the left eye, and these are for the right eye.
+        bool     stereo;
+        XMMATRIX rightViewProj;
+        XMVECTOR rightCameraPosition;
+        // Maximum amount of texels relit per view each frame
+        // with texture space lighting.
+        uint  lightingTexelBudget;
+#if defined(DEBUG_SHADOW_MATRICES)
+        // Render the view from this shadow cube face instead, unless -1.
+        int   shadowView;
+#endif
+#if defined(DEBUG_SHADOW_CPU_RASTERIZER)
+        bool  validateShadowMaps;
+        bool  showCPUShadowMaps;
+#endif
     };
 
+    // Separate texture space specular lighting is kept for each view.
+    static const unsigned MaxViews = 2;
+
 private:
     GraphicsPipeline renderMeshPipeline;
     GraphicsPipeline renderMeshPipelineTessellated;
     Resource vertexBuffer;
     Resource indexBuffer;
+    Resource shadowVertexBuffer;
+    Resource shadowIndexBuffer;
+#if defined(DEBUG_SHADOW_CPU_RASTERIZER)
+    // Only the software rasterizer reads the geometry back.
+    std::shared_ptr<const std::vector<Vertex>> cpuVertices;
+    std::shared_ptr<const std::vector<uint32_t>> cpuIndices;
+#endif
     CComPtr<ID3D11SamplerState> bilinear;
     CComPtr<ID3D11SamplerState> aniso;
 
-    MeshMode meshMode;
-    DisplacementMode displacementMode;
     unsigned indexCount;
+    unsigned shadowIndexCount;
     float meshScale;
 
-    std::vector<Light> lights;
+    // The coarser LODs of a loaded mesh, which share its vertex buffer, and
+    // the radius of its bounding sphere around the origin.
+    struct GeometryLod
+    {
+        Resource indexBuffer;
+        unsigned indexCount;
+        float error;
+    };
+    std::vector<GeometryLod> lods;
+    float meshRadius;
+
+    // What the resources were last built from. The material and the mesh
+    // are identified by their textures and buffers, which are referenced
+    // here, so that new ones cannot reuse the same addresses. The settings
+    // that the geometry does not depend on are zeroed. The displacement
+    // magnitude is not one of them, as the displaced meshes are built with
+    // unit heights, which the vertex shader scales.
+    struct Configuration
+    {
+        MeshMode meshMode;
+        DisplacementMode displacementMode;
+        float displacementDensity;
+        CComPtr<ID3D11Texture2D> material;
+        CComPtr<ID3D11Buffer> mesh;
+        unsigned shadowLights;
+        unsigned shadowResolution;
+        int   shadowDepthBias;
+        float shadowSSDepthBias;
+    };
+    Configuration configuration;
+    bool configured;
 
-    struct RegularMeshVSConstants
+    // The CPU displaced meshes of a material, and the coarser meshes for its
+    // shadow maps, if any. The material is identified by its path, so that
+    // the meshes are reused when it is loaded again.
+    struct DisplacedMeshKey
     {
-        XMMATRIX viewProj;
-        float scale;
-        float displacementMagnitude;
+        std::string material;
+        bool adaptive;
+        unsigned pixelsPerVertex;
+        float tessellation;
+
+        bool operator<(const DisplacedMeshKey &other) const
+        {
+            return std::tie(material, adaptive, pixelsPerVertex, tessellation)
+                 < std::tie(other.material, other.adaptive, other.pixelsPerVertex, other.tessellation);
+        }
     };
 
-    struct LightingPSConstants
+    struct DisplacedMesh
+    {
+        Resource vertexBuffer;
+        Resource indexBuffer;
+        unsigned indexCount;
+        Resource shadowVertexBuffer;
+        Resource shadowIndexBuffer;
+        unsigned shadowIndexCount;
+#if defined(DEBUG_SHADOW_CPU_RASTERIZER)
+        std::shared_ptr<const std::vector<Vertex>> vertices;
+        std::shared_ptr<const std::vector<uint32_t>> indices;
+#endif
+        // On the GPU, and on the CPU for the software rasterizer.
+        uint64_t bytes;
+    };
+
+    LruCache<DisplacedMeshKey, DisplacedMesh> displacedMeshes;
+    // The errors of the adaptive meshes only depend on the heightmap, so
+    // they are kept for the last material to change the density quickly.
+    std::shared_ptr<const HeightfieldMesh> heightfield;
+    std::string heightfieldMaterial;
+
+    std::vector<Light> lights;
+
+    struct RegularMeshVSConstants
+    {
+        XMMATRIX viewProj;
+        float scale;
+        float displacementMagnitude;
+        uint  stereo;
+        // Scale of the vertex heights, see heightScale().
+        float heightScale;
+        XMMATRIX rightViewProj;
+    };
+
+    struct LightingPSConstants
     {
         XMVECTOR ambientLight;
         XMVECTOR cameraPosition;
@@ -1755,18 +2456,109 @@ private:
         uint   normalMode;
         uint   useNormalMapping;
         uint   numLights;
+        float  displacementMagnitude;
+        uint   flatDisplacementBase;
+        XMVECTOR rightCameraPosition;
+    };
+
+    // Same as in Displacement.hs.hlsl
+    struct TessellationHSConstants
+    {
+        XMMATRIX viewProj;
+        XMMATRIX rightViewProj;
+        XMVECTOR eyePosition;
+        XMVECTOR rightEyePosition;
+        float viewportSize[2];
+        float edgePixels;
+        float displacementMagnitude;
+        uint  heightmapSize[2];
+        uint  heightBoundsLevels;
+        uint  _padding;
     };
 
     struct TextureSpacePSConstants
     {
         float displacementMagnitude;
+        uint  lightingTerms;
+    };
+
+    // Same as in Lighting.h.hlsl
+    enum LightingTerms : uint
+    {
+        LightingDiffuse  = 1,
+        LightingSpecular = 2,
+        LightingAll      = LightingDiffuse | LightingSpecular,
+    };
+    static const unsigned StoredShadowLights = 4;
+
+    struct TileConstants
+    {
+        float targetSize[2];
+    };
+
+    struct FeedbackConstants
+    {
+        float lightingMapSize[2];
+        float tileSize;
+        uint  tilesX;
+        uint  tilesY;
+        uint  feedbackPixel[2];
+    };
+
+    // Stencil values marking the tiles to relight
+    enum TileStencil : UINT
+    {
+        StencilDiffuseAndSpecular = 1,
+        StencilSpecular           = 2,
     };
 
     LightingMode lightingMode;
     TextureSpaceLightingPrecision lightingPrecision;
     GraphicsPipeline renderTextureSpaceLightingPipeline;
-    Resource textureSpaceLightingMap;
-    Resource textureSpaceLightingDepth;
+    GraphicsPipeline markLightingTilesPipeline;
+    GraphicsPipeline downsampleLightingTilesPipeline;
+    // The diffuse lighting is view independent and shared by all views,
+    // the specular lighting map of a view is created when first used.
+    DXGI_FORMAT lightingMapFormat;
+    Resource diffuseLightingMap;
+    std::vector<Resource> diffuseLightingMips;
+    std::array<Resource, MaxViews> specularLightingMaps;
+    std::array<std::vector<Resource>, MaxViews> specularLightingMips;
+    // With shared diffuse lighting, there are no specular lighting maps.
+    // Instead, the shadow terms are stored for the per eye specular lighting.
+    Resource shadowTermMap;
+    std::vector<Resource> shadowTermMips;
+    Resource textureSpaceLightingStencil;
+    std::vector<Resource> textureSpaceLightingStencilMips;
+    // The lighting maps and the stencil come from the texture pool, so
+    // reconfiguring back and forth reuses them.
+    PooledTextures lightingTextures;
+    Resource lightingTileRects;
+    LightingTileScheduler lightingTiles;
+    // The tiles and mip levels sampled by each view are recorded on the GPU,
+    // and copied to a ring of staging buffers that are read once the GPU has
+    // finished with them, so the readback never stalls.
+    static const unsigned FeedbackReadbackLatency = 3;
+    struct FeedbackBuffers
+    {
+        Resource tileLevels;
+        std::array<Resource, FeedbackReadbackLatency> readback;
+        uint64_t written;
+        uint64_t read;
+        // Cleared and not yet copied for readback
+        bool recording;
+    };
+    std::array<FeedbackBuffers, MaxViews> lightingFeedbackBuffers;
+    LightingFeedback lightingFeedback;
+    unsigned lastLightingView;
+
+    // Pixels shaded per view according to the GPU, and the shading work of
+    // whole frames for comparing the lighting modes.
+    std::array<PipelineStatisticsQuery, MaxViews> viewStatistics;
+    std::array<uint64_t, MaxViews> viewPixels;
+    ShadingCostModel costModel;
+    ShadingCostModel::Work frameWork;
+    ShadingCostModel::Work lastFrameWork;
 
     Resource lightBuffer;
 
@@ -1790,6 +2582,7 @@ private:
     GraphicsPipeline renderShadowMapPipeline;
     GraphicsPipeline renderShadowMapPipelineTessellated;
     GraphicsPipeline unprojectShadowMapPipeline;
+    PooledTextures shadowTextures;
     Resource shadowMaps;
     std::vector<XMMATRIX> shadowViewProjs;
     Resource shadowViewProjBuffer;
@@ -1797,117 +2590,132 @@ private:
     std::vector<Resource> shadowMapCubeFaceDSVs;
     ShadowConstants shadowConstants;
     Resource debugRTV;
+#if defined(DEBUG_SHADOW_CPU_RASTERIZER)
+    DepthRasterizer cpuRasterizer;
+    Resource cpuShadowMaps;
+#endif
 
 public:
 
-    SVBRDFRenderer(MeshMode meshMode, DisplacementMode displacementMode,
-                   LightingMode lightingMode,
-                   TextureSpaceLightingPrecision lightingPrecision)
-        : meshMode(meshMode)
-        , displacementMode(displacementMode)
-        , lightingMode(lightingMode)
-        , lightingPrecision(lightingPrecision)
+    // The parts of the renderer rebuilt by configure().
+    struct Rebuilt
     {
-        if (lightingMode == LightingMode::ForwardLighting)
-        {
-            constructForward();
-        }
-        else if (lightingMode == LightingMode::TextureSpaceLighting)
-        {
-            constructTextureSpace();
-        }
-        else
+        bool pipelines;
+        bool geometry;
+        bool lightingMaps;
+        bool shadows;
+
+        bool any() const
         {
-            check(false, "Unknown lighting mode!");
+            return pipelines || geometry || lightingMaps || shadows;
         }
+    };
+
+    SVBRDFRenderer()
+        : displacedMeshes(DisplacedMeshCacheBytes)
+    {
+        lightingMode      = LightingMode::ForwardLighting;
+        lightingPrecision = TextureSpaceLightingPrecision::Float11_11_10;
+        lightingMapFormat = DXGI_FORMAT_UNKNOWN;
+        lastLightingView  = 0;
+        shadowLights      = 0;
+        configured        = false;
 
         constructLightBuffer();
 
+        viewPixels.fill(0);
+        zero(frameWork);
+        zero(lastFrameWork);
+
         bilinear = samplerBilinear(D3D11_TEXTURE_ADDRESS_WRAP);
         aniso = samplerAnisotropic(8, D3D11_TEXTURE_ADDRESS_WRAP);
 
         indexCount = 0;
+        shadowIndexCount = 0;
         meshScale = 1;
+        meshRadius = 0;
+
     }
 
-    void init(SVBRDF &svbrdf, Mesh *mesh, const Constants &constants) 
+    // Take the given settings, material and mesh into use, and rebuild in
+    // place only the parts of the renderer that depend on what changed.
+    // The first call builds everything.
+    Rebuilt configure(MeshMode meshMode, DisplacementMode displacementMode,
+                      LightingMode newLightingMode,
+                      TextureSpaceLightingPrecision newLightingPrecision,
+                      SVBRDF &svbrdf, Mesh *mesh, const Constants &constants)
     {
-        static const float Dim = 5.f;
-
-        float displacementDensity   = constants.displacementDensity;
-        float displacementMagnitude = constants.displacementMagnitude;
-
-        float smallerDim = static_cast<float>(std::min(svbrdf.width, svbrdf.height));
-        float xDim = Dim * static_cast<float>( svbrdf.width) / smallerDim;
-        float yDim = Dim * static_cast<float>(svbrdf.height) / smallerDim;
-
-        bool displacementEnabled =
-            displacementMode != DisplacementMode::NoDisplacement
-            && displacementDensity > 0
-            && displacementMagnitude != 0;
-
-        if (meshMode == MeshMode::SingleQuad)
+        Configuration c = configurationFor(meshMode, displacementMode, svbrdf, mesh, constants);
+        auto &old = configuration;
+
+        Rebuilt rebuilt;
+        zero(rebuilt);
+
+        rebuilt.pipelines = !configured || newLightingMode != lightingMode;
+
+        rebuilt.geometry = !configured
+            || c.meshMode              != old.meshMode
+            || c.displacementMode      != old.displacementMode
+            || c.displacementDensity   != old.displacementDensity
+            || c.mesh                  != old.mesh
+            || (c.meshMode == MeshMode::SingleQuad && c.material != old.material);
+
+        // The lighting maps have the dimensions of the material, and a new
+        // material has to be relit in any case.
+        rebuilt.lightingMaps = !configured
+            || newLightingMode      != lightingMode
+            || newLightingPrecision != lightingPrecision
+            || c.material           != old.material;
+
+        rebuilt.shadows = !configured
+            || c.shadowLights      != old.shadowLights
+            || c.shadowResolution  != old.shadowResolution
+            || c.shadowDepthBias   != old.shadowDepthBias
+            || c.shadowSSDepthBias != old.shadowSSDepthBias;
+
+        configuration     = c;
+        configured        = true;
+        lightingMode      = newLightingMode;
+        lightingPrecision = newLightingPrecision;
+
+        if (rebuilt.pipelines)
         {
-            if (displacementEnabled)
+            if (lightingMode == LightingMode::ForwardLighting)
             {
-                if (displacementMode == DisplacementMode::CPUDisplacementMapping)
-                {
-                    initCPUDisplacementMapped(svbrdf, xDim, yDim, displacementDensity, displacementMagnitude, 1.f);
-                }
-                else
-                {
-                    float cpuTess = 64.f;
-                    float targetTriangleArea = computeTargetTriangleArea(svbrdf, displacementDensity);
-                    float uDim = xDim / cpuTess;
-                    float vDim = yDim / cpuTess;
-                    float cpuTriangleArea = uDim * vDim / 2;
-                    float areaRatio = cpuTriangleArea / targetTriangleArea;
-                    float gpuTess = std::sqrt(areaRatio);
-                    initCPUDisplacementMapped(svbrdf, xDim, yDim, cpuTess, 0, gpuTess);
-                }
+                constructForward();
+            }
+            else if (usesLightingMaps())
+            {
+                constructTextureSpace();
             }
             else
             {
-                initSingleQuad(svbrdf, xDim, yDim, MaxTessellation);
+                check(false, "Unknown lighting mode!");
             }
         }
-        else if (meshMode == MeshMode::LoadedMesh)
+
+        if (rebuilt.geometry)
+            constructGeometry(svbrdf, mesh, c);
+
+        if (!usesLightingMaps())
         {
-            initLoadedMesh(svbrdf, *mesh, Dim);
+            rebuilt.lightingMaps = false;
+            releaseLightingMaps();
         }
-        else
+        else if (rebuilt.lightingMaps)
         {
-            check(false, "Unknown mesh mode!");
+            constructLightingMaps(svbrdf);
         }
-
-        if (lightingMode == LightingMode::TextureSpaceLighting)
+        else if (rebuilt.geometry)
         {
-            DXGI_FORMAT format;
-
-            switch (lightingPrecision)
-            {
-            default:
-            case TextureSpaceLightingPrecision::Float11_11_10:
-                format = DXGI_FORMAT_R11G11B10_FLOAT;
-                break;
-            case TextureSpaceLightingPrecision::Float16:
-                format = DXGI_FORMAT_R16G16B16A16_FLOAT;
-                break;
-            case TextureSpaceLightingPrecision::Float32:
-                format = DXGI_FORMAT_R32G32B32A32_FLOAT;
-                break;
-            }
-            auto lightingMapDesc = texture2DDesc(svbrdf.width, svbrdf.height, format);
-            auto dimPow2 = std::min(roundUpToPowerOf2(svbrdf.width), roundUpToPowerOf2(svbrdf.height));
-            lightingMapDesc.MipLevels = static_cast<UINT>(log2(dimPow2));
-            lightingMapDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET;
-            lightingMapDesc.MiscFlags = D3D11_RESOURCE_MISC_GENERATE_MIPS;
-
-            textureSpaceLightingMap = Resource(lightingMapDesc);
-            RESOURCE_DEBUG_NAME(textureSpaceLightingMap);
+            // The lit texels come from the geometry, so all of them are stale.
+            lightingTiles.invalidate();
         }
 
-        constructShadowMapping(constants);
+        if (rebuilt.shadows)
+            constructShadowMapping(constants);
+
+        return rebuilt;
     }
 
     void updateLights(const std::vector<Light> &newLights)
@@ -1950,37 +2758,153 @@ public:
                                    SVBRDF &svbrdf,
                                    const Constants &constants) 
     {
-        shadowConstants = computeShadowConstants(constants);
+        beginFrame(constants);
 
         if (shadowLights > 0)
         {
             renderShadowMaps(cb, svbrdf, constants);
         }
+
+        updateViewIndependentLighting(cb, svbrdf, constants);
     }
 
-    void render(ConstantBuffers &cb,
-                SVBRDF &svbrdf,
-                const Constants &konstants,
-                Resource &renderTarget, Resource &depthBuffer) 
+    // The parts of renderViewportIndependent(), for recording the shadow
+    // maps of each light separately. beginFrame() comes first, and
+    // updateViewIndependentLighting() after every shadow map.
+    void beginFrame(const Constants &constants)
     {
-        Constants constants = konstants;
-#if defined(DEBUG_SHADOW_MATRICES)
-        static int shadowView = -1;
-        static int prevShadowView = -1;
-        updateValueWrap('E', 'Q', shadowView, 1, -1, 6);
-        if (shadowView >= 0 && !shadowViewProjs.empty())
+        lastFrameWork = frameWork;
+        zero(frameWork);
+
+        shadowConstants = computeShadowConstants(constants);
+    }
+
+    unsigned shadowMapLights() const
+    {
+        return shadowLights;
+    }
+
+    // Render the six cube map faces of one shadowed light. Nothing is shared
+    // with the other lights, so they can be recorded in parallel.
+    void renderShadowMap(ConstantBuffers &cb,
+                         SVBRDF &svbrdf,
+                         const Constants &constants,
+                         unsigned L)
+    {
+        GPUScope scope(L"Point light shadows");
+
+        if (constants.tessellation)
+            renderShadowMapPipelineTessellated.bind();
+        else
+            renderShadowMapPipeline.bind();
+
+        unsigned lodIndexCount = setLodBuffers(shadowVertexBuffer, shadowIndexBuffer, shadowIndexCount,
+                                               shadowLod(constants, L));
+
+        for (unsigned i = 0; i < 6; ++i)
         {
-            constants.viewProj = shadowViewProjs[shadowView];
+            GPUScope scope(L"Cube map face");
+
+            unsigned idx = L * 6 + i;
+
+            RegularMeshVSConstants vsConstants;
+            zero(vsConstants);
+            vsConstants.viewProj              = shadowViewProjs[idx];
+            vsConstants.scale                 = meshScale;
+            vsConstants.displacementMagnitude = constants.displacementMagnitude;
+            vsConstants.heightScale           = heightScale(constants);
+
+            auto &dsv = shadowMapCubeFaceDSVs[idx];
+            clearDepthStencil(dsv.dsv, D3D11_CLEAR_DEPTH, D3D11_MIN_DEPTH, 0);
+#if defined(DEBUG_SHADOW_MAPS)
+            clearRenderTarget(debugRTV.rtv, std::array<float, 4> { 0, 0, 0, 1 }.data());
+            setRenderTarget(debugRTV, &dsv);
+#else
+            setDepthOnly(dsv);
+#endif
+
+            auto vsCB = cb.write(vsConstants);
+
+            setConstantBuffer(ShaderStage::VS, 0, vsCB);
+            setConstantBuffer(ShaderStage::DS, 0, vsCB);
+            setShaderResources(ShaderStage::DS, 0, { svbrdf.heightMap.srv });
+            setSamplers(ShaderStage::DS, 0, { bilinear });
 
-            if (prevShadowView != shadowView)
+            if (constants.tessellation)
             {
-                log("Shadow view: %d\n", shadowView);
-                prevShadowView = shadowView;
+                float resolution = static_cast<float>(constants.shadowResolution);
+                auto hsCB = cb.write(tessellationHSConstants(svbrdf, constants,
+                                                             shadowViewProjs[idx],
+                                                             toVec(lights[L].positionWorld, 1),
+                                                             resolution, resolution));
+                setConstantBuffer(ShaderStage::HS, 0, hsCB);
+                setShaderResources(ShaderStage::HS, 0, { svbrdf.heightBoundsMap.srv });
             }
+
+            bindLightingResources(svbrdf, false);
+#if defined(DEBUG_SHADOW_MAPS)
+            setShaderResources(ShaderStage::PS, 6, { shadowViewProjBuffer.srv });
+#endif
+            drawIndexed(lodIndexCount);
+            unbindLightingResources();
+
+            setRenderTarget(nullptr);
+        }
+    }
+
+    // Called on the immediate context once the shadow maps have been rendered.
+    void finishShadowMaps(const Constants &constants)
+    {
+#if defined(DEBUG_SHADOW_CPU_RASTERIZER)
+        if (constants.validateShadowMaps)
+            validateShadowMaps(constants);
+#else
+        (void)constants;
+#endif
+    }
+
+    // Lighting shared by every view, which depends on the shadow maps.
+    void updateViewIndependentLighting(ConstantBuffers &cb,
+                                       SVBRDF &svbrdf,
+                                       const Constants &constants)
+    {
+        if (lightingMode == LightingMode::SharedDiffuseLighting)
+        {
+            updateSharedLighting(cb, svbrdf, constants);
         }
+    }
+
+    // Whether renderView() can be recorded on a deferred context in parallel
+    // with other views. Texture space lighting reads back the lighting
+    // feedback and schedules tiles while rendering each view.
+    bool supportsParallelViews() const
+    {
+        return lightingMode != LightingMode::TextureSpaceLighting;
+    }
+
+    // Whether the views depend on the CPU side state left by
+    // updateViewIndependentLighting(), and have to be recorded after it.
+    bool viewsDependOnSharedLighting() const
+    {
+        return lightingMode == LightingMode::SharedDiffuseLighting;
+    }
+
+    // Render a view without reading anything back from the GPU, so that
+    // it can be recorded on a deferred context if supportsParallelViews().
+    // finishView() is called for it afterwards on the immediate context.
+    void renderView(ConstantBuffers &cb,
+                    SVBRDF &svbrdf,
+                    const Constants &konstants,
+                    Resource &renderTarget, Resource &depthBuffer) 
+    {
+        Constants constants = konstants;
+#if defined(DEBUG_SHADOW_MATRICES)
+        if (constants.shadowView >= 0 && static_cast<size_t>(constants.shadowView) < shadowViewProjs.size())
+            constants.viewProj = shadowViewProjs[constants.shadowView];
 #endif
 
-        shadowConstants = computeShadowConstants(constants);
+        check(!constants.stereo || supportsSinglePassStereo(),
+              "Single pass stereo is not supported with this lighting mode.");
 
         if (lightingMode == LightingMode::ForwardLighting)
         {
@@ -1990,6 +2914,16 @@ public:
         {
             renderTextureSpaceLighting(cb, svbrdf, constants, renderTarget, depthBuffer);
         }
+        else if (lightingMode == LightingMode::SharedDiffuseLighting)
+        {
+            renderSharedDiffuseLighting(cb, svbrdf, constants, renderTarget, depthBuffer);
+        }
+    }
+
+    // Read back the statistics of a rendered view on the immediate context.
+    void finishView(unsigned view)
+    {
+        countViewPixels(std::min(view, MaxViews - 1));
     }
 
     void unprojectShadowMap(ConstantBuffers &cb, const Constants &constants, unsigned slice)
@@ -2004,14 +2938,71 @@ public:
 
         auto vsCB = cb.write(vsConstants);
 
+        auto *shadowMapSource = &shadowMaps;
+#if defined(DEBUG_SHADOW_CPU_RASTERIZER)
+        if (constants.showCPUShadowMaps && cpuShadowMaps.valid())
+            shadowMapSource = &cpuShadowMaps;
+#endif
+
         unprojectShadowMapPipeline.bind();
-        context->VSSetShaderResources(0, 1, bind(shadowMaps.srv));
-        context->VSSetConstantBuffers(0, 1, bind(vsCB));
-        context->Draw(constants.shadowResolution * constants.shadowResolution, 0);
-        unbindResources(&ID3D11DeviceContext::VSSetShaderResources, { 0 });
+        setShaderResources(ShaderStage::VS, 0, { shadowMapSource->srv });
+        setConstantBuffer(ShaderStage::VS, 0, vsCB);
+        draw(constants.shadowResolution * constants.shadowResolution);
+        unbindShaderResources(ShaderStage::VS, { 0 });
+    }
+
+    // Texture space lighting keeps the specular lighting and the feedback
+    // separately for each eye, so it has to render them one at a time.
+    bool supportsSinglePassStereo() const
+    {
+        return lightingMode != LightingMode::TextureSpaceLighting;
+    }
+
+    // Texture space lighting statistics of the most recently rendered view.
+    // Returns false with forward lighting.
+    bool lightingTileStats(LightingTileScheduler::Stats &stats,
+                           std::vector<unsigned> &residency,
+                           unsigned &sampledTiles) const
+    {
+        if (!usesLightingMaps())
+            return false;
+
+        stats        = lightingTiles.stats();
+        residency    = lightingTiles.residency(lastLightingView);
+        sampledTiles = lightingFeedback.sampledTiles(lastLightingView);
+        return true;
+    }
+
+    // Estimated pixel shading work of the previous frame, compared to
+    // lighting all of its pixels with forward lighting.
+    ShadingCostModel::Estimate shadingCost(ShadingCostModel::Work &work) const
+    {
+        ShadingCostModel::Scene scene;
+        scene.lights             = static_cast<unsigned>(lights.size());
+        scene.shadowLights       = shadowConstants.shadowLights;
+        scene.pcfTaps            = shadowConstants.shadowPcfTaps;
+        scene.storedShadowLights = StoredShadowLights;
+
+        ShadingCostModel::Mode mode;
+        switch (lightingMode)
+        {
+        default:
+        case LightingMode::ForwardLighting:       mode = ShadingCostModel::Mode::Forward;       break;
+        case LightingMode::TextureSpaceLighting:  mode = ShadingCostModel::Mode::TextureSpace;  break;
+        case LightingMode::SharedDiffuseLighting: mode = ShadingCostModel::Mode::SharedDiffuse; break;
+        }
+
+        work = lastFrameWork;
+        return costModel.estimate(mode, scene, work);
     }
 
 private:
+    bool usesLightingMaps() const
+    {
+        return lightingMode == LightingMode::TextureSpaceLighting
+            || lightingMode == LightingMode::SharedDiffuseLighting;
+    }
+
     void constructForward()
     {
         // Setup depth buffering with inverse Z
@@ -2040,10 +3031,16 @@ private:
 
     void constructTextureSpace()
     {
+        // Either all lighting comes from the lighting maps, or only the view
+        // independent part, and the specular lighting is done per eye.
+        Shader<PS> lightingPS = (lightingMode == LightingMode::SharedDiffuseLighting)
+            ? Shader<PS>(shareddiffuselighting_ps)
+            : Shader<PS>(samplelightingfromtexture_ps);
+
         // Setup depth buffering with inverse Z
         renderMeshPipeline = GraphicsPipeline(
             regularmesh_vs,
-            samplelightingfromtexture_ps,
+            lightingPS,
             D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST,
             &depthStencilDesc(DepthMode::InverseDepth, true),
             &rasterizerDesc(true));
@@ -2053,105 +3050,371 @@ private:
             regularmesh_vs,
             displacement_hs,
             displacement_ds,
-            samplelightingfromtexture_ps,
+            lightingPS,
             D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST,
             &depthStencilDesc(DepthMode::InverseDepth, true),
             &rasterizerDesc(true));
         renderMeshPipelineTessellated.psWireframe = Shader<PS>(wireframe_ps);
 
+        // Tiles that need relighting are marked in the stencil buffer, and
+        // the lighting pass only shades the texels with a matching value.
+        D3D11_DEPTH_STENCIL_DESC markTiles = depthStencilDesc(DepthMode::Always, false, false);
+        markTiles.StencilEnable                = TRUE;
+        markTiles.StencilReadMask              = D3D11_DEFAULT_STENCIL_READ_MASK;
+        markTiles.StencilWriteMask             = D3D11_DEFAULT_STENCIL_WRITE_MASK;
+        markTiles.FrontFace.StencilFunc        = D3D11_COMPARISON_ALWAYS;
+        markTiles.FrontFace.StencilPassOp      = D3D11_STENCIL_OP_REPLACE;
+        markTiles.FrontFace.StencilFailOp      = D3D11_STENCIL_OP_KEEP;
+        markTiles.FrontFace.StencilDepthFailOp = D3D11_STENCIL_OP_KEEP;
+        markTiles.BackFace                     = markTiles.FrontFace;
+
+        D3D11_DEPTH_STENCIL_DESC shadeTiles = markTiles;
+        shadeTiles.StencilWriteMask            = 0;
+        shadeTiles.FrontFace.StencilFunc       = D3D11_COMPARISON_EQUAL;
+        shadeTiles.FrontFace.StencilPassOp     = D3D11_STENCIL_OP_KEEP;
+        shadeTiles.BackFace                    = shadeTiles.FrontFace;
+
+        CD3D11_RASTERIZER_DESC noCulling = rasterizerDesc(true);
+        noCulling.CullMode = D3D11_CULL_NONE;
+
         renderTextureSpaceLightingPipeline = GraphicsPipeline(
             texturespacemesh_vs,
             texturespacelighting_ps,
             D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST,
-            &depthStencilDesc(DepthMode::InverseDepth, true),
+            &shadeTiles,
             &rasterizerDesc(true));
 
+        markLightingTilesPipeline.vs = Shader<VS>(tilequads_vs);
+        markLightingTilesPipeline.initStates(
+            D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST,
+            &markTiles,
+            &noCulling);
+
+        downsampleLightingTilesPipeline = GraphicsPipeline(
+            tilequads_vs,
+            downsamplelighting_ps,
+            D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST,
+            nullptr,
+            &noCulling);
+
         renderMeshPipeline.inputLayout = inputLayoutFor<Vertex>(regularmesh_vs);
         renderMeshPipelineTessellated.inputLayout = inputLayoutFor<Vertex>(regularmesh_vs);
         renderTextureSpaceLightingPipeline.inputLayout = inputLayoutFor<Vertex>(texturespacemesh_vs);
     }
 
-    void constructLightBuffer()
+    Configuration configurationFor(MeshMode meshMode, DisplacementMode displacementMode,
+                                   const SVBRDF &svbrdf, const Mesh *mesh,
+                                   const Constants &constants) const
     {
-        D3D11_BUFFER_DESC desc;
-        zero(desc);
-        desc.ByteWidth           = MaxLights * sizeof(Light);
-        desc.StructureByteStride = sizeof(Light);
-        desc.BindFlags  = D3D11_BIND_SHADER_RESOURCE;
-        desc.Usage      = D3D11_USAGE_DEFAULT;
-        desc.MiscFlags  = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
-        lightBuffer = Resource(desc, DXGI_FORMAT_UNKNOWN);
-        RESOURCE_DEBUG_NAME(lightBuffer);
-    }
+        Configuration c;
+        c.meshMode            = meshMode;
+        c.displacementMode    = displacementMode;
+        c.displacementDensity = constants.displacementDensity;
+        c.material            = svbrdf.diffuseAlbedo.texture;
+        c.shadowLights        = constants.shadowLights;
+        c.shadowResolution    = constants.shadowResolution;
+        c.shadowDepthBias     = constants.shadowDepthBias;
+        c.shadowSSDepthBias   = constants.shadowSSDepthBias;
 
-    void constructShadowMapping(const Constants &constants)
-    {
-        shadowLights = constants.shadowLights;
+        bool displacementEnabled =
+            displacementMode != DisplacementMode::NoDisplacement
+            && c.displacementDensity > 0
+            && constants.displacementMagnitude != 0;
 
-        log("Shadow resolution %u x %u, bias (%d, %4.2f)\n",
-            constants.shadowResolution,
-            constants.shadowResolution,
-            constants.shadowDepthBias,
-            constants.shadowSSDepthBias);
+        if (meshMode == MeshMode::LoadedMesh && mesh)
+            c.mesh = mesh->vertexBuffer.buffer;
 
+        if (meshMode == MeshMode::LoadedMesh || !displacementEnabled)
         {
-            renderShadowMapPipeline = GraphicsPipeline(
-                regularmesh_vs,
-#if defined(DEBUG_SHADOW_MAPS)
-                debugshadowmap_ps,
-#else
-                nullptr,
-#endif
-                D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST,
-                //&depthStencilDesc(DepthMode::InverseDepth, true, true),
-                &depthStencilDesc(DepthMode::InverseDepth, true),
-                &rasterizerDesc(true,
-                                constants.shadowDepthBias,
-                                constants.shadowSSDepthBias));
-
-            renderShadowMapPipeline.inputLayout = inputLayoutFor<Vertex>(regularmesh_vs);
-            renderShadowMapPipeline.vs = renderMeshPipeline.vs;
+            c.displacementMode    = DisplacementMode::NoDisplacement;
+            c.displacementDensity = 0;
         }
 
-        {
-            renderShadowMapPipelineTessellated = GraphicsPipeline(
-                regularmesh_vs,
-                displacement_hs,
-                displacement_ds,
-#if defined(DEBUG_SHADOW_MAPS)
-                debugshadowmap_ps,
-#else
-                nullptr,
-#endif
-                D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST,
-                &depthStencilDesc(DepthMode::InverseDepth, true),
-                &rasterizerDesc(true,
-                                constants.shadowDepthBias,
-                                constants.shadowSSDepthBias));
+        return c;
+    }
 
-            renderShadowMapPipelineTessellated.inputLayout = inputLayoutFor<Vertex>(regularmesh_vs);
-        }
+    void constructGeometry(SVBRDF &svbrdf, Mesh *mesh, const Configuration &c)
+    {
+        static const float Dim = 5.f;
 
-        {
-            unprojectShadowMapPipeline = GraphicsPipeline(
-                unprojectshadowmap_vs,
-                wireframe_ps,
-                D3D11_PRIMITIVE_TOPOLOGY_POINTLIST,
-                &depthStencilDesc(DepthMode::Always, false, false));
-        }
+        float displacementDensity = c.displacementDensity;
 
-        UINT faces = static_cast<UINT>(6 * shadowLights);
+        float smallerDim = static_cast<float>(std::min(svbrdf.width, svbrdf.height));
+        float xDim = Dim * static_cast<float>( svbrdf.width) / smallerDim;
+        float yDim = Dim * static_cast<float>(svbrdf.height) / smallerDim;
 
-        auto shadowDesc = texture2DDesc(constants.shadowResolution, constants.shadowResolution, DXGI_FORMAT_D32_FLOAT);
-        shadowDesc.ArraySize = std::max(6u, faces);
-        shadowDesc.BindFlags = D3D11_BIND_DEPTH_STENCIL | D3D11_BIND_SHADER_RESOURCE;
+        shadowVertexBuffer = Resource();
+        shadowIndexBuffer  = Resource();
+        lods.clear();
 
-        shadowViewProjs.clear();
+        if (c.meshMode == MeshMode::SingleQuad)
+        {
+            if (c.displacementMode != DisplacementMode::NoDisplacement)
+            {
+                if (c.displacementMode == DisplacementMode::CPUDisplacementMapping)
+                {
+                    initCPUDisplacementMapped(svbrdf, xDim, yDim, displacementDensity, 1.f);
+                }
+                else if (c.displacementMode == DisplacementMode::AdaptiveDisplacementMapping)
+                {
+                    initAdaptiveDisplacementMapped(svbrdf, xDim, yDim, displacementDensity);
+                }
+                else
+                {
+                    float cpuTess = 64.f;
+                    float targetTriangleArea = computeTargetTriangleArea(svbrdf, displacementDensity);
+                    float uDim = xDim / cpuTess;
+                    float vDim = yDim / cpuTess;
+                    float cpuTriangleArea = uDim * vDim / 2;
+                    float areaRatio = cpuTriangleArea / targetTriangleArea;
+                    float gpuTess = std::sqrt(areaRatio);
+                    initCPUDisplacementMapped(svbrdf, xDim, yDim, cpuTess, gpuTess);
+                }
+            }
+            else
+            {
+                initSingleQuad(svbrdf, xDim, yDim, MaxTessellation);
+            }
+        }
+        else if (c.meshMode == MeshMode::LoadedMesh)
+        {
+            initLoadedMesh(svbrdf, *mesh, Dim);
+        }
+        else
+        {
+            check(false, "Unknown mesh mode!");
+        }
+
+        if (!shadowVertexBuffer.buffer)
+        {
+            shadowVertexBuffer = vertexBuffer;
+            shadowIndexBuffer  = indexBuffer;
+            shadowIndexCount   = indexCount;
+        }
+    }
+
+    void constructLightingMaps(SVBRDF &svbrdf)
+    {
+        switch (lightingPrecision)
+        {
+        default:
+        case TextureSpaceLightingPrecision::Float11_11_10:
+            lightingMapFormat = DXGI_FORMAT_R11G11B10_FLOAT;
+            break;
+        case TextureSpaceLightingPrecision::Float16:
+            lightingMapFormat = DXGI_FORMAT_R16G16B16A16_FLOAT;
+            break;
+        case TextureSpaceLightingPrecision::Float32:
+            lightingMapFormat = DXGI_FORMAT_R32G32B32A32_FLOAT;
+            break;
+        }
+
+        lightingTextures.release();
+
+        diffuseLightingMap = createLightingMap(svbrdf, diffuseLightingMips, lightingMapFormat);
+        RESOURCE_DEBUG_NAME(diffuseLightingMap);
+
+        for (auto &map : specularLightingMaps)
+            map = Resource();
+
+        if (lightingMode == LightingMode::SharedDiffuseLighting)
+        {
+            shadowTermMap = createLightingMap(svbrdf, shadowTermMips, DXGI_FORMAT_R8G8B8A8_UNORM);
+            RESOURCE_DEBUG_NAME(shadowTermMap);
+        }
+        else
+        {
+            shadowTermMap = Resource();
+            shadowTermMips.clear();
+        }
+
+        // Tiles are shaded at different mip levels, so the stencil needs them too.
+        auto levels = static_cast<unsigned>(diffuseLightingMips.size());
+        auto stencilDesc = texture2DDesc(svbrdf.width, svbrdf.height, DXGI_FORMAT_D24_UNORM_S8_UINT);
+        stencilDesc.MipLevels = levels;
+        stencilDesc.BindFlags = D3D11_BIND_DEPTH_STENCIL;
+        textureSpaceLightingStencil = lightingTextures.acquire(stencilDesc);
+        textureSpaceLightingStencilMips = mipLevelViews(textureSpaceLightingStencil);
+        RESOURCE_DEBUG_NAME(textureSpaceLightingStencil);
+
+        // Shared diffuse lighting is view independent, so it is scheduled
+        // as a single view that both eyes give feedback for.
+        unsigned lightingViews = (lightingMode == LightingMode::SharedDiffuseLighting) ? 1 : MaxViews;
+        lightingTiles = LightingTileScheduler(svbrdf.width, svbrdf.height, lightingViews, levels);
+        lightingFeedback = LightingFeedback(lightingTiles.tilesX(), lightingTiles.tilesY(), lightingViews);
+        lastLightingView = 0;
+
+        for (unsigned v = 0; v < MaxViews; ++v)
+        {
+            auto &fb = lightingFeedbackBuffers[v];
+
+            D3D11_BUFFER_DESC levelsDesc;
+            zero(levelsDesc);
+            levelsDesc.ByteWidth           = lightingTiles.tileCount() * sizeof(uint32_t);
+            levelsDesc.StructureByteStride = sizeof(uint32_t);
+            levelsDesc.BindFlags           = D3D11_BIND_UNORDERED_ACCESS;
+            levelsDesc.Usage               = D3D11_USAGE_DEFAULT;
+            levelsDesc.MiscFlags           = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
+            fb.tileLevels = Resource(levelsDesc, DXGI_FORMAT_UNKNOWN);
+            fb.tileLevels.name("lightingFeedbackBuffers[%u].tileLevels", v);
+
+            D3D11_BUFFER_DESC readbackDesc;
+            zero(readbackDesc);
+            readbackDesc.ByteWidth      = levelsDesc.ByteWidth;
+            readbackDesc.Usage          = D3D11_USAGE_STAGING;
+            readbackDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+            for (unsigned i = 0; i < FeedbackReadbackLatency; ++i)
+            {
+                fb.readback[i] = Resource(readbackDesc, DXGI_FORMAT_R32_UINT);
+                fb.readback[i].name("lightingFeedbackBuffers[%u].readback[%u]", v, i);
+            }
+
+            fb.written   = 0;
+            fb.read      = 0;
+            fb.recording = false;
+        }
+
+        D3D11_BUFFER_DESC rectsDesc;
+        zero(rectsDesc);
+        rectsDesc.ByteWidth           = lightingTiles.tileCount() * sizeof(float4);
+        rectsDesc.StructureByteStride = sizeof(float4);
+        rectsDesc.BindFlags      = D3D11_BIND_SHADER_RESOURCE;
+        rectsDesc.Usage          = D3D11_USAGE_DYNAMIC;
+        rectsDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+        rectsDesc.MiscFlags      = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
+        lightingTileRects = Resource(rectsDesc, DXGI_FORMAT_UNKNOWN);
+        RESOURCE_DEBUG_NAME(lightingTileRects);
+    }
+
+    void releaseLightingMaps()
+    {
+        diffuseLightingMap = Resource();
+        diffuseLightingMips.clear();
+        for (auto &map : specularLightingMaps)
+            map = Resource();
+        for (auto &mips : specularLightingMips)
+            mips.clear();
+        shadowTermMap = Resource();
+        shadowTermMips.clear();
+        textureSpaceLightingStencil = Resource();
+        textureSpaceLightingStencilMips.clear();
+        lightingTileRects = Resource();
+        for (auto &fb : lightingFeedbackBuffers)
+            fb = FeedbackBuffers();
+        lightingTextures.release();
+    }
+
+    Resource createLightingMap(const SVBRDF &svbrdf, std::vector<Resource> &mips, DXGI_FORMAT format)
+    {
+        auto lightingMapDesc = texture2DDesc(svbrdf.width, svbrdf.height, format);
+        auto dimPow2 = std::min(roundUpToPowerOf2(svbrdf.width), roundUpToPowerOf2(svbrdf.height));
+        lightingMapDesc.MipLevels = static_cast<UINT>(log2(dimPow2));
+        lightingMapDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET;
+
+        Resource map = lightingTextures.acquire(lightingMapDesc);
+        mips = mipLevelViews(map);
+
+        // Texels outside the mesh are never lit, so clear them once.
+        float zero[4] = { 0, 0, 0, 1 };
+        for (auto &mip : mips)
+            clearRenderTarget(mip.rtv, zero);
+
+        return map;
+    }
+
+    Resource &specularLightingMap(const SVBRDF &svbrdf, unsigned view)
+    {
+        auto &map = specularLightingMaps[view];
+        if (!map.valid())
+        {
+            map = createLightingMap(svbrdf, specularLightingMips[view], lightingMapFormat);
+            map.name("specularLightingMaps[%u]", view);
+        }
+        return map;
+    }
+
+    void constructLightBuffer()
+    {
+        D3D11_BUFFER_DESC desc;
+        zero(desc);
+        desc.ByteWidth           = MaxLights * sizeof(Light);
+        desc.StructureByteStride = sizeof(Light);
+        desc.BindFlags  = D3D11_BIND_SHADER_RESOURCE;
+        desc.Usage      = D3D11_USAGE_DEFAULT;
+        desc.MiscFlags  = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
+        lightBuffer = Resource(desc, DXGI_FORMAT_UNKNOWN);
+        RESOURCE_DEBUG_NAME(lightBuffer);
+    }
+
+    void constructShadowMapping(const Constants &constants)
+    {
+        shadowLights = constants.shadowLights;
+
+        log("Shadow resolution %u x %u, bias (%d, %4.2f)\n",
+            constants.shadowResolution,
+            constants.shadowResolution,
+            constants.shadowDepthBias,
+            constants.shadowSSDepthBias);
+
+        {
+            renderShadowMapPipeline = GraphicsPipeline(
+                regularmesh_vs,
+#if defined(DEBUG_SHADOW_MAPS)
+                debugshadowmap_ps,
+#else
+                nullptr,
+#endif
+                D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST,
+                //&depthStencilDesc(DepthMode::InverseDepth, true, true),
+                &depthStencilDesc(DepthMode::InverseDepth, true),
+                &rasterizerDesc(true,
+                                constants.shadowDepthBias,
+                                constants.shadowSSDepthBias));
+
+            renderShadowMapPipeline.inputLayout = inputLayoutFor<Vertex>(regularmesh_vs);
+            renderShadowMapPipeline.vs = renderMeshPipeline.vs;
+        }
+
+        {
+            renderShadowMapPipelineTessellated = GraphicsPipeline(
+                regularmesh_vs,
+                displacement_hs,
+                displacement_ds,
+#if defined(DEBUG_SHADOW_MAPS)
+                debugshadowmap_ps,
+#else
+                nullptr,
+#endif
+                D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST,
+                &depthStencilDesc(DepthMode::InverseDepth, true),
+                &rasterizerDesc(true,
+                                constants.shadowDepthBias,
+                                constants.shadowSSDepthBias));
+
+            renderShadowMapPipelineTessellated.inputLayout = inputLayoutFor<Vertex>(regularmesh_vs);
+        }
+
+        {
+            unprojectShadowMapPipeline = GraphicsPipeline(
+                unprojectshadowmap_vs,
+                wireframe_ps,
+                D3D11_PRIMITIVE_TOPOLOGY_POINTLIST,
+                &depthStencilDesc(DepthMode::Always, false, false));
+        }
+
+        UINT faces = static_cast<UINT>(6 * shadowLights);
+
+        auto shadowDesc = texture2DDesc(constants.shadowResolution, constants.shadowResolution, DXGI_FORMAT_D32_FLOAT);
+        shadowDesc.ArraySize = std::max(6u, faces);
+        shadowDesc.BindFlags = D3D11_BIND_DEPTH_STENCIL | D3D11_BIND_SHADER_RESOURCE;
+
+        shadowViewProjs.clear();
         shadowViewProjs.resize(shadowLights * 6);
 
         shadowMapCubeFaceDSVs.clear();
 
-        shadowMaps = Resource(shadowDesc);
+        shadowTextures.release();
+        shadowMaps = shadowTextures.acquire(shadowDesc);
         RESOURCE_DEBUG_NAME(shadowMaps);
         for (unsigned L = 0; L < shadowLights; ++L)
         {
@@ -2182,9 +3445,11 @@ private:
         shadowViewProjBuffer = Resource(viewProjDesc, DXGI_FORMAT_UNKNOWN);
         RESOURCE_DEBUG_NAME(shadowViewProjBuffer);
 
+#if defined(DEBUG_SHADOW_MAPS)
         auto debugDesc = texture2DDesc(constants.shadowResolution, constants.shadowResolution, DXGI_FORMAT_R32G32B32A32_FLOAT);
         debugDesc.BindFlags = D3D11_BIND_RENDER_TARGET;
-        debugRTV = Resource(debugDesc);
+        debugRTV = shadowTextures.acquire(debugDesc);
+#endif
 
 #if defined(SHADOW_USE_COMPARISON_SAMPLER)
         D3D11_SAMPLER_DESC pcfDesc;
@@ -2198,8 +3463,7 @@ private:
         pcfDesc.ComparisonFunc = D3D11_COMPARISON_GREATER_EQUAL;
         pcfDesc.MinLOD   = 0;
         pcfDesc.MaxLOD   = D3D11_FLOAT32_MAX;
-        shadowSampler = nullptr;
-        checkHR(device->CreateSamplerState(&pcfDesc, &shadowSampler));
+        shadowSampler = pipelineCache().samplerState(pcfDesc);
 #else
         shadowSampler = samplerPoint();
 #endif
@@ -2207,12 +3471,17 @@ private:
 
     void initSingleQuad(SVBRDF &svbrdf, float xDim, float yDim, float tessellation)
     {
+        // U grows along +x and V along -y, so the bitangent sign is negative.
+        const float tangent[3] = { 1, 0, 0 };
+        const float normal[3]  = { 0, 0, 1 };
+        const auto frame = TangentFrames::encode(tangent, normal, -1);
+
         // Counterclockwise single quad
         Vertex vertices[] = {
-            { { -xDim,  yDim, 0, }, { 0, 0, 1, }, { 0, 0 }, tessellation },
-            { {  xDim,  yDim, 0, }, { 0, 0, 1, }, { 1, 0 }, tessellation },
-            { { -xDim, -yDim, 0, }, { 0, 0, 1, }, { 0, 1 }, tessellation },
-            { {  xDim, -yDim, 0, }, { 0, 0, 1, }, { 1, 1 }, tessellation },
+            { { -xDim,  yDim, 0, }, { 0, 0, 1, }, { 0, 0 }, tessellation, frame },
+            { {  xDim,  yDim, 0, }, { 0, 0, 1, }, { 1, 0 }, tessellation, frame },
+            { { -xDim, -yDim, 0, }, { 0, 0, 1, }, { 0, 1 }, tessellation, frame },
+            { {  xDim, -yDim, 0, }, { 0, 0, 1, }, { 1, 1 }, tessellation, frame },
         };
         uint32_t indices[] = {
             0, 2, 1,
@@ -2237,6 +3506,11 @@ private:
         indexCount       = static_cast<UINT>(::size(indices));
         RESOURCE_DEBUG_NAME(indexBuffer);
 
+#if defined(DEBUG_SHADOW_CPU_RASTERIZER)
+        cpuVertices = std::make_shared<std::vector<Vertex>>(std::begin(vertices), std::end(vertices));
+        cpuIndices  = std::make_shared<std::vector<uint32_t>>(std::begin(indices), std::end(indices));
+#endif
+
         meshScale = 1;
     }
 
@@ -2247,18 +3521,123 @@ private:
         indexBuffer  = mesh.indexBuffer;
         RESOURCE_DEBUG_NAME(indexBuffer);
         indexCount   = mesh.indexAmount;
+#if defined(DEBUG_SHADOW_CPU_RASTERIZER)
+        cpuVertices  = std::make_shared<std::vector<Vertex>>(mesh.vertices);
+        cpuIndices   = std::make_shared<std::vector<uint32_t>>(mesh.indices);
+#endif
 
         // set the mesh scale so that the furthest away vertex is at distance 'dim'
         meshScale    = dim / mesh.scale;
+        meshRadius   = dim;
+
+        for (auto &l : mesh.lods)
+        {
+            GeometryLod lod;
+            lod.indexBuffer = l.indexBuffer;
+            lod.indexCount  = l.indexAmount;
+            lod.error       = l.error;
+            lods.emplace_back(std::move(lod));
+        }
+    }
+
+    static void createMeshBuffers(const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices,
+                                  Resource &vb, Resource &ib)
+    {
+        D3D11_BUFFER_DESC vbDesc;
+        zero(vbDesc);
+        vbDesc.ByteWidth = static_cast<UINT>(sizeBytes(vertices));
+        vbDesc.StructureByteStride = sizeof(Vertex);
+        vbDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+        vbDesc.Usage     = D3D11_USAGE_IMMUTABLE;
+        vb               = Resource(vbDesc, DXGI_FORMAT_UNKNOWN, vertices.data(), sizeBytes(vertices));
+
+        D3D11_BUFFER_DESC ibDesc;
+        zero(ibDesc);
+        ibDesc.ByteWidth = static_cast<UINT>(sizeBytes(indices));
+        ibDesc.BindFlags = D3D11_BIND_INDEX_BUFFER;
+        ibDesc.Usage     = D3D11_USAGE_IMMUTABLE;
+        ib               = Resource(ibDesc, DXGI_FORMAT_R32_UINT, indices.data(), sizeBytes(indices));
+    }
+
+    static void initDisplacedMesh(DisplacedMesh &mesh,
+                                  std::vector<Vertex> vertices, std::vector<uint32_t> indices)
+    {
+        createMeshBuffers(vertices, indices, mesh.vertexBuffer, mesh.indexBuffer);
+        mesh.indexCount = static_cast<UINT>(indices.size());
+        mesh.bytes      = sizeBytes(vertices) + sizeBytes(indices);
+        RESOURCE_DEBUG_NAME(mesh.vertexBuffer);
+        RESOURCE_DEBUG_NAME(mesh.indexBuffer);
+
+#if defined(DEBUG_SHADOW_CPU_RASTERIZER)
+        mesh.bytes   *= 2;
+        mesh.vertices = std::make_shared<std::vector<Vertex>>(std::move(vertices));
+        mesh.indices  = std::make_shared<std::vector<uint32_t>>(std::move(indices));
+#endif
+    }
+
+    // A coarser version of the displaced mesh for the shadow maps. Without
+    // one, the shadow maps use the same mesh as the views.
+    static void initShadowMesh(DisplacedMesh &mesh,
+                               const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices)
+    {
+        createMeshBuffers(vertices, indices, mesh.shadowVertexBuffer, mesh.shadowIndexBuffer);
+        mesh.shadowIndexCount = static_cast<UINT>(indices.size());
+        mesh.bytes           += sizeBytes(vertices) + sizeBytes(indices);
+        RESOURCE_DEBUG_NAME(mesh.shadowVertexBuffer);
+        RESOURCE_DEBUG_NAME(mesh.shadowIndexBuffer);
+    }
+
+    void useDisplacedMesh(const DisplacedMesh &mesh)
+    {
+        vertexBuffer = mesh.vertexBuffer;
+        indexBuffer  = mesh.indexBuffer;
+        indexCount   = mesh.indexCount;
+#if defined(DEBUG_SHADOW_CPU_RASTERIZER)
+        cpuVertices  = mesh.vertices;
+        cpuIndices   = mesh.indices;
+#endif
+
+        if (mesh.shadowVertexBuffer.buffer)
+        {
+            shadowVertexBuffer = mesh.shadowVertexBuffer;
+            shadowIndexBuffer  = mesh.shadowIndexBuffer;
+            shadowIndexCount   = mesh.shadowIndexCount;
+        }
+
+        meshScale = 1;
+    }
+
+    // Take a cached displaced mesh into use, if there is one.
+    bool useCachedDisplacedMesh(const DisplacedMeshKey &key)
+    {
+        auto mesh = displacedMeshes.find(key);
+        if (!mesh)
+            return false;
+
+        useDisplacedMesh(*mesh);
+        log("Reused the %s displaced mesh of \"%s\" with PPV = %u, %u displaced meshes (%.2f MB) cached.\n",
+            key.adaptive ? "adaptive" : "uniform", key.material.c_str(), key.pixelsPerVertex,
+            static_cast<unsigned>(displacedMeshes.size()),
+            static_cast<double>(displacedMeshes.stats().bytes) / (1024 * 1024));
+        return true;
+    }
+
+    void cacheDisplacedMesh(const DisplacedMeshKey &key, DisplacedMesh mesh)
+    {
+        useDisplacedMesh(mesh);
+        uint64_t bytes = mesh.bytes;
+        if (!displacedMeshes.insert(key, std::move(mesh), bytes))
+            log("Displaced mesh is larger than the cache, not caching it.\n");
     }
 
     // Always compile CPU displacement mapping with optimizations enabled, even in debug mode.
-    void initCPUDisplacementMapped(SVBRDF &svbrdf, float xDim, float yDim, float displacementDensity, float displacementMagnitude, float tessellation = 1)
+    // The heights are not scaled with the displacement magnitude, see heightScale().
+    void initCPUDisplacementMapped(SVBRDF &svbrdf, float xDim, float yDim, float displacementDensity, float tessellation = 1)
     {
         unsigned pixelsPerVertex = std::max(1u, static_cast<unsigned>(std::ceil(displacementDensity)));
         pixelsPerVertex = std::min(pixelsPerVertex, 64u);
 
-        if (svbrdf.heightMapCPU.width <= 0 || svbrdf.heightMapCPU.height <= 0)
+        if (!svbrdf.heightPyramid)
         {
             log("No heightmap for \"%s\", using a single quad instead.\n",
                 svbrdf.name.c_str());
@@ -2273,148 +3652,160 @@ private:
             return;
         }
 
+        DisplacedMeshKey key = { svbrdf.path, false, pixelsPerVertex, tessellation };
+        if (useCachedDisplacedMesh(key))
+            return;
+
         Timer t;
 
-        const unsigned W = svbrdf.width  / pixelsPerVertex;
-        const unsigned H = svbrdf.height / pixelsPerVertex;
-        const unsigned numVerts = W * H;
-        const unsigned quadsX = W - 1;
-        const unsigned quadsY = H - 1;
-        const unsigned numQuads = quadsX * quadsY;
-        const unsigned numTriangles = numQuads * 2;
+        auto &pyramid = *svbrdf.heightPyramid;
 
+        // The heights are filtered for the vertex spacing, so detail between
+        // the vertices does not alias into the mesh.
+        unsigned W = 0;
+        unsigned H = 0;
+        auto grid = pyramid.grid(pixelsPerVertex, W, H);
+
+        DisplacedMesh mesh = {};
         std::vector<Vertex> vertices;
-        vertices.reserve(W * H);
         std::vector<uint32_t> indices;
-        indices.reserve(numTriangles * 3);
+        generateDisplacedGrid(grid, W, H, xDim, yDim,
+                              1.f, tessellation,
+                              vertices, indices);
+        initDisplacedMesh(mesh, std::move(vertices), std::move(indices));
 
-        const float maxX = static_cast<float>(W - 1);
-        const float maxY = static_cast<float>(H - 1);
-        for (unsigned y = 0 ; y < H; ++y)
+        unsigned shadowPPV = pixelsPerVertex << ShadowGeometryLodBias;
+        if (pyramid.width() / shadowPPV >= 2 && pyramid.height() / shadowPPV >= 2)
         {
-            for (unsigned x = 0 ; x < W; ++x)
-            {
-                float height = svbrdf.heightMapCPU(x * pixelsPerVertex, y * pixelsPerVertex, 0); 
-
-                float u = static_cast<float>(x) / maxX;
-                float v = static_cast<float>(y) / maxY;
+            grid = pyramid.grid(shadowPPV, W, H);
+            generateDisplacedGrid(grid, W, H, xDim, yDim,
+                                  1.f, tessellation,
+                                  vertices, indices);
+            initShadowMesh(mesh, vertices, indices);
+        }
 
-                float vx = ((       u  * 2) - 1) * xDim;
-                float vy = (((1.f - v) * 2) - 1) * yDim;
-                float vz = height * displacementMagnitude;
+        cacheDisplacedMesh(key, std::move(mesh));
 
-                Vertex vert;
-                vert.pos[0] = vx;
-                vert.pos[1] = vy;
-                vert.pos[2] = vz;
-                vert.uv[0] = u;
-                vert.uv[1] = v;
-                vert.tessellation = tessellation;
-                vertices.emplace_back(vert);
-            }
-        }
-
-        for (unsigned qy = 0; qy < quadsY; ++qy)
-        {
-            for (unsigned qx = 0; qx < quadsX; ++qx)
-            {
-                bool even = ((qy + qx) % 2) == 0;
-
-                // even quads:
-                // A---B
-                // |  /|
-                // | / |
-                // |/  |
-                // C---D
-                // odd quads:
-                // A---B
-                // |\  |
-                // | \ |
-                // |  \|
-                // C---D
-                //
-                // where
-                // A = (qx,     qy    )
-                // B = (qx + 1, qy    )
-                // C = (qx    , qy + 1)
-                // D = (qx + 1, qy + 1)
-
-                uint32_t Ax = qx;
-                uint32_t Ay = qy;
-                uint32_t Bx = qx + 1;
-                uint32_t By = qy;
-                uint32_t Cx = qx;
-                uint32_t Cy = qy + 1;
-                uint32_t Dx = qx + 1;
-                uint32_t Dy = qy + 1;
-
-                uint32_t A = Ay * W + Ax;
-                uint32_t B = By * W + Bx;
-                uint32_t C = Cy * W + Cx;
-                uint32_t D = Dy * W + Dx;
-
-                // Counterclockwise triangles
-                if (even)
-                {
-                    indices.emplace_back(A);
-                    indices.emplace_back(C);
-                    indices.emplace_back(B);
+        log("Displacement mapped \"%s\" with PPV = %u in %.2f ms.\n", svbrdf.name.c_str(), pixelsPerVertex, t.seconds() * 1000);
+    }
 
-                    indices.emplace_back(B);
-                    indices.emplace_back(C);
-                    indices.emplace_back(D);
-                }
-                else
-                {
-                    indices.emplace_back(A);
-                    indices.emplace_back(D);
-                    indices.emplace_back(B);
+    // Build a mesh that is only as dense as the heightmap requires. The error
+    // bound is the error of the uniform grid of initCPUDisplacementMapped()
+    // with the same density, so that both are of equal quality.
+    void initAdaptiveDisplacementMapped(SVBRDF &svbrdf, float xDim, float yDim, float displacementDensity)
+    {
+        unsigned pixelsPerVertex = std::max(1u, static_cast<unsigned>(std::ceil(displacementDensity)));
+        pixelsPerVertex = std::min(pixelsPerVertex, 64u);
 
-                    indices.emplace_back(A);
-                    indices.emplace_back(C);
-                    indices.emplace_back(D);
-                }
-            }
+        if (!svbrdf.heightPyramid)
+        {
+            log("No heightmap for \"%s\", using a single quad instead.\n",
+                svbrdf.name.c_str());
+            initSingleQuad(svbrdf, xDim, yDim, MaxTessellation);
+            return;
+        }
+        else if (displacementDensity < 1)
+        {
+            log("Displacement density set to no-op, using a single quad instead.\n");
+            initSingleQuad(svbrdf, xDim, yDim, MaxTessellation);
+            return;
         }
 
-        computeVertexNormals(vertices, indices);
+        DisplacedMeshKey key = { svbrdf.path, true, pixelsPerVertex, 1.f };
+        if (useCachedDisplacedMesh(key))
+            return;
 
-        D3D11_BUFFER_DESC vbDesc;
-        zero(vbDesc);
-        vbDesc.ByteWidth = static_cast<UINT>(sizeBytes(vertices));
-        vbDesc.StructureByteStride = sizeof(Vertex);
-        vbDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
-        vbDesc.Usage     = D3D11_USAGE_IMMUTABLE;
-        vertexBuffer     = Resource(vbDesc, DXGI_FORMAT_UNKNOWN, vertices.data(), sizeBytes(vertices));
-        RESOURCE_DEBUG_NAME(vertexBuffer);
+        Timer t;
 
-        D3D11_BUFFER_DESC ibDesc;
-        zero(ibDesc);
-        ibDesc.ByteWidth = static_cast<UINT>(sizeBytes(indices));
-        ibDesc.BindFlags = D3D11_BIND_INDEX_BUFFER;
-        ibDesc.Usage     = D3D11_USAGE_IMMUTABLE;
-        indexBuffer      = Resource(ibDesc, DXGI_FORMAT_R32_UINT, indices.data(), sizeBytes(indices));
-        indexCount       = static_cast<UINT>(indices.size());
-        RESOURCE_DEBUG_NAME(indexBuffer);
+        auto &pyramid        = *svbrdf.heightPyramid;
+        const unsigned width  = pyramid.width();
+        const unsigned height = pyramid.height();
+        const float *heights  = pyramid.level(0).heights.data();
 
-        meshScale = 1;
+        auto gridError = [&](unsigned step)
+        {
+            unsigned W = 0;
+            unsigned H = 0;
+            auto grid = pyramid.grid(step, W, H);
+            return uniformGridError(heights, width, height, 1, grid.data(), step);
+        };
 
-        log("Displacement mapped \"%s\" with PPV = %u and height = %.3f in %.2f ms.\n", svbrdf.name.c_str(), pixelsPerVertex, displacementMagnitude, t.seconds() * 1000);
-    }
+        float maxError = gridError(pixelsPerVertex);
 
-    XMMATRIX computeShadowViewProj(unsigned light, unsigned faceIndex)
-    {
-        auto face = static_cast<CubeMapFace>(faceIndex);
+        unsigned size = HeightfieldMesh::gridSize(std::max(width, height));
+        if (!heightfield || heightfieldMaterial != svbrdf.path || heightfield->size() != size)
+        {
+            heightfield = std::make_shared<HeightfieldMesh>(
+                HeightfieldMesh::resample(heights, width, height, 1, size), size);
+            heightfieldMaterial = svbrdf.path;
+        }
+        auto mesh = heightfield->triangulate(maxError);
 
-        auto pos  = toVec(lights[light].positionWorld, 1);
-        auto view = cubeMapFaceViewRH(face, pos);
-        auto proj = cubeMapFaceProjRH(ShadowNearZ, ShadowFarZ, DepthMode::InverseDepth);
+        const float maxCoord = static_cast<float>(size - 1);
+        auto meshVertices = [&](const HeightfieldMesh::Triangulation &m)
+        {
+            std::vector<Vertex> vertices(m.vertices.size());
 
-        XMMATRIX shadowViewProj = XMMatrixMultiply(view, proj);
-        return shadowViewProj;
-    }
-    
-    ShadowConstants computeShadowConstants(const Constants &constants)
+            parallelFor(0, vertices.size(), [&](size_t i)
+            {
+                unsigned x = m.vertices[i] % size;
+                unsigned y = m.vertices[i] / size;
+
+                float u = static_cast<float>(x) / maxCoord;
+                float v = static_cast<float>(y) / maxCoord;
+
+                Vertex &vert = vertices[i];
+                vert.pos[0] = ((       u  * 2) - 1) * xDim;
+                vert.pos[1] = (((1.f - v) * 2) - 1) * yDim;
+                vert.pos[2] = heightfield->height(x, y);
+                vert.uv[0] = u;
+                vert.uv[1] = v;
+                vert.tessellation = 1;
+            }, 1024);
+
+            computeAreaWeightedNormals(vertices, m.indices);
+            computeTangentFrames(vertices, m.indices);
+            return vertices;
+        };
+
+        std::vector<Vertex> vertices = meshVertices(mesh);
+
+        unsigned uniformW = width  / pixelsPerVertex;
+        unsigned uniformH = height / pixelsPerVertex;
+        unsigned uniformTriangles = uniformW > 1 && uniformH > 1
+            ? 2 * (uniformW - 1) * (uniformH - 1)
+            : 0;
+        unsigned triangles = static_cast<unsigned>(mesh.triangleCount());
+
+        DisplacedMesh displaced = {};
+        initDisplacedMesh(displaced, std::move(vertices), std::move(mesh.indices));
+
+        // The shadows get the error of the coarser uniform grid instead.
+        unsigned shadowPPV = pixelsPerVertex << ShadowGeometryLodBias;
+        if (width / shadowPPV >= 2 && height / shadowPPV >= 2)
+        {
+            auto shadowMesh = heightfield->triangulate(gridError(shadowPPV));
+            initShadowMesh(displaced, meshVertices(shadowMesh), shadowMesh.indices);
+        }
+
+        cacheDisplacedMesh(key, std::move(displaced));
+
+        // The errors are in heightmap units, before the displacement magnitude.
+        log("Adaptively displacement mapped \"%s\" with %u triangles and max error %.5f, uniform grid with PPV = %u has %u triangles (%.1fx) and max error %.5f, in %.2f ms.\n",
+            svbrdf.name.c_str(),
+            triangles, mesh.maxError,
+            pixelsPerVertex, uniformTriangles,
+            static_cast<double>(uniformTriangles) / std::max(1u, triangles),
+            maxError,
+            t.seconds() * 1000);
+    }
+
+    XMMATRIX computeShadowViewProj(unsigned light, unsigned faceIndex)
+    {
+        return shadowCubeFaceViewProj(toVec(lights[light].positionWorld, 1), faceIndex);
+    }
+    
+    ShadowConstants computeShadowConstants(const Constants &constants)
     {
         ShadowConstants c;
         zero(c);
@@ -2433,56 +3824,267 @@ private:
     {
         GPUScope scope(L"renderShadowMaps");
 
-        context->ClearDepthStencilView(shadowMaps.dsv, D3D11_CLEAR_DEPTH, D3D11_MIN_DEPTH, 0);
+        for (unsigned L = 0; L < shadowLights; ++L)
+            renderShadowMap(cb, svbrdf, constants, L);
 
-        if (constants.tessellation)
-            renderShadowMapPipelineTessellated.bind();
-        else
-            renderShadowMapPipeline.bind();
+        finishShadowMaps(constants);
+    }
 
-        setVertexBuffers(&vertexBuffer, &indexBuffer);
+#if defined(DEBUG_SHADOW_CPU_RASTERIZER)
+    // Render the shadow maps with the software rasterizer, and compare them
+    // against the GPU shadow maps. Use DEBUG_SHADOW_TEXEL_UNPROJECT to view them.
+    void validateShadowMaps(const Constants &constants)
+    {
+        Timer t;
 
-        for (unsigned L = 0; L < shadowLights; ++L)
+        unsigned faces      = shadowLights * 6;
+        unsigned resolution = constants.shadowResolution;
+
+        std::vector<DepthRasterizer::Matrix> viewProjs;
+        for (auto &m : shadowViewProjs)
+            viewProjs.emplace_back(rasterizerMatrix(m));
+
+        // The displaced meshes have unit heights, which the GPU scales.
+        const std::vector<Vertex> *vertices = cpuVertices.get();
+        std::vector<Vertex> scaledVertices;
+        float scaleHeights = heightScale(constants);
+        if (scaleHeights != 1)
         {
-            GPUScope scope(L"Point light shadows");
-            for (unsigned i = 0; i < 6; ++i)
+            scaledVertices = *vertices;
+            for (auto &v : scaledVertices)
+                v.pos[2] *= scaleHeights;
+            vertices = &scaledVertices;
+        }
+
+        cpuRasterizer.setGeometry(vertices->front().pos.data(), sizeof(Vertex), vertices->size(),
+                                  cpuIndices->data(), cpuIndices->size(),
+                                  meshScale);
+        auto stats = cpuRasterizer.render(viewProjs.data(), faces, resolution,
+                                          constants.shadowDepthBias,
+                                          constants.shadowSSDepthBias);
+
+        log("Software rasterized %u shadow map faces (%llu / %llu triangles, %llu pixels) in %.2f ms.\n",
+            faces, stats.trianglesBinned, stats.triangles, stats.pixelsWritten,
+            t.seconds() * 1000.0);
+
+        if (constants.tessellation)
+            log("NOTE: GPU displacement is not applied to software rasterized shadow maps.\n");
+        if (!lods.empty())
+            log("NOTE: Software rasterized shadow maps use the full mesh, not its shadow LODs.\n");
+
+        auto cpuDesc = shadowMaps.textureDescriptor();
+        cpuDesc.Format    = DXGI_FORMAT_R32_FLOAT;
+        cpuDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+        cpuShadowMaps = Resource(cpuDesc);
+        RESOURCE_DEBUG_NAME(cpuShadowMaps);
+
+        auto stagingDesc = shadowMaps.textureDescriptor();
+        stagingDesc.Usage          = D3D11_USAGE_STAGING;
+        stagingDesc.BindFlags      = 0;
+        stagingDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+        Resource staging(stagingDesc);
+        context->CopyResource(staging.texture, shadowMaps.texture);
+
+        static const float Tolerance = 1e-4f;
+
+        for (unsigned f = 0; f < faces; ++f)
+        {
+            const float *cpuDepth = cpuRasterizer.depth(f);
+            UINT subresource = D3D11CalcSubresource(0, f, 1);
+
+            context->UpdateSubresource(cpuShadowMaps.texture, subresource, nullptr,
+                                       cpuDepth,
+                                       cpuRasterizer.rowPitch() * sizeof(float), 0);
+
+            D3D11_MAPPED_SUBRESOURCE mapped;
+            checkHR(context->Map(staging.texture, subresource, D3D11_MAP_READ, 0, &mapped));
+
+            unsigned mismatches = 0;
+            float maxDifference = 0;
+            for (unsigned y = 0; y < resolution; ++y)
             {
-                GPUScope scope(L"Cube map face");
+                auto gpuRow = reinterpret_cast<const float *>(
+                    reinterpret_cast<const uint8_t *>(mapped.pData) + y * mapped.RowPitch);
+                auto cpuRow = cpuDepth + y * cpuRasterizer.rowPitch();
+
+                for (unsigned x = 0; x < resolution; ++x)
+                {
+                    float d = std::abs(gpuRow[x] - cpuRow[x]);
+                    maxDifference = std::max(maxDifference, d);
+                    if (d > Tolerance)
+                        ++mismatches;
+                }
+            }
+
+            context->Unmap(staging.texture, subresource);
 
-                auto face = static_cast<CubeMapFace>(i);
+            log("    Light %u face %u: %6.3f%% texels differ, max difference %g\n",
+                f / 6, f % 6,
+                100.0 * mismatches / (resolution * resolution),
+                maxDifference);
+        }
+    }
+#endif
 
-                unsigned idx = L * 6 + i;
+    // The CPU displaced meshes are built with unit heights, so that a new
+    // displacement magnitude only changes this scale. The base mesh of GPU
+    // displacement is flattened, as tessellation displaces it instead.
+    // Loaded meshes are never built from the heightmap, and keep their shape.
+    float heightScale(const Constants &constants) const
+    {
+        if (configuration.meshMode != MeshMode::SingleQuad)
+            return 1;
 
-                RegularMeshVSConstants vsConstants;
-                vsConstants.viewProj              = shadowViewProjs[idx];
-                vsConstants.scale                 = meshScale;
-                vsConstants.displacementMagnitude = constants.displacementMagnitude;
+        switch (configuration.displacementMode)
+        {
+        case DisplacementMode::CPUDisplacementMapping:
+        case DisplacementMode::AdaptiveDisplacementMapping:
+            return constants.displacementMagnitude;
+        case DisplacementMode::GPUDisplacementMapping:
+            return 0;
+        default:
+            return 1;
+        }
+    }
 
-                auto &dsv = shadowMapCubeFaceDSVs[idx];
-    #if defined(DEBUG_SHADOW_MAPS)
-                context->ClearRenderTargetView(debugRTV.rtv, std::array<float, 4> { 0, 0, 0, 1 }.data());
-                setRenderTarget(debugRTV, &dsv);
-    #else
-                setDepthOnly(dsv);
-    #endif
+    RegularMeshVSConstants meshVSConstants(const Constants &constants)
+    {
+        RegularMeshVSConstants vsConstants;
 
-                auto vsCB = cb.write(vsConstants);
+        zero(vsConstants);
 
-                context->VSSetConstantBuffers(0, 1, bind(vsCB));
-                context->DSSetConstantBuffers(0, 1, bind(vsCB));
-                context->DSSetShaderResources(0, 1, bind(svbrdf.heightMap.srv));
-                context->DSSetSamplers(0, 1, bind(bilinear));
+        vsConstants.viewProj              = constants.viewProj;
+        vsConstants.scale                 = meshScale;
+        vsConstants.displacementMagnitude = constants.displacementMagnitude;
+        vsConstants.heightScale           = heightScale(constants);
 
-                bindLightingResources(svbrdf, false);
-    #if defined(DEBUG_SHADOW_MAPS)
-                context->PSSetShaderResources(6, 1, bind(shadowViewProjBuffer.srv));
-    #endif
-                context->DrawIndexed(indexCount, 0, 0);
-                unbindLightingResources();
+        if (constants.stereo)
+        {
+            vsConstants.stereo        = 1;
+            vsConstants.rightViewProj = constants.rightViewProj;
+        }
 
-                setRenderTarget(nullptr);
-            }
+        return vsConstants;
+    }
+
+    // The GPU tessellated patches are split by their size on the screen, and
+    // culled using the range of the heightmap around their UVs, which bounds
+    // their displacement.
+    TessellationHSConstants tessellationHSConstants(const SVBRDF &svbrdf, const Constants &constants,
+                                                    const XMMATRIX &viewProj, XMVECTOR eyePosition,
+                                                    float width, float height)
+    {
+        TessellationHSConstants hsConstants;
+
+        zero(hsConstants);
+
+        hsConstants.viewProj              = viewProj;
+        hsConstants.rightViewProj         = viewProj;
+        hsConstants.eyePosition           = eyePosition;
+        hsConstants.rightEyePosition      = eyePosition;
+        hsConstants.viewportSize[0]       = width;
+        hsConstants.viewportSize[1]       = height;
+        hsConstants.edgePixels            = TessellationEdgePixels;
+        hsConstants.displacementMagnitude = constants.displacementMagnitude;
+
+        if (svbrdf.heightBounds)
+        {
+            hsConstants.heightmapSize[0]   = svbrdf.heightBounds->width();
+            hsConstants.heightmapSize[1]   = svbrdf.heightBounds->height();
+            hsConstants.heightBoundsLevels = svbrdf.heightBounds->levelCount();
+        }
+
+        return hsConstants;
+    }
+
+    // With single pass stereo, each eye gets half of the render target.
+    TessellationHSConstants viewTessellationHSConstants(const SVBRDF &svbrdf, const Constants &constants,
+                                                        Resource &renderTarget)
+    {
+        auto desc    = renderTarget.textureDescriptor();
+        float width  = static_cast<float>(constants.stereo ? desc.Width / 2 : desc.Width);
+        float height = static_cast<float>(desc.Height);
+
+        auto hsConstants = tessellationHSConstants(svbrdf, constants,
+                                                   constants.viewProj, constants.cameraPosition,
+                                                   width, height);
+
+        if (constants.stereo)
+        {
+            hsConstants.rightViewProj    = constants.rightViewProj;
+            hsConstants.rightEyePosition = constants.rightCameraPosition;
+        }
+
+        return hsConstants;
+    }
+
+    // The coarsest LOD whose error projects to at most LodErrorPixels, when
+    // the nearest point of the mesh is at the given distance and a unit
+    // there would be pixelsPerUnit long. 0 is the full mesh.
+    unsigned selectLod(float distance, float pixelsPerUnit) const
+    {
+        distance = std::max(distance, NearZ);
+
+        unsigned level = 0;
+        while (level < lods.size() &&
+               lods[level].error * meshScale * pixelsPerUnit / distance <= LodErrorPixels)
+        {
+            ++level;
+        }
+
+        return level;
+    }
+
+    // The LOD for the view, from the vertical scale of its projection. With
+    // stereo, the nearer eye decides for both.
+    unsigned viewLod(const Constants &constants, Resource &renderTarget)
+    {
+        if (lods.empty())
+            return 0;
+
+        XMFLOAT4X4 viewProj;
+        XMStoreFloat4x4(&viewProj, constants.viewProj);
+        float yScale = std::sqrt(viewProj._12 * viewProj._12 +
+                                 viewProj._22 * viewProj._22 +
+                                 viewProj._32 * viewProj._32);
+
+        auto desc = renderTarget.textureDescriptor();
+        float pixelsPerUnit = .5f * static_cast<float>(desc.Height) * yScale;
+
+        float distance = XMVectorGetX(XMVector3Length(constants.cameraPosition));
+        if (constants.stereo)
+            distance = std::min(distance, XMVectorGetX(XMVector3Length(constants.rightCameraPosition)));
+
+        return selectLod(distance - meshRadius, pixelsPerUnit);
+    }
+
+    // The shadow maps have a 90 degree field of view from the light, and can
+    // afford coarser geometry than the view.
+    unsigned shadowLod(const Constants &constants, unsigned L) const
+    {
+        if (lods.empty())
+            return 0;
+
+        float pixelsPerUnit = .5f * static_cast<float>(constants.shadowResolution);
+        float distance = XMVectorGetX(XMVector3Length(toVec(lights[L].positionWorld, 1)));
+
+        unsigned level = selectLod(distance - meshRadius, pixelsPerUnit) + ShadowGeometryLodBias;
+        return std::min(level, static_cast<unsigned>(lods.size()));
+    }
+
+    // Bind the vertices with the indices of the given LOD, and return the
+    // number of indices to draw.
+    unsigned setLodBuffers(Resource &vertices, Resource &indices, unsigned count, unsigned level)
+    {
+        if (level == 0)
+        {
+            setVertexBuffers(&vertices, &indices);
+            return count;
         }
+
+        auto &lod = lods[level - 1];
+        setVertexBuffers(&vertices, &lod.indexBuffer);
+        return lod.indexCount;
     }
 
     LightingPSConstants lightingPSConstants(const SVBRDF &svbrdf, const Constants &constants)
@@ -2500,33 +4102,46 @@ private:
         psConstants.useNormalMapping   = constants.useNormalMapping;
         psConstants.numLights          = static_cast<uint>(lights.size());
 
+        // Only the single quad is displaced by the CPU, and its displaced
+        // meshes have the displaced normals, so the undisplaced one is
+        // ConstantUp. GPU displacement keeps the interpolated normals.
+        bool cpuDisplaced =
+            configuration.meshMode == MeshMode::SingleQuad &&
+            (configuration.displacementMode == DisplacementMode::CPUDisplacementMapping ||
+             configuration.displacementMode == DisplacementMode::AdaptiveDisplacementMapping);
+        bool displaced = cpuDisplaced || configuration.displacementMode == DisplacementMode::GPUDisplacementMapping;
+
+        psConstants.displacementMagnitude = displaced ? constants.displacementMagnitude : 0;
+        psConstants.flatDisplacementBase  = cpuDisplaced;
+
+        if (constants.stereo)
+            psConstants.rightCameraPosition = constants.rightCameraPosition;
+
         return psConstants;
     }
 
     void bindLightingResources(SVBRDF &svbrdf, bool bindShadows = true)
     {
-        context->PSSetShaderResources(0, 1, bind(svbrdf.diffuseAlbedo.srv));
-        context->PSSetShaderResources(1, 1, bind(svbrdf.specularAlbedo.srv));
-        context->PSSetShaderResources(2, 1, bind(svbrdf.specularShape.srv));
-        context->PSSetShaderResources(3, 1, bind(svbrdf.normals.srv));
-        context->PSSetShaderResources(4, 1, bind(lightBuffer.srv));
-        context->PSSetSamplers(0, 1, bind(bilinear));
+        setShaderResources(ShaderStage::PS, 0, { svbrdf.diffuseAlbedo.srv });
+        setShaderResources(ShaderStage::PS, 1, { svbrdf.specularAlbedo.srv });
+        setShaderResources(ShaderStage::PS, 2, { svbrdf.specularShape.srv });
+        setShaderResources(ShaderStage::PS, 3, { svbrdf.normals.srv });
+        setShaderResources(ShaderStage::PS, 4, { lightBuffer.srv });
+        setShaderResources(ShaderStage::PS, 10, { svbrdf.heightDerivativeMap.srv });
+        setSamplers(ShaderStage::PS, 0, { bilinear });
 
         if (bindShadows)
         {
-            context->PSSetShaderResources(5, 1, bind(shadowMaps.srv));
-            context->PSSetShaderResources(6, 1, bind(shadowViewProjBuffer.srv));
-            context->PSSetSamplers(1, 1, bind(shadowSampler));
+            setShaderResources(ShaderStage::PS, 5, { shadowMaps.srv });
+            setShaderResources(ShaderStage::PS, 6, { shadowViewProjBuffer.srv });
+            setSamplers(ShaderStage::PS, 1, { shadowSampler });
         }
     }
 
     void unbindLightingResources()
     {
-        ID3D11ShaderResourceView *nilSRV[7] = { nullptr };
-        ID3D11SamplerState *nilSmp[2] = { nullptr };
-
-        context->PSSetShaderResources(0, 7, nilSRV);
-        context->PSSetSamplers(0, 2, nilSmp);
+        unbindShaderResources(ShaderStage::PS, { 0, 1, 2, 3, 4, 5, 6, 10 });
+        unbindSamplers(ShaderStage::PS, { 0, 1 });
     }
 
     void renderForward(ConstantBuffers &cb,
@@ -2536,11 +4151,9 @@ private:
     {
         GPUScope scope(L"renderForward");
 
-        RegularMeshVSConstants vsConstants;
-        vsConstants.viewProj              = constants.viewProj;
-        vsConstants.scale                 = meshScale;
-        vsConstants.displacementMagnitude = constants.displacementMagnitude;
+        RegularMeshVSConstants vsConstants = meshVSConstants(constants);
         LightingPSConstants psConstants = lightingPSConstants(svbrdf, constants);
+        UINT instances = constants.stereo ? 2 : 1;
 
         setRenderTarget(renderTarget, &depthBuffer);
 
@@ -2553,18 +4166,29 @@ private:
         auto psCB0 = cb.write(psConstants);
         auto psCB1 = cb.write(shadowConstants);
 
-        setVertexBuffers(&vertexBuffer, &indexBuffer);
+        unsigned lodIndexCount = setLodBuffers(vertexBuffer, indexBuffer, indexCount,
+                                               viewLod(constants, renderTarget));
+
+        setConstantBuffer(ShaderStage::VS, 0, vsCB);
+        setConstantBuffer(ShaderStage::DS, 0, vsCB);
+        setShaderResources(ShaderStage::DS, 0, { svbrdf.heightMap.srv });
+        setSamplers(ShaderStage::DS, 0, { bilinear });
 
-        context->VSSetConstantBuffers(0, 1, bind(vsCB));
-        context->DSSetConstantBuffers(0, 1, bind(vsCB));
-        context->DSSetShaderResources(0, 1, bind(svbrdf.heightMap.srv));
-        context->DSSetSamplers(0, 1, bind(bilinear));
+        if (constants.tessellation)
+        {
+            setConstantBuffer(ShaderStage::HS, 0, cb.write(viewTessellationHSConstants(svbrdf, constants, renderTarget)));
+            setShaderResources(ShaderStage::HS, 0, { svbrdf.heightBoundsMap.srv });
+        }
 
-        context->PSSetConstantBuffers(0, 1, bind(psCB0));
-        context->PSSetConstantBuffers(1, 1, bind(psCB1));
+        setConstantBuffer(ShaderStage::PS, 0, psCB0);
+        setConstantBuffer(ShaderStage::PS, 1, psCB1);
 
         bindLightingResources(svbrdf);
-        context->DrawIndexed(indexCount, 0, 0);
+
+        auto &statistics = viewStatistics[std::min(constants.view, MaxViews - 1)];
+        statistics.begin();
+        drawIndexed(lodIndexCount, instances);
+        statistics.end();
 
         if (constants.wireframe)
         {
@@ -2574,7 +4198,7 @@ private:
             else
                 renderMeshPipeline.bindWireframe();
 
-            context->DrawIndexed(indexCount, 0, 0);
+            drawIndexed(lodIndexCount, instances);
         }
 
         unbindLightingResources();
@@ -2582,62 +4206,278 @@ private:
         setRenderTarget(nullptr);
     }
 
-    void renderTextureSpaceLighting(ConstantBuffers &cb,
-                       SVBRDF &svbrdf,
-                       const Constants &constants,
-                       Resource &renderTarget, Resource &depthBuffer)
+    // Hash of everything the view independent lighting depends on.
+    uint64_t lightingHash(const SVBRDF &svbrdf, const Constants &constants)
     {
-        GPUScope scope(L"renderTextureSpaceLighting");
+        uint64_t hash = hashValue(lights.size(), 14695981039346656037ull);
+        for (auto &l : lights)
+        {
+            hash = hashValue(l.positionWorld, hash);
+            hash = hashValue(l.falloffMultiplier, hash);
+            hash = hashValue(l.colorHDR, hash);
+        }
 
-        LightingPSConstants psConstants = lightingPSConstants(svbrdf, constants);
+        XMFLOAT4 ambient;
+        XMStoreFloat4(&ambient, constants.ambientLight);
+
+        hash = hashValue(ambient, hash);
+        hash = hashValue(svbrdf.alpha, hash);
+        hash = hashValue(constants.normalMode, hash);
+        hash = hashValue(constants.useNormalMapping, hash);
+        hash = hashValue(constants.displacementMagnitude, hash);
+        hash = hashValue(constants.shadowDepthBias, hash);
+        hash = hashValue(constants.shadowSSDepthBias, hash);
+        hash = hashValue(shadowConstants, hash);
 
+        return hash;
+    }
+
+    void updateLightingTiles(ConstantBuffers &cb,
+                             SVBRDF &svbrdf,
+                             const Constants &constants,
+                             const LightingPSConstants &psConstants,
+                             unsigned view,
+                             std::vector<LightingTileScheduler::TileUpdate> &updates)
+    {
+        GPUScope scope(L"Texture space lighting");
+
+        // With shared diffuse lighting, the second map is the shadow terms,
+        // which are view independent like the diffuse lighting.
+        bool shared = lightingMode == LightingMode::SharedDiffuseLighting;
+        if (shared)
         {
-            GPUScope scope(L"Texture space lighting");
+            for (auto &u : updates)
+                u.shading = LightingTileScheduler::Shading::DiffuseAndSpecular;
+        }
+        else
+        {
+            specularLightingMap(svbrdf, view);
+        }
 
-            RegularMeshVSConstants vsConstants;
-            TextureSpacePSConstants psDisplacement;
-            psDisplacement.displacementMagnitude = constants.displacementMagnitude;
+        auto &secondMips = shared ? shadowTermMips : specularLightingMips[view];
+
+        // Group the tiles by the mip level they are shaded at, with the tiles
+        // that also need diffuse lighting first in each group.
+        std::stable_sort(updates.begin(), updates.end(),
+            [] (const LightingTileScheduler::TileUpdate &a, const LightingTileScheduler::TileUpdate &b)
+            {
+                if (a.level != b.level)
+                    return a.level < b.level;
+                return a.shading == LightingTileScheduler::Shading::DiffuseAndSpecular
+                    && b.shading != LightingTileScheduler::Shading::DiffuseAndSpecular;
+            });
+
+        struct LevelTiles
+        {
+            unsigned level;
+            UINT first;
+            UINT diffuseTiles;
+            UINT allTiles;
+        };
+
+        std::vector<LevelTiles> levels;
+        for (UINT i = 0; i < static_cast<UINT>(updates.size()); ++i)
+        {
+            auto &u = updates[i];
+            if (levels.empty() || levels.back().level != u.level)
+                levels.push_back({ u.level, i, 0, 0 });
+
+            auto &l = levels.back();
+            if (u.shading == LightingTileScheduler::Shading::DiffuseAndSpecular)
+                ++l.diffuseTiles;
+            ++l.allTiles;
+        }
+
+        {
+            float w = static_cast<float>(svbrdf.width);
+            float h = static_cast<float>(svbrdf.height);
+
+            D3D11_MAPPED_SUBRESOURCE mapped;
+            zero(mapped);
+            checkHR(context->Map(lightingTileRects.buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped));
+            auto rects = static_cast<float4 *>(mapped.pData);
+            for (auto &u : updates)
+            {
+                *rects++ = {
+                    u.rect.x0 / w, u.rect.y0 / h,
+                    u.rect.x1 / w, u.rect.y1 / h,
+                };
+            }
+            context->Unmap(lightingTileRects.buffer, 0);
+        }
+
+        auto tileConstants = [&] (unsigned mip)
+        {
+            TileConstants c;
+            c.targetSize[0] = static_cast<float>(std::max(1u, svbrdf.width  >> mip));
+            c.targetSize[1] = static_cast<float>(std::max(1u, svbrdf.height >> mip));
+            return cb.write(c);
+        };
+
+        {
+            GPUScope scope(L"Mark tiles");
+
+            markLightingTilesPipeline.bind();
+            setShaderResources(ShaderStage::VS, 0, { lightingTileRects.srv });
+
+            for (auto &l : levels)
+            {
+                auto &stencil = textureSpaceLightingStencilMips[l.level];
 
-            vsConstants.viewProj = constants.viewProj;
-            vsConstants.scale    = meshScale;
+                clearDepthStencil(stencil.dsv, D3D11_CLEAR_STENCIL, 0, 0);
+                setRenderTargets({}, stencil.dsv);
 
-            float zero[4] = { 0, 0, 0, 1 };
-            context->ClearRenderTargetView(textureSpaceLightingMap.rtv, zero);
-            setRenderTarget(textureSpaceLightingMap);
+                auto vsCB = tileConstants(l.level);
+                setConstantBuffer(ShaderStage::VS, 0, vsCB);
+
+                UINT specularTiles = l.allTiles - l.diffuseTiles;
+                markLightingTilesPipeline.setStencilRef(StencilDiffuseAndSpecular);
+                draw(l.diffuseTiles * 6, l.first * 6);
+                markLightingTilesPipeline.setStencilRef(StencilSpecular);
+                draw(specularTiles * 6, (l.first + l.diffuseTiles) * 6);
+            }
+
+            unbindShaderResources(ShaderStage::VS, { 0 });
+            setRenderTargets({});
+        }
+
+        {
+            GPUScope scope(L"Shade tiles");
+
+            RegularMeshVSConstants vsConstants;
+            zero(vsConstants);
+            vsConstants.viewProj    = constants.viewProj;
+            vsConstants.scale       = meshScale;
+            vsConstants.heightScale = heightScale(constants);
 
             renderTextureSpaceLightingPipeline.bind();
             auto vsCB = cb.write(vsConstants);
             auto psCB0 = cb.write(psConstants);
             auto psCB1 = cb.write(shadowConstants);
-            auto psCB2 = cb.write(psDisplacement);
 
             setVertexBuffers(&vertexBuffer, &indexBuffer);
 
-            context->VSSetConstantBuffers(0, 1, bind(vsCB));
+            setConstantBuffer(ShaderStage::VS, 0, vsCB);
 
-            context->PSSetConstantBuffers(0, 1, bind(psCB0));
-            context->PSSetConstantBuffers(1, 1, bind(psCB1));
-            context->PSSetConstantBuffers(2, 1, bind(psCB2));
-            context->PSSetShaderResources(7, 1, bind(svbrdf.heightMap.srv));
-            context->PSSetSamplers(2, 1, bind(bilinear));
+            setConstantBuffer(ShaderStage::PS, 0, psCB0);
+            setConstantBuffer(ShaderStage::PS, 1, psCB1);
+            setShaderResources(ShaderStage::PS, 7, { svbrdf.heightMap.srv });
+            setSamplers(ShaderStage::PS, 2, { bilinear });
 
             bindLightingResources(svbrdf);
-            context->DrawIndexed(indexCount, 0, 0);
+
+            TextureSpacePSConstants psDisplacement;
+            psDisplacement.displacementMagnitude = constants.displacementMagnitude;
+
+            psDisplacement.lightingTerms = shared ? LightingDiffuse : LightingAll;
+            auto psCB2Diffuse = cb.write(psDisplacement);
+            psDisplacement.lightingTerms = LightingSpecular;
+            auto psCB2Specular = cb.write(psDisplacement);
+
+            for (auto &l : levels)
+            {
+                auto &stencil = textureSpaceLightingStencilMips[l.level];
+
+                if (l.diffuseTiles > 0)
+                {
+                    setConstantBuffer(ShaderStage::PS, 2, psCB2Diffuse);
+
+                    if (shared)
+                        setRenderTargets({ diffuseLightingMips[l.level].rtv, nullptr, secondMips[l.level].rtv }, stencil.dsv);
+                    else
+                        setRenderTargets({ diffuseLightingMips[l.level].rtv, secondMips[l.level].rtv }, stencil.dsv);
+                    renderTextureSpaceLightingPipeline.setStencilRef(StencilDiffuseAndSpecular);
+                    drawIndexed(indexCount);
+                }
+
+                if (l.allTiles > l.diffuseTiles)
+                {
+                    setConstantBuffer(ShaderStage::PS, 2, psCB2Specular);
+
+                    setRenderTargets({ nullptr, secondMips[l.level].rtv }, stencil.dsv);
+                    renderTextureSpaceLightingPipeline.setStencilRef(StencilSpecular);
+                    drawIndexed(indexCount);
+                }
+            }
+
             unbindLightingResources();
+            unbindShaderResources(ShaderStage::PS, { 7 });
+            setRenderTargets({ nullptr, nullptr, nullptr });
+        }
 
-            setRenderTarget(nullptr);
+        {
+            // Only rebuild the mip chain below the relit tiles. A tile shaded
+            // at some level only affects the levels coarser than that.
+            GPUScope scope(L"Downsample tiles");
+
+            downsampleLightingTilesPipeline.bind();
+            setShaderResources(ShaderStage::VS, 0, { lightingTileRects.srv });
+
+            for (size_t mip = 1; mip < diffuseLightingMips.size(); ++mip)
+            {
+                UINT tiles = 0;
+                for (auto &l : levels)
+                {
+                    if (l.level < mip)
+                        tiles = l.first + l.allTiles;
+                }
+
+                if (tiles == 0)
+                    continue;
+
+                setRenderTargets({ diffuseLightingMips[mip].rtv, secondMips[mip].rtv });
+
+                auto vsCB = tileConstants(static_cast<unsigned>(mip));
+                setConstantBuffer(ShaderStage::VS, 0, vsCB);
+                setShaderResources(ShaderStage::PS, 0, { diffuseLightingMips[mip - 1].srv });
+                setShaderResources(ShaderStage::PS, 1, { secondMips[mip - 1].srv });
+                draw(tiles * 6);
+
+                unbindShaderResources(ShaderStage::PS, { 0, 1 });
+            }
+
+            unbindShaderResources(ShaderStage::VS, { 0 });
+            setRenderTargets({ nullptr, nullptr });
+        }
+    }
+
+    void renderTextureSpaceLighting(ConstantBuffers &cb,
+                       SVBRDF &svbrdf,
+                       const Constants &constants,
+                       Resource &renderTarget, Resource &depthBuffer)
+    {
+        GPUScope scope(L"renderTextureSpaceLighting");
+
+        LightingPSConstants psConstants = lightingPSConstants(svbrdf, constants);
+
+        unsigned view = std::min(constants.view, MaxViews - 1);
+
+        {
+            LightingTileScheduler::Inputs inputs;
+            inputs.lightingHash = lightingHash(svbrdf, constants);
+
+            XMFLOAT3 cameraPosition;
+            XMStoreFloat3(&cameraPosition, constants.cameraPosition);
+            inputs.cameraPosition[0] = cameraPosition.x;
+            inputs.cameraPosition[1] = cameraPosition.y;
+            inputs.cameraPosition[2] = cameraPosition.z;
+
+            lightingTiles.update(view, inputs);
 
-            context->GenerateMips(textureSpaceLightingMap.srv);
+            readLightingFeedback(view);
+            lastLightingView = view;
+
+            auto updates = lightingTiles.schedule(view, constants.lightingTexelBudget, &lightingFeedback);
+            if (!updates.empty())
+                updateLightingTiles(cb, svbrdf, constants, psConstants, view, updates);
+
+            frameWork.texels += lightingTiles.stats().shadedTexels;
         }
 
         {
             GPUScope scope(L"Render with texture space lighting");
 
-            RegularMeshVSConstants vsConstants;
-
-            vsConstants.viewProj              = constants.viewProj;
-            vsConstants.scale                 = meshScale;
-            vsConstants.displacementMagnitude = constants.displacementMagnitude;
+            RegularMeshVSConstants vsConstants = meshVSConstants(constants);
 
             setRenderTarget(renderTarget, &depthBuffer);
 
@@ -2649,18 +4489,32 @@ private:
             auto vsCB = cb.write(vsConstants);
             auto psCB = cb.write(psConstants);
 
-            setVertexBuffers(&vertexBuffer, &indexBuffer);
+            unsigned lodIndexCount = setLodBuffers(vertexBuffer, indexBuffer, indexCount,
+                                                   viewLod(constants, renderTarget));
+
+            setConstantBuffer(ShaderStage::VS, 0, vsCB);
 
-            context->VSSetConstantBuffers(0, 1, bind(vsCB));
+            setConstantBuffer(ShaderStage::DS, 0, vsCB);
+            setShaderResources(ShaderStage::DS, 0, { svbrdf.heightMap.srv });
+            setSamplers(ShaderStage::DS, 0, { bilinear });
 
-            context->DSSetConstantBuffers(0, 1, bind(vsCB));
-            context->DSSetShaderResources(0, 1, bind(svbrdf.heightMap.srv));
-            context->DSSetSamplers(0, 1, bind(bilinear));
+            if (constants.tessellation)
+            {
+                setConstantBuffer(ShaderStage::HS, 0, cb.write(viewTessellationHSConstants(svbrdf, constants, renderTarget)));
+                setShaderResources(ShaderStage::HS, 0, { svbrdf.heightBoundsMap.srv });
+            }
+
+            clearLightingFeedback(view);
+            auto feedbackCB = bindLightingFeedback(cb, svbrdf, view);
 
-            context->PSSetConstantBuffers(0, 1, bind(psCB));
-            context->PSSetShaderResources(0, 1, bind(textureSpaceLightingMap.srv));
-            context->PSSetSamplers(0, 1, bind(aniso));
-            context->DrawIndexed(indexCount, 0, 0);
+            setConstantBuffer(ShaderStage::PS, 0, psCB);
+            setShaderResources(ShaderStage::PS, 0, { diffuseLightingMap.srv });
+            setShaderResources(ShaderStage::PS, 1, { specularLightingMap(svbrdf, view).srv });
+            setSamplers(ShaderStage::PS, 0, { aniso });
+
+            viewStatistics[view].begin();
+            drawIndexed(lodIndexCount);
+            viewStatistics[view].end();
 
             if (constants.wireframe)
             {
@@ -2670,167 +4524,360 @@ private:
                 else
                     renderMeshPipeline.bindWireframe();
 
-                context->DrawIndexed(indexCount, 0, 0);
+                drawIndexed(lodIndexCount);
             }
 
-            unbindResources(&ID3D11DeviceContext::PSSetShaderResources, { 0 });
+            unbindShaderResources(ShaderStage::PS, { 0, 1 });
 
+            // Also unbinds the feedback buffer.
             setRenderTarget(nullptr);
         }
+
+        copyLightingFeedback(view);
     }
 
-};
+    // The view independent lighting is updated once per frame before the
+    // eyes are rendered. Both eyes record their feedback into the same
+    // buffer, which is read back when the next frame begins.
+    void updateSharedLighting(ConstantBuffers &cb,
+                              SVBRDF &svbrdf,
+                              const Constants &constants)
+    {
+        GPUScope scope(L"updateSharedLighting");
 
-static UINT maximumMSAAQualityFor(DXGI_FORMAT format, UINT count)
-{
-    UINT maxQuality = 0;
-    checkHR(device->CheckMultisampleQualityLevels(format, count, &maxQuality));
-    return (maxQuality == 0) ? 0 : (maxQuality - 1);
-}
+        if (lightingFeedbackBuffers[0].recording)
+            copyLightingFeedback(0);
 
-class SVBRDFOculus
-{
-    Oculus &oculus;
-    ConstantBuffers cb;
-    LightIndicator lightIndicator;
-    TextManager textManager;
-    bool showHelp;
-    bool wireframe;
+        LightingTileScheduler::Inputs inputs;
+        zero(inputs);
+        inputs.lightingHash = lightingHash(svbrdf, constants);
 
-    std::string dataDirectory;
-    bool rwPresets;
-    RenderingState state;
+        lightingTiles.update(0, inputs);
 
-    bool useOculus;
+        readLightingFeedback(0);
+        lastLightingView = 0;
 
-    std::shared_ptr<SVBRDFRenderer> renderer;
+        auto updates = lightingTiles.schedule(0, constants.lightingTexelBudget, &lightingFeedback);
+        if (!updates.empty())
+        {
+            LightingPSConstants psConstants = lightingPSConstants(svbrdf, constants);
+            updateLightingTiles(cb, svbrdf, constants, psConstants, 0, updates);
+        }
 
-    MeshMode meshMode;
-    DisplacementMode displacementMode;
-    LightingMode lightingMode;
-    TextureSpaceLightingPrecision lightingPrecision;
-    NormalMode normalMode;
-    bool useNormalMapping;
+        frameWork.texels += lightingTiles.stats().shadedTexels;
 
-    ShadowMode shadowMode;
-    int shadowPcfTaps;
-    float shadowKernelWidth;
+        clearLightingFeedback(0);
+    }
 
-    FPSCamera camera;
+    void renderSharedDiffuseLighting(ConstantBuffers &cb,
+                                     SVBRDF &svbrdf,
+                                     const Constants &constants,
+                                     Resource &renderTarget, Resource &depthBuffer)
+    {
+        GPUScope scope(L"renderSharedDiffuseLighting");
 
-    float lightIntensity;
-    int selectedLight;
+        unsigned view = std::min(constants.view, MaxViews - 1);
 
-    SVBRDFCollection materials;
-    SVBRDF activeMaterial;
-    int materialIndex;
+        RegularMeshVSConstants vsConstants = meshVSConstants(constants);
+        LightingPSConstants psConstants = lightingPSConstants(svbrdf, constants);
+        UINT instances = constants.stereo ? 2 : 1;
 
-    MeshCollection meshes;
-    Mesh activeMesh;
-    int meshIndex;
+        setRenderTarget(renderTarget, &depthBuffer);
 
-    std::array<Resource, 2> aaTargets;
-    std::array<Resource, 2> aaDepth;
-public:
-    SVBRDFOculus(Oculus &oculus, const std::string &dataDir = std::string(), bool rwPresets = false)
-        : oculus(oculus)
-        , textManager(3)
-        , dataDirectory(dataDir)
-        , camera(CameraButtons, XMVectorZero(), 0, 0)
-        , rwPresets(rwPresets)
+        if (constants.tessellation)
+            renderMeshPipelineTessellated.bind();
+        else
+            renderMeshPipeline.bind();
+
+        auto vsCB  = cb.write(vsConstants);
+        auto psCB0 = cb.write(psConstants);
+        auto psCB1 = cb.write(shadowConstants);
+
+        unsigned lodIndexCount = setLodBuffers(vertexBuffer, indexBuffer, indexCount,
+                                               viewLod(constants, renderTarget));
+
+        setConstantBuffer(ShaderStage::VS, 0, vsCB);
+        setConstantBuffer(ShaderStage::DS, 0, vsCB);
+        setShaderResources(ShaderStage::DS, 0, { svbrdf.heightMap.srv });
+        setSamplers(ShaderStage::DS, 0, { bilinear });
+
+        if (constants.tessellation)
+        {
+            setConstantBuffer(ShaderStage::HS, 0, cb.write(viewTessellationHSConstants(svbrdf, constants, renderTarget)));
+            setShaderResources(ShaderStage::HS, 0, { svbrdf.heightBoundsMap.srv });
+        }
+
+        // Feedback of both eyes goes to the same buffer.
+        auto feedbackCB = bindLightingFeedback(cb, svbrdf, 0);
+
+        setConstantBuffer(ShaderStage::PS, 0, psCB0);
+        setConstantBuffer(ShaderStage::PS, 1, psCB1);
+
+        bindLightingResources(svbrdf);
+        setShaderResources(ShaderStage::PS, 8, { diffuseLightingMap.srv });
+        setShaderResources(ShaderStage::PS, 9, { shadowTermMap.srv });
+        setSamplers(ShaderStage::PS, 2, { aniso });
+
+        viewStatistics[view].begin();
+        drawIndexed(lodIndexCount, instances);
+        viewStatistics[view].end();
+
+        if (constants.wireframe)
+        {
+            GPUScope wf(L"Wireframe");
+            if (constants.tessellation)
+                renderMeshPipelineTessellated.bindWireframe();
+            else
+                renderMeshPipeline.bindWireframe();
+
+            drawIndexed(lodIndexCount, instances);
+        }
+
+        unbindLightingResources();
+        unbindShaderResources(ShaderStage::PS, { 8, 9 });
+
+        // Also unbinds the feedback buffer.
+        setRenderTarget(nullptr);
+    }
+
+    void clearLightingFeedback(unsigned view)
     {
-        useOculus = false;
-        wireframe = false;
+        auto &feedback = lightingFeedbackBuffers[view];
 
-        if (dataDirectory.empty())
-            dataDirectory = "data";
+        UINT notSampled[4] = { LightingFeedback::NotSampled, LightingFeedback::NotSampled, LightingFeedback::NotSampled, LightingFeedback::NotSampled };
+        context->ClearUnorderedAccessViewUint(feedback.tileLevels.uav, notSampled);
+        feedback.recording = true;
+    }
 
-        log("Using data directory \"%s\" (%s).\n", dataDirectory.c_str(), absolutePath(dataDirectory).c_str());
+    // Bind the feedback buffer of the view for the pixel shader, after the
+    // render targets have been set.
+    ConstantBuffers::CB bindLightingFeedback(ConstantBuffers &cb, const SVBRDF &svbrdf, unsigned view)
+    {
+        auto &feedback = lightingFeedbackBuffers[view];
 
-        materials = SVBRDFCollection(dataDirectory.c_str());
-        materialIndex = 0;
+        FeedbackConstants feedbackConstants;
+        feedbackConstants.lightingMapSize[0] = static_cast<float>(svbrdf.width);
+        feedbackConstants.lightingMapSize[1] = static_cast<float>(svbrdf.height);
+        feedbackConstants.tileSize           = static_cast<float>(lightingTiles.tileSize());
+        feedbackConstants.tilesX             = lightingTiles.tilesX();
+        feedbackConstants.tilesY             = lightingTiles.tilesY();
+        feedbackConstants.feedbackPixel[0]   = static_cast<uint>(feedback.written & 1);
+        feedbackConstants.feedbackPixel[1]   = static_cast<uint>((feedback.written >> 1) & 1);
 
-        meshes = MeshCollection(dataDirectory.c_str());
-        meshIndex = 0;
+        auto feedbackCB = cb.write(feedbackConstants);
 
-        selectedLight = 0;
+        setUnorderedAccessView(1, feedback.tileLevels.uav);
+        setConstantBuffer(ShaderStage::PS, 2, feedbackCB);
 
-        RenderingState s;
-        s.load(dataDirectory + "/" + QuickPresetFilenames[0]);
-        setState(s);
+        return feedbackCB;
+    }
 
-        initHelpText();
-        showHelp = true;
+    void copyLightingFeedback(unsigned view)
+    {
+        auto &feedback = lightingFeedbackBuffers[view];
+
+        // If the ring is full, the oldest feedback is dropped in favor of the latest.
+        if (feedback.written - feedback.read >= FeedbackReadbackLatency)
+            ++feedback.read;
+
+        auto &readback = feedback.readback[feedback.written % FeedbackReadbackLatency];
+        context->CopyResource(readback.buffer, feedback.tileLevels.buffer);
+        ++feedback.written;
+        feedback.recording = false;
     }
 
-    void initHelpText()
+    // The statistics arrive a few frames late, so the most recent ones
+    // are used for the current frame.
+    void countViewPixels(unsigned view)
     {
-        float3 normalText = { 1, 1, 1 };
-        float3 valueText  = { 1, .25f, .25f };
+        D3D11_QUERY_DATA_PIPELINE_STATISTICS statistics;
+        if (viewStatistics[view].read(statistics))
+            viewPixels[view] = statistics.PSInvocations;
 
-        textManager.addText(1, 0, "SVBRDF");
+        frameWork.pixels += viewPixels[view];
+    }
 
-        textManager.addText(0, 2, "Setting");
-        textManager.addText(1, 2, "Value");
-        textManager.addText(2, 2, "Controls");
+    void readLightingFeedback(unsigned view)
+    {
+        auto &feedback = lightingFeedbackBuffers[view];
 
-        int row = 2;
+        while (feedback.read < feedback.written)
+        {
+            auto &readback = feedback.readback[feedback.read % FeedbackReadbackLatency];
 
-#define MEMBER_NUMBER(member) [this] { return static_cast<double>(this->member); }
-#define MEMBER_STRING(member) [this] (TextManager::TextBuffer &buf) { sprintf_s(buf, "%s", this->member.c_str()); }
+            D3D11_MAPPED_SUBRESOURCE mapped;
+            zero(mapped);
+            HRESULT hr = context->Map(readback.buffer, 0, D3D11_MAP_READ, D3D11_MAP_FLAG_DO_NOT_WAIT, &mapped);
+            if (hr == DXGI_ERROR_WAS_STILL_DRAWING)
+                break;
+            checkHR(hr);
 
-        ++row; textManager.addText(0, row, "Move camera");   textManager.addText(2, row, "(WASD)");
-        ++row; textManager.addText(0, row, "Turn camera");   textManager.addText(2, row, "(Arrows)");
-        ++row; textManager.addText(0, row, "Fast movement"); textManager.addText(2, row, "(Hold Ctrl)");
+            lightingFeedback.add(view, static_cast<const uint32_t *>(mapped.pData));
+            context->Unmap(readback.buffer, 0);
 
-        ++row;
+            ++feedback.read;
+        }
+    }
+};
 
-        ++row; textManager.addText(0, row, "Selected material"); textManager.addCallback(1, row, MEMBER_STRING(state.svbrdfName), valueText); textManager.addText(2, row, "(ZX or 9)");
-        ++row; textManager.addText(0, row, "Selected mesh");     textManager.addCallback(1, row, MEMBER_STRING(state.meshName), valueText);   textManager.addText(2, row, "(CV or 0)");
+static UINT maximumMSAAQualityFor(DXGI_FORMAT format, UINT count)
+{
+    UINT maxQuality = 0;
+    checkHR(device->CheckMultisampleQualityLevels(format, count, &maxQuality));
+    return (maxQuality == 0) ? 0 : (maxQuality - 1);
+}
 
-        ++row;
+// Everything the update thread hands over to the render thread for a frame.
+// A published FrameState is never modified, so the render thread can use it
+// without locking while the update thread works on the next one.
+struct FrameState
+{
+    RenderingState state;
+    FPSCamera camera;
 
-        ++row; textManager.addEnum(0, row, "Mesh mode",      meshMode,          normalText, valueText); textManager.addText(2, row, "(1)");
-        ++row; textManager.addEnum(0, row, "Displacement",   displacementMode,  normalText, valueText); textManager.addText(2, row, "(2)");
-        ++row; textManager.addEnum(0, row, "Shadows",        shadowMode,        normalText, valueText); textManager.addText(2, row, "(3)");
-        ++row; textManager.addEnum(0, row, "Antialiasing",   state.aaMode,      normalText, valueText); textManager.addText(2, row, "(4)");
-        ++row; textManager.addEnum(0, row, "Normals",        normalMode,        normalText, valueText); textManager.addText(2, row, "(5)");
-        ++row; textManager.addBool(0, row, "Normal mapping", useNormalMapping,  normalText, valueText); textManager.addText(2, row, "(6)");
-        ++row; textManager.addEnum(0, row, "Tone mapping",   state.tonemapMode, normalText, valueText); textManager.addText(2, row, "(7)");
-        ++row; textManager.addEnum(0, row, "Lighting",       lightingMode,      normalText, valueText); textManager.addText(2, row, "(8)");
+    float lightIntensity;
+    int selectedLight;
 
-        ++row; textManager.addNumberCallback(0, row, "Displacement triangle area", MEMBER_NUMBER(state.displacementDensity),   normalText, valueText); textManager.addText(2, row, "(TG)");
-        ++row; textManager.addNumberCallback(0, row, "Displacement magnitude",     MEMBER_NUMBER(state.displacementMagnitude), normalText, valueText); textManager.addText(2, row, "(RF)");
+    MeshMode meshMode;
+    DisplacementMode displacementMode;
+    LightingMode lightingMode;
+    NormalMode normalMode;
+    bool useNormalMapping;
+    ShadowMode shadowMode;
 
-        ++row;
+    bool showHelp;
+    bool wireframe;
+    bool useOculus;
+    bool singlePassStereo;
+    bool multithreadedRecording;
+    bool measureFrameTime;
+    bool quit;
+    DynamicResolution dynamicResolution;
+
+    // Loaded by the update thread, and shared by every frame using them.
+    // Assets are replaced instead of modified once they have been published.
+    std::shared_ptr<SVBRDF> material;
+    std::shared_ptr<Mesh> mesh;
+
+    // Bumped for the changes the render thread has to act on. These are
+    // counters instead of flags, so that a change is not lost if the render
+    // thread skips the frame it happened in.
+    uint32_t rendererChanges;
+    uint32_t targetChanges;
+    uint32_t recenters;
+
+    // Debug views of the shadow maps, which are toggled here like the other
+    // inputs, as the render thread does not poll the keyboard.
+#if defined(DEBUG_SHADOW_MATRICES)
+    int debugShadowView;
+#endif
+#if defined(DEBUG_SHADOW_TEXEL_UNPROJECT)
+    int debugShadowSlice;
+#endif
+#if defined(DEBUG_SHADOW_CPU_RASTERIZER)
+    bool showCPUShadowMaps;
+    uint32_t shadowValidations;
+#endif
 
-        ++row; textManager.addBool(          0, row, "VR rendering", useOculus, normalText, valueText);                    textManager.addText(2, row, "(Enter)");
-        ++row; textManager.addNumberCallback(0, row, "VR scale",     MEMBER_NUMBER(state.vrScale), normalText, valueText); textManager.addText(2, row, "(IK)");
-        ++row; textManager.addText(          0, row, "VR recenter");                                                       textManager.addText(2, row, "(Space bar)");
+    FrameState()
+        : camera(CameraButtons, XMVectorZero(), 0, 0)
+        , lightIntensity(1)
+        , selectedLight(0)
+        , meshMode(MeshMode::SingleQuad)
+        , displacementMode(DisplacementMode::NoDisplacement)
+        , lightingMode(LightingMode::ForwardLighting)
+        , normalMode(NormalMode::ConstantNormal)
+        , useNormalMapping(true)
+        , shadowMode(ShadowMode::NoShadows)
+        , showHelp(true)
+        , wireframe(false)
+        , useOculus(false)
+        , singlePassStereo(false)
+        , multithreadedRecording(false)
+        , measureFrameTime(false)
+        , quit(false)
+        , dynamicResolution(DynamicResolution::Scale)
+        , rendererChanges(0)
+        , targetChanges(0)
+        , recenters(0)
+    {
+#if defined(DEBUG_SHADOW_MATRICES)
+        debugShadowView = -1;
+#endif
+#if defined(DEBUG_SHADOW_TEXEL_UNPROJECT)
+        debugShadowSlice = 5;
+#endif
+#if defined(DEBUG_SHADOW_CPU_RASTERIZER)
+        showCPUShadowMaps = false;
+        shadowValidations = 0;
+#endif
+    }
 
-        ++row;
+    void addNewLight()
+    {
+        Light l;
 
-        ++row; textManager.addNumberCallback(0, row, "Amount of lights",    MEMBER_NUMBER(state.lights.size()), normalText, valueText); textManager.addText(2, row, "(Numpad +-)");
-        ++row; textManager.addNumberCallback(0, row, "Lights with shadows", MEMBER_NUMBER(state.shadowLights), normalText, valueText);  textManager.addText(2, row, "(Numpad .0)");
-        ++row; textManager.addNumber        (0, row, "Selected light", selectedLight, normalText, valueText);                           textManager.addText(2, row, "(Numpad 13)");
-        ++row; textManager.addText(0, row, "Move light");               textManager.addText(2, row, "(Numpad 845679)");
-        ++row; textManager.addText(0, row, "Adjust light intensity");   textManager.addText(2, row, "(Numpad */)");
-        ++row; textManager.addText(0, row, "Adjust ambient intensity"); textManager.addText(2, row, "(PgUp/PgDn)");
+        l.positionWorld = state.lights[selectedLight].positionWorld;
 
-        ++row;
+        l.colorHDR[1] = 1;
+        l.colorHDR[2] = 1;
+        l.colorHDR[0] = 1;
 
-        ++row; textManager.addText(0, row, "Load preset");            textManager.addText(2, row, "(F1...F10)");
-        ++row; textManager.addText(0, row, "Load preset dialog");     textManager.addText(2, row, "(F11)");
-        if (rwPresets)
+        l.falloffMultiplier = 1;
+
+        state.lights.emplace_back(l);
+        selectedLight = static_cast<int>(state.lights.size() - 1);
+    }
+
+    void removeLight()
+    {
+        if (state.lights.size() > 1)
         {
-            ++row; textManager.addText(0, row, "Save preset");            textManager.addText(2, row, "(Ctrl + F1...F10)");
+            state.lights.erase(state.lights.begin() + selectedLight);
+            selectedLight = std::min(selectedLight, static_cast<int>(state.lights.size() - 1));
         }
-        ++row; textManager.addText(0, row, "Toggle wireframe");       textManager.addText(2, row, "(Del)");
-        ++row; textManager.addText(0, row, "Toggle FPS measurement"); textManager.addText(2, row, "(Home)");
-        ++row; textManager.addText(0, row, "Toggle help");            textManager.addText(2, row, "(Tab)");
+    }
+};
 
-#undef MEMBER_NUMBER
-#undef MEMBER_STRING
+// The input handling, presets and asset loading. Each update produces the
+// next FrameState without using the immediate context, so that it can run on
+// a thread of its own.
+class Simulation : public FrameState
+{
+    Oculus &oculus;
+
+    std::string dataDirectory;
+    bool rwPresets;
+
+    SVBRDFCollection materials;
+    int materialIndex;
+
+    MeshCollection meshes;
+    int meshIndex;
+public:
+    Simulation(Oculus &oculus, const std::string &dataDir, bool rwPresets)
+        : oculus(oculus)
+        , dataDirectory(dataDir)
+        , rwPresets(rwPresets)
+    {
+        // Emulated command lists are usually slower than rendering serially.
+        multithreadedRecording = driverCommandLists();
+        log("Driver command lists are %s.\n", multithreadedRecording ? "supported" : "not supported");
+
+        if (dataDirectory.empty())
+            dataDirectory = "data";
+
+        log("Using data directory \"%s\" (%s).\n", dataDirectory.c_str(), absolutePath(dataDirectory).c_str());
+
+        materials = SVBRDFCollection(dataDirectory.c_str());
+        materialIndex = 0;
+
+        meshes = MeshCollection(dataDirectory.c_str());
+        meshIndex = 0;
+
+        RenderingState s;
+        s.load(dataDirectory + "/" + QuickPresetFilenames[0]);
+        setState(s);
     }
 
     void setState(const RenderingState &s)
@@ -2855,8 +4902,6 @@ public:
         displacementMode = DisplacementMode::NoDisplacement;
         lightingMode = LightingMode::ForwardLighting;
         shadowMode = ShadowMode::NoShadows;
-        shadowPcfTaps = ShadowPcfTaps;
-        shadowKernelWidth = ShadowKernelWidth;
 
         if (meshMode == MeshMode::SingleQuad)
         {
@@ -2872,8 +4917,6 @@ public:
         if (meshMode != MeshMode::SingleQuad)
             lightingMode = LightingMode::ForwardLighting;
 
-        lightingPrecision = TextureSpaceLightingPrecision::Float11_11_10;
-
         lightIntensity   = 1.f;
 
         camera = FPSCamera(CameraButtons,
@@ -2938,13 +4981,13 @@ public:
 
     void updateState()
     {
-        if (state.svbrdfName != activeMaterial.name)
-            state.svbrdfName = activeMaterial.name;
+        if (state.svbrdfName != material->name)
+            state.svbrdfName = material->name;
 
-        if (activeMesh.valid() && meshMode == MeshMode::LoadedMesh)
+        if (mesh->valid() && meshMode == MeshMode::LoadedMesh)
         {
-            if (state.meshName != activeMesh.name)
-                state.meshName = activeMesh.name;
+            if (state.meshName != mesh->name)
+                state.meshName = mesh->name;
         }
         else
         {
@@ -2956,31 +4999,6 @@ public:
         state.cameraPitchDegrees = toDegrees(camera.pitch());
     }
 
-    void addNewLight()
-    {
-        Light l;
-
-        l.positionWorld = state.lights[selectedLight].positionWorld;
-
-        l.colorHDR[1] = 1;
-        l.colorHDR[2] = 1;
-        l.colorHDR[0] = 1;
-
-        l.falloffMultiplier = 1;
-
-        state.lights.emplace_back(l);
-        selectedLight = static_cast<int>(state.lights.size() - 1);
-    }
-
-    void removeLight()
-    {
-        if (state.lights.size() > 1)
-        {
-            state.lights.erase(state.lights.begin() + selectedLight);
-            selectedLight = std::min(selectedLight, static_cast<int>(state.lights.size() - 1));
-        }
-    }
-
     void update(bool forceInit = false)
     {
         updatePresets();
@@ -2988,6 +5006,8 @@ public:
         camera.update();
 
         toggleValue("Show help", VK_TAB, showHelp);
+        toggleValue("Frame time measurement", VK_HOME, measureFrameTime);
+        quit = quit || keyPressed(VK_ESCAPE);
 
         updateValueClamp('Y', 'H', lightIntensity, 0.05f, 0, 10);
 
@@ -3034,6 +5054,9 @@ public:
         // changedRenderer     |= toggleValue("Lighting precision", VK_F11, lightingPrecision);
 
         bool changedVR = toggleValue("VR rendering", VK_RETURN, useOculus);
+        bool changedStereo = toggleValue("Single pass stereo", 'B', singlePassStereo);
+        toggleValue("Multithreaded recording", 'M', multithreadedRecording);
+        bool changedResolution = toggleValue("Dynamic resolution", 'N', dynamicResolution);
         updateValueClamp('I', 'K', state.vrScale, 1, -1, 10);
 
         if (useOculus && !oculus.isConnected())
@@ -3042,8 +5065,22 @@ public:
             useOculus = false;
         }
 
+        // Recentering is left to the render thread, which samples the poses.
         if (keyPressed(VK_SPACE))
-            oculus.recenter();
+            ++recenters;
+
+#if defined(DEBUG_SHADOW_MATRICES)
+        if (updateValueWrap('E', 'Q', debugShadowView, 1, -1, 6))
+            log("Shadow view: %d\n", debugShadowView);
+#endif
+#if defined(DEBUG_SHADOW_TEXEL_UNPROJECT)
+        updateValueWrap('I', 'K', debugShadowSlice, 1, 0, 6);
+#endif
+#if defined(DEBUG_SHADOW_CPU_RASTERIZER)
+        toggleValue("Software rasterized shadow maps", 'J', showCPUShadowMaps);
+        if (keyPressed('U'))
+            ++shadowValidations;
+#endif
 
         if (meshMode == MeshMode::LoadedMesh)
         {
@@ -3057,7 +5094,8 @@ public:
         bool loadMesh            = updateValueWrap('V', 'C', meshIndex,     1, 0, meshes.size())    || forceInit;
 
         bool changedHeight       = updateValueMultiply('R', 'F', state.displacementMagnitude, 1.1f, 0.f,  1.f);
-        bool changedTessellation = updateValueMultiply('T', 'G', state.displacementDensity,   2.f,  0.5f, 64.f, true);
+        bool changedTessellation = updateValueMultiply('T', 'G', state.displacementDensity,   DisplacementDensityStep, MinDisplacementDensity, MaxDisplacementDensity, true);
+        updateValueMultiply('O', 'L', state.lightingBudget, 2.f, 1.f / 16, 64.f, true);
         bool initRenderer        = changedRenderer || changedHeight || changedTessellation || loadMaterial || loadMesh || changedLights;
 
         // initRenderer |= updateValueClamp('E', 'Q', state.shadowDepthBias,   1, -100, 100);
@@ -3065,39 +5103,45 @@ public:
 
         if (loadMaterial)
         {
-            activeMaterial = materials.load(materialIndex);
+            material = std::make_shared<SVBRDF>(materials.load(materialIndex));
             changedTessellation = true;
         }
 
-        if (!activeMaterial.valid() || keyPressed('9'))
+        if (!material || !material->valid() || keyPressed('9'))
         {
-            if (!activeMaterial.valid())
+            if (!material || !material->valid())
                 log("No valid material to render with. Please select a material.\n");
 
-            materials.loadDialog(activeMaterial);
+            auto loaded = std::make_shared<SVBRDF>();
+            if (materials.loadDialog(*loaded))
+                material = loaded;
             changedTessellation = true;
             initRenderer = true;
         }
 
-        check(activeMaterial.valid(), "Must have a valid material to render with.\n");
+        check(material && material->valid(), "Must have a valid material to render with.\n");
 
         if (loadMesh)
         {
-            activeMesh = meshes.load(meshIndex, computeTargetTriangleArea(activeMaterial, state.displacementDensity));
+            mesh = std::make_shared<Mesh>(meshes.load(meshIndex, computeTargetTriangleArea(*material, state.displacementDensity)));
         }
         else if (keyPressed('0'))
         {
-            meshes.loadDialog(activeMesh, computeTargetTriangleArea(activeMaterial, state.displacementDensity));
+            auto loaded = std::make_shared<Mesh>();
+            if (meshes.loadDialog(*loaded, computeTargetTriangleArea(*material, state.displacementDensity)))
+                mesh = loaded;
             meshMode = MeshMode::LoadedMesh;
             initRenderer = true;
         }
 
-        if (activeMesh.valid() && meshMode == MeshMode::LoadedMesh && changedTessellation)
+        if (mesh->valid() && meshMode == MeshMode::LoadedMesh && changedTessellation)
         {
-            MeshCollection::retessellate(activeMesh, computeTargetTriangleArea(activeMaterial, state.displacementDensity));
+            auto retessellated = std::make_shared<Mesh>(*mesh);
+            MeshCollection::retessellate(*retessellated, computeTargetTriangleArea(*material, state.displacementDensity));
+            mesh = retessellated;
             initRenderer = true;
         }
-        else if (!activeMesh.valid() && meshMode == MeshMode::LoadedMesh)
+        else if (!mesh->valid() && meshMode == MeshMode::LoadedMesh)
         {
             log("No valid mesh for .OBJ mesh rendering. Switching to single quad.\n");
             meshMode = MeshMode::SingleQuad;
@@ -3106,33 +5150,450 @@ public:
 
         if (displacementMode != DisplacementMode::NoDisplacement)
         {
-            if (!activeMaterial.heightMap.valid()
-                || activeMaterial.heightMapCPU.width <= 0
-                || activeMaterial.heightMapCPU.height <= 0)
+            if (!material->heightMap.valid()
+                || material->heightMapCPU.width <= 0
+                || material->heightMapCPU.height <= 0)
             {
                 log("No valid height map for material \"%s\", displacement mapping disabled.\n",
-                    activeMaterial.name.c_str());
+                    material->name.c_str());
                 displacementMode = DisplacementMode::NoDisplacement;
             }
         }
 
         if (initRenderer)
-        {
-            renderer = std::make_shared<SVBRDFRenderer>(
-                meshMode, displacementMode,
-                lightingMode, lightingPrecision);
-            renderer->init(activeMaterial, &activeMesh, computeConstants());
-        }
-
-        if (forceInit || changedVR || changedAA)
-            initAA();
+            ++rendererChanges;
 
-        renderer->updateLights(state.lights);
+        if (forceInit || changedVR || changedAA || changedStereo || changedResolution)
+            ++targetChanges;
 
         updateState();
     }
+};
+
+// Renders the latest FrameState published by simulate(), which can run on a
+// separate update thread. The inherited FrameState is the frame being
+// rendered, and only changes in beginFrame().
+class SVBRDFOculus : FrameState
+{
+    Oculus &oculus;
+    ConstantBuffers cb;
+    LightIndicator lightIndicator;
+    TextManager textManager;
+
+    bool rwPresets;
+
+    // Only used by simulate().
+    Simulation simulation;
+    TripleBuffer<FrameState> frames;
+
+    std::shared_ptr<SVBRDFRenderer> renderer;
+
+    TextureSpaceLightingPrecision lightingPrecision;
+    int shadowPcfTaps;
+    float shadowKernelWidth;
+
+    // In VR, the resolution controller lowers the resolution of the eyes,
+    // and optionally the antialiasing, when the frames go over budget.
+    ResolutionController resolution;
+    GPUTimerQuery frameQuery;
+    double frameCpuSeconds;
+    float renderScale;
+    AntialiasingMode renderAAMode;
+
+    std::array<Resource, 2> aaTargets;
+    std::array<Resource, 2> aaDepth;
+    // With a lowered resolution and without supersampling, the eyes are
+    // rendered or resolved into these, and copied to the eye targets.
+    std::array<Resource, 2> scaledTargets;
+    std::array<Resource, 2> scaledDepth;
+    PooledTextures targetTextures;
+
+    // Double width targets for rendering both eyes in a single pass
+    Resource stereoTarget;
+    Resource stereoDepth;
+    Resource aaStereoTarget;
+    Resource aaStereoDepth;
+
+    CommandCounts frameCommands;
+    StateCache::Stats frameBinds;
+
+    // Record the shadow maps and the views into command lists on worker
+    // threads, using a deferred context for each of them.
+    std::vector<std::unique_ptr<DeferredContext>> shadowContexts;
+    std::array<std::unique_ptr<DeferredContext>, 2> viewContexts;
+    StateCache::Stats recordedBinds;
+    // A shadow map only needs the constants of its six faces.
+    static const uint32_t ShadowListConstants = 64 * 1024;
+#if defined(DEBUG_SHADOW_CPU_RASTERIZER)
+    // Set for the one frame after a validation was asked for.
+    bool validateShadows;
+#endif
+public:
+    SVBRDFOculus(Oculus &oculus, const std::string &dataDir = std::string(), bool rwPresets = false)
+        : oculus(oculus)
+        , textManager(3)
+        , rwPresets(rwPresets)
+        , simulation(oculus, dataDir, rwPresets)
+        , resolution(ResolutionController::defaultSettings(1. / DefaultRefreshRate))
+        , frameCpuSeconds(0)
+        , renderScale(1)
+        , renderAAMode(AntialiasingMode::NoAA)
+    {
+        lightingPrecision = TextureSpaceLightingPrecision::Float11_11_10;
+        shadowPcfTaps     = ShadowPcfTaps;
+        shadowKernelWidth = ShadowKernelWidth;
+
+        zero(frameCommands);
+        zero(frameBinds);
+        zero(recordedBinds);
+
+#if defined(DEBUG_SHADOW_CPU_RASTERIZER)
+        validateShadows = false;
+#endif
+
+        update();
+
+        initHelpText();
+    }
+
+    void initHelpText()
+    {
+        float3 normalText = { 1, 1, 1 };
+        float3 valueText  = { 1, .25f, .25f };
+
+        textManager.addText(1, 0, "SVBRDF");
+
+        textManager.addText(0, 2, "Setting");
+        textManager.addText(1, 2, "Value");
+        textManager.addText(2, 2, "Controls");
+
+        int row = 2;
+
+#define MEMBER_NUMBER(member) [this] { return static_cast<double>(this->member); }
+#define MEMBER_STRING(member) [this] (TextManager::TextBuffer &buf) { sprintf_s(buf, "%s", this->member.c_str()); }
+
+        ++row; textManager.addText(0, row, "Move camera");   textManager.addText(2, row, "(WASD)");
+        ++row; textManager.addText(0, row, "Turn camera");   textManager.addText(2, row, "(Arrows)");
+        ++row; textManager.addText(0, row, "Fast movement"); textManager.addText(2, row, "(Hold Ctrl)");
+
+        ++row;
+
+        ++row; textManager.addText(0, row, "Selected material"); textManager.addCallback(1, row, MEMBER_STRING(state.svbrdfName), valueText); textManager.addText(2, row, "(ZX or 9)");
+        ++row; textManager.addText(0, row, "Selected mesh");     textManager.addCallback(1, row, MEMBER_STRING(state.meshName), valueText);   textManager.addText(2, row, "(CV or 0)");
+
+        ++row;
+
+        ++row; textManager.addEnum(0, row, "Mesh mode",      meshMode,          normalText, valueText); textManager.addText(2, row, "(1)");
+        ++row; textManager.addEnum(0, row, "Displacement",   displacementMode,  normalText, valueText); textManager.addText(2, row, "(2)");
+        ++row; textManager.addEnum(0, row, "Shadows",        shadowMode,        normalText, valueText); textManager.addText(2, row, "(3)");
+        ++row; textManager.addEnum(0, row, "Antialiasing",   state.aaMode,      normalText, valueText); textManager.addText(2, row, "(4)");
+        ++row; textManager.addEnum(0, row, "Normals",        normalMode,        normalText, valueText); textManager.addText(2, row, "(5)");
+        ++row; textManager.addBool(0, row, "Normal mapping", useNormalMapping,  normalText, valueText); textManager.addText(2, row, "(6)");
+        ++row; textManager.addEnum(0, row, "Tone mapping",   state.tonemapMode, normalText, valueText); textManager.addText(2, row, "(7)");
+        ++row; textManager.addEnum(0, row, "Lighting",       lightingMode,      normalText, valueText); textManager.addText(2, row, "(8)");
+
+        ++row; textManager.addNumberCallback(0, row, "Displacement triangle area", MEMBER_NUMBER(state.displacementDensity),   normalText, valueText); textManager.addText(2, row, "(TG)");
+        ++row; textManager.addNumberCallback(0, row, "Displacement magnitude",     MEMBER_NUMBER(state.displacementMagnitude), normalText, valueText); textManager.addText(2, row, "(RF)");
+        ++row; textManager.addNumberCallback(0, row, "Lighting budget (Mtexels)",  MEMBER_NUMBER(state.lightingBudget),        normalText, valueText); textManager.addText(2, row, "(OL)");
+        ++row; textManager.addText(0, row, "Lit Mtexels (seen/new/all):", normalText); textManager.addCallback(1, row, [this] (TextManager::TextBuffer &buf)
+        {
+            LightingTileScheduler::Stats stats;
+            std::vector<unsigned> residency;
+            unsigned sampled = 0;
+            if (renderer && renderer->lightingTileStats(stats, residency, sampled))
+                sprintf_s(buf, "%.2f/%.2f/%.2f", stats.requestedTexels / 1e6, stats.shadedTexels / 1e6, stats.fullResolutionTexels / 1e6);
+        }, valueText);
+        ++row; textManager.addText(0, row, "Lighting tiles seen:", normalText); textManager.addCallback(1, row, [this] (TextManager::TextBuffer &buf)
+        {
+            LightingTileScheduler::Stats stats;
+            std::vector<unsigned> residency;
+            unsigned sampled = 0;
+            if (renderer && renderer->lightingTileStats(stats, residency, sampled))
+                sprintf_s(buf, "%u/%u", sampled, stats.tiles);
+        }, valueText);
+        ++row; textManager.addText(0, row, "Lighting tiles per mip:", normalText); textManager.addCallback(1, row, [this] (TextManager::TextBuffer &buf)
+        {
+            LightingTileScheduler::Stats stats;
+            std::vector<unsigned> residency;
+            unsigned sampled = 0;
+            if (!renderer || !renderer->lightingTileStats(stats, residency, sampled))
+                return;
+            // The finest few levels that have resident tiles
+            std::string text;
+            unsigned shown = 0;
+            for (size_t l = 0; l + 1 < residency.size() && shown < 3; ++l)
+            {
+                if (residency[l] == 0)
+                    continue;
+                char entry[32];
+                sprintf_s(entry, "L%u:%u ", static_cast<unsigned>(l), residency[l]);
+                text += entry;
+                ++shown;
+            }
+            sprintf_s(buf, "%s", text.c_str());
+        }, valueText);
+        ++row; textManager.addText(0, row, "Shaded Mpixels/Mtexels:", normalText); textManager.addCallback(1, row, [this] (TextManager::TextBuffer &buf)
+        {
+            if (!renderer)
+                return;
+            ShadingCostModel::Work work;
+            renderer->shadingCost(work);
+            sprintf_s(buf, "%.2f/%.2f", work.pixels / 1e6, work.texels / 1e6);
+        }, valueText);
+        ++row; textManager.addText(0, row, "Shading work saved:", normalText); textManager.addCallback(1, row, [this] (TextManager::TextBuffer &buf)
+        {
+            if (!renderer)
+                return;
+            ShadingCostModel::Work work;
+            auto cost = renderer->shadingCost(work);
+            sprintf_s(buf, "%.0f%%", cost.savedFraction() * 100);
+        }, valueText);
+
+        ++row;
+
+        ++row; textManager.addBool(          0, row, "VR rendering", useOculus, normalText, valueText);                    textManager.addText(2, row, "(Enter)");
+        ++row; textManager.addNumberCallback(0, row, "VR scale",     MEMBER_NUMBER(state.vrScale), normalText, valueText); textManager.addText(2, row, "(IK)");
+        ++row; textManager.addEnum(          0, row, "Dynamic resolution", dynamicResolution, normalText, valueText);      textManager.addText(2, row, "(N)");
+        ++row; textManager.addText(0, row, "Render scale:", normalText); textManager.addCallback(1, row, [this] (TextManager::TextBuffer &buf)
+        {
+            sprintf_s(buf, "%.2f, %s%s", renderScale, enumToString(renderAAMode),
+                      resolution.cpuBound() ? ", CPU bound" : "");
+        }, valueText);
+        ++row; textManager.addText(0, row, "Single pass stereo:", normalText); textManager.addCallback(1, row, [this] (TextManager::TextBuffer &buf)
+        {
+            // Only the eyes of the HMD can be rendered in a single pass,
+            // and not with texture space lighting.
+            const char *value = !singlePassStereo                    ? "Disabled"
+                              : renderer && renderSinglePassStereo() ? "Enabled"
+                              :                                       "Unavailable";
+            sprintf_s(buf, "%s", value);
+        }, valueText);
+        textManager.addText(2, row, "(B)");
+        ++row; textManager.addBool(          0, row, "Multithreaded recording", multithreadedRecording, normalText, valueText); textManager.addText(2, row, "(M)");
+        ++row; textManager.addText(0, row, "Commands per frame:", normalText); textManager.addCallback(1, row, [this] (TextManager::TextBuffer &buf)
+        {
+            sprintf_s(buf, "%llu (%llu draws)", frameCommands.total(), frameCommands.draws);
+        }, valueText);
+        ++row; textManager.addText(0, row, "Binds per frame:", normalText); textManager.addCallback(1, row, [this] (TextManager::TextBuffer &buf)
+        {
+            sprintf_s(buf, "%llu (%llu filtered)", frameBinds.issued, frameBinds.filtered());
+        }, valueText);
+        ++row; textManager.addText(0, row, "Constants per frame:", normalText); textManager.addCallback(1, row, [this] (TextManager::TextBuffer &buf)
+        {
+            auto &stats = cb.lastFrameStats();
+            sprintf_s(buf, "%u (%.1f KB)", stats.allocations, stats.bytesWritten / 1024.0);
+        }, valueText);
+        ++row; textManager.addText(0, row, "Pooled textures:", normalText); textManager.addCallback(1, row, [this] (TextManager::TextBuffer &buf)
+        {
+            auto &stats = texturePool().stats();
+            sprintf_s(buf, "%.1f MB (peak %.1f MB, %.1f MB aliased)",
+                      stats.currentBytes / 1048576.0,
+                      stats.peakBytes    / 1048576.0,
+                      stats.aliasedBytes / 1048576.0);
+        }, valueText);
+        ++row; textManager.addText(          0, row, "VR recenter");                                                       textManager.addText(2, row, "(Space bar)");
+
+        ++row;
+
+        ++row; textManager.addNumberCallback(0, row, "Amount of lights",    MEMBER_NUMBER(state.lights.size()), normalText, valueText); textManager.addText(2, row, "(Numpad +-)");
+        ++row; textManager.addNumberCallback(0, row, "Lights with shadows", MEMBER_NUMBER(state.shadowLights), normalText, valueText);  textManager.addText(2, row, "(Numpad .0)");
+        ++row; textManager.addNumber        (0, row, "Selected light", selectedLight, normalText, valueText);                           textManager.addText(2, row, "(Numpad 13)");
+        ++row; textManager.addText(0, row, "Move light");               textManager.addText(2, row, "(Numpad 845679)");
+        ++row; textManager.addText(0, row, "Adjust light intensity");   textManager.addText(2, row, "(Numpad */)");
+        ++row; textManager.addText(0, row, "Adjust ambient intensity"); textManager.addText(2, row, "(PgUp/PgDn)");
+
+        ++row;
+
+        ++row; textManager.addText(0, row, "Load preset");            textManager.addText(2, row, "(F1...F10)");
+        ++row; textManager.addText(0, row, "Load preset dialog");     textManager.addText(2, row, "(F11)");
+        if (rwPresets)
+        {
+            ++row; textManager.addText(0, row, "Save preset");            textManager.addText(2, row, "(Ctrl + F1...F10)");
+        }
+        ++row; textManager.addText(0, row, "Toggle wireframe");       textManager.addText(2, row, "(Del)");
+        ++row; textManager.addText(0, row, "Toggle FPS measurement"); textManager.addText(2, row, "(Home)");
+        ++row; textManager.addText(0, row, "Toggle help");            textManager.addText(2, row, "(Tab)");
+
+#undef MEMBER_NUMBER
+#undef MEMBER_STRING
+    }
+
+    // Run the input handling and publish the next frame for rendering. This
+    // can run on a different thread than everything else.
+    void simulate(bool forceInit = false)
+    {
+        simulation.update(forceInit);
+        frames.write() = simulation;
+        frames.publish();
+    }
+
+    // Take the latest published frame into use for rendering. Returns false
+    // once it asks to quit.
+    bool beginFrame()
+    {
+#if defined(DEBUG_SHADOW_CPU_RASTERIZER)
+        validateShadows = false;
+#endif
+
+        if (frames.update())
+            applyFrame(frames.read());
+
+        return !quit;
+    }
+
+    // Simulate and take the result into use on the calling thread.
+    bool update(bool forceInit = false)
+    {
+        simulate(forceInit);
+        return beginFrame();
+    }
+
+    bool measuringFrameTime() const
+    {
+        return measureFrameTime;
+    }
+
+    // Act on the changes that use the immediate context, so they stay on
+    // the render thread.
+    void applyFrame(const FrameState &frame)
+    {
+        bool initRenderer   = !renderer || frame.rendererChanges != rendererChanges;
+        bool changedTargets = frame.targetChanges != targetChanges;
+        bool recenter       = frame.recenters != recenters;
+#if defined(DEBUG_SHADOW_CPU_RASTERIZER)
+        validateShadows     = frame.shadowValidations != shadowValidations;
+#endif
+
+        static_cast<FrameState &>(*this) = frame;
+
+        if (recenter)
+            oculus.recenter();
+
+        if (initRenderer)
+            configureRenderer(true);
+
+        if (changedTargets)
+            initAA();
+
+        renderer->updateLights(state.lights);
+    }
+
+    // Create the renderer or reconfigure it for the current settings, and
+    // optionally log how long the frame hitched for it.
+    void configureRenderer(bool logHitch = false)
+    {
+        if (!renderer)
+            renderer = std::make_shared<SVBRDFRenderer>();
+
+        auto cacheBefore = pipelineCache().stats();
+        Timer t;
+
+        auto rebuilt = renderer->configure(meshMode, displacementMode,
+                                           lightingMode, lightingPrecision,
+                                           *material, mesh.get(), computeConstants());
+
+        double ms = t.seconds() * 1000.0;
+        auto cache = pipelineCache().stats();
+
+        if (logHitch)
+        {
+            log("Renderer reconfigured in %.2f ms:%s%s%s%s%s, %llu pipeline objects created, %llu reused\n",
+                ms,
+                rebuilt.pipelines    ? " pipelines"     : "",
+                rebuilt.geometry     ? " geometry"      : "",
+                rebuilt.lightingMaps ? " lighting maps" : "",
+                rebuilt.shadows      ? " shadows"       : "",
+                rebuilt.any()        ? ""               : " nothing rebuilt",
+                static_cast<unsigned long long>(cache.created - cacheBefore.created),
+                static_cast<unsigned long long>(cache.reused  - cacheBefore.reused));
+        }
+    }
 
     void initAA()
+    {
+        resetResolution();
+        applyResolution();
+    }
+
+    // The resolution is only changed in VR, where the compositor scales the
+    // rendered part of the eye textures to the display.
+    bool dynamicResolutionActive() const
+    {
+        return dynamicResolution != DynamicResolution::Disabled && renderToOculus();
+    }
+
+    // Start the resolution controller over from the full resolution and
+    // the chosen antialiasing mode.
+    void resetResolution()
+    {
+        double refreshRate = oculus.isConnected() ? oculus.hmd.DisplayRefreshRate : 0;
+        if (refreshRate <= 0)
+            refreshRate = DefaultRefreshRate;
+
+        unsigned maxAALevel = 0;
+        if (dynamicResolution == DynamicResolution::ScaleAndAA)
+            maxAALevel = antialiasingLevel(state.aaMode);
+
+        resolution = ResolutionController(ResolutionController::defaultSettings(1. / refreshRate, maxAALevel));
+    }
+
+    // Create the targets for the resolution and the antialiasing mode
+    // chosen by the resolution controller.
+    void applyResolution()
+    {
+        bool active  = dynamicResolutionActive();
+        renderScale  = active ? resolution.scale() : 1.f;
+        renderAAMode = state.aaMode;
+        if (active && dynamicResolution == DynamicResolution::ScaleAndAA)
+            renderAAMode = AntialiasingByCost[resolution.aaLevel()];
+
+        if (renderToOculus())
+        {
+            for (auto &eye : oculus.eyes)
+                eye.viewport = scaledSize(eye.size, renderScale);
+
+            initTargets({ oculus.eyes[0].size, oculus.eyes[1].size }, renderScale);
+        }
+        else
+        {
+            ovrSizei size;
+            size.w = static_cast<int>(oculus.mirrorW);
+            size.h = static_cast<int>(oculus.mirrorH);
+            initTargets({ size });
+        }
+    }
+
+    // Feed the controller with the latest frame times, and recreate the
+    // targets if it changed the resolution or the antialiasing.
+    void updateResolution()
+    {
+        double gpuSeconds = 0;
+        if (!frameQuery.read(gpuSeconds))
+            return;
+
+        if (!resolution.addFrame(frameCpuSeconds, gpuSeconds))
+            return;
+
+        Timer t;
+        applyResolution();
+
+        log("Dynamic resolution: scale %.2f, %s, GPU %.2f ms, CPU %.2f ms, targets in %.2f ms\n",
+            renderScale, enumToString(renderAAMode),
+            gpuSeconds * 1000.0, frameCpuSeconds * 1000.0, t.seconds() * 1000.0);
+    }
+
+    static ovrSizei scaledSize(ovrSizei size, float scale)
+    {
+        ovrSizei scaled;
+        scaled.w = std::max(1, static_cast<int>(static_cast<float>(size.w) * scale + .5f));
+        scaled.h = std::max(1, static_cast<int>(static_cast<float>(size.h) * scale + .5f));
+        return scaled;
+    }
+
+    // Create the antialiasing targets for each eye, which are scaled by
+    // scale. With two equally sized eyes, also create the double width
+    // targets for single pass stereo.
+    void initTargets(std::initializer_list<ovrSizei> eyeSizes, float scale = 1.f)
     {
         auto rtDesc = texture2DDesc(1, 1, DXGI_FORMAT_R8G8B8A8_UNORM_SRGB);
         rtDesc.BindFlags = D3D11_BIND_RENDER_TARGET;
@@ -3143,14 +5604,86 @@ public:
         rtDesc.SampleDesc.Quality = 0;
         zDesc.SampleDesc.Quality = 0;
 
+        // The targets come from the texture pool as transients of the passes
+        // that render the eyes. Each eye only uses its antialiasing targets
+        // while it is rendered, so equally sized eyes share them.
+        std::vector<TexturePool::Transient> transients;
+        std::vector<Resource *> outputs;
+
+        auto makeTargets = [&](Resource &rt, Resource &z, unsigned w, unsigned h,
+                               unsigned supersampling, unsigned mipLevels,
+                               unsigned firstPass, unsigned lastPass)
+        {
+            w *= supersampling;
+            h *= supersampling;
+
+            rtDesc.Width     = w;
+            rtDesc.Height    = h;
+            rtDesc.MipLevels = mipLevels;
+            zDesc.Width      = w;
+            zDesc.Height     = h;
+
+            transients.push_back({ rtDesc, firstPass, lastPass });
+            transients.push_back({ zDesc,  firstPass, lastPass });
+            outputs.push_back(&rt);
+            outputs.push_back(&z);
+        };
+
+        std::vector<ovrSizei> sizes(eyeSizes);
+        for (auto &s : sizes)
+            s = scaledSize(s, scale);
+
+        targetTextures.release();
+        for (auto &t : aaTargets)
+            t = Resource();
+        for (auto &z : aaDepth)
+            z = Resource();
+        for (auto &t : scaledTargets)
+            t = Resource();
+        for (auto &z : scaledDepth)
+            z = Resource();
+        stereoTarget   = Resource();
+        stereoDepth    = Resource();
+        aaStereoTarget = Resource();
+        aaStereoDepth  = Resource();
+
+        // The final single pass stereo target has no antialiasing, and the
+        // eyes are copied out of it.
+        bool stereo = singlePassStereo
+            && sizes.size() == 2
+            && sizes[0].w == sizes[1].w
+            && sizes[0].h == sizes[1].h;
+
+        unsigned lastPass = static_cast<unsigned>(sizes.size()) - 1;
+
+        if (stereo)
+            makeTargets(stereoTarget, stereoDepth, sizes[0].w * 2, sizes[0].h, 1, 1, 0, lastPass);
+
+        // Supersampling already ends in a smaller mip level, which is
+        // copied to the eye targets.
+        bool resolveScaled = scale < 1.f
+            && (renderAAMode == AntialiasingMode::NoAA || renderAAMode == AntialiasingMode::MSAA4x);
+
+        if (resolveScaled)
+        {
+            for (unsigned eye = 0; eye < sizes.size(); ++eye)
+            {
+                makeTargets(scaledTargets[eye], scaledDepth[eye],
+                            sizes[eye].w, sizes[eye].h,
+                            1, 1, eye, eye);
+            }
+        }
+
+        bool aa = true;
         unsigned supersampling = 1;
         unsigned mipLevels     = 1;
 
-        switch (state.aaMode)
+        switch (renderAAMode)
         {
         case AntialiasingMode::NoAA:
         default:
-            return;
+            aa = false;
+            break;
         case AntialiasingMode::SSAA2x:
             supersampling = 2;
             mipLevels     = 2;
@@ -3169,40 +5702,44 @@ public:
             break;
         }
 
-        auto makeTargets = [&](Resource &rt, Resource &z, unsigned w, unsigned h)
+        if (aa)
         {
-            w *= supersampling;
-            h *= supersampling;
+            for (unsigned eye = 0; eye < sizes.size(); ++eye)
+            {
+                makeTargets(aaTargets[eye], aaDepth[eye],
+                            sizes[eye].w, sizes[eye].h,
+                            supersampling, mipLevels,
+                            eye, eye);
+            }
 
-            rtDesc.Width     = w;
-            rtDesc.Height    = h;
-            rtDesc.MipLevels = mipLevels;
-            zDesc.Width      = w;
-            zDesc.Height     = h;
+            if (stereo)
+            {
+                makeTargets(aaStereoTarget, aaStereoDepth, sizes[0].w * 2, sizes[0].h,
+                            supersampling, mipLevels,
+                            0, lastPass);
+            }
+        }
 
-            rt = Resource(rtDesc);
-            z  = Resource(zDesc);
-        };
+        auto textures = targetTextures.acquire(transients);
+        for (size_t i = 0; i < textures.size(); ++i)
+            *outputs[i] = textures[i];
 
-        if (renderToOculus())
+        if (stereo)
         {
-            for (unsigned eye = 0; eye < 2; ++eye)
-            {
-                makeTargets(aaTargets[eye], aaDepth[eye],
-                            oculus.eyes[eye].size.w,
-                            oculus.eyes[eye].size.h);
-            }
+            RESOURCE_DEBUG_NAME(stereoTarget);
+            RESOURCE_DEBUG_NAME(stereoDepth);
         }
-        else
+
+        if (aa && stereo)
         {
-            makeTargets(aaTargets[0], aaDepth[0],
-                        oculus.mirrorW,
-                        oculus.mirrorH);
+            RESOURCE_DEBUG_NAME(aaStereoTarget);
+            RESOURCE_DEBUG_NAME(aaStereoDepth);
         }
     }
 
     SVBRDFRenderer::Constants computeConstants(const XMMATRIX *viewProjection = nullptr,
-                                                const XMVECTOR *cameraPosition = nullptr)
+                                                const XMVECTOR *cameraPosition = nullptr,
+                                                unsigned view = 0)
     {
         SVBRDFRenderer::Constants constants;
         zero(constants);
@@ -3222,240 +5759,1347 @@ public:
         constants.shadowDepthBias    = state.shadowDepthBias;
         constants.shadowSSDepthBias  = state.shadowSSDepthBias;
 
-        constants.shadowPcfTaps      = std::max(1, shadowPcfTaps);
-        constants.shadowKernelWidth  = shadowKernelWidth;
+        constants.shadowPcfTaps      = std::max(1, shadowPcfTaps);
+        constants.shadowKernelWidth  = shadowKernelWidth;
+
+        constants.normalMode         = static_cast<uint>(normalMode);
+
+        // Disable normal mapping for the displacement mapped mesh unless
+        // constant normals are used. The material normals are already included
+        // in the geometry, and normal mapping in this situation would account
+        // for them twice. The same goes for displaced normals of any
+        // displacement.
+        bool disableNormalMap =
+            (displacementMode == DisplacementMode::CPUDisplacementMapping ||
+             displacementMode == DisplacementMode::AdaptiveDisplacementMapping) &&
+            normalMode != NormalMode::ConstantNormal;
+        disableNormalMap |=
+            displacementMode != DisplacementMode::NoDisplacement &&
+            normalMode == NormalMode::DisplacedNormals;
+
+        constants.useNormalMapping      = static_cast<uint>(useNormalMapping && !disableNormalMap);
+        constants.displacementDensity   = state.displacementDensity;
+        constants.displacementMagnitude = state.displacementMagnitude;
+        constants.tessellation = displacementMode == DisplacementMode::GPUDisplacementMapping;
+
+        constants.wireframe = wireframe;
+
+        constants.view                = view;
+        constants.lightingTexelBudget = static_cast<uint>(state.lightingBudget * 1e6f);
+
+#if defined(DEBUG_SHADOW_MATRICES)
+        constants.shadowView         = debugShadowView;
+#endif
+#if defined(DEBUG_SHADOW_CPU_RASTERIZER)
+        constants.validateShadowMaps = validateShadows;
+        constants.showCPUShadowMaps  = showCPUShadowMaps;
+#endif
+
+        return constants;
+    }
+
+    void renderView(
+        ConstantBuffers &cb,
+        Resource &renderTarget, Resource &depthBuffer,
+        const XMMATRIX &viewProjection, XMVECTOR cameraPosition,
+        unsigned view)
+    {
+        auto constants = computeConstants(&viewProjection, &cameraPosition, view);
+
+        {
+            GPUScope clears(L"Clear render targets");
+            float black[] = { 0, 0, 0, 1 };
+            clearRenderTarget(renderTarget.rtv, black);
+            // Clear to min depth since we are using inverse Z
+            clearDepthStencil(depthBuffer.dsv, D3D11_CLEAR_DEPTH, D3D11_MIN_DEPTH, 0);
+        }
+
+        {
+            GPUScope scope(L"Render SVBRDF");
+            renderer->renderView(cb, *material, constants, renderTarget, depthBuffer);
+        }
+
+        {
+            GPUScope scope(L"Render light indicators");
+            setRenderTarget(renderTarget, &depthBuffer);
+            renderLightIndicators(cb, constants.viewProj);
+            setRenderTarget(nullptr);
+        }
+    }
+
+    void renderLightIndicators(ConstantBuffers &cb, const XMMATRIX &viewProjection)
+    {
+        for (size_t i = 0; i < state.lights.size(); ++i)
+        {
+            float size = (i == selectedLight)
+                ? 0.15f
+                : 0.05f;
+            auto &L = state.lights[i];
+            lightIndicator.render(cb, size, toVec(L.positionWorld), viewProjection,
+                                  L.colorHDR[0], L.colorHDR[1], L.colorHDR[2]);
+        }
+    }
+
+    // Update the help text once per frame, before drawing it into the views.
+    void updateHelp()
+    {
+        if (!showHelp)
+            return;
+
+        textManager.update();
+    }
+
+    void renderHelp(Resource &renderTarget)
+    {
+        if (!showHelp)
+            return;
+
+        GPUScope scope(L"Render text");
+
+        // The overlay is not scaled, so it covers more of a lowered
+        // resolution, but it is kept at the same place.
+        uint2 textCoords;
+        if (useOculus)
+            textCoords = { static_cast<uint32_t>(400 * renderScale), static_cast<uint32_t>(300 * renderScale) };
+        else
+            textCoords = { 10, 10 };
+
+        textManager.render(renderTarget, textCoords);
+    }
+
+    bool renderToOculus() const
+    {
+        return useOculus && oculus.isActive();
+    }
+
+    bool canVsync() const
+    {
+        return !renderToOculus();
+    }
+
+    static XMMATRIX viewMatrix(XMVECTOR cameraPosition, XMVECTOR cameraRotation)
+    {
+        XMVECTOR forwardRH = XMVector3Rotate(XMVectorSet(0, 0, -1, 0), cameraRotation);
+
+        XMVECTOR target    = XMVectorAdd(cameraPosition, forwardRH);
+        XMVECTOR up        = XMVector3Rotate(XMVectorSet(0, 1, 0, 0), cameraRotation);
+
+        XMMATRIX view = XMMatrixLookAtRH(cameraPosition, target, up);
+
+        return view;
+    }
+
+    // Resolve the antialiasing of a view rendered into aaRT, or without
+    // antialiasing into resolved, and return the resource and subresource
+    // that hold it at the final resolution.
+    Resource &resolveAA(Resource &aaRT, Resource &resolved, UINT &subresource)
+    {
+        subresource = 0;
+
+        switch (renderAAMode)
+        {
+        case AntialiasingMode::NoAA:
+            return resolved;
+        case AntialiasingMode::MSAA4x:
+            // FIXME: Fixed function resolve might not be sRGB correct. :(
+            context->ResolveSubresource(resolved.texture, 0, aaRT.texture, 0, DXGI_FORMAT_R8G8B8A8_UNORM_SRGB);
+            return resolved;
+        case AntialiasingMode::SSAA2x:
+        case AntialiasingMode::SSAA4x:
+        {
+            // FIXME: This might not be sRGB correct
+            context->GenerateMips(aaRT.srv);
+            unsigned mips = aaRT.textureDescriptor().MipLevels;
+            subresource   = D3D11CalcSubresource(mips - 1, 0, mips);
+            return aaRT;
+        }
+        default:
+            check(false, "Unknown antialiasing mode!");
+            return resolved;
+        }
+    }
+
+    void renderViewWithAA(
+        ConstantBuffers &cb,
+        Resource &finalRT, Resource &finalZ,
+        const XMMATRIX &viewProjection, XMVECTOR cameraPosition,
+        Resource &aaRT, Resource &aaZ,
+        unsigned view = 0)
+    {
+        // With a lowered resolution, the view ends up in the upper left
+        // corner of the final target.
+        Resource *scaledRT = scaledTargets[view] ? &scaledTargets[view] : nullptr;
+        Resource &resolved = scaledRT ? *scaledRT : finalRT;
+
+        if (renderAAMode != AntialiasingMode::NoAA)
+            renderView(cb, aaRT, aaZ, viewProjection, cameraPosition, view);
+        else if (scaledRT)
+            renderView(cb, *scaledRT, scaledDepth[view], viewProjection, cameraPosition, view);
+        else
+            renderView(cb, finalRT, finalZ, viewProjection, cameraPosition, view);
+
+        UINT subresource;
+        Resource &source = resolveAA(aaRT, resolved, subresource);
+        if (&source != &finalRT)
+            context->CopySubresourceRegion(finalRT.texture, 0, 0, 0, 0, source.texture, subresource, nullptr);
+
+#if defined(DEBUG_SHADOW_TEXEL_UNPROJECT)
+        if (shadowMode == ShadowMode::ShadowMapping)
+        {
+            setRenderTarget(finalRT);
+            renderer->unprojectShadowMap(cb, computeConstants(&viewProjection), debugShadowSlice);
+            setRenderTarget(nullptr);
+        }
+#endif
+    }
+
+    struct EyeView
+    {
+        XMMATRIX viewProjection;
+        XMVECTOR cameraPosition;
+    };
+
+    EyeView eyeView(const Oculus::Eye &eye)
+    {
+        // Apply head pose on top of the camera pose
+        XMVECTOR eyeRot = XMVectorSet(
+            eye.pose.Orientation.x,
+            eye.pose.Orientation.y,
+            eye.pose.Orientation.z,
+            eye.pose.Orientation.w);
+
+        XMVECTOR eyePos = XMVectorSet(
+            eye.pose.Position.x,
+            eye.pose.Position.y,
+            eye.pose.Position.z,
+            0);
+
+        XMVECTOR basePosition = camera.position();
+        XMVECTOR baseRotation = camera.rotation();
+
+        XMVECTOR eyeOffset    = XMVector3Rotate(eyePos, baseRotation);
+
+        XMVECTOR cameraPosition;
+        XMVECTOR cameraRotation;
+
+        float headPositionMultiplier;
+
+        if (state.vrScale < 0)
+            headPositionMultiplier = 0;
+        else
+            headPositionMultiplier = std::pow(10.f, state.vrScale / 4.f);
+
+        eyeOffset = XMVectorMultiply(eyeOffset, XMVectorReplicate(headPositionMultiplier));
+
+        cameraPosition = XMVectorAdd(basePosition, eyeOffset);
+        cameraRotation = XMQuaternionMultiply(eyeRot, baseRotation);
+
+        XMMATRIX view = viewMatrix(cameraPosition, cameraRotation);
+
+        ovrMatrix4f ovrProj    = ovrMatrix4f_Projection(eye.fov, NearZ, FarZ,
+                                                        ovrProjection_FarLessThanNear |
+                                                        ovrProjection_RightHanded);
+
+        XMMATRIX proj = XMMatrixSet(ovrProj.M[0][0], ovrProj.M[1][0], ovrProj.M[2][0], ovrProj.M[3][0],
+                                    ovrProj.M[0][1], ovrProj.M[1][1], ovrProj.M[2][1], ovrProj.M[3][1],
+                                    ovrProj.M[0][2], ovrProj.M[1][2], ovrProj.M[2][2], ovrProj.M[3][2],
+                                    ovrProj.M[0][3], ovrProj.M[1][3], ovrProj.M[2][3], ovrProj.M[3][3]);
+
+        EyeView v;
+        v.viewProjection = XMMatrixMultiply(view, proj);
+        v.cameraPosition = cameraPosition;
+        return v;
+    }
+
+    bool renderSinglePassStereo() const
+    {
+        return singlePassStereo
+            && stereoTarget.valid()
+            && renderer->supportsSinglePassStereo();
+    }
+
+    // Render both eyes into their final targets, either one at a time,
+    // or both at once with single pass stereo.
+    void renderEyes(const std::array<Resource *, 2> &targets,
+                    const std::array<Resource *, 2> &depthBuffers,
+                    const std::array<EyeView, 2> &eyes)
+    {
+        bool stereo = renderSinglePassStereo();
+
+        if (stereo)
+        {
+            renderStereo(cb, targets, eyes);
+        }
+        else
+        {
+            for (unsigned eye = 0; eye < 2; ++eye)
+                renderEye(cb, targets, depthBuffers, eyes, eye);
+        }
+
+        finishViews(targets, 2, stereo);
+    }
+
+    // Read back the view statistics and draw the help text, which can only
+    // be done on the immediate context.
+    void finishViews(const std::array<Resource *, 2> &targets, unsigned views, bool stereo)
+    {
+        // Single pass stereo renders both eyes as the first view.
+        for (unsigned view = 0; view < (stereo ? 1u : views); ++view)
+            renderer->finishView(view);
+
+        // The text is drawn once into an overlay shared by the views.
+        updateHelp();
+        for (unsigned view = 0; view < views; ++view)
+            renderHelp(*targets[view]);
+    }
+
+    void renderEye(ConstantBuffers &cb,
+                   const std::array<Resource *, 2> &targets,
+                   const std::array<Resource *, 2> &depthBuffers,
+                   const std::array<EyeView, 2> &eyes,
+                   unsigned eye)
+    {
+        GPUScope scope(L"Render eye");
+        renderViewWithAA(cb, *targets[eye], *depthBuffers[eye],
+                         eyes[eye].viewProjection, eyes[eye].cameraPosition,
+                         aaTargets[eye], aaDepth[eye], eye);
+    }
+
+    // Render both eyes side by side into a double width target with instanced
+    // draws, and copy them out to the eye targets. Light indicators are drawn
+    // separately for each half, as they are only a handful of triangles.
+    void renderStereo(ConstantBuffers &cb,
+                      const std::array<Resource *, 2> &targets,
+                      const std::array<EyeView, 2> &eyes)
+    {
+        GPUScope scope(L"Render single pass stereo");
+
+        bool aa = renderAAMode != AntialiasingMode::NoAA;
+        Resource &renderTarget = aa ? aaStereoTarget : stereoTarget;
+        Resource &depthBuffer  = aa ? aaStereoDepth  : stereoDepth;
+
+        auto constants = computeConstants(&eyes[0].viewProjection, &eyes[0].cameraPosition, 0);
+        constants.stereo              = true;
+        constants.rightViewProj       = eyes[1].viewProjection;
+        constants.rightCameraPosition = eyes[1].cameraPosition;
+
+        {
+            GPUScope clears(L"Clear render targets");
+            float black[] = { 0, 0, 0, 1 };
+            clearRenderTarget(renderTarget.rtv, black);
+            // Clear to min depth since we are using inverse Z
+            clearDepthStencil(depthBuffer.dsv, D3D11_CLEAR_DEPTH, D3D11_MIN_DEPTH, 0);
+        }
+
+        {
+            GPUScope scope(L"Render SVBRDF");
+            renderer->renderView(cb, *material, constants, renderTarget, depthBuffer);
+        }
+
+        auto desc    = renderTarget.textureDescriptor();
+        unsigned eyeW = desc.Width / 2;
+
+        {
+            GPUScope scope(L"Render light indicators");
+            setRenderTarget(renderTarget, &depthBuffer);
+            for (unsigned eye = 0; eye < 2; ++eye)
+            {
+                setViewport(eye * eyeW, 0, eyeW, desc.Height);
+                renderLightIndicators(cb, eyes[eye].viewProjection);
+            }
+            setRenderTarget(nullptr);
+        }
+
+        // Resolve the antialiasing for both eyes at once.
+        UINT subresource;
+        Resource &source = resolveAA(aaStereoTarget, stereoTarget, subresource);
+
+        auto finalDesc = stereoTarget.textureDescriptor();
+        unsigned finalW = finalDesc.Width / 2;
+
+        for (unsigned eye = 0; eye < 2; ++eye)
+        {
+            D3D11_BOX box;
+            box.left   = eye * finalW;
+            box.right  = box.left + finalW;
+            box.top    = 0;
+            box.bottom = finalDesc.Height;
+            box.front  = 0;
+            box.back   = 1;
+            context->CopySubresourceRegion(targets[eye]->texture, 0, 0, 0, 0,
+                                           source.texture, subresource, &box);
+        }
+    }
+
+    void render(Resource &renderTarget, Resource &depthBuffer)
+    {
+        Timer cpuTimer;
+        bool adjustResolution = dynamicResolutionActive();
+        if (adjustResolution)
+        {
+            updateResolution();
+            frameQuery.begin();
+        }
+
+        CommandCounts commandsBefore = commandCounts;
+        StateCache::Stats bindsBefore = stateCache().stats();
+        zero(recordedBinds);
+        cb.beginFrame();
+
+        bool recorded = recordInParallel();
+
+        if (!recorded)
+            renderer->renderViewportIndependent(cb, *material, computeConstants());
+
+        if (renderToOculus())
+        {
+            // Sample sensors as close as possible to rendering, so right before.
+            // When recording in parallel, the eyes are recorded along with
+            // the shadow maps, so the pose is needed before them.
+            oculus.samplePose();
+
+            std::array<Resource *, 2> targets;
+            std::array<Resource *, 2> depthBuffers;
+            std::array<EyeView, 2> eyes;
+
+            for (auto &&eye : oculus.eyes)
+            {
+                eye.next();
+
+                targets[eye.number]      = &eye.active();
+                depthBuffers[eye.number] = &eye.depthBuffer;
+                eyes[eye.number]         = eyeView(eye);
+            }
+
+            auto submit = [&]
+            {
+                // Submit the eyes to OVR
+                ovrLayerEyeFov frame = oculus.frame();
+                auto layers = &frame.Header;
+                oculus.assertStatus(ovr_SubmitFrame(oculus.session, 0, nullptr, &layers, 1));
+
+                // Then, copy the mirror texture contents to the target of the rendering
+                context->CopyResource(renderTarget.texture, oculus.mirrorD3DTexture());
+            };
+
+            if (recorded)
+            {
+                renderRecorded(targets, depthBuffers, eyes, 2, submit);
+            }
+            else
+            {
+                // First, render both eyes
+                renderEyes(targets, depthBuffers, eyes);
+                submit();
+            }
+        }
+        else
+        {
+            // No headset active, render normally to the window
+            unsigned width  = oculus.mirrorW;
+            unsigned height = oculus.mirrorH;
+
+            XMVECTOR cameraPosition = camera.position();
+
+            XMMATRIX view = viewMatrix(cameraPosition, camera.rotation());
+
+            XMMATRIX proj = projection(width, height, NearZ, FarZ, DefaultVerticalFOV, DepthMode::InverseDepth);
+
+            XMMATRIX viewProjection = XMMatrixMultiply(view, proj);
+
+            if (recorded)
+            {
+                std::array<Resource *, 2> targets      = { &renderTarget, nullptr };
+                std::array<Resource *, 2> depthBuffers = { &depthBuffer, nullptr };
+                std::array<EyeView, 2> eyes;
+                eyes[0].viewProjection = viewProjection;
+                eyes[0].cameraPosition = cameraPosition;
+
+                renderRecorded(targets, depthBuffers, eyes, 1, nullptr);
+            }
+            else
+            {
+                renderViewWithAA(cb, renderTarget, depthBuffer, viewProjection, cameraPosition,
+                                 aaTargets[0], aaDepth[0]);
+                renderer->finishView(0);
+                updateHelp();
+                renderHelp(renderTarget);
+            }
+        }
+
+        frameCommands = commandCounts - commandsBefore;
+        frameBinds    = stateCache().stats() - bindsBefore + recordedBinds;
+
+        // The GPU time of a frame is read a few frames later, and paired
+        // with the CPU time of the latest frame then.
+        if (adjustResolution)
+        {
+            frameQuery.end();
+            frameCpuSeconds = cpuTimer.seconds();
+        }
+    }
+
+    // Record command lists on worker threads, unless the commands go to
+    // some other backend than the default one, like in headless runs.
+    bool recordInParallel() const
+    {
+        return multithreadedRecording && backend == &stateCache();
+    }
+
+    // Render a frame with command lists recorded in parallel. The shadow map
+    // of each light and each of the views is recorded on its own deferred
+    // context, and the job graph executes the lists in order on the immediate
+    // context while the workers are still recording the later ones: first
+    // the shadow maps, then the view independent lighting, then the views,
+    // and finally submit. Views that cannot be recorded in
+    // parallel are rendered on the immediate context instead.
+    void renderRecorded(const std::array<Resource *, 2> &targets,
+                        const std::array<Resource *, 2> &depthBuffers,
+                        const std::array<EyeView, 2> &eyes,
+                        unsigned views,
+                        const std::function<void()> &submit)
+    {
+        auto constants = computeConstants();
+        renderer->beginFrame(constants);
+
+        unsigned lights = renderer->shadowMapLights();
+        bool stereo     = views == 2 && renderSinglePassStereo();
+        unsigned lists  = !renderer->supportsParallelViews() ? 0
+                        : stereo ? 1
+                        : views;
+
+        while (shadowContexts.size() < lights)
+            shadowContexts.emplace_back(new DeferredContext(ShadowListConstants));
+
+        for (unsigned i = 0; i < lists; ++i)
+        {
+            if (!viewContexts[i])
+                viewContexts[i].reset(new DeferredContext());
+        }
+
+        JobGraph jobs;
+
+        std::vector<JobGraph::Job> shadowJobs;
+        for (unsigned L = 0; L < lights; ++L)
+        {
+            shadowJobs.push_back(jobs.add("Record shadow map", [&, L]
+            {
+                shadowContexts[L]->record([&] (ConstantBuffers &listCB)
+                {
+                    renderer->renderShadowMap(listCB, *material, constants, L);
+                });
+            }));
+        }
+
+        auto shadows = jobs.add("Execute shadow maps", [&]
+        {
+            GPUScope scope(L"renderShadowMaps");
+            for (unsigned L = 0; L < lights; ++L)
+                executeList(*shadowContexts[L]);
+            renderer->finishShadowMaps(constants);
+        }, shadowJobs, JobGraph::Thread::Caller);
+
+        auto viewIndependent = jobs.add("View independent lighting", [&]
+        {
+            renderer->updateViewIndependentLighting(cb, *material, constants);
+        }, { shadows }, JobGraph::Thread::Caller);
+
+        std::vector<JobGraph::Job> viewDependencies;
+        if (renderer->viewsDependOnSharedLighting())
+            viewDependencies.push_back(viewIndependent);
+
+        std::vector<JobGraph::Job> viewJobs = { viewIndependent };
+        for (unsigned i = 0; i < lists; ++i)
+        {
+            viewJobs.push_back(jobs.add("Record view", [&, i]
+            {
+                viewContexts[i]->record([&] (ConstantBuffers &listCB)
+                {
+                    if (stereo)
+                        renderStereo(listCB, targets, eyes);
+                    else
+                        renderEye(listCB, targets, depthBuffers, eyes, i);
+                });
+            }, viewDependencies));
+        }
+
+        auto executeViews = jobs.add("Execute views", [&]
+        {
+            if (lists > 0)
+            {
+                for (unsigned i = 0; i < lists; ++i)
+                    executeList(*viewContexts[i]);
+            }
+            else if (stereo)
+            {
+                renderStereo(cb, targets, eyes);
+            }
+            else
+            {
+                for (unsigned eye = 0; eye < views; ++eye)
+                    renderEye(cb, targets, depthBuffers, eyes, eye);
+            }
+
+            finishViews(targets, views, stereo);
+        }, viewJobs, JobGraph::Thread::Caller);
+
+        if (submit)
+            jobs.add("Submit", submit, { executeViews }, JobGraph::Thread::Caller);
+
+        jobs.run();
+    }
+
+    void executeList(DeferredContext &list)
+    {
+        list.execute();
+        recordedBinds = recordedBinds + list.listBinds();
+    }
+
+    // Close to the recommended eye target size of the Rift DK2
+    static const int BenchmarkEyeW = 1182;
+    static const int BenchmarkEyeH = 1464;
+
+    // Create offscreen eye targets and views from the camera, for
+    // benchmarking without a headset.
+    void benchmarkEyes(std::array<Resource, 2> &eyeTargets,
+                       std::array<Resource, 2> &eyeDepths,
+                       std::array<EyeView, 2> &eyes)
+    {
+        static const int EyeW = BenchmarkEyeW;
+        static const int EyeH = BenchmarkEyeH;
+        static const float EyeSeparation = 0.064f;
+
+        for (unsigned eye = 0; eye < 2; ++eye)
+        {
+            auto rtDesc = texture2DDesc(EyeW, EyeH, DXGI_FORMAT_R8G8B8A8_UNORM_SRGB);
+            rtDesc.BindFlags = D3D11_BIND_RENDER_TARGET;
+            auto zDesc = texture2DDesc(EyeW, EyeH, DXGI_FORMAT_D32_FLOAT);
+            zDesc.BindFlags = D3D11_BIND_DEPTH_STENCIL;
+
+            eyeTargets[eye] = Resource(rtDesc);
+            eyeDepths[eye]  = Resource(zDesc);
+        }
+
+        {
+            XMVECTOR rotation = camera.rotation();
+            XMVECTOR right    = XMVector3Rotate(XMVectorSet(1, 0, 0, 0), rotation);
+            XMMATRIX proj     = projection(EyeW, EyeH, NearZ, FarZ, DefaultVerticalFOV, DepthMode::InverseDepth);
+
+            for (unsigned eye = 0; eye < 2; ++eye)
+            {
+                float side = eye ? .5f : -.5f;
+                XMVECTOR position = XMVectorAdd(camera.position(),
+                                                XMVectorScale(right, side * EyeSeparation));
+
+                eyes[eye].viewProjection = XMMatrixMultiply(viewMatrix(position, rotation), proj);
+                eyes[eye].cameraPosition = position;
+            }
+        }
+    }
+
+    // Compare the CPU cost of submitting both eyes one at a time against
+    // single pass stereo, with every lighting mode the current mesh supports.
+    // Offscreen eye targets are used, so no headset is needed.
+    void benchmarkStereo()
+    {
+        static const unsigned WarmupFrames = 20;
+        static const unsigned Frames       = 200;
+        static const int EyeW = BenchmarkEyeW;
+        static const int EyeH = BenchmarkEyeH;
+
+        ovrSizei eyeSize;
+        eyeSize.w = EyeW;
+        eyeSize.h = EyeH;
+
+        std::array<Resource, 2> eyeTargets;
+        std::array<Resource, 2> eyeDepths;
+        std::array<EyeView, 2> eyes;
+        benchmarkEyes(eyeTargets, eyeDepths, eyes);
+
+        std::array<Resource *, 2> targets      = { &eyeTargets[0], &eyeTargets[1] };
+        std::array<Resource *, 2> depthBuffers = { &eyeDepths[0],  &eyeDepths[1] };
+
+        LightingMode activeLightingMode = lightingMode;
+        bool activeStereo = singlePassStereo;
+        bool activeHelp   = showHelp;
+        showHelp = false;
+
+        log("Stereo rendering, %d x %d per eye, %u frames\n", EyeW, EyeH, Frames);
+
+        for (int mode = 0; mode <= static_cast<int>(LightingMode::Maximum); ++mode)
+        {
+            lightingMode = static_cast<LightingMode>(mode);
+            if (meshMode == MeshMode::LoadedMesh && lightingMode != LightingMode::ForwardLighting)
+                continue;
+
+            configureRenderer();
+            renderer->updateLights(state.lights);
+
+            for (int stereo = 0; stereo < 2; ++stereo)
+            {
+                singlePassStereo = stereo != 0;
+                initTargets({ eyeSize, eyeSize });
+
+                const char *path = singlePassStereo ? "single pass" : "per eye";
+                if (singlePassStereo && !renderSinglePassStereo())
+                {
+                    log("%-22s %-12s not supported\n", enumToString(lightingMode), path);
+                    continue;
+                }
+
+                CommandCounts commands;
+                zero(commands);
+                double seconds = 0;
+
+                for (unsigned f = 0; f < WarmupFrames + Frames; ++f)
+                {
+                    CommandCounts before = commandCounts;
+                    cb.beginFrame();
+
+                    // Include the flush, so the work the driver defers to
+                    // submission is also measured.
+                    Timer t;
+                    renderer->renderViewportIndependent(cb, *material, computeConstants());
+                    renderEyes(targets, depthBuffers, eyes);
+                    context->Flush();
+                    double frameSeconds = t.seconds();
+
+                    // Keep the GPU from limiting the CPU timings.
+                    waitForGPU();
+
+                    if (f < WarmupFrames)
+                        continue;
+
+                    CommandCounts c = commandCounts - before;
+                    commands.draws         += c.draws;
+                    commands.pipelines     += c.pipelines;
+                    commands.renderTargets += c.renderTargets;
+                    commands.bindings      += c.bindings;
+                    seconds                += frameSeconds;
+                }
+
+                double n = static_cast<double>(Frames);
+                log("%-22s %-12s %7.3f ms, %7.1f commands (%5.1f draws, %5.1f pipelines, %5.1f targets, %6.1f bindings)\n",
+                    enumToString(lightingMode), path,
+                    seconds * 1000.0 / n,
+                    commands.total() / n,
+                    commands.draws / n,
+                    commands.pipelines / n,
+                    commands.renderTargets / n,
+                    commands.bindings / n);
+            }
+        }
+
+        lightingMode     = activeLightingMode;
+        singlePassStereo = activeStereo;
+        showHelp         = activeHelp;
+        update(true);
+    }
+
+    // Compare the CPU cost of rendering both eyes serially on the immediate
+    // context against recording the shadow maps and the eyes in parallel,
+    // with at least eight shadowed lights and every lighting mode the current
+    // mesh supports. Offscreen eye targets are used, so no headset is needed.
+    void benchmarkRecording()
+    {
+        static const unsigned WarmupFrames = 20;
+        static const unsigned Frames       = 200;
+        static const unsigned ShadowLights = 8;
+        static const int EyeW = BenchmarkEyeW;
+        static const int EyeH = BenchmarkEyeH;
+
+        ovrSizei eyeSize;
+        eyeSize.w = EyeW;
+        eyeSize.h = EyeH;
+
+        std::array<Resource, 2> eyeTargets;
+        std::array<Resource, 2> eyeDepths;
+        std::array<EyeView, 2> eyes;
+        benchmarkEyes(eyeTargets, eyeDepths, eyes);
+
+        std::array<Resource *, 2> targets      = { &eyeTargets[0], &eyeTargets[1] };
+        std::array<Resource *, 2> depthBuffers = { &eyeDepths[0],  &eyeDepths[1] };
+
+        RenderingState activeState      = state;
+        int activeSelectedLight         = selectedLight;
+        LightingMode activeLightingMode = lightingMode;
+        ShadowMode activeShadowMode     = shadowMode;
+        bool activeStereo    = singlePassStereo;
+        bool activeRecording = multithreadedRecording;
+        bool activeHelp      = showHelp;
+        showHelp         = false;
+        singlePassStereo = false;
+
+        // The added lights are copies of the selected one, which costs
+        // the same to render as any other light.
+        while (state.lights.size() < ShadowLights)
+            addNewLight();
+        state.shadowLights = std::max(state.shadowLights, ShadowLights);
+        shadowMode         = ShadowMode::ShadowMapping;
+
+        log("Command list recording, %u shadowed lights, %d x %d per eye, %u frames, %u threads, %s command lists\n",
+            state.shadowLights, EyeW, EyeH, Frames, hardwareThreads(),
+            driverCommandLists() ? "driver" : "emulated");
+
+        for (int mode = 0; mode <= static_cast<int>(LightingMode::Maximum); ++mode)
+        {
+            lightingMode = static_cast<LightingMode>(mode);
+            if (meshMode == MeshMode::LoadedMesh && lightingMode != LightingMode::ForwardLighting)
+                continue;
+
+            configureRenderer();
+            renderer->updateLights(state.lights);
+            initTargets({ eyeSize, eyeSize });
+
+            double serialSeconds = 0;
+
+            for (int recording = 0; recording < 2; ++recording)
+            {
+                multithreadedRecording = recording != 0;
+
+                double seconds = 0;
+
+                for (unsigned f = 0; f < WarmupFrames + Frames; ++f)
+                {
+                    cb.beginFrame();
+
+                    // Include the flush, so the work the driver defers to
+                    // submission is also measured.
+                    Timer t;
+                    if (multithreadedRecording)
+                    {
+                        renderRecorded(targets, depthBuffers, eyes, 2, nullptr);
+                    }
+                    else
+                    {
+                        renderer->renderViewportIndependent(cb, *material, computeConstants());
+                        renderEyes(targets, depthBuffers, eyes);
+                    }
+                    context->Flush();
+                    double frameSeconds = t.seconds();
+
+                    // Keep the GPU from limiting the CPU timings.
+                    waitForGPU();
+
+                    if (f < WarmupFrames)
+                        continue;
+
+                    seconds += frameSeconds;
+                }
+
+                double ms = seconds * 1000.0 / static_cast<double>(Frames);
+                if (multithreadedRecording)
+                {
+                    log("%-22s %-12s %7.3f ms (%.2fx)\n",
+                        enumToString(lightingMode), "parallel", ms, serialSeconds / seconds);
+                }
+                else
+                {
+                    log("%-22s %-12s %7.3f ms\n", enumToString(lightingMode), "serial", ms);
+                    serialSeconds = seconds;
+                }
+            }
+        }
+
+        state                  = activeState;
+        selectedLight          = activeSelectedLight;
+        lightingMode           = activeLightingMode;
+        shadowMode             = activeShadowMode;
+        singlePassStereo       = activeStereo;
+        multithreadedRecording = activeRecording;
+        showHelp               = activeHelp;
+        update(true);
+    }
+
+    // Measure the CPU cost of the on-screen help per frame in two offscreen
+    // eye targets, both when the text stays the same and when all of it is
+    // laid out, uploaded and drawn into the overlay again every frame.
+    void benchmarkOverlay()
+    {
+        static const unsigned WarmupFrames = 20;
+        static const unsigned Frames       = 1000;
+
+        std::array<Resource, 2> eyeTargets;
+        std::array<Resource, 2> eyeDepths;
+        std::array<EyeView, 2> eyes;
+        benchmarkEyes(eyeTargets, eyeDepths, eyes);
+
+        bool activeHelp = showHelp;
+        showHelp = true;
+
+        {
+            Timer t;
+            FontAtlas atlas(TextManager::FontPointSize);
+            log("Font atlas, %u x %u, rasterized in %.3f ms\n",
+                atlas.glyphs.width(), atlas.glyphs.height(), t.seconds() * 1000.0);
+        }
+
+        // With the text unchanged, only the overlay is drawn into each eye.
+        for (int changing = 0; changing < 2; ++changing)
+        {
+            double seconds = 0;
 
-        constants.normalMode         = static_cast<uint>(normalMode);
+            for (unsigned f = 0; f < WarmupFrames + Frames; ++f)
+            {
+                if (changing)
+                    textManager.invalidate();
 
-        // Disable normal mapping for the displacement mapped mesh unless
-        // constant normals are used. The material normals are already included
-        // in the geometry, and normal mapping in this situation would account
-        // for them twice. 
-        bool disableNormalMap =
-            displacementMode == DisplacementMode::CPUDisplacementMapping &&
-            normalMode != NormalMode::ConstantNormal;
+                Timer t;
+                updateHelp();
+                renderHelp(eyeTargets[0]);
+                renderHelp(eyeTargets[1]);
+                context->Flush();
+                double frameSeconds = t.seconds();
 
-        constants.useNormalMapping      = static_cast<uint>(useNormalMapping && !disableNormalMap);
-        constants.displacementDensity   = state.displacementDensity;
-        constants.displacementMagnitude = state.displacementMagnitude;
-        constants.tessellation = displacementMode == DisplacementMode::GPUDisplacementMapping;
+                // Keep the GPU from limiting the CPU timings.
+                waitForGPU();
 
-        constants.wireframe = wireframe;
+                if (f < WarmupFrames)
+                    continue;
 
-        return constants;
+                seconds += frameSeconds;
+            }
+
+            log("Help overlay, %u glyphs, %u frames, %-14s %7.3f ms per frame\n",
+                textManager.glyphCount(), Frames, changing ? "all changed:" : "unchanged:",
+                seconds * 1000.0 / static_cast<double>(Frames));
+        }
+
+        showHelp = activeHelp;
     }
 
-    void renderView(
-        Resource &renderTarget, Resource &depthBuffer,
-        const XMMATRIX &viewProjection, XMVECTOR cameraPosition)
+    // Time the heightmap pyramid of the current material with each filter,
+    // and the uniform displacement mapped grid at each density the T and G
+    // keys allow, along with what the triangle based normal pass it replaces
+    // would add.
+    void benchmarkDisplacement()
     {
-        auto constants = computeConstants(&viewProjection, &cameraPosition);
+        static const unsigned Repeats = 5;
 
+        if (!material || !material->heightPyramid)
         {
-            GPUScope clears(L"Clear render targets");
-            float black[] = { 0, 0, 0, 1 };
-            context->ClearRenderTargetView(renderTarget.rtv, black);
-            // Clear to min depth since we are using inverse Z
-            context->ClearDepthStencilView(depthBuffer.dsv, D3D11_CLEAR_DEPTH, D3D11_MIN_DEPTH, 0);
+            log("No heightmap for the current material, cannot benchmark displacement mapping.\n");
+            return;
         }
 
+        auto &heightMap = material->heightMapCPU;
+        auto &pyramid   = *material->heightPyramid;
+        log("Displacement mapped grids for \"%s\", %d x %d heightmap, %u threads, best of %u\n",
+            material->name.c_str(), heightMap.width, heightMap.height, hardwareThreads(), Repeats);
+
+        for (auto filter : { HeightPyramid::Filter::Box, HeightPyramid::Filter::Tent, HeightPyramid::Filter::Lanczos })
         {
-            GPUScope scope(L"Render SVBRDF");
-            renderer->render(cb, activeMaterial, constants, renderTarget, depthBuffer);
+            double seconds = std::numeric_limits<double>::max();
+            for (unsigned i = 0; i < Repeats; ++i)
+            {
+                Timer t;
+                HeightPyramid p(heightMap.pixels.data(),
+                                static_cast<unsigned>(heightMap.width),
+                                static_cast<unsigned>(heightMap.height),
+                                static_cast<unsigned>(heightMap.channels),
+                                filter);
+                seconds = std::min(seconds, t.seconds());
+            }
+
+            log("%-8s pyramid: %8.2f ms\n", enumToString(filter), seconds * 1000.0);
         }
 
+        for (float density = MinDisplacementDensity; density <= MaxDisplacementDensity; density *= DisplacementDensityStep)
         {
-            GPUScope scope(L"Render light indicators");
-            setRenderTarget(renderTarget, &depthBuffer);
-            for (size_t i = 0; i < state.lights.size(); ++i)
+            // Densities below one pixel per vertex use a single quad.
+            if (density < 1)
+                continue;
+
+            unsigned pixelsPerVertex = static_cast<unsigned>(std::ceil(density));
+            if (static_cast<unsigned>(heightMap.width)  / pixelsPerVertex < 2 ||
+                static_cast<unsigned>(heightMap.height) / pixelsPerVertex < 2)
+                continue;
+
+            std::vector<Vertex> vertices;
+            std::vector<uint32_t> indices;
+
+            double gridSeconds = std::numeric_limits<double>::max();
+            for (unsigned i = 0; i < Repeats; ++i)
             {
-                float size = (i == selectedLight)
-                    ? 0.15f
-                    : 0.05f;
-                auto &L = state.lights[i];
-                lightIndicator.render(cb, size, toVec(L.positionWorld), constants.viewProj,
-                                      L.colorHDR[0], L.colorHDR[1], L.colorHDR[2]);
+                Timer t;
+                unsigned W = 0;
+                unsigned H = 0;
+                auto grid = pyramid.grid(pixelsPerVertex, W, H);
+                generateDisplacedGrid(grid, W, H, 5, 5, 1, 1, vertices, indices);
+                gridSeconds = std::min(gridSeconds, t.seconds());
             }
-            setRenderTarget(nullptr);
+
+            unsigned vertexCount = static_cast<unsigned>(vertices.size());
+
+            Timer t;
+            computeVertexNormals(vertices, indices);
+            double normalSeconds = t.seconds();
+
+            Timer tangentTimer;
+            computeTangentFrames(vertices, indices);
+            double tangentSeconds = tangentTimer.seconds();
+
+            log("PPV %2u: %9u vertices, %9u triangles, grid %8.2f ms (%6.1f Mvertices/s), triangle normals would add %8.2f ms, tangent frames %8.2f ms\n",
+                pixelsPerVertex,
+                vertexCount,
+                static_cast<unsigned>(indices.size() / 3),
+                gridSeconds * 1000.0,
+                static_cast<double>(vertexCount) / gridSeconds / 1e6,
+                normalSeconds * 1000.0,
+                tangentSeconds * 1000.0);
         }
     }
 
-    bool renderToOculus() const
+    struct HeadlessBudget
     {
-        return useOculus && oculus.isActive();
-    }
+        // Maximum commands in any single frame, zero for no limit.
+        uint64_t draws;
+        uint64_t stateChanges;
+    };
 
-    bool canVsync() const
+    // Render frames to an offscreen target with the recording backend, so that
+    // none of the recorded commands reach the GPU, and report the CPU cost and
+    // command stream of each frame. Returns false if any frame goes over budget.
+    bool runHeadless(unsigned frames, const HeadlessBudget &budget)
     {
-        return !renderToOculus();
-    }
+        unsigned width  = oculus.mirrorW;
+        unsigned height = oculus.mirrorH;
 
-    static XMMATRIX viewMatrix(XMVECTOR cameraPosition, XMVECTOR cameraRotation)
-    {
-        XMVECTOR forwardRH = XMVector3Rotate(XMVectorSet(0, 0, -1, 0), cameraRotation);
+        auto rtDesc = texture2DDesc(width, height, DXGI_FORMAT_R8G8B8A8_UNORM_SRGB);
+        rtDesc.BindFlags = D3D11_BIND_RENDER_TARGET;
+        auto zDesc = texture2DDesc(width, height, DXGI_FORMAT_D32_FLOAT);
+        zDesc.BindFlags = D3D11_BIND_DEPTH_STENCIL;
 
-        XMVECTOR target    = XMVectorAdd(cameraPosition, forwardRH);
-        XMVECTOR up        = XMVector3Rotate(XMVectorSet(0, 1, 0, 0), cameraRotation);
+        Resource renderTarget(rtDesc);
+        Resource depthBuffer(zDesc);
 
-        XMMATRIX view = XMMatrixLookAtRH(cameraPosition, target, up);
+        simulation.useOculus = false;
+        simulation.showHelp  = false;
+        update(true);
 
-        return view;
-    }
+        RecordingBackend recorder(&d3d11Backend());
+        StateCache cache(recorder);
+        BackendScope recording(cache);
 
-    void renderViewWithAA(
-        Resource &finalRT, Resource &finalZ,
-        const XMMATRIX &viewProjection, XMVECTOR cameraPosition,
-        Resource &aaRT, Resource &aaZ)
-    {
-        switch (state.aaMode)
-        {
-        case AntialiasingMode::NoAA:
+        RecordingBackend::Stats total;
+        zero(total);
+        uint64_t maxDraws        = 0;
+        uint64_t maxStateChanges = 0;
+        double seconds = 0;
+
+        for (unsigned f = 0; f < frames; ++f)
         {
-            renderView(finalRT, finalZ, viewProjection, cameraPosition);
-            break;
+            recorder.reset();
+
+            Timer t;
+            render(renderTarget, depthBuffer);
+            seconds += t.seconds();
+
+            auto &stats = recorder.stats();
+            for (unsigned c = 0; c < RecordingBackend::CommandKinds; ++c)
+            {
+                total.commands[c] += stats.commands[c];
+                total.bytes[c]    += stats.bytes[c];
+            }
+            maxDraws        = std::max(maxDraws,        stats.draws());
+            maxStateChanges = std::max(maxStateChanges, stats.stateChanges());
         }
-        case AntialiasingMode::MSAA4x:
+
+        double n = static_cast<double>(std::max(frames, 1u));
+
+        log("Headless rendering, %u x %u, %s, %u frames\n", width, height, enumToString(lightingMode), frames);
+        log("%7.3f ms CPU, %7.1f commands, %9.1f bytes per frame\n",
+            seconds * 1000.0 / n, total.totalCommands() / n, total.totalBytes() / n);
+        for (unsigned c = 0; c < RecordingBackend::CommandKinds; ++c)
         {
-            renderView(aaRT, aaZ, viewProjection, cameraPosition);
-            // FIXME: Fixed function resolve might not be sRGB correct. :(
-            context->ResolveSubresource(finalRT.texture, 0, aaRT.texture, 0, DXGI_FORMAT_R8G8B8A8_UNORM_SRGB);
-            break;
+            if (!total.commands[c])
+                continue;
+
+            log("    %-20s %8.1f commands %9.1f bytes\n",
+                RecordingBackend::commandName(static_cast<RecordingBackend::Command>(c)),
+                total.commands[c] / n, total.bytes[c] / n);
         }
-        case AntialiasingMode::SSAA2x:
-        case AntialiasingMode::SSAA4x:
+        log("Most in one frame: %llu draws, %llu state changes\n", maxDraws, maxStateChanges);
+        log("State cache: %.1f binds, %.1f filtered, %.1f issued per frame\n",
+            cache.stats().binds / n, cache.stats().filtered() / n, cache.stats().issued / n);
+
+        bool withinBudget = true;
+        if (budget.draws && maxDraws > budget.draws)
         {
-            renderView(aaRT, aaZ, viewProjection, cameraPosition);
-            // FIXME: This might not be sRGB correct
-            context->GenerateMips(aaRT.srv);
-            unsigned mips     = aaRT.textureDescriptor().MipLevels;
-            context->CopySubresourceRegion(finalRT.texture, 0, 0, 0, 0,
-                                           aaRT.texture, D3D11CalcSubresource(mips - 1, 0, mips), nullptr);
-            break;
+            log("Draws over budget (%llu > %llu)\n", maxDraws, budget.draws);
+            withinBudget = false;
         }
-        default:
-            check(false, "Unknown antialiasing mode!");
-            break;
+        if (budget.stateChanges && maxStateChanges > budget.stateChanges)
+        {
+            log("State changes over budget (%llu > %llu)\n", maxStateChanges, budget.stateChanges);
+            withinBudget = false;
         }
 
-        if (showHelp)
-        {
-            GPUScope scope(L"Render text");
-            textManager.updateTextCache();
+        return withinBudget;
+    }
 
-            uint2 textCoords;
-            if (useOculus)
-                textCoords = { 400, 300 };
-            else
-                textCoords = { 10, 10 };
+};
 
-            textManager.render(finalRT, textCoords);
-        }
+// Measure the software shadow map rasterizer with every bundled mesh, using
+// the same cube face matrices and depth bias as the GPU shadow pass.
+static void benchmarkDepthRasterizer(const std::string &dataDirectory)
+{
+    static const unsigned Iterations = 10;
+    // Meshes are scaled like in SVBRDFRenderer::initLoadedMesh
+    static const float MeshDim = 5.f;
 
-#if defined(DEBUG_SHADOW_TEXEL_UNPROJECT)
-        if (shadowMode == ShadowMode::ShadowMapping)
+    struct LightPlacement
+    {
+        const char *name;
+        float3 position;
+    };
+    // A light outside the mesh only sees it through some of the faces,
+    // while a light at the center sees it through all of them.
+    LightPlacement placements[] =
+    {
+        { "outside", { 4, 4, 8 } },
+        { "center",  { 0, 0, 0 } },
+    };
+
+    MeshCollection meshes(dataDirectory.c_str());
+    DepthRasterizer rasterizer;
+
+    log("Software shadow map rasterizer, %u threads, %d x %d cube faces, %u iterations\n",
+        hardwareThreads(), ShadowResolution, ShadowResolution, Iterations);
+
+    for (int i = 0; i < meshes.size(); ++i)
+    {
+        Mesh mesh = meshes.loadGeometry(i);
+        if (mesh.vertices.empty() || mesh.indices.empty())
+            continue;
+
+        rasterizer.setGeometry(mesh.vertices.front().pos.data(), sizeof(Vertex), mesh.vertices.size(),
+                               mesh.indices.data(), mesh.indices.size(),
+                               MeshDim / mesh.scale);
+
+        for (auto &p : placements)
         {
-            static int shadowSlice = 5;
-            updateValueWrap('I', 'K', shadowSlice, 1, 0, 6);
-            setRenderTarget(finalRT);
-            renderer->unprojectShadowMap(cb, computeConstants(&viewProjection), shadowSlice);
-            setRenderTarget(nullptr);
+            DepthRasterizer::Matrix viewProjs[6];
+            for (unsigned f = 0; f < 6; ++f)
+                viewProjs[f] = rasterizerMatrix(shadowCubeFaceViewProj(toVec(p.position, 1), f));
+
+            DepthRasterizer::Stats total;
+            zero(total);
+
+            Timer t;
+            for (unsigned it = 0; it < Iterations; ++it)
+            {
+                auto stats = rasterizer.render(viewProjs, 6, ShadowResolution,
+                                               ShadowDepthBias, ShadowSSDepthBias);
+                total.triangles       += stats.triangles;
+                total.trianglesBinned += stats.trianglesBinned;
+                total.pixelsTested    += stats.pixelsTested;
+                total.pixelsWritten   += stats.pixelsWritten;
+                total.setupSeconds    += stats.setupSeconds;
+                total.rasterSeconds   += stats.rasterSeconds;
+            }
+            double seconds = t.seconds();
+
+            log("%-12s %-8s %8u tris: %7.2f ms (setup %6.2f ms, raster %6.2f ms), %8.2f Mtris/s, %8.2f Mpixels/s\n",
+                mesh.name.c_str(), p.name,
+                mesh.indexAmount / 3,
+                seconds * 1000.0 / Iterations,
+                total.setupSeconds * 1000.0 / Iterations,
+                total.rasterSeconds * 1000.0 / Iterations,
+                total.triangles / seconds / 1e6,
+                total.pixelsTested / seconds / 1e6);
         }
-#endif
     }
+}
 
-    void render(Resource &renderTarget, Resource &depthBuffer)
-    {
-        renderer->renderViewportIndependent(cb, activeMaterial, computeConstants());
+// Runs the updates on a thread of its own, at most one frame ahead of the
+// frames started by the render thread. Input handling, presets and asset loads
+// then overlap with rendering instead of delaying it, and if an update takes
+// longer than a frame, the render thread keeps rendering the latest frame.
+class UpdateThread
+{
+    std::mutex mutex;
+    std::condition_variable started;
+    uint64_t framesStarted;
+    bool stop;
+    std::thread thread;
 
-        if (renderToOculus())
+public:
+    UpdateThread(std::function<void()> update)
+        : framesStarted(0)
+        , stop(false)
+    {
+        thread = std::thread([this, update]
         {
-            // Sample sensors as close as possible to rendering, so right before.
-            oculus.samplePose();
+            // For the file dialogs and the image decoders.
+            checkHR(CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED));
+            // Loading assets only creates resources, which is safe to do
+            // on any thread.
+            backend = &d3d11Backend();
 
-            // First, render both eyes
-            for (auto &&eye : oculus.eyes)
+            for (uint64_t updates = 0; ; ++updates)
             {
-                GPUScope scope(L"Render eye");
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    started.wait(lock, [&] { return stop || framesStarted >= updates; });
+                    if (stop)
+                        break;
+                }
 
-                // Apply head pose on top of the camera pose
-                XMVECTOR eyeRot = XMVectorSet(
-                    eye.pose.Orientation.x,
-                    eye.pose.Orientation.y,
-                    eye.pose.Orientation.z,
-                    eye.pose.Orientation.w);
+                update();
+            }
 
-                XMVECTOR eyePos = XMVectorSet(
-                    eye.pose.Position.x,
-                    eye.pose.Position.y,
-                    eye.pose.Position.z,
-                    0);
+            backend = nullptr;
+            CoUninitialize();
+        });
+    }
 
-                XMVECTOR basePosition = camera.position();
-                XMVECTOR baseRotation = camera.rotation();
+    ~UpdateThread()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        started.notify_one();
+        thread.join();
+    }
 
-                XMVECTOR eyeOffset    = XMVector3Rotate(eyePos, baseRotation);
+    UpdateThread(const UpdateThread &) = delete;
+    UpdateThread &operator=(const UpdateThread &) = delete;
 
-                XMVECTOR cameraPosition;
-                XMVECTOR cameraRotation;
+    void frameStarted()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++framesStarted;
+        }
+        started.notify_one();
+    }
+};
 
-                float headPositionMultiplier;
+static void logFrameTimes(const char *what, const FrameTimes::Summary &s)
+{
+    log("%-14s %5u frames: %7.2f ms average, %7.2f ms 50%%, %7.2f ms 90%%, %7.2f ms 99%%, %7.2f ms max\n",
+        what, static_cast<unsigned>(s.frames),
+        s.average * 1000.0, s.p50 * 1000.0, s.p90 * 1000.0, s.p99 * 1000.0, s.max * 1000.0);
+}
 
-                if (state.vrScale < 0)
-                    headPositionMultiplier = 0;
-                else
-                    headPositionMultiplier = std::pow(10.f, state.vrScale / 4.f);
+// Render in the window until asked to quit, or for the given amount of seconds
+// if it is not zero. With threadedUpdate, the frames are simulated on an update
+// thread, and otherwise before each frame on the calling thread. If frameTimes
+// is given, vsync is disabled and every frame time is added to it.
+static void runWindow(Window &window, Graphics &graphics, SVBRDFOculus &svbrdfOculus,
+                      Resource &depthBuffer, bool threadedUpdate,
+                      double seconds = 0, FrameTimes *frameTimes = nullptr)
+{
+    static const size_t NumFrameTimeSamples = 120;
+    FrameTimes measuredTimes;
+    Timer frameTimer;
+    Timer runTimer;
 
-                eyeOffset = XMVectorMultiply(eyeOffset, XMVectorReplicate(headPositionMultiplier));
+    std::unique_ptr<UpdateThread> updateThread;
+    if (threadedUpdate)
+        updateThread.reset(new UpdateThread([&] { svbrdfOculus.simulate(); }));
 
-                cameraPosition = XMVectorAdd(basePosition, eyeOffset);
-                cameraRotation = XMQuaternionMultiply(eyeRot, baseRotation);
+    window.run([&](Window &)
+    {
+        GPUScope frame(L"Frame");
 
-                XMMATRIX view = viewMatrix(cameraPosition, cameraRotation);
+        bool running;
+        if (updateThread)
+        {
+            running = svbrdfOculus.beginFrame();
+            updateThread->frameStarted();
+        }
+        else
+        {
+            running = svbrdfOculus.update();
+        }
 
-                ovrMatrix4f ovrProj    = ovrMatrix4f_Projection(eye.fov, NearZ, FarZ,
-                                                                ovrProjection_FarLessThanNear |
-                                                                ovrProjection_RightHanded);
+        if (!running)
+            return false;
 
-			    XMMATRIX proj = XMMatrixSet(ovrProj.M[0][0], ovrProj.M[1][0], ovrProj.M[2][0], ovrProj.M[3][0],
-				                            ovrProj.M[0][1], ovrProj.M[1][1], ovrProj.M[2][1], ovrProj.M[3][1],
-				                            ovrProj.M[0][2], ovrProj.M[1][2], ovrProj.M[2][2], ovrProj.M[3][2],
-				                            ovrProj.M[0][3], ovrProj.M[1][3], ovrProj.M[2][3], ovrProj.M[3][3]);
+        svbrdfOculus.render(graphics.swapChain.backBuffer, depthBuffer);
 
-                XMMATRIX viewProjection = XMMatrixMultiply(view, proj);
+        frame.end();
 
-                eye.next();
+        bool measuring = svbrdfOculus.measuringFrameTime();
+        bool vsync = svbrdfOculus.canVsync() && !measuring && !frameTimes;
+        graphics.present(vsync);
 
-                renderViewWithAA(eye.active(), eye.depthBuffer, viewProjection, cameraPosition,
-                                 aaTargets[eye.number], aaDepth[eye.number]);
-            }
+        double t = frameTimer.seconds();
+        frameTimer = Timer();
 
-            // Submit the eyes to OVR
-            ovrLayerEyeFov frame = oculus.frame();
-            auto layers = &frame.Header;
-            oculus.assertStatus(ovr_SubmitFrame(oculus.session, 0, nullptr, &layers, 1));
+        if (frameTimes)
+            frameTimes->add(t);
 
-            // Then, copy the mirror texture contents to the target of the rendering
-            context->CopyResource(renderTarget.texture, oculus.mirrorD3DTexture());
+        if (measuring)
+        {
+            measuredTimes.add(t);
+            if (measuredTimes.size() >= NumFrameTimeSamples)
+            {
+                logFrameTimes("Frame time", measuredTimes.summary());
+                measuredTimes.clear();
+            }
         }
         else
         {
-            // No headset active, render normally to the window
-            unsigned width  = oculus.mirrorW;
-            unsigned height = oculus.mirrorH;
+            measuredTimes.clear();
+        }
 
-            XMVECTOR cameraPosition = camera.position();
+        return seconds <= 0 || runTimer.seconds() < seconds;
+    });
+}
 
-            XMMATRIX view = viewMatrix(cameraPosition, camera.rotation());
+// Scripted input for benchmarking the update: the camera and a light move all
+// the time, and every few seconds a material is switched and a preset loaded.
+static bool scriptedKeyHeld(double seconds, int virtualKeyCode)
+{
+    static const double Period = 4;
+    static const double Press  = .1;
 
-            XMMATRIX proj = projection(width, height, NearZ, FarZ, DefaultVerticalFOV, DepthMode::InverseDepth);
+    double t = std::fmod(seconds, Period);
+    bool firstHalf = t < Period / 2;
+    auto pressedAt = [&] (double at) { return t >= at && t < at + Press; };
 
-            XMMATRIX viewProjection = XMMatrixMultiply(view, proj);
+    switch (virtualKeyCode)
+    {
+    case 'W':        return firstHalf;
+    case 'S':        return !firstHalf;
+    case VK_LEFT:    return true;
+    case VK_NUMPAD6: return firstHalf;
+    case VK_NUMPAD4: return !firstHalf;
+    case 'X':        return pressedAt(1);
+    case VK_F1:      return pressedAt(3);
+    default:         return false;
+    }
+}
 
-            renderViewWithAA(renderTarget, depthBuffer, viewProjection, cameraPosition,
-                             aaTargets[0], aaDepth[0]);
-        }
+// Compare the frame times of updating before each frame on the render thread
+// against updating on the update thread, with the same scripted input.
+static void benchmarkUpdate(Window &window, Graphics &graphics, SVBRDFOculus &svbrdfOculus,
+                            Resource &depthBuffer)
+{
+    static const double Seconds = 20;
+
+    log("Update, %.0f seconds of scripted input per run, no vsync\n", Seconds);
+
+    for (int threaded = 0; threaded < 2; ++threaded)
+    {
+        Timer scriptTimer;
+        keyboardSource([&scriptTimer] (int virtualKeyCode)
+        {
+            return scriptedKeyHeld(scriptTimer.seconds(), virtualKeyCode);
+        });
+
+        FrameTimes frameTimes;
+        runWindow(window, graphics, svbrdfOculus, depthBuffer, threaded != 0, Seconds, &frameTimes);
+
+        keyboardSource(nullptr);
+
+        logFrameTimes(threaded ? "Update thread" : "Serial update", frameTimes.summary());
     }
-};
+}
 
 struct Args
 {
@@ -3463,13 +7107,34 @@ struct Args
     unsigned width;
     unsigned height;
     bool readWritePresets;
+    bool benchmarkRasterizer;
+    bool benchmarkStereo;
+    bool benchmarkRecording;
+    bool benchmarkUpdate;
+    bool benchmarkOverlay;
+    bool benchmarkDisplacement;
+    bool serialUpdate;
+    bool headless;
+    unsigned headlessFrames;
+    SVBRDFOculus::HeadlessBudget budget;
 
     Args()
         : dataDirectory(nullptr)
         , width(DefaultWindowWidth)
         , height(DefaultWindowHeight)
         , readWritePresets(false)
-    {}
+        , benchmarkRasterizer(false)
+        , benchmarkStereo(false)
+        , benchmarkRecording(false)
+        , benchmarkUpdate(false)
+        , benchmarkOverlay(false)
+        , benchmarkDisplacement(false)
+        , serialUpdate(false)
+        , headless(false)
+        , headlessFrames(DefaultHeadlessFrames)
+    {
+        zero(budget);
+    }
 };
 
 Args processArgs(int argc, const char *argv[])
@@ -3501,6 +7166,53 @@ Args processArgs(int argc, const char *argv[])
         {
             args.readWritePresets = true;
         }
+        else if (a == "--benchmark-rasterizer")
+        {
+            args.benchmarkRasterizer = true;
+        }
+        else if (a == "--benchmark-stereo")
+        {
+            args.benchmarkStereo = true;
+        }
+        else if (a == "--benchmark-recording")
+        {
+            args.benchmarkRecording = true;
+        }
+        else if (a == "--benchmark-update")
+        {
+            args.benchmarkUpdate = true;
+        }
+        else if (a == "--benchmark-overlay")
+        {
+            args.benchmarkOverlay = true;
+        }
+        else if (a == "--benchmark-displacement")
+        {
+            args.benchmarkDisplacement = true;
+        }
+        else if (a == "--serial-update")
+        {
+            args.serialUpdate = true;
+        }
+        else if (a == "--headless")
+        {
+            args.headless = true;
+        }
+        else if (a == "--frames")
+        {
+            ++it;
+            args.headlessFrames = atoi(*it);
+        }
+        else if (a == "--budget-draws")
+        {
+            ++it;
+            args.budget.draws = atoi(*it);
+        }
+        else if (a == "--budget-state-changes")
+        {
+            ++it;
+            args.budget.stateChanges = atoi(*it);
+        }
         else
         {
             log("Usage: %s [--help] [--data DATA_DIRECTORY] [--width WIDTH] [--height HEIGHT]\n", argv[0]);
@@ -3509,6 +7221,21 @@ Args processArgs(int argc, const char *argv[])
             log("   --height HEIGHT        Set the height of the created window (default: %u)\n", DefaultWindowHeight);
             log("   --data DATA_DIRECTORY  Use DATA_DIRECTORY as the data directory.\n");
             log("   --rw-presets           Allow saving presets with Ctrl + F1...F10\n");
+            log("   --benchmark-rasterizer Benchmark the software shadow map rasterizer and exit.\n");
+            log("   --benchmark-stereo     Benchmark per eye and single pass stereo rendering and exit.\n");
+            log("   --benchmark-recording  Benchmark serial and multithreaded command recording and exit.\n");
+            log("   --benchmark-update     Compare frame times with and without the update thread, using\n");
+            log("                          scripted input, and exit.\n");
+            log("   --benchmark-overlay    Benchmark the CPU cost of the on-screen help per frame and exit.\n");
+            log("   --benchmark-displacement\n");
+            log("                          Benchmark building the displacement mapped grid of the default\n");
+            log("                          material at each density and exit.\n");
+            log("   --serial-update        Handle input before each frame on the render thread.\n");
+            log("   --headless             Record the commands of rendering without a window or a GPU and exit.\n");
+            log("   --frames FRAMES        Frames to render with --headless (default: %u)\n", DefaultHeadlessFrames);
+            log("   --budget-draws N       Fail --headless if a frame has more than N draws.\n");
+            log("   --budget-state-changes N\n");
+            log("                          Fail --headless if a frame has more than N state changes.\n");
             exit(0);
         }
 
@@ -3522,6 +7249,22 @@ int main(int argc, const char *argv[])
 {
     Args args = processArgs(argc, argv);
 
+    if (args.benchmarkRasterizer)
+    {
+        benchmarkDepthRasterizer(args.dataDirectory ? args.dataDirectory : "data");
+        return 0;
+    }
+
+    if (args.headless)
+    {
+        // WARP is only used for creating the resources, the recording
+        // backend keeps the rendering commands from being submitted.
+        Oculus oculus(args.width, args.height);
+        Graphics graphics(D3D_DRIVER_TYPE_WARP);
+        SVBRDFOculus svbrdfOculus(oculus, args.dataDirectory ? args.dataDirectory : "");
+        return svbrdfOculus.runHeadless(args.headlessFrames, args.budget) ? 0 : 1;
+    }
+
     Oculus oculus(args.width, args.height);
 
     unsigned windowW = oculus.mirrorW;
@@ -3537,6 +7280,30 @@ int main(int argc, const char *argv[])
     oculus.createOutputTextures();
     SVBRDFOculus svbrdfOculus(oculus, args.dataDirectory ? args.dataDirectory : "", args.readWritePresets);
 
+    if (args.benchmarkStereo)
+    {
+        svbrdfOculus.benchmarkStereo();
+        return 0;
+    }
+
+    if (args.benchmarkRecording)
+    {
+        svbrdfOculus.benchmarkRecording();
+        return 0;
+    }
+
+    if (args.benchmarkOverlay)
+    {
+        svbrdfOculus.benchmarkOverlay();
+        return 0;
+    }
+
+    if (args.benchmarkDisplacement)
+    {
+        svbrdfOculus.benchmarkDisplacement();
+        return 0;
+    }
+
     Resource depthBuffer;
     {
         D3D11_TEXTURE2D_DESC zDesc = texture2DDesc(
@@ -3548,49 +7315,13 @@ int main(int argc, const char *argv[])
         RESOURCE_DEBUG_NAME(depthBuffer);
     }
 
-    static const size_t NumFrameTimeSamples = 30;
-    bool measureFrameTime = false;
-    Timer frameTimer;
-    std::vector<double> frameTimeSamples;
-    frameTimeSamples.reserve(NumFrameTimeSamples);
-
-    window.run([&](Window &)
+    if (args.benchmarkUpdate)
     {
-        GPUScope frame(L"Frame");
-
-        svbrdfOculus.update();
-        {
-            svbrdfOculus.render(graphics.swapChain.backBuffer, depthBuffer);
-        }
-
-        frame.end();
-
-        toggleValue("Frame time measurement", VK_HOME, measureFrameTime);
-        bool vsync = svbrdfOculus.canVsync() && !measureFrameTime;
-        graphics.present(vsync);
-
-        double t = frameTimer.seconds();
-        frameTimer = Timer();
-
-        if (measureFrameTime)
-        {
-            frameTimeSamples.emplace_back(t);
-            if (frameTimeSamples.size() >= NumFrameTimeSamples)
-            {
-                double sum = std::accumulate(frameTimeSamples.begin(), frameTimeSamples.end(), 0.);
-                double avgTime = sum / static_cast<double>(frameTimeSamples.size());
-                frameTimeSamples.clear();
-                log("Average frame time: %10.2f ms\n", avgTime * 1000.0);
-            }
-        }
-        else
-        {
-            frameTimeSamples.clear();
-        }
+        benchmarkUpdate(window, graphics, svbrdfOculus, depthBuffer);
+        return 0;
+    }
 
-        return !keyPressed(VK_ESCAPE);
-    });
+    runWindow(window, graphics, svbrdfOculus, depthBuffer, !args.serialUpdate);
 
     return 0;
 }
-
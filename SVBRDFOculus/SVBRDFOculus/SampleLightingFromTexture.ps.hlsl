@@ -1,6 +1,8 @@
 #include "Lighting.h.hlsl"
+#include "LightingFeedback.h.hlsl"
 
-Texture2D<float4> lightingMap : register(t0);
+Texture2D<float4> diffuseLightingMap  : register(t0);
+Texture2D<float4> specularLightingMap : register(t1);
 SamplerState smp : register(s0);
 
 struct PSInput
@@ -8,11 +10,17 @@ struct PSInput
     float4 worldPos : POSITION0;
     float4 uv       : TEXCOORD0;
     float4 normal   : NORMAL0;
+    float4 tangent  : TANGENT0;
+    float4 svPos    : SV_Position;
 };
 
+[earlydepthstencil]
 float4 main(PSInput i) : SV_Target
 {
-    float3 radianceHDR = lightingMap.Sample(smp, i.uv.xy).rgb;
+    recordFeedback(diffuseLightingMap, smp, i.svPos.xy, i.uv.xy);
+
+    float3 radianceHDR = diffuseLightingMap.Sample(smp, i.uv.xy).rgb
+                       + specularLightingMap.Sample(smp, i.uv.xy).rgb;
     float3 radianceLDR = toneMap(radianceHDR, tonemapMode, maxLuminance);
     // sRGB mapping done by hardware, so no manual gamma correction needed
     return float4(radianceLDR, 1);
@@ -0,0 +1,82 @@
+#include "ShadingCost.hpp"
+
+#include <algorithm>
+
+ShadingCostModel::ShadingCostModel()
+    : w(defaultWeights())
+{}
+
+ShadingCostModel::ShadingCostModel(const Weights &weights)
+    : w(weights)
+{}
+
+ShadingCostModel::Weights ShadingCostModel::defaultWeights()
+{
+    // Approximate instruction counts of the corresponding parts of Lighting.h.hlsl.
+    Weights weights;
+    weights.material    = 40;
+    weights.diffuse     = 10;
+    weights.specular    = 50;
+    weights.shadowTap   = 8;
+    weights.lightingMap = 4;
+    return weights;
+}
+
+double ShadingCostModel::shadowCost(const Scene &scene, unsigned lights) const
+{
+    unsigned shadowed = std::min(lights, scene.shadowLights);
+    return static_cast<double>(shadowed) * scene.pcfTaps * w.shadowTap;
+}
+
+double ShadingCostModel::forwardPixel(const Scene &scene) const
+{
+    return w.material
+        + scene.lights * (w.diffuse + w.specular)
+        + shadowCost(scene, scene.lights);
+}
+
+double ShadingCostModel::sharedTexel(const Scene &scene) const
+{
+    return w.material
+        + scene.lights * w.diffuse
+        + shadowCost(scene, scene.lights);
+}
+
+double ShadingCostModel::specularPixel(const Scene &scene) const
+{
+    // Shadows of the lights that do not fit in the stored terms are still
+    // looked up for every pixel.
+    unsigned stored = std::min(scene.storedShadowLights, scene.lights);
+    double shadows  = shadowCost(scene, scene.lights) - shadowCost(scene, stored);
+
+    return w.material
+        + 2 * w.lightingMap
+        + scene.lights * w.specular
+        + shadows;
+}
+
+ShadingCostModel::Estimate ShadingCostModel::estimate(Mode mode, const Scene &scene, const Work &work) const
+{
+    double pixels = static_cast<double>(work.pixels);
+    double texels = static_cast<double>(work.texels);
+
+    Estimate e;
+    e.baseline = pixels * forwardPixel(scene);
+
+    switch (mode)
+    {
+    default:
+    case Mode::Forward:
+        e.actual = e.baseline;
+        break;
+    case Mode::TextureSpace:
+        // Texels are relit with both terms, and every view samples both maps.
+        e.actual = texels * forwardPixel(scene) + pixels * 2 * w.lightingMap;
+        break;
+    case Mode::SharedDiffuse:
+        e.actual = texels * sharedTexel(scene) + pixels * specularPixel(scene);
+        break;
+    }
+
+    return e;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+
+// Rough CPU side model of the pixel shading work done by the lighting modes,
+// used to show how much work sharing the view independent lighting saves
+// compared to lighting every pixel of every view from scratch. The costs are
+// in arbitrary units, and only meant for comparing the modes with each other.
+class ShadingCostModel
+{
+public:
+    // Relative costs of the parts of the lighting.
+    struct Weights
+    {
+        double material;      // sampling the SVBRDF and setting up the lighting at a point
+        double diffuse;       // diffuse term of one light
+        double specular;      // specular lobe of one light
+        double shadowTap;     // one PCF tap of a shadow map
+        double lightingMap;   // one sample from a texture space lighting map
+    };
+
+    enum class Mode
+    {
+        // Every pixel of every view evaluates all lighting.
+        Forward,
+        // All lighting is done in texture space, views only sample it.
+        TextureSpace,
+        // Diffuse lighting and shadows are done once in texture space,
+        // the views evaluate only the specular lobe.
+        SharedDiffuse,
+    };
+
+    struct Scene
+    {
+        unsigned lights;
+        unsigned shadowLights;
+        unsigned pcfTaps;
+        // Lights whose shadow terms the shared diffuse mode stores in texture space.
+        unsigned storedShadowLights;
+    };
+
+    // Work done during one frame.
+    struct Work
+    {
+        uint64_t pixels;  // lit pixels over all views
+        uint64_t texels;  // texels lit in texture space
+    };
+
+    struct Estimate
+    {
+        double baseline;  // cost of Mode::Forward for the same pixels
+        double actual;
+
+        double saved() const { return baseline - actual; }
+        double savedFraction() const { return (baseline > 0) ? saved() / baseline : 0; }
+    };
+
+    ShadingCostModel();
+    explicit ShadingCostModel(const Weights &weights);
+
+    static Weights defaultWeights();
+    const Weights &weights() const { return w; }
+
+    // Full lighting of a single pixel.
+    double forwardPixel(const Scene &scene) const;
+    // View independent lighting of a texel in the shared diffuse mode,
+    // including the stored shadow terms.
+    double sharedTexel(const Scene &scene) const;
+    // View dependent lighting of a pixel in the shared diffuse mode.
+    double specularPixel(const Scene &scene) const;
+
+    Estimate estimate(Mode mode, const Scene &scene, const Work &work) const;
+
+private:
+    Weights w;
+
+    double shadowCost(const Scene &scene, unsigned lights) const;
+};
@@ -0,0 +1,34 @@
+#include "Lighting.h.hlsl"
+#include "LightingFeedback.h.hlsl"
+
+// View independent lighting shared by both eyes, lit in texture space
+Texture2D<float4> diffuseLightingMap : register(t8);
+Texture2D<float4> shadowTermMap      : register(t9);
+SamplerState lightingMapSampler      : register(s2);
+
+struct PSInput
+{
+    float4 worldPos : POSITION0;
+    float4 uv       : TEXCOORD0;
+    float4 normal   : NORMAL0;
+    float4 tangent  : TANGENT0;
+    float4 svPos    : SV_Position;
+};
+
+[earlydepthstencil]
+float4 main(PSInput i) : SV_Target
+{
+    recordFeedback(diffuseLightingMap, lightingMapSampler, i.svPos.xy, i.uv.xy);
+
+    float3 N = normalize(i.normal.xyz); // Renormalize after interpolation
+
+    // Only the specular lobe depends on the eye.
+    float4 shadowTerms = shadowTermMap.Sample(lightingMapSampler, i.uv.xy);
+    Radiance radianceHDR = lightingSplit(i.worldPos.xyz, N, i.tangent, i.uv.xy,
+                                         LightingSpecular, true, shadowTerms, i.uv.w);
+
+    float3 diffuseHDR  = diffuseLightingMap.Sample(lightingMapSampler, i.uv.xy).rgb;
+    float3 radianceLDR = toneMap(diffuseHDR + radianceHDR.specular, tonemapMode, maxLuminance);
+    // sRGB mapping done by hardware, so no manual gamma correction needed
+    return float4(radianceLDR, 1);
+}
@@ -0,0 +1,392 @@
+#include "StateCache.hpp"
+
+#include <algorithm>
+
+const unsigned StateCache::ShaderResourceSlots;
+const unsigned StateCache::SamplerSlots;
+const unsigned StateCache::ConstantBufferSlots;
+
+StateCache::Stats StateCache::Stats::operator+(const Stats &s) const
+{
+    Stats d;
+    d.binds  = binds  + s.binds;
+    d.issued = issued + s.issued;
+    return d;
+}
+
+StateCache::Stats StateCache::Stats::operator-(const Stats &s) const
+{
+    Stats d;
+    d.binds  = binds  - s.binds;
+    d.issued = issued - s.issued;
+    return d;
+}
+
+static bool samePipeline(const PipelineState &a, const PipelineState &b)
+{
+    return a.vs                == b.vs
+        && a.hs                == b.hs
+        && a.ds                == b.ds
+        && a.ps                == b.ps
+        && a.primitiveTopology == b.primitiveTopology
+        && a.inputLayout       == b.inputLayout
+        && a.rasterizerState   == b.rasterizerState
+        && a.blendState        == b.blendState
+        && a.depthStencilState == b.depthStencilState
+        && a.stencilRef        == b.stencilRef;
+}
+
+StateCache::StateCache(Backend &target)
+    : target(target)
+{
+    zero(counts);
+    invalidate();
+}
+
+void StateCache::invalidate()
+{
+    hasPipeline      = false;
+    hasRenderTargets = false;
+    hasViewport      = false;
+    unorderedAccessViews = false;
+
+    zero(pipeline);
+    zero(renderTargets);
+    renderTargetCount = 0;
+    depthStencil      = nullptr;
+    zero(viewport);
+
+    // A buffer that can never be bound, so the next bind of every
+    // constant buffer slot is issued.
+    ConstantBuffer unknown;
+    unknown.buffer        = nullptr;
+    unknown.firstConstant = ~0u;
+    unknown.numConstants  = 0;
+    for (auto &stage : constantBuffers)
+        stage.fill(unknown);
+
+    // Shader resources and samplers start out unbound, like in a new context.
+    for (auto &s : shaderResources)
+    {
+        s.bound.fill(nullptr);
+        s.pending.fill(nullptr);
+        s.dirty = false;
+    }
+    for (auto &s : samplers)
+    {
+        s.bound.fill(nullptr);
+        s.pending.fill(nullptr);
+        s.dirty = false;
+    }
+}
+
+// Issue the slots whose pending state differs from the bound state,
+// one call for each contiguous range of them.
+template <typename T, size_t N, typename Issue>
+static unsigned flushSlots(std::array<T *, N> &bound, const std::array<T *, N> &pending, Issue &&issue)
+{
+    unsigned calls = 0;
+    unsigned s     = 0;
+
+    while (s < N)
+    {
+        if (bound[s] == pending[s])
+        {
+            ++s;
+            continue;
+        }
+
+        unsigned first = s;
+        while (s < N && bound[s] != pending[s])
+        {
+            bound[s] = pending[s];
+            ++s;
+        }
+
+        issue(first, s - first, &pending[first]);
+        ++calls;
+    }
+
+    return calls;
+}
+
+void StateCache::flushShaderResources(ShaderStage stage)
+{
+    auto &slots = shaderResources[static_cast<unsigned>(stage)];
+    if (!slots.dirty)
+        return;
+
+    counts.issued += flushSlots(slots.bound, slots.pending,
+        [&] (UINT first, UINT count, ID3D11ShaderResourceView * const *srvs)
+    {
+        target.setShaderResources(stage, first, count, srvs);
+    });
+    slots.dirty = false;
+}
+
+void StateCache::flushSamplers(ShaderStage stage)
+{
+    auto &slots = samplers[static_cast<unsigned>(stage)];
+    if (!slots.dirty)
+        return;
+
+    counts.issued += flushSlots(slots.bound, slots.pending,
+        [&] (UINT first, UINT count, ID3D11SamplerState * const *smps)
+    {
+        target.setSamplers(stage, first, count, smps);
+    });
+    slots.dirty = false;
+}
+
+void StateCache::flush()
+{
+    for (unsigned s = 0; s < ShaderStages; ++s)
+    {
+        flushShaderResources(static_cast<ShaderStage>(s));
+        flushSamplers(static_cast<ShaderStage>(s));
+    }
+}
+
+// Binding a resource as an output forcibly unbinds its shader resource views.
+// Deferred binds involving such views are issued first to keep the original
+// order, and the shadowed state then follows what the runtime does.
+void StateCache::unbindOutputs(ID3D11View * const *views, unsigned count)
+{
+    std::array<ID3D11Resource *, D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT + 1> outputs;
+    unsigned outputCount = 0;
+
+    for (unsigned i = 0; i < count && outputCount < outputs.size(); ++i)
+    {
+        if (!views[i])
+            continue;
+
+        // The views keep their resources alive, so the reference can be released.
+        CComPtr<ID3D11Resource> resource;
+        views[i]->GetResource(&resource);
+        outputs[outputCount++] = resource;
+    }
+
+    if (outputCount == 0)
+        return;
+
+    auto isOutput = [&] (ID3D11ShaderResourceView *srv)
+    {
+        if (!srv)
+            return false;
+
+        CComPtr<ID3D11Resource> resource;
+        srv->GetResource(&resource);
+        return std::find(outputs.begin(), outputs.begin() + outputCount,
+                         static_cast<ID3D11Resource *>(resource)) != outputs.begin() + outputCount;
+    };
+
+    for (unsigned s = 0; s < ShaderStages; ++s)
+    {
+        auto &slots = shaderResources[s];
+
+        bool conflict = false;
+        for (unsigned i = 0; i < ShaderResourceSlots && !conflict; ++i)
+        {
+            if (slots.bound[i] != slots.pending[i] &&
+                (isOutput(slots.bound[i]) || isOutput(slots.pending[i])))
+            {
+                conflict = true;
+            }
+        }
+
+        if (conflict)
+            flushShaderResources(static_cast<ShaderStage>(s));
+
+        for (unsigned i = 0; i < ShaderResourceSlots; ++i)
+        {
+            if (slots.bound[i] == slots.pending[i] && isOutput(slots.bound[i]))
+            {
+                slots.bound[i]   = nullptr;
+                slots.pending[i] = nullptr;
+            }
+        }
+    }
+}
+
+CComPtr<ID3D11Texture2D> StateCache::createTexture2D(const D3D11_TEXTURE2D_DESC &desc,
+                                                     const D3D11_SUBRESOURCE_DATA *initialData)
+{
+    return target.createTexture2D(desc, initialData);
+}
+
+CComPtr<ID3D11Buffer> StateCache::createBuffer(const D3D11_BUFFER_DESC &desc,
+                                               const D3D11_SUBRESOURCE_DATA *initialData)
+{
+    return target.createBuffer(desc, initialData);
+}
+
+void StateCache::writeBuffer(ID3D11Buffer *buffer, D3D11_MAP map, UINT offset,
+                             const void *data, size_t bytes)
+{
+    target.writeBuffer(buffer, map, offset, data, bytes);
+}
+
+void StateCache::bindPipeline(const PipelineState &state)
+{
+    ++counts.binds;
+    if (hasPipeline && samePipeline(pipeline, state))
+        return;
+
+    hasPipeline = true;
+    pipeline    = state;
+    ++counts.issued;
+    target.bindPipeline(state);
+}
+
+void StateCache::setDepthStencilState(ID3D11DepthStencilState *state, UINT stencilRef)
+{
+    ++counts.binds;
+    if (hasPipeline && pipeline.depthStencilState == state && pipeline.stencilRef == stencilRef)
+        return;
+
+    pipeline.depthStencilState = state;
+    pipeline.stencilRef        = stencilRef;
+    ++counts.issued;
+    target.setDepthStencilState(state, stencilRef);
+}
+
+void StateCache::setConstantBuffer(ShaderStage stage, UINT slot, ID3D11Buffer *buffer,
+                                   UINT firstConstant, UINT numConstants)
+{
+    ++counts.binds;
+    if (slot >= ConstantBufferSlots)
+    {
+        ++counts.issued;
+        target.setConstantBuffer(stage, slot, buffer, firstConstant, numConstants);
+        return;
+    }
+
+    auto &cb = constantBuffers[static_cast<unsigned>(stage)][slot];
+    if (cb.buffer == buffer && cb.firstConstant == firstConstant && cb.numConstants == numConstants)
+        return;
+
+    cb.buffer        = buffer;
+    cb.firstConstant = firstConstant;
+    cb.numConstants  = numConstants;
+    ++counts.issued;
+    target.setConstantBuffer(stage, slot, buffer, firstConstant, numConstants);
+}
+
+void StateCache::setShaderResources(ShaderStage stage, UINT slot, UINT count,
+                                    ID3D11ShaderResourceView * const *srvs)
+{
+    ++counts.binds;
+    if (slot + count > ShaderResourceSlots)
+    {
+        flushShaderResources(stage);
+        ++counts.issued;
+        target.setShaderResources(stage, slot, count, srvs);
+        // Forget the slots that were bound past the cache.
+        auto &slots = shaderResources[static_cast<unsigned>(stage)];
+        for (UINT i = slot; i < std::min(slot + count, ShaderResourceSlots); ++i)
+            slots.bound[i] = slots.pending[i] = srvs[i - slot];
+        return;
+    }
+
+    auto &slots = shaderResources[static_cast<unsigned>(stage)];
+    if (std::equal(srvs, srvs + count, slots.pending.begin() + slot))
+        return;
+
+    std::copy(srvs, srvs + count, slots.pending.begin() + slot);
+    slots.dirty = true;
+}
+
+void StateCache::setSamplers(ShaderStage stage, UINT slot, UINT count,
+                             ID3D11SamplerState * const *smps)
+{
+    ++counts.binds;
+    if (slot + count > SamplerSlots)
+    {
+        ++counts.issued;
+        target.setSamplers(stage, slot, count, smps);
+        return;
+    }
+
+    auto &slots = samplers[static_cast<unsigned>(stage)];
+    if (std::equal(smps, smps + count, slots.pending.begin() + slot))
+        return;
+
+    std::copy(smps, smps + count, slots.pending.begin() + slot);
+    slots.dirty = true;
+}
+
+void StateCache::setRenderTargets(UINT count, ID3D11RenderTargetView * const *rtvs,
+                                  ID3D11DepthStencilView *dsv)
+{
+    ++counts.binds;
+    count = std::min(count, static_cast<UINT>(renderTargets.size()));
+
+    if (hasRenderTargets && !unorderedAccessViews &&
+        count == renderTargetCount &&
+        dsv == depthStencil &&
+        std::equal(rtvs, rtvs + count, renderTargets.begin()))
+    {
+        return;
+    }
+
+    std::array<ID3D11View *, D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT + 1> views;
+    std::copy(rtvs, rtvs + count, views.begin());
+    views[count] = dsv;
+    unbindOutputs(views.data(), count + 1);
+
+    hasRenderTargets = true;
+    renderTargets.fill(nullptr);
+    std::copy(rtvs, rtvs + count, renderTargets.begin());
+    renderTargetCount    = count;
+    depthStencil         = dsv;
+    unorderedAccessViews = false;
+
+    ++counts.issued;
+    target.setRenderTargets(count, rtvs, dsv);
+}
+
+void StateCache::setViewport(const D3D11_VIEWPORT &vp)
+{
+    ++counts.binds;
+    if (hasViewport && memcmp(&viewport, &vp, sizeof(vp)) == 0)
+        return;
+
+    hasViewport = true;
+    viewport    = vp;
+    ++counts.issued;
+    target.setViewport(vp);
+}
+
+void StateCache::setUnorderedAccessView(UINT slot, ID3D11UnorderedAccessView *uav)
+{
+    ++counts.binds;
+
+    ID3D11View *views[] = { uav };
+    unbindOutputs(views, 1);
+
+    unorderedAccessViews = true;
+    ++counts.issued;
+    target.setUnorderedAccessView(slot, uav);
+}
+
+void StateCache::clearRenderTarget(ID3D11RenderTargetView *rtv, const float color[4])
+{
+    target.clearRenderTarget(rtv, color);
+}
+
+void StateCache::clearDepthStencil(ID3D11DepthStencilView *dsv, UINT flags, float depth, UINT8 stencil)
+{
+    target.clearDepthStencil(dsv, flags, depth, stencil);
+}
+
+void StateCache::draw(UINT vertexCount, UINT startVertex)
+{
+    flush();
+    target.draw(vertexCount, startVertex);
+}
+
+void StateCache::drawIndexed(UINT indexCount, UINT instances)
+{
+    flush();
+    target.drawIndexed(indexCount, instances);
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "Backend.hpp"
+
+#include <array>
+
+// Shadows the bound state in front of another backend, and drops binds that
+// would not change it. Shader resource and sampler binds are deferred until
+// the next draw, so that unbinding and rebinding the same views in between
+// draws costs nothing, and the changed slots are issued as contiguous ranges
+// with one call each. Everything else is passed through in order.
+class StateCache : public Backend
+{
+public:
+    // Slots shadowed per stage, binds to the slots above are passed through.
+    static const unsigned ShaderResourceSlots = 16;
+    static const unsigned SamplerSlots        = D3D11_COMMONSHADER_SAMPLER_SLOT_COUNT;
+    static const unsigned ConstantBufferSlots = D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT;
+
+    struct Stats
+    {
+        uint64_t binds;     // bind calls made to the cache
+        uint64_t issued;    // bind calls made to the target
+
+        // Bind calls saved, either because they did not change anything,
+        // were undone before the next draw or were batched with others.
+        uint64_t filtered() const { return binds - issued; }
+        Stats operator+(const Stats &s) const;
+        Stats operator-(const Stats &s) const;
+    };
+
+    StateCache(Backend &target);
+
+    const Stats &stats() const { return counts; }
+
+    // Issue all deferred binds.
+    void flush();
+    // Forget the shadowed state, e.g. after the context state has been
+    // changed without going through the cache.
+    void invalidate();
+
+    CComPtr<ID3D11Texture2D> createTexture2D(const D3D11_TEXTURE2D_DESC &desc,
+                                             const D3D11_SUBRESOURCE_DATA *initialData) override;
+    CComPtr<ID3D11Buffer> createBuffer(const D3D11_BUFFER_DESC &desc,
+                                       const D3D11_SUBRESOURCE_DATA *initialData) override;
+    void writeBuffer(ID3D11Buffer *buffer, D3D11_MAP map, UINT offset,
+                     const void *data, size_t bytes) override;
+
+    void bindPipeline(const PipelineState &state) override;
+    void setDepthStencilState(ID3D11DepthStencilState *state, UINT stencilRef) override;
+    void setConstantBuffer(ShaderStage stage, UINT slot, ID3D11Buffer *buffer,
+                           UINT firstConstant, UINT numConstants) override;
+    void setShaderResources(ShaderStage stage, UINT slot, UINT count,
+                            ID3D11ShaderResourceView * const *srvs) override;
+    void setSamplers(ShaderStage stage, UINT slot, UINT count,
+                     ID3D11SamplerState * const *samplers) override;
+    void setRenderTargets(UINT count, ID3D11RenderTargetView * const *rtvs,
+                          ID3D11DepthStencilView *dsv) override;
+    void setViewport(const D3D11_VIEWPORT &viewport) override;
+    void setUnorderedAccessView(UINT slot, ID3D11UnorderedAccessView *uav) override;
+
+    void clearRenderTarget(ID3D11RenderTargetView *rtv, const float color[4]) override;
+    void clearDepthStencil(ID3D11DepthStencilView *dsv, UINT flags, float depth, UINT8 stencil) override;
+    void draw(UINT vertexCount, UINT startVertex) override;
+    void drawIndexed(UINT indexCount, UINT instances) override;
+
+private:
+    template <typename T, unsigned N>
+    struct Slots
+    {
+        std::array<T *, N> bound;
+        std::array<T *, N> pending;
+        bool dirty;
+    };
+
+    struct ConstantBuffer
+    {
+        ID3D11Buffer *buffer;
+        UINT firstConstant;
+        UINT numConstants;
+    };
+
+    Backend &target;
+    Stats counts;
+
+    bool hasPipeline;
+    PipelineState pipeline;
+
+    bool hasRenderTargets;
+    std::array<ID3D11RenderTargetView *, D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT> renderTargets;
+    UINT renderTargetCount;
+    ID3D11DepthStencilView *depthStencil;
+    // Binding render targets also unbinds any UAVs, so it is never dropped
+    // while there are some.
+    bool unorderedAccessViews;
+
+    bool hasViewport;
+    D3D11_VIEWPORT viewport;
+
+    std::array<std::array<ConstantBuffer, ConstantBufferSlots>, ShaderStages> constantBuffers;
+    std::array<Slots<ID3D11ShaderResourceView, ShaderResourceSlots>, ShaderStages> shaderResources;
+    std::array<Slots<ID3D11SamplerState, SamplerSlots>, ShaderStages> samplers;
+
+    void flushShaderResources(ShaderStage stage);
+    void flushSamplers(ShaderStage stage);
+    void unbindOutputs(ID3D11View * const *views, unsigned count);
+};
+
+// The default backend, which filters the binds going to D3D11Backend.
+StateCache &stateCache();
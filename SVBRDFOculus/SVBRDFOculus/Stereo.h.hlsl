@@ -0,0 +1,18 @@
+#ifndef SVBRDF_STEREO_H_HLSL
+#define SVBRDF_STEREO_H_HLSL
+
+// Single pass stereo renders both eyes side by side into a double width
+// target with one instanced draw. Instance 0 is the left eye, and
+// instance 1 is the right eye.
+
+// Squeeze the clip space position of an eye into its half of the target.
+// The clip distance cuts off anything that would spill over to the other half.
+float4 stereoEyePosition(float4 projPos, uint eye, out float clipDistance)
+{
+    float side   = eye ? 1 : -1;
+    projPos.x    = 0.5 * projPos.x + 0.5 * side * projPos.w;
+    clipDistance = side * projPos.x;
+    return projPos;
+}
+
+#endif
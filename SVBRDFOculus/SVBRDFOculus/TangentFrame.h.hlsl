@@ -0,0 +1,27 @@
+#ifndef SVBRDF_TANGENT_FRAME_H_HLSL
+#define SVBRDF_TANGENT_FRAME_H_HLSL
+
+// The vertices store their tangent frames as quaternions, which rotate the
+// tangent space to the object space, and whose sign of w is the sign of the
+// bitangent. See TangentFrames.hpp, which generates them.
+
+// The tangent of the frame in xyz and the sign of the bitangent in w, same
+// as TangentFrames::decode().
+float4 frameTangent(float4 q)
+{
+    q = normalize(q);
+    float3 T = float3(1 - 2 * (q.y * q.y + q.z * q.z),
+                          2 * (q.x * q.y + q.w * q.z),
+                          2 * (q.x * q.z - q.w * q.y));
+    return float4(T, q.w < 0 ? -1 : 1);
+}
+
+// The tangent of a CPU displaced mesh, whose unit heights are scaled by
+// heightScale in the vertex shader. Tangents scale like the positions.
+float4 scaledFrameTangent(float4 q, float heightScale)
+{
+    float4 t = frameTangent(q);
+    return float4(normalize(float3(t.xy, t.z * heightScale)), t.w);
+}
+
+#endif
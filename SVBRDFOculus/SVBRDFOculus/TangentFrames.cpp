@@ -0,0 +1,329 @@
+#include "TangentFrames.hpp"
+#include "Parallel.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace
+{
+    struct Vector
+    {
+        float x;
+        float y;
+        float z;
+    };
+
+    Vector load(const float *p)                   { return { p[0], p[1], p[2] }; }
+    Vector operator+(Vector a, Vector b)          { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+    Vector operator-(Vector a, Vector b)          { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+    Vector operator*(Vector a, float s)           { return { a.x * s, a.y * s, a.z * s }; }
+    float dot(Vector a, Vector b)                 { return a.x * b.x + a.y * b.y + a.z * b.z; }
+    float length(Vector a)                        { return std::sqrt(dot(a, a)); }
+
+    Vector cross(Vector a, Vector b)
+    {
+        return {
+            a.y * b.z - a.z * b.y,
+            a.z * b.x - a.x * b.z,
+            a.x * b.y - a.y * b.x,
+        };
+    }
+
+    // Vectors shorter than this have no meaningful direction.
+    const float MinLength = 1e-20f;
+
+    // The part of v orthogonal to the unit vector n, normalized, or zero if
+    // there is none.
+    Vector orthonormalize(Vector v, Vector n)
+    {
+        Vector t = v - n * dot(n, v);
+        float l  = length(t);
+        return l > MinLength ? t * (1.f / l) : Vector { 0, 0, 0 };
+    }
+
+    // Some unit vector orthogonal to the unit vector n.
+    Vector anyOrthogonal(Vector n)
+    {
+        float ax = std::abs(n.x);
+        float ay = std::abs(n.y);
+        float az = std::abs(n.z);
+
+        Vector axis = (ax <= ay && ax <= az) ? Vector { 1, 0, 0 }
+                    : (ay <= az)             ? Vector { 0, 1, 0 }
+                    :                          Vector { 0, 0, 1 };
+        return orthonormalize(axis, n);
+    }
+
+    struct Triangle
+    {
+        // Directions of increasing U and V, zero for degenerate triangles.
+        Vector tangent;
+        Vector bitangent;
+    };
+
+    struct VertexTangents
+    {
+        // Sums for the corners with positive and negative bitangent signs.
+        Vector sums[2];
+        float weights[2];
+    };
+
+    int16_t quantize(float f)
+    {
+        f = std::max(-1.f, std::min(1.f, f));
+        return static_cast<int16_t>(std::lround(f * 32767.f));
+    }
+
+    float dequantize(int16_t i)
+    {
+        return std::max(-1.f, static_cast<float>(i) / 32767.f);
+    }
+}
+
+TangentFrames::TangentFrames(const Mesh &mesh)
+{
+    assert(mesh.stride >= 3 && mesh.indexCount % 3 == 0);
+
+    const size_t vertexCount   = mesh.vertexCount;
+    const size_t triangleCount = mesh.indexCount / 3;
+    const uint32_t *indices    = mesh.indices;
+
+    auto position = [&](uint32_t v) { return load(mesh.positions + v * mesh.stride); };
+    auto normal   = [&](uint32_t v) { return load(mesh.normals   + v * mesh.stride); };
+    auto uv       = [&](uint32_t v) { return mesh.uvs + v * mesh.stride; };
+
+    std::vector<Triangle> triangles(triangleCount);
+    parallelFor(0, triangleCount, [&](size_t t)
+    {
+        const uint32_t *tri = indices + t * 3;
+
+        Vector e1 = position(tri[1]) - position(tri[0]);
+        Vector e2 = position(tri[2]) - position(tri[0]);
+
+        const float *uv0 = uv(tri[0]);
+        const float *uv1 = uv(tri[1]);
+        const float *uv2 = uv(tri[2]);
+        float du1 = uv1[0] - uv0[0];
+        float dv1 = uv1[1] - uv0[1];
+        float du2 = uv2[0] - uv0[0];
+        float dv2 = uv2[1] - uv0[1];
+
+        // Solve e = du * tangent + dv * bitangent for both edges. Only the
+        // directions matter, so the determinant only contributes its sign.
+        float det = du1 * dv2 - du2 * dv1;
+        Triangle &triangle = triangles[t];
+
+        // Triangles that are degenerate in either space only add noise,
+        // including the ones whose area has rounded to almost nothing.
+        Vector area = cross(e1, e2);
+        if (det == 0 || dot(area, area) <= 1e-12f * dot(e1, e1) * dot(e2, e2))
+        {
+            triangle.tangent   = { 0, 0, 0 };
+            triangle.bitangent = { 0, 0, 0 };
+            return;
+        }
+
+        float s = det > 0 ? 1.f : -1.f;
+        triangle.tangent   = (e1 * dv2 - e2 * dv1) * s;
+        triangle.bitangent = (e2 * du1 - e1 * du2) * s;
+    }, 4096);
+
+    // The corners of each vertex, as offsets into the index array.
+    std::vector<uint32_t> cornerStart(vertexCount + 1, 0);
+    for (size_t c = 0; c < mesh.indexCount; ++c)
+    {
+        assert(indices[c] < vertexCount);
+        ++cornerStart[indices[c] + 1];
+    }
+    for (size_t v = 0; v < vertexCount; ++v)
+        cornerStart[v + 1] += cornerStart[v];
+
+    std::vector<uint32_t> corners(mesh.indexCount);
+    {
+        std::vector<uint32_t> next(cornerStart.begin(), cornerStart.end() - 1);
+        for (size_t c = 0; c < mesh.indexCount; ++c)
+            corners[next[indices[c]]++] = static_cast<uint32_t>(c);
+    }
+
+    // Accumulate the tangents of the corners of each vertex separately for
+    // both signs, and remember the sign of each corner. Corners without a
+    // tangent have no sign and stay with their vertex.
+    const uint8_t NoSign = 2;
+    std::vector<VertexTangents> sums(vertexCount);
+    std::vector<uint8_t> cornerNegative(mesh.indexCount, NoSign);
+    parallelFor(0, vertexCount, [&](size_t vIndex)
+    {
+        uint32_t v = static_cast<uint32_t>(vIndex);
+        Vector n   = normal(v);
+        Vector p   = position(v);
+
+        VertexTangents &s = sums[v];
+        s.sums[0]    = s.sums[1]    = { 0, 0, 0 };
+        s.weights[0] = s.weights[1] = 0;
+
+        for (uint32_t k = cornerStart[v]; k < cornerStart[v + 1]; ++k)
+        {
+            uint32_t c = corners[k];
+            const uint32_t *tri = indices + c / 3 * 3;
+            const Triangle &triangle = triangles[c / 3];
+
+            Vector t = orthonormalize(triangle.tangent, n);
+            if (dot(t, t) == 0)
+                continue;
+
+            unsigned negative = dot(cross(n, t), triangle.bitangent) < 0 ? 1 : 0;
+            cornerNegative[c] = static_cast<uint8_t>(negative);
+
+            // Weight by the angle of the corner, so that the result does not
+            // depend on how the surrounding polygons are triangulated.
+            Vector a = position(tri[(c + 1) % 3]) - p;
+            Vector b = position(tri[(c + 2) % 3]) - p;
+            float la = length(a);
+            float lb = length(b);
+            if (la <= MinLength || lb <= MinLength)
+                continue;
+            float cosine = std::max(-1.f, std::min(1.f, dot(a, b) / (la * lb)));
+            float angle  = std::acos(cosine);
+
+            s.sums[negative]     = s.sums[negative] + t * angle;
+            s.weights[negative] += angle;
+        }
+    }, 4096);
+
+    // The sign with the most weight keeps the vertex and the other one gets
+    // a copy of it.
+    std::vector<uint32_t> splitIndex(vertexCount, 0);
+    for (size_t v = 0; v < vertexCount; ++v)
+    {
+        if (sums[v].weights[0] > 0 && sums[v].weights[1] > 0)
+        {
+            splitIndex[v] = static_cast<uint32_t>(vertexCount + splits.size());
+            splits.push_back(static_cast<uint32_t>(v));
+        }
+    }
+
+    auto primaryNegative = [&](size_t v) -> unsigned
+    {
+        return sums[v].weights[1] > sums[v].weights[0] ? 1 : 0;
+    };
+
+    splitIndices.resize(mesh.indexCount);
+    parallelFor(0, mesh.indexCount, [&](size_t c)
+    {
+        uint32_t v = indices[c];
+        bool moved = splitIndex[v] && cornerNegative[c] != NoSign && cornerNegative[c] != primaryNegative(v);
+        splitIndices[c] = moved ? splitIndex[v] : v;
+    }, 16384);
+
+    vertexFrames.resize(vertexCount + splits.size());
+    parallelFor(0, vertexFrames.size(), [&](size_t i)
+    {
+        bool split = i >= vertexCount;
+        uint32_t v = split ? splits[i - vertexCount] : static_cast<uint32_t>(i);
+        unsigned negative = primaryNegative(v) ^ (split ? 1 : 0);
+
+        Vector n = normal(v);
+        Vector t = orthonormalize(sums[v].sums[negative], n);
+        if (dot(t, t) == 0)
+            t = anyOrthogonal(n);
+
+        vertexFrames[i] = encode(&t.x, &n.x, negative ? -1.f : 1.f);
+    }, 4096);
+}
+
+TangentFrames::Quaternion TangentFrames::encode(const float tangent[3], const float normal[3], float sign)
+{
+    Vector n = load(normal);
+    Vector t = orthonormalize(load(tangent), n);
+    if (dot(t, t) == 0)
+        t = anyOrthogonal(n);
+    Vector b = cross(n, t);
+
+    // The columns of the rotation matrix are t, b and n.
+    float m00 = t.x, m01 = b.x, m02 = n.x;
+    float m10 = t.y, m11 = b.y, m12 = n.y;
+    float m20 = t.z, m21 = b.z, m22 = n.z;
+
+    float q[4];
+    float trace = m00 + m11 + m22;
+    if (trace > 0)
+    {
+        float s = .5f / std::sqrt(trace + 1);
+        q[0] = (m21 - m12) * s;
+        q[1] = (m02 - m20) * s;
+        q[2] = (m10 - m01) * s;
+        q[3] = .25f / s;
+    }
+    else if (m00 > m11 && m00 > m22)
+    {
+        float s = 2 * std::sqrt(1 + m00 - m11 - m22);
+        q[0] = .25f * s;
+        q[1] = (m01 + m10) / s;
+        q[2] = (m02 + m20) / s;
+        q[3] = (m21 - m12) / s;
+    }
+    else if (m11 > m22)
+    {
+        float s = 2 * std::sqrt(1 + m11 - m00 - m22);
+        q[0] = (m01 + m10) / s;
+        q[1] = .25f * s;
+        q[2] = (m12 + m21) / s;
+        q[3] = (m02 - m20) / s;
+    }
+    else
+    {
+        float s = 2 * std::sqrt(1 + m22 - m00 - m11);
+        q[0] = (m02 + m20) / s;
+        q[1] = (m12 + m21) / s;
+        q[2] = .25f * s;
+        q[3] = (m10 - m01) / s;
+    }
+
+    // q and -q are the same rotation, so w can be made positive and its sign
+    // used for the bitangent instead. It is kept away from zero, where its
+    // sign would not survive the quantization.
+    float length = std::sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+    float flip   = q[3] < 0 ? -1.f : 1.f;
+    for (auto &c : q)
+        c *= flip / length;
+
+    const float MinW = 1.f / 32767.f;
+    if (q[3] < MinW)
+    {
+        float xyz   = std::sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2]);
+        float scale = std::sqrt(1 - MinW * MinW) / xyz;
+        q[0] *= scale;
+        q[1] *= scale;
+        q[2] *= scale;
+        q[3]  = MinW;
+    }
+
+    float s = sign < 0 ? -1.f : 1.f;
+    return { quantize(q[0] * s), quantize(q[1] * s), quantize(q[2] * s), quantize(q[3] * s) };
+}
+
+void TangentFrames::decode(const Quaternion &quaternion, float tangent[3], float normal[3], float &sign)
+{
+    float x = dequantize(quaternion.x);
+    float y = dequantize(quaternion.y);
+    float z = dequantize(quaternion.z);
+    float w = dequantize(quaternion.w);
+
+    float invLength = 1.f / std::sqrt(x * x + y * y + z * z + w * w);
+    x *= invLength;
+    y *= invLength;
+    z *= invLength;
+    w *= invLength;
+
+    // The rotated X and Z axes, which do not change when q is negated.
+    tangent[0] = 1 - 2 * (y * y + z * z);
+    tangent[1] =     2 * (x * y + w * z);
+    tangent[2] =     2 * (x * z - w * y);
+
+    normal[0]  =     2 * (x * z + w * y);
+    normal[1]  =     2 * (y * z - w * x);
+    normal[2]  = 1 - 2 * (x * x + y * y);
+
+    sign = w < 0 ? -1.f : 1.f;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Per-vertex tangent frames of a triangle mesh, generated in the manner of
+// MikkTSpace: the tangent of each triangle is the direction of increasing U,
+// it is projected to the tangent plane of each of its vertices and averaged
+// weighted by the angle of the corner, and the bitangent, the direction of
+// increasing V, is only stored as a sign relative to cross(normal, tangent).
+// Vertices shared by triangles of opposite signs, as on the seams of
+// mirrored texture coordinates, are split in two.
+//
+// The frames are encoded as quaternions, the rotation from the tangent space
+// (tangent, cross(normal, tangent), normal) to the object space, whose sign
+// of w is the sign of the bitangent.
+class TangentFrames
+{
+public:
+    // Same layout as DXGI_FORMAT_R16G16B16A16_SNORM.
+    struct Quaternion
+    {
+        int16_t x;
+        int16_t y;
+        int16_t z;
+        int16_t w;
+    };
+
+    struct Mesh
+    {
+        // Consecutive vertices are stride floats apart in each array, so
+        // that they can point into an interleaved vertex buffer.
+        const float *positions;
+        const float *normals;
+        const float *uvs;
+        size_t stride;
+        size_t vertexCount;
+        // Counter-clockwise triangles.
+        const uint32_t *indices;
+        size_t indexCount;
+    };
+
+    // Generate the frames, in parallel over triangles and vertices. The
+    // normals must be of unit length.
+    explicit TangentFrames(const Mesh &mesh);
+
+    // One frame for each input vertex, followed by one for each split one.
+    const std::vector<Quaternion> &frames() const { return vertexFrames; }
+    // The input vertex that each split vertex is a copy of, in order.
+    const std::vector<uint32_t> &splitVertices() const { return splits; }
+    // The indices of the mesh, with the corners of the split vertices
+    // pointing to their copies.
+    const std::vector<uint32_t> &indices() const { return splitIndices; }
+
+    // Encode a frame from a unit normal and a tangent orthogonal to it, and
+    // the sign of the bitangent.
+    static Quaternion encode(const float tangent[3], const float normal[3], float sign);
+    // The inverse of encode(), as in decodeTangentFrame() of Lighting.h.hlsl.
+    static void decode(const Quaternion &q, float tangent[3], float normal[3], float &sign);
+
+private:
+    std::vector<Quaternion> vertexFrames;
+    std::vector<uint32_t> splits;
+    std::vector<uint32_t> splitIndices;
+};
@@ -6,6 +6,9 @@ SamplerState heightSampler : register(s2);
 cbuffer TextureSpacePSConstants : register(b2)
 {
     float displacementMagnitude;
+    // LightingDiffuse and LightingSpecular bits of the terms to relight,
+    // the outputs of the other terms are ignored.
+    uint  lightingTerms;
 };
 
 struct PSInput
@@ -13,9 +16,18 @@ struct PSInput
     float4 worldPos : POSITION0;
     float4 uv       : TEXCOORD0;
     float4 normal   : NORMAL0;
+    float4 tangent  : TANGENT0;
 };
 
-float4 main(PSInput i) : SV_Target
+struct PSOutput
+{
+    float4 diffuse  : SV_Target0;
+    float4 specular : SV_Target1;
+    // Shadow terms of the first StoredShadowLights lights
+    float4 shadows  : SV_Target2;
+};
+
+PSOutput main(PSInput i)
 {
     // Because we know what the displacement should be at the pixel, we can easily
     // take it into account when lighting.
@@ -26,7 +38,14 @@ float4 main(PSInput i) : SV_Target
     float displacement = height * displacementMagnitude;
     i.worldPos.xyz += N * displacement;
 
-    float3 radianceHDR = lighting(i.worldPos.xyz, N, i.uv.xy);
-    // Linear HDR color into the lighting texture
-    return float4(radianceHDR, 1);
+    float4 shadowTerms = 1;
+    Radiance radianceHDR = lightingSplit(i.worldPos.xyz, N, i.tangent, i.uv.xy,
+                                         lightingTerms, false, shadowTerms);
+
+    // Linear HDR colors into the lighting textures
+    PSOutput o;
+    o.diffuse  = float4(radianceHDR.diffuse, 1);
+    o.specular = float4(radianceHDR.specular, 1);
+    o.shadows  = shadowTerms;
+    return o;
 }
@@ -1,9 +1,12 @@
+#include "TangentFrame.h.hlsl"
+
 struct Vertex
 {
     float3 pos    : POSITION0;
     float3 normal : NORMAL0;
     float2 uv     : TEXCOORD0;
     float  tess   : COLOR0;
+    float4 frame  : TANGENT0;
 };
 
 struct VSOutput
@@ -11,14 +14,26 @@ struct VSOutput
     float4 worldPos : POSITION0;
     float4 uvTess   : TEXCOORD0;
     float4 normal   : NORMAL0;
+    float4 tangent  : TANGENT0;
     float4 svPos    : SV_Position;
 };
 
+// Same as in RegularMesh.vs.hlsl
+cbuffer VSConstants : register(b0)
+{
+    float4x4 viewProj;
+    float scale;
+    float displacementMagnitude;
+    uint  stereo;
+    float heightScale;
+    float4x4 rightViewProj;
+};
+
 VSOutput main(Vertex v)
 {
     VSOutput o;
     // FIXME: Do not assume input vertices are in world space
-    o.worldPos = float4(v.pos, 1);
+    o.worldPos = float4(v.pos.xy, v.pos.z * heightScale, 1);
     o.uvTess   = float4(v.uv, v.tess, 0);
 
     o.svPos    = float4(
@@ -26,7 +41,8 @@ VSOutput main(Vertex v)
         lerp(-1, 1, 1 - v.uv.y),
         0,
         1);
-    o.normal   = float4(v.normal, 0);
+    o.normal   = float4(normalize(float3(v.normal.xy * heightScale, v.normal.z)), 0);
+    o.tangent  = scaledFrameTangent(v.frame, heightScale);
 
 	return o;
 }
@@ -0,0 +1,38 @@
+// Normalized texture coordinate rectangles (minU, minV, maxU, maxV)
+StructuredBuffer<float4> tileRects : register(t0);
+
+cbuffer TileConstants : register(b0)
+{
+    // Size of the render target mip level in texels
+    float2 targetSize;
+};
+
+static const float2 corners[6] =
+{
+    float2(0, 0),
+    float2(1, 0),
+    float2(0, 1),
+    float2(0, 1),
+    float2(1, 0),
+    float2(1, 1),
+};
+
+// Six vertices per tile, rendered with backface culling off
+float4 main(uint id : SV_VertexID) : SV_Position
+{
+    float4 rect = tileRects[id / 6];
+
+    // Grow the rectangle to whole texels, so a tile smaller than a texel
+    // of a small mip level still covers the texel it belongs to.
+    float2 minUV = floor(rect.xy * targetSize) / targetSize;
+    float2 maxUV = ceil (rect.zw * targetSize) / targetSize;
+
+    float2 uv = lerp(minUV, maxUV, corners[id % 6]);
+
+    // Same mapping as in TextureSpaceMesh.vs
+    return float4(
+        lerp(-1, 1,     uv.x),
+        lerp(-1, 1, 1 - uv.y),
+        0,
+        1);
+}
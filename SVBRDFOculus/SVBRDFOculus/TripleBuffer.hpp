@@ -0,0 +1,66 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Hands values from one producer thread to one consumer thread without either
+// of them ever waiting for the other. The producer fills its back slot and
+// publishes it by swapping it with the middle slot, and the consumer swaps its
+// front slot with the middle slot when something new has been published. The
+// consumer always gets the latest published value, and older ones that it did
+// not get to in time are skipped.
+template <typename T>
+class TripleBuffer
+{
+    // The middle slot index, and whether it has been published since the
+    // consumer last took it.
+    static const uint32_t SlotMask = 3;
+    static const uint32_t Fresh    = 4;
+
+    std::array<T, 3> slots;
+    std::atomic<uint32_t> middle;
+    uint32_t back;
+    uint32_t front;
+
+public:
+    TripleBuffer()
+        : middle(1)
+        , back(0)
+        , front(2)
+    {}
+
+    TripleBuffer(const TripleBuffer &) = delete;
+    TripleBuffer &operator=(const TripleBuffer &) = delete;
+
+    // Producer: the slot to fill in before publish(). It holds an older value,
+    // so every part of it must be written.
+    T &write()
+    {
+        return slots[back];
+    }
+
+    // Producer: make the written slot the latest value.
+    void publish()
+    {
+        back = middle.exchange(back | Fresh, std::memory_order_acq_rel) & SlotMask;
+    }
+
+    // Consumer: take the latest value if one has been published since the
+    // last call, and return true if so.
+    bool update()
+    {
+        if (!(middle.load(std::memory_order_relaxed) & Fresh))
+            return false;
+
+        front = middle.exchange(front, std::memory_order_acq_rel) & SlotMask;
+        return true;
+    }
+
+    // Consumer: the value taken by the last successful update(). It stays
+    // untouched by the producer until the next update().
+    const T &read() const
+    {
+        return slots[front];
+    }
+};
@@ -1,4 +1,4 @@
-#include "Utils.hpp"
+﻿#include "Utils.hpp"
 
 #include <cstring>
 #include <vector>
@@ -169,17 +169,27 @@ static bool &keyStatus(int virtualKeyCode)
 }
 
 static HWND keyboardHwnd = nullptr;
+static std::function<bool(int)> keyboardOverride;
 
 void keyboardWindow(HWND hwnd)
 {
     keyboardHwnd = hwnd;
 }
 
+void keyboardSource(std::function<bool(int)> keyHeld)
+{
+    keyboardOverride = std::move(keyHeld);
+}
+
 bool keyHeld(int virtualKeyCode)
 {
     bool held;
 
-    if (keyboardHwnd && GetFocus() != keyboardHwnd)
+    // GetFocus() only knows about the windows of the calling thread, so the
+    // foreground window is checked instead to also work on other threads.
+    if (keyboardOverride)
+        held = keyboardOverride(virtualKeyCode);
+    else if (keyboardHwnd && GetForegroundWindow() != keyboardHwnd)
         held = false;
     else
         held = (GetAsyncKeyState(virtualKeyCode) & 0x80000000) != 0;
@@ -365,6 +375,16 @@ std::string absolutePath(const std::string & path)
         return std::string(absPath);
 }
 
+uint64_t fileModificationTime(const std::string &path)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attributes))
+        return 0;
+
+    return (static_cast<uint64_t>(attributes.ftLastWriteTime.dwHighDateTime) << 32)
+         | attributes.ftLastWriteTime.dwLowDateTime;
+}
+
 Timer::Timer()
 {
     LARGE_INTEGER f;
@@ -1,4 +1,4 @@
-#pragma once
+﻿#pragma once
 
 #include <Windows.h>
 #include <comdef.h>
@@ -87,6 +87,9 @@ void vlog(const char *fmt, va_list ap);
 void log(const char *fmt, ...);
 
 void keyboardWindow(HWND hwnd);
+// Read the keyboard through keyHeld instead, e.g. to feed scripted input to a
+// benchmark. An empty function restores the real keyboard.
+void keyboardSource(std::function<bool(int virtualKeyCode)> keyHeld);
 bool keyHeld(int virtualKeyCode);
 bool keyPressed(int virtualKeyCode);
 
@@ -139,6 +142,8 @@ std::vector<std::string> splitPath(const std::string &path);
 std::string fileOpenDialog(const std::string &description, const std::string &pattern);
 std::string fileSaveDialog(const std::string &description, const std::string &pattern);
 std::string absolutePath(const std::string &path);
+// Last write time of the file in 100 ns units, or 0 if it does not exist.
+uint64_t fileModificationTime(const std::string &path);
 
 template <typename Iter>
 std::string join(Iter begin, Iter end, std::string separator)
@@ -0,0 +1,166 @@
+#include "Tests.hpp"
+#include "HeightDerivatives.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace
+{
+    typedef HeightDerivatives HD;
+
+    const double Pi = 3.14159265358979323846;
+
+    // Heights at the texel centers, every stride floats, with garbage in
+    // between that the derivatives must not read.
+    template <typename F>
+    std::vector<float> heightmap(unsigned width, unsigned height, unsigned stride, F h)
+    {
+        std::vector<float> heights(static_cast<size_t>(width) * height * stride, 1e6f);
+        for (unsigned y = 0; y < height; ++y)
+        {
+            for (unsigned x = 0; x < width; ++x)
+            {
+                double u = (x + .5) / width;
+                double v = (y + .5) / height;
+                heights[(static_cast<size_t>(y) * width + x) * stride] = static_cast<float>(h(u, v));
+            }
+        }
+        return heights;
+    }
+
+    // h(u, v) = A sin(2 pi u) sin(4 pi v) + B cos(6 pi u), which tiles and is
+    // not symmetric about the seams, where clamping would go unnoticed.
+    const double A = .01;
+    const double B = .005;
+
+    double sinusoid(double u, double v)
+    {
+        return A * std::sin(2 * Pi * u) * std::sin(4 * Pi * v) + B * std::cos(6 * Pi * u);
+    }
+
+    // The central difference of sin(k u) over texels size apart is
+    // sin(k / size) size cos(k u), i.e. the derivative with k replaced by
+    // that factor, so it can be compared exactly.
+    double centralFactor(double k, unsigned size)
+    {
+        return std::sin(k / size) * size;
+    }
+
+    // Error of the central difference of sin(k u), i.e. of k - centralFactor().
+    double centralError(double k, unsigned size)
+    {
+        return k * k * k / (6. * size * size);
+    }
+
+    HD::Derivative sinusoidDerivative(double u, double v, unsigned width, unsigned height, bool central)
+    {
+        double k1u = central ? centralFactor(2 * Pi, width)  : 2 * Pi;
+        double k2v = central ? centralFactor(4 * Pi, height) : 4 * Pi;
+        double k3u = central ? centralFactor(6 * Pi, width)  : 6 * Pi;
+
+        HD::Derivative d;
+        d.du = static_cast<float>(A * k1u * std::cos(2 * Pi * u) * std::sin(4 * Pi * v)
+                                - B * k3u * std::sin(6 * Pi * u));
+        d.dv = static_cast<float>(A * k2v * std::sin(2 * Pi * u) * std::cos(4 * Pi * v));
+        return d;
+    }
+}
+
+TEST(heightDerivativesPlane)
+{
+    static const unsigned W = 40;
+    static const unsigned H = 24;
+    static const double   a = .3;
+    static const double   b = -.7;
+
+    auto heights = heightmap(W, H, 1, [] (double u, double v) { return a * u + b * v; });
+    HD d(heights.data(), W, H, 1);
+    EXPECT(d.width() == W && d.height() == H);
+    EXPECT(d.derivatives().size() == W * H);
+
+    for (unsigned y = 0; y < H; ++y)
+    {
+        for (unsigned x = 0; x < W; ++x)
+        {
+            // The plane does not tile, so the differences across the seams
+            // see the jump of a whole period, a or b, over two texels.
+            double du = x == 0 || x == W - 1 ? a * (2 - static_cast<double>(W)) / 2 : a;
+            double dv = y == 0 || y == H - 1 ? b * (2 - static_cast<double>(H)) / 2 : b;
+
+            EXPECT_NEAR(d(x, y).du, du, 1e-4 * W);
+            EXPECT_NEAR(d(x, y).dv, dv, 1e-4 * H);
+        }
+    }
+}
+
+TEST(heightDerivativesSinusoid)
+{
+    unsigned sizes[][2] = { { 64, 64 }, { 48, 20 }, { 37, 13 } };
+    for (auto &size : sizes)
+    {
+        unsigned width  = size[0];
+        unsigned height = size[1];
+
+        // Every fourth float, like the red channel of an RGBA map.
+        auto heights = heightmap(width, height, 4, sinusoid);
+        HD d(heights.data(), width, height, 4);
+
+        double maxDiscrete = 0;
+        double maxAnalyticU = 0;
+        double maxAnalyticV = 0;
+        for (unsigned y = 0; y < height; ++y)
+        {
+            for (unsigned x = 0; x < width; ++x)
+            {
+                double u = (x + .5) / width;
+                double v = (y + .5) / height;
+
+                // Including the borders, which wrap around.
+                auto discrete = sinusoidDerivative(u, v, width, height, true);
+                maxDiscrete = std::max(maxDiscrete, static_cast<double>(std::abs(d(x, y).du - discrete.du)));
+                maxDiscrete = std::max(maxDiscrete, static_cast<double>(std::abs(d(x, y).dv - discrete.dv)));
+
+                auto analytic = sinusoidDerivative(u, v, width, height, false);
+                maxAnalyticU = std::max(maxAnalyticU, static_cast<double>(std::abs(d(x, y).du - analytic.du)));
+                maxAnalyticV = std::max(maxAnalyticV, static_cast<double>(std::abs(d(x, y).dv - analytic.dv)));
+            }
+        }
+
+        // Up to the rounding of the heights, whose differences are divided
+        // by the texel size.
+        double rounding = 1e-7 * std::max(width, height);
+        EXPECT(maxDiscrete < rounding);
+
+        // The central differences are second order accurate.
+        EXPECT(maxAnalyticU < A * centralError(2 * Pi, width) + B * centralError(6 * Pi, width) + rounding);
+        EXPECT(maxAnalyticV < A * centralError(4 * Pi, height) + rounding);
+    }
+}
+
+TEST(heightDerivativesDisplacedNormal)
+{
+    static const float Magnitude = 2;
+
+    HD::Derivative d = { .3f, -.4f };
+    float normal[3] = { 0, 0, 1 };
+
+    // A patch of size 2 x .5, over which U and V change at .5 and 2 per
+    // unit of distance. Its displaced points are (2 u, .5 v, m h), whose
+    // tangents (2, 0, m du) and (0, .5, m dv) give the normal
+    // (-.5 m du, -2 m dv, 1).
+    float gradU[3] = { .5f, 0, 0 };
+    float gradV[3] = { 0, 2, 0 };
+
+    float result[3];
+    HD::displacedNormal(normal, gradU, gradV, d, Magnitude, result);
+
+    float expected[3] = { -.5f * Magnitude * d.du, -2 * Magnitude * d.dv, 1 };
+    float length = std::sqrt(expected[0] * expected[0] + expected[1] * expected[1] + expected[2] * expected[2]);
+    for (unsigned k = 0; k < 3; ++k)
+        EXPECT_NEAR(result[k], expected[k] / length, 1e-6f);
+
+    // Without displacement, the normal stays.
+    HD::displacedNormal(normal, gradU, gradV, d, 0, result);
+    EXPECT(result[0] == 0 && result[1] == 0 && result[2] == 1);
+}
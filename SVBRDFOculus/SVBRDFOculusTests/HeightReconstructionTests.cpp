@@ -0,0 +1,131 @@
+#include "Tests.hpp"
+#include "HeightReconstruction.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace
+{
+    const double Pi = 3.14159265358979323846;
+
+    // h(u, v) = A sin(2 pi u) cos(4 pi v) + B cos(6 pi u), which tiles. The
+    // heights are in units of U, and V spans height / width of them.
+    const double A = .01;
+    const double B = .005;
+
+    double sinusoid(unsigned x, unsigned y, unsigned width, unsigned height)
+    {
+        double u = (x + .5) / width;
+        double v = (y + .5) / height;
+        return A * std::sin(2 * Pi * u) * std::cos(4 * Pi * v) + B * std::cos(6 * Pi * u);
+    }
+
+    std::vector<float> sinusoidNormals(unsigned width, unsigned height)
+    {
+        std::vector<float> normals(static_cast<size_t>(width) * height * 4);
+        for (unsigned y = 0; y < height; ++y)
+        {
+            for (unsigned x = 0; x < width; ++x)
+            {
+                double u  = (x + .5) / width;
+                double v  = (y + .5) / height;
+                double du = A * 2 * Pi * std::cos(2 * Pi * u) * std::cos(4 * Pi * v)
+                          - B * 6 * Pi * std::sin(6 * Pi * u);
+                double dv = -A * 4 * Pi * std::sin(2 * Pi * u) * std::sin(4 * Pi * v)
+                          * width / height;
+                double length = std::sqrt(du * du + dv * dv + 1);
+
+                float *n = &normals[(static_cast<size_t>(y) * width + x) * 4];
+                n[0] = static_cast<float>(-du / length);
+                n[1] = static_cast<float>(-dv / length);
+                n[2] = static_cast<float>(1 / length);
+                n[3] = 0;
+            }
+        }
+        return normals;
+    }
+
+    // Largest difference to the sinusoid with its mean removed, relative to
+    // its amplitude.
+    double sinusoidError(const HeightReconstruction &r)
+    {
+        unsigned width  = r.width();
+        unsigned height = r.height();
+
+        double mean = 0;
+        for (unsigned y = 0; y < height; ++y)
+            for (unsigned x = 0; x < width; ++x)
+                mean += sinusoid(x, y, width, height);
+        mean /= static_cast<double>(width) * height;
+
+        double error = 0;
+        for (unsigned y = 0; y < height; ++y)
+        {
+            for (unsigned x = 0; x < width; ++x)
+            {
+                double expected = sinusoid(x, y, width, height) - mean;
+                error = std::max(error, std::abs(r.heights()[static_cast<size_t>(y) * width + x] - expected));
+            }
+        }
+        return error / (A + B);
+    }
+
+    // The central differences are second order accurate.
+    double sinusoidTolerance(unsigned width, unsigned height)
+    {
+        double size = std::min(width, height);
+        return 30 / (size * size);
+    }
+}
+
+TEST(heightReconstructionFlat)
+{
+    std::vector<float> normals;
+    for (unsigned i = 0; i < 32 * 16; ++i)
+    {
+        normals.push_back(0);
+        normals.push_back(0);
+        normals.push_back(1);
+    }
+
+    HeightReconstruction r(normals.data(), 32, 16, 3);
+    EXPECT(r.heights().size() == 32 * 16);
+    for (float h : r.heights())
+        EXPECT(h == 0);
+}
+
+TEST(heightReconstructionSinusoid)
+{
+    unsigned sizes[][2] = { { 128, 128 }, { 200, 100 }, { 64, 64 } };
+    for (auto &size : sizes)
+    {
+        auto normals = sinusoidNormals(size[0], size[1]);
+        HeightReconstruction r(normals.data(), size[0], size[1], 4);
+
+        EXPECT(sinusoidError(r) < sinusoidTolerance(size[0], size[1]));
+        EXPECT(r.stats().levels > 1);
+        EXPECT(r.stats().cycles <= 3);
+
+        double sum = 0;
+        for (float h : r.heights())
+            sum += h;
+        EXPECT_NEAR(sum / r.heights().size(), 0., 1e-7);
+    }
+}
+
+TEST(heightReconstructionOddSizes)
+{
+    // Odd sizes coarsen like the even ones, and are as accurate.
+    unsigned sizes[][2] = { { 127, 129 }, { 101, 100 }, { 99, 99 }, { 255, 257 }, { 37, 21 } };
+    for (auto &size : sizes)
+    {
+        auto normals = sinusoidNormals(size[0], size[1]);
+        HeightReconstruction r(normals.data(), size[0], size[1], 4);
+
+        EXPECT(sinusoidError(r) < sinusoidTolerance(size[0], size[1]));
+        EXPECT(r.stats().levels >= 3);
+        EXPECT(r.stats().cycles <= 3);
+        EXPECT(r.stats().residual <= HeightReconstruction::defaultSettings().tolerance);
+    }
+}
@@ -0,0 +1,110 @@
+#include "Tests.hpp"
+#include "JobGraph.hpp"
+#include "Parallel.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    typedef JobGraph::Thread Thread;
+
+    // Wait for the flag, giving up after a while so a broken schedule fails
+    // instead of hanging.
+    bool waitFor(const std::atomic<bool> &flag)
+    {
+        auto giveUp = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (!flag)
+        {
+            if (std::chrono::steady_clock::now() > giveUp)
+                return false;
+            std::this_thread::yield();
+        }
+        return true;
+    }
+}
+
+TEST(jobGraphDependencies)
+{
+    // Two independent chains of worker jobs, joined by jobs of the calling
+    // thread, like recording lists and executing them.
+    JobGraph graph;
+    std::mutex mutex;
+    std::vector<JobGraph::Job> order;
+    std::vector<std::thread::id> threads;
+
+    auto job = [&] (JobGraph::Job j)
+    {
+        return [&, j]
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            order.push_back(j);
+            threads[j] = std::this_thread::get_id();
+        };
+    };
+
+    std::vector<std::vector<JobGraph::Job>> dependencies =
+    {
+        {}, {}, { 0 }, { 1 }, { 2, 3 }, { 4 }, { 4 }, { 5, 6 },
+    };
+    std::vector<Thread> kinds =
+    {
+        Thread::Any, Thread::Any, Thread::Any, Thread::Any, Thread::Caller, Thread::Any, Thread::Caller, Thread::Caller,
+    };
+    threads.resize(dependencies.size());
+    for (JobGraph::Job j = 0; j < dependencies.size(); ++j)
+        EXPECT(graph.add("Job", job(j), dependencies[j], kinds[j]) == j);
+    EXPECT(graph.size() == dependencies.size());
+
+    graph.run();
+
+    EXPECT(order.size() == dependencies.size());
+    std::vector<size_t> position(order.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        position[order[i]] = i;
+
+    for (JobGraph::Job j = 0; j < dependencies.size(); ++j)
+    {
+        for (JobGraph::Job d : dependencies[j])
+            EXPECT(position[d] < position[j]);
+        if (kinds[j] == Thread::Caller)
+            EXPECT(threads[j] == std::this_thread::get_id());
+    }
+
+    // Running again runs every job again.
+    order.clear();
+    graph.run();
+    EXPECT(order.size() == dependencies.size());
+
+    graph.clear();
+    EXPECT(graph.size() == 0);
+    graph.run();
+}
+
+TEST(jobGraphCallerRunsAlongsideWorkers)
+{
+    // Needs a worker thread besides the calling one.
+    if (hardwareThreads() < 2)
+        return;
+
+    // The worker job can only finish once the job of the calling thread
+    // has started, so they have to overlap.
+    std::atomic<bool> callerStarted(false);
+    bool overlapped = false;
+
+    JobGraph graph;
+    graph.add("Worker", [&]
+    {
+        overlapped = waitFor(callerStarted);
+    });
+    graph.add("Caller", [&]
+    {
+        callerStarted = true;
+    }, {}, Thread::Caller);
+
+    graph.run();
+    EXPECT(overlapped);
+}
@@ -0,0 +1,315 @@
+#include "Tests.hpp"
+#include "LightingTiles.hpp"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace
+{
+    typedef LightingTileScheduler LTS;
+
+    // 4 x 3 tiles of 32 texels, with partial tiles on the right and bottom.
+    const unsigned Width    = 100;
+    const unsigned Height   = 70;
+    const unsigned TileSize = 32;
+    const unsigned Tiles    = 12;
+    const uint64_t TileTexels = TileSize * TileSize;
+
+    LTS::Inputs inputs(uint64_t lightingHash, float cameraX = 0)
+    {
+        LTS::Inputs i = { lightingHash, { cameraX, 0, 0 } };
+        return i;
+    }
+
+    // Shade every tile of every view, so that nothing is forced anymore.
+    void shadeAll(LTS &s, unsigned views, uint64_t lightingHash = 1)
+    {
+        for (unsigned v = 0; v < views; ++v)
+        {
+            s.update(v, inputs(lightingHash));
+            s.schedule(v, ~0ull);
+        }
+    }
+
+    std::vector<unsigned> tilesOf(const std::vector<LTS::TileUpdate> &updates)
+    {
+        std::vector<unsigned> tiles;
+        for (auto &u : updates)
+            tiles.push_back(u.tile);
+        return tiles;
+    }
+}
+
+TEST(lightingTilesLayout)
+{
+    LTS s(Width, Height, 1, 1, TileSize);
+    EXPECT(s.tileCount() == Tiles);
+    EXPECT(s.tilesX() == 4 && s.tilesY() == 3);
+
+    auto last = s.tileRect(Tiles - 1);
+    EXPECT(last.x0 == 96 && last.x1 == Width && last.y0 == 64 && last.y1 == Height);
+
+    // Coarser levels round outwards.
+    auto coarse = s.tileRect(Tiles - 1, 3);
+    EXPECT(coarse.x0 == 12 && coarse.x1 == 13 && coarse.y0 == 8 && coarse.y1 == 9);
+}
+
+TEST(lightingTilesNeverShadedIgnoreBudget)
+{
+    LTS s(Width, Height, 1, 1, TileSize);
+    s.update(0, inputs(1));
+
+    auto updates = s.schedule(0, 0);
+    EXPECT(updates.size() == Tiles);
+    for (auto &u : updates)
+        EXPECT(u.shading == LTS::Shading::DiffuseAndSpecular && u.level == 0);
+    EXPECT(s.stats().diffuseDirty == 0 && s.stats().specularDirty == 0);
+    EXPECT(s.stats().shadedTexels == Width * Height);
+
+    // Until the inputs change, there is nothing left to do.
+    s.update(0, inputs(1));
+    EXPECT(s.schedule(0, ~0ull).empty());
+}
+
+TEST(lightingTilesBudget)
+{
+    LTS s(Width, Height, 1, 1, TileSize);
+    shadeAll(s, 1);
+
+    // After a change, the budget of three full tiles caps every frame, and
+    // each tile is relit exactly once.
+    s.update(0, inputs(2));
+    std::vector<unsigned> shaded(Tiles, 0);
+    unsigned frames = 0;
+    for (;;)
+    {
+        auto updates = s.schedule(0, 3 * TileTexels);
+        if (updates.empty())
+            break;
+
+        ++frames;
+        EXPECT(s.stats().shadedTexels <= 3 * TileTexels);
+        EXPECT(s.stats().shadedTiles == updates.size());
+        for (auto &u : updates)
+            ++shaded[u.tile];
+    }
+
+    EXPECT(frames == 3);
+    for (unsigned n : shaded)
+        EXPECT(n == 1);
+    EXPECT(s.stats().diffuseDirty == 0);
+
+    // A budget below a single tile still makes progress, one tile a frame.
+    s.update(0, inputs(3));
+    for (unsigned i = 0; i < Tiles; ++i)
+    {
+        EXPECT(s.schedule(0, 0).size() == 1);
+        EXPECT(s.stats().diffuseDirty == Tiles - 1 - i);
+    }
+    EXPECT(s.schedule(0, 0).empty());
+}
+
+TEST(lightingTilesPriority)
+{
+    LTS s(Width, Height, 2, 1, TileSize);
+    shadeAll(s, 2);
+
+    // The diffuse term is shared, so after the other view has relit tiles 0
+    // and 1, only their specular term is left for this view, and the tiles
+    // that still need diffuse lighting go first.
+    s.update(0, inputs(2));
+    s.update(1, inputs(2));
+    EXPECT(tilesOf(s.schedule(1, 2 * TileTexels)) == std::vector<unsigned>({ 0, 1 }));
+
+    auto updates = s.schedule(0, ~0ull);
+    EXPECT(updates.size() == Tiles);
+    for (unsigned i = 0; i < Tiles; ++i)
+    {
+        bool diffuse = i < Tiles - 2;
+        EXPECT(updates[i].tile == (diffuse ? i + 2 : i - (Tiles - 2)));
+        EXPECT((updates[i].shading == LTS::Shading::DiffuseAndSpecular) == diffuse);
+    }
+
+    // Among the tiles waiting for specular lighting, the least recently
+    // shaded ones go first.
+    s.update(0, inputs(2, 1));
+    EXPECT(tilesOf(s.schedule(0, 2 * TileTexels)) == std::vector<unsigned>({ 0, 1 }));
+    s.update(0, inputs(2, 2));
+    EXPECT(tilesOf(s.schedule(0, 2 * TileTexels)) == std::vector<unsigned>({ 2, 3 }));
+    EXPECT(s.stats().oldestTileFrames == 2);
+}
+
+TEST(lightingTilesDirtying)
+{
+    LTS s(Width, Height, 2, 1, TileSize);
+    shadeAll(s, 2);
+
+    // Moving the camera less than the threshold keeps the lighting.
+    s.update(0, inputs(1, s.cameraThreshold() / 2));
+    EXPECT(s.schedule(0, ~0ull).empty());
+
+    // Moving it further only relights the specular term of that view.
+    s.update(0, inputs(1, 1));
+    EXPECT(s.schedule(0, 0).size() == 1);
+    EXPECT(s.stats().diffuseDirty == 0);
+    EXPECT(s.stats().specularDirty == Tiles - 1);
+    s.update(1, inputs(1));
+    EXPECT(s.schedule(1, ~0ull).empty());
+
+    // A change of the lights or materials relights both terms of every view.
+    s.update(0, inputs(2, 1));
+    s.update(1, inputs(2));
+    auto updates = s.schedule(1, ~0ull);
+    EXPECT(updates.size() == Tiles);
+    for (auto &u : updates)
+        EXPECT(u.shading == LTS::Shading::DiffuseAndSpecular);
+
+    updates = s.schedule(0, ~0ull);
+    EXPECT(updates.size() == Tiles);
+    for (auto &u : updates)
+        EXPECT(u.shading == LTS::Shading::Specular);
+
+    // Invalidating forgets everything, regardless of the budget.
+    s.invalidate();
+    s.update(0, inputs(2, 1));
+    EXPECT(s.schedule(0, 0).size() == Tiles);
+    EXPECT(s.residency(0).back() == 0);
+    EXPECT(s.residency(1).back() == Tiles);
+}
+
+namespace
+{
+    typedef LightingFeedback LF;
+
+    const uint32_t NS = LF::NotSampled;
+
+    // The levels of the 4 x 3 tiles, with only the given tiles sampled.
+    std::vector<uint32_t> feedbackFrame(std::vector<std::pair<unsigned, uint32_t>> sampled)
+    {
+        std::vector<uint32_t> levels(Tiles, NS);
+        for (auto &s : sampled)
+            levels[s.first] = s.second;
+        return levels;
+    }
+}
+
+TEST(lightingFeedbackDilation)
+{
+    LF f(4, 3, 1);
+    EXPECT(!f.hasFeedback(0));
+
+    // Tile 5, at (1, 1), is sampled at level 1, and its neighbours are
+    // requested one level coarser. The last column is not needed.
+    f.add(0, feedbackFrame({ { 5, 1 } }).data());
+    EXPECT(f.hasFeedback(0));
+    EXPECT(f.sampledTiles(0) == 1);
+
+    std::vector<uint32_t> expected =
+    {
+        2, 2, 2, NS,
+        2, 1, 2, NS,
+        2, 2, 2, NS,
+    };
+    for (unsigned t = 0; t < Tiles; ++t)
+    {
+        EXPECT(f.level(0, t) == expected[t]);
+        EXPECT(f.level(t) == expected[t]);
+    }
+
+    // The finest level over the history wins, until it falls out of it.
+    f.add(0, feedbackFrame({ { 5, 3 }, { 3, 0 } }).data());
+    EXPECT(f.level(0, 5) == 1);
+    EXPECT(f.level(0, 3) == 0);
+    EXPECT(f.level(0, 7) == 1);
+    EXPECT(f.sampledTiles(0) == 2);
+
+    for (unsigned i = 0; i < LF::DefaultHistory; ++i)
+        f.add(0, feedbackFrame({}).data());
+    EXPECT(f.sampledTiles(0) == 0);
+    for (unsigned t = 0; t < Tiles; ++t)
+        EXPECT(f.level(0, t) == NS);
+}
+
+TEST(lightingTilesScheduleVisibleTiles)
+{
+    LTS s(Width, Height, 1, 4, TileSize);
+    shadeAll(s, 1);
+
+    LF f(4, 3, 1);
+    f.add(0, feedbackFrame({ { 5, 1 } }).data());
+
+    // After a change, only the sampled tile and its neighbours are relit,
+    // at the levels they are sampled at.
+    s.update(0, inputs(2));
+    auto updates = s.schedule(0, ~0ull, &f);
+    EXPECT(updates.size() == 9);
+    for (auto &u : updates)
+    {
+        EXPECT(u.tile % 4 != 3);
+        EXPECT(u.level == (u.tile == 5 ? 1u : 2u));
+        EXPECT(u.shading == LTS::Shading::DiffuseAndSpecular);
+    }
+    EXPECT(s.stats().visibleTiles == 9);
+    // The bottom tiles are 6 texels high, i.e. 2 on level 2.
+    EXPECT(s.stats().requestedTexels == 16 * 16 + 5 * 8 * 8 + 3 * 8 * 2);
+    EXPECT(s.stats().diffuseDirty == 3);
+
+    // Sampling tile 7 brings the last column into view, and its neighbours
+    // in the middle column are now needed one level finer. The dirty tiles
+    // that waited longer go first.
+    f.add(0, feedbackFrame({ { 5, 1 }, { 7, 0 } }).data());
+    updates = s.schedule(0, ~0ull, &f);
+    EXPECT(tilesOf(updates) == std::vector<unsigned>({ 3, 7, 11, 2, 6, 10 }));
+    for (auto &u : updates)
+        EXPECT(u.level == (u.tile == 7 ? 0u : 1u));
+    EXPECT(s.stats().diffuseDirty == 0);
+
+    // Sampling a tile more finely than it is lit relights it and its
+    // neighbours, even though nothing changed. The tiles lit finely enough
+    // are left alone.
+    f.add(0, feedbackFrame({ { 5, 0 } }).data());
+    updates = s.schedule(0, ~0ull, &f);
+    EXPECT(tilesOf(updates) == std::vector<unsigned>({ 0, 1, 4, 5, 8, 9 }));
+    for (auto &u : updates)
+        EXPECT(u.level == (u.tile == 5 ? 0u : 1u));
+
+    // Without feedback for the view, every tile is visible at level 0.
+    LF none(4, 3, 1);
+    s.update(0, inputs(3));
+    EXPECT(s.schedule(0, ~0ull, &none).size() == Tiles);
+    EXPECT(s.stats().visibleTiles == Tiles);
+}
+
+TEST(lightingTilesDiffuseForAllViews)
+{
+    LTS s(Width, Height, 2, 4, TileSize);
+    shadeAll(s, 2);
+
+    // View 1 samples tile 0 at level 0, and view 0 only at level 3.
+    LF f(4, 3, 2);
+    f.add(0, feedbackFrame({ { 0, 3 } }).data());
+    f.add(1, feedbackFrame({ { 0, 0 } }).data());
+    EXPECT(f.level(0) == 0);
+
+    // The shared diffuse term of tile 0 and its neighbours is shaded finely
+    // enough for view 1.
+    s.update(0, inputs(2));
+    s.update(1, inputs(2));
+    auto updates = s.schedule(0, ~0ull, &f);
+    EXPECT(tilesOf(updates) == std::vector<unsigned>({ 0, 1, 4, 5 }));
+    for (auto &u : updates)
+    {
+        EXPECT(u.shading == LTS::Shading::DiffuseAndSpecular);
+        EXPECT(u.level == (u.tile == 0 ? 0u : 1u));
+    }
+
+    // So view 1 only needs its specular term.
+    updates = s.schedule(1, ~0ull, &f);
+    EXPECT(tilesOf(updates) == std::vector<unsigned>({ 0, 1, 4, 5 }));
+    for (auto &u : updates)
+    {
+        EXPECT(u.shading == LTS::Shading::Specular);
+        EXPECT(u.level == (u.tile == 0 ? 0u : 1u));
+    }
+}
@@ -0,0 +1,195 @@
+#include "Tests.hpp"
+#include "PatchTessellation.hpp"
+
+#include <cstdint>
+#include <vector>
+
+namespace
+{
+    typedef PatchTessellation PT;
+
+    // Looking down +z from the origin with a 90 degree left-handed
+    // perspective, like XMMatrixPerspectiveFovLH().
+    PT::View perspectiveView(float width = 1000, float height = 1000)
+    {
+        static const float Near = .1f;
+        static const float Far  = 100.f;
+
+        PT::View view = {};
+        view.viewProj.m[0][0] = 1;
+        view.viewProj.m[1][1] = 1;
+        view.viewProj.m[2][2] = Far / (Far - Near);
+        view.viewProj.m[2][3] = 1;
+        view.viewProj.m[3][2] = -Near * Far / (Far - Near);
+        view.width  = width;
+        view.height = height;
+        return view;
+    }
+
+    PT::Vertex vertex(float x, float y, float z, float factor = PT::MaxFactor)
+    {
+        // Facing the eye at the origin.
+        PT::Vertex v = { { x, y, z }, { 0, 0, -1 }, factor };
+        return v;
+    }
+
+    PT::Settings settings(float edgePixels = 10)
+    {
+        PT::Settings s = { edgePixels, 0, 0 };
+        return s;
+    }
+}
+
+TEST(patchScreenFactor)
+{
+    auto view = perspectiveView();
+
+    // A unit edge at distance 10 is 50 pixels long.
+    EXPECT_NEAR(PT::screenFactor(vertex(0, 0, 10), vertex(1, 0, 10), view, settings()), 5.f, 1e-3f);
+    EXPECT_NEAR(PT::screenFactor(vertex(0, 0, 20), vertex(1, 0, 20), view, settings()), 2.5f, 1e-3f);
+    EXPECT_NEAR(PT::screenFactor(vertex(0, 0, 10), vertex(1, 0, 10), view, settings(5)), 10.f, 1e-3f);
+
+    // Edges through the plane of the eye are only limited by the density.
+    EXPECT(PT::screenFactor(vertex(0, 0, -1), vertex(0, 1, 5), view, settings()) == PT::MaxFactor);
+}
+
+TEST(patchFactorsClampToValidRange)
+{
+    auto view = perspectiveView();
+
+    // Far away, the edges are less than a pixel long.
+    PT::Vertex small[3] = { vertex(0, 0, 90), vertex(.01f, 0, 90), vertex(0, .01f, 90) };
+    auto f = PT::compute(small, view, settings());
+    for (unsigned i = 0; i < 3; ++i)
+        EXPECT(f.edge[i] == 1);
+    EXPECT(f.inside == 1);
+
+    // Close, they would need hundreds of pieces.
+    PT::Vertex large[3] = { vertex(-1, -1, 1), vertex(1, -1, 1), vertex(-1, 1, 1) };
+    f = PT::compute(large, view, settings(1));
+    for (unsigned i = 0; i < 3; ++i)
+        EXPECT(f.edge[i] == PT::MaxFactor);
+    EXPECT(f.inside == PT::MaxFactor);
+
+    // Every factor of random visible patches stays in [1, 64].
+    uint32_t seed = 1;
+    auto random = [&] (float lo, float hi)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return lo + (hi - lo) * static_cast<float>(seed >> 8) / static_cast<float>(1u << 24);
+    };
+
+    for (unsigned n = 0; n < 1000; ++n)
+    {
+        PT::Vertex patch[3];
+        for (auto &v : patch)
+            v = vertex(random(-5, 5), random(-5, 5), random(.5f, 50), random(0, 100));
+
+        f = PT::compute(patch, view, settings(random(1, 20)));
+        if (f.culled())
+            continue;
+
+        for (unsigned i = 0; i < 3; ++i)
+            EXPECT(f.edge[i] >= 1 && f.edge[i] <= PT::MaxFactor);
+        EXPECT(f.inside >= 1 && f.inside <= PT::MaxFactor);
+    }
+}
+
+TEST(patchFactorsLimitedByDensity)
+{
+    auto view = perspectiveView();
+
+    PT::Vertex patch[3] = { vertex(0, 0, 2, 2), vertex(1, 0, 2, 3), vertex(0, 1, 2, 3) };
+    auto f = PT::compute(patch, view, settings());
+
+    // Each edge takes the finer of its vertices, and the inside the coarsest.
+    EXPECT(f.edge[0] == 3);
+    EXPECT(f.edge[1] == 3);
+    EXPECT(f.edge[2] == 3);
+    EXPECT(f.inside == 2);
+}
+
+TEST(patchSharedEdgesAgree)
+{
+    auto view = perspectiveView(1280, 720);
+
+    // A wavy grid in front of the eye, with densities varying per vertex.
+    static const unsigned N = 16;
+    std::vector<PT::Vertex> grid;
+    for (unsigned y = 0; y <= N; ++y)
+    {
+        for (unsigned x = 0; x <= N; ++x)
+        {
+            float fx = static_cast<float>(x);
+            float fy = static_cast<float>(y);
+            grid.emplace_back(vertex(fx - N / 2, fy - N / 2,
+                                     3 + fx * .7f + std::sin(fy) * 2,
+                                     4 + static_cast<float>((x * 7 + y * 3) % 40)));
+        }
+    }
+
+    auto at = [&] (unsigned x, unsigned y) { return grid[y * (N + 1) + x]; };
+
+    unsigned compared = 0;
+    for (unsigned y = 0; y < N; ++y)
+    {
+        for (unsigned x = 0; x < N; ++x)
+        {
+            // The two triangles of the quad share its diagonal, in
+            // opposite directions.
+            PT::Vertex lower[3] = { at(x, y), at(x + 1, y), at(x, y + 1) };
+            PT::Vertex upper[3] = { at(x + 1, y), at(x + 1, y + 1), at(x, y + 1) };
+            auto fl = PT::compute(lower, view, settings());
+            auto fu = PT::compute(upper, view, settings());
+
+            // The diagonal is opposite to vertex 0 of the lower and vertex 1
+            // of the upper triangle.
+            if (!fl.culled() && !fu.culled())
+            {
+                EXPECT(fl.edge[0] == fu.edge[1]);
+                ++compared;
+            }
+
+            // The vertical edge on the right is shared with the lower
+            // triangle of the next quad.
+            if (x + 1 < N)
+            {
+                PT::Vertex next[3] = { at(x + 1, y), at(x + 2, y), at(x + 1, y + 1) };
+                auto fn = PT::compute(next, view, settings());
+                if (!fu.culled() && !fn.culled())
+                {
+                    EXPECT(fu.edge[2] == fn.edge[1]);
+                    ++compared;
+                }
+            }
+        }
+    }
+
+    EXPECT(compared > N * N);
+}
+
+TEST(patchCulling)
+{
+    auto view = perspectiveView();
+
+    PT::Vertex behind[3] = { vertex(0, 0, -10), vertex(1, 0, -10), vertex(0, 1, -10) };
+    EXPECT(PT::compute(behind, view, settings()).culled());
+
+    PT::Vertex right[3] = { vertex(20, 0, 10), vertex(21, 0, 10), vertex(20, 1, 10) };
+    EXPECT(PT::outsideFrustum(right, view, settings()));
+
+    // Displacement that can reach back into the frustum keeps the patch.
+    PT::Settings displaced = { 10, -11, 11 };
+    EXPECT(!PT::outsideFrustum(right, view, displaced));
+
+    // The eye is below the surface of patches facing away from it, unless
+    // the displacement can bring the surface below the eye.
+    PT::Vertex away[3] = { vertex(0, 0, 10), vertex(1, 0, 10), vertex(0, 1, 10) };
+    for (auto &v : away)
+        v.normal[2] = 1;
+    EXPECT(PT::compute(away, view, settings()).culled());
+    EXPECT(!PT::backFacing(away, view, displaced));
+
+    PT::Vertex facing[3] = { vertex(0, 0, 10), vertex(1, 0, 10), vertex(0, 1, 10) };
+    EXPECT(!PT::compute(facing, view, settings()).culled());
+}
@@ -0,0 +1,177 @@
+#include "Tests.hpp"
+#include "ResolutionController.hpp"
+
+#include <cstdint>
+
+namespace
+{
+    typedef ResolutionController RC;
+
+    const double Budget = 1. / 90;
+
+    // GPU cost of the antialiasing levels relative to none, roughly the
+    // shaded samples of NoAA, 4x MSAA, 2x SSAA and 4x SSAA.
+    const double AACosts[] = { 1, 1.5, 2, 4 };
+    const unsigned MaxAALevel = 3;
+
+    // A scene whose GPU time scales with the pixels and the antialiasing
+    // cost, as a fraction of the budget at the full resolution without
+    // antialiasing.
+    struct Scene
+    {
+        double gpuLoad;
+        double cpuLoad;
+        // Relative amount of random variation of each frame.
+        double noise;
+        // Every this many frames, one frame takes twice as long.
+        unsigned spikeInterval;
+    };
+
+    Scene scene(double gpuLoad)
+    {
+        Scene s = { gpuLoad, .3, 0, 0 };
+        return s;
+    }
+
+    double gpuLoad(const RC &c, const Scene &s)
+    {
+        return s.gpuLoad * c.scale() * c.scale() * AACosts[c.aaLevel()];
+    }
+
+    struct Replay
+    {
+        RC controller;
+        unsigned changes;
+        unsigned windows;
+        unsigned lastChangeWindow;
+        uint32_t seed;
+
+        explicit Replay(unsigned maxAALevel)
+            : controller(RC::defaultSettings(Budget, maxAALevel))
+            , changes(0)
+            , windows(0)
+            , lastChangeWindow(0)
+            , seed(1)
+        {}
+
+        double random()
+        {
+            seed = seed * 1664525u + 1013904223u;
+            return static_cast<double>(seed >> 8) / static_cast<double>(1u << 24);
+        }
+
+        // Feed the controller with the given amount of windows of frames.
+        void run(const Scene &s, unsigned windowCount)
+        {
+            unsigned frames = windowCount * controller.settings().windowFrames;
+            for (unsigned f = 0; f < frames; ++f)
+            {
+                double variation = 1 + s.noise * (2 * random() - 1);
+                if (s.spikeInterval && f % s.spikeInterval == 0)
+                    variation *= 2;
+
+                double gpu = gpuLoad(controller, s) * variation * Budget;
+                double cpu = s.cpuLoad * Budget;
+                if (controller.addFrame(cpu, gpu))
+                {
+                    ++changes;
+                    lastChangeWindow = windows;
+                }
+                if ((f + 1) % controller.settings().windowFrames == 0)
+                    ++windows;
+            }
+        }
+    };
+}
+
+TEST(resolutionControllerConverges)
+{
+    auto settings = RC::defaultSettings(Budget);
+
+    // Over the budget, the scale goes right down to the band between the
+    // thresholds, and under it, climbs back up step by step.
+    Replay r(0);
+    r.run(scene(1.3), 20);
+    EXPECT(r.changes == 1);
+    EXPECT(r.controller.scale() < 1);
+    EXPECT(gpuLoad(r.controller, scene(1.3)) <= settings.upperThreshold);
+    EXPECT(gpuLoad(r.controller, scene(1.3)) >= settings.lowerThreshold);
+
+    r.changes = 0;
+    r.run(scene(.5), 40);
+    EXPECT(r.controller.scale() == 1);
+    EXPECT(r.changes >= 2);
+
+    // The scale never goes below the minimum, even if the budget is missed.
+    r.run(scene(5), 20);
+    EXPECT(r.controller.scale() == settings.minScale);
+}
+
+TEST(resolutionControllerLowersAAFirst)
+{
+    // At 1.3 times the budget with the most expensive antialiasing, the
+    // antialiasing steps down while the full resolution stays.
+    Replay r(MaxAALevel);
+    EXPECT(r.controller.aaLevel() == MaxAALevel);
+    r.run(scene(1.3 / AACosts[MaxAALevel]), 20);
+    EXPECT(r.controller.scale() == 1);
+    EXPECT(r.controller.aaLevel() == 2);
+    EXPECT(r.changes == 1);
+
+    // Only without any antialiasing left does the scale go down.
+    r.run(scene(3), 20);
+    EXPECT(r.controller.aaLevel() == 0);
+    EXPECT(r.controller.scale() < 1);
+
+    // Going back up, the scale comes first, and the antialiasing only while
+    // the load stays well under the budget: .2 and .3 of it with no and
+    // with 4x MSAA, but not .4 with 2x SSAA.
+    r.run(scene(.4), 40);
+    EXPECT(r.controller.scale() == 1);
+    EXPECT(r.controller.aaLevel() == 0);
+    r.run(scene(.2), 40);
+    EXPECT(r.controller.aaLevel() == 2);
+    r.run(scene(.1), 40);
+    EXPECT(r.controller.aaLevel() == MaxAALevel);
+}
+
+TEST(resolutionControllerHysteresis)
+{
+    // Frame to frame variation and single slow frames within the band do
+    // not change anything.
+    Replay r(0);
+    Scene noisy = scene(.8);
+    noisy.noise = .08;
+    noisy.spikeInterval = 15;
+    r.run(noisy, 100);
+    EXPECT(r.changes == 0);
+
+    // Neither does missing the budget on the CPU.
+    Scene cpuBound = scene(1.2);
+    cpuBound.cpuLoad = 1.5;
+    r.run(cpuBound, 10);
+    EXPECT(r.changes == 0);
+    EXPECT(r.controller.cpuBound());
+}
+
+TEST(resolutionControllerSettles)
+{
+    // Whatever the load, the quality settles within a few windows and then
+    // stays, without going back and forth between two settings.
+    for (unsigned maxAALevel : { 0u, MaxAALevel })
+    {
+        for (double load = .05; load < 3; load += .01)
+        {
+            Replay r(maxAALevel);
+            Scene s = scene(load);
+            s.noise = .02;
+            r.run(s, 40);
+
+            unsigned settled = r.lastChangeWindow;
+            r.run(s, 40);
+            EXPECT(r.lastChangeWindow == settled);
+            EXPECT(settled < 25);
+            EXPECT(r.changes <= 12);
+        }
+    }
+}
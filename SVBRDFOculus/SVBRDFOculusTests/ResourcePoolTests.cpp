@@ -0,0 +1,167 @@
+#include "Tests.hpp"
+#include "ResourcePool.hpp"
+
+#include <set>
+#include <string>
+#include <vector>
+
+namespace
+{
+    typedef ResourcePool RP;
+
+    // Keys like the ones of the texture pool, which differ by format or size.
+    const std::string Color      = "RGBA8 1024x1024";
+    const std::string ColorSmall = "RGBA8 512x512";
+    const std::string Depth      = "D32 1024x1024";
+
+    const uint64_t ColorBytes      = 4 << 20;
+    const uint64_t ColorSmallBytes = 1 << 20;
+    const uint64_t DepthBytes      = 4 << 20;
+
+    RP::Transient transient(const std::string &key, uint64_t bytes, unsigned firstPass, unsigned lastPass)
+    {
+        RP::Transient t;
+        t.key       = key;
+        t.bytes     = bytes;
+        t.firstPass = firstPass;
+        t.lastPass  = lastPass;
+        return t;
+    }
+}
+
+TEST(resourcePoolReuse)
+{
+    RP pool;
+    bool created = false;
+
+    auto a = pool.acquire(Color, ColorBytes, created);
+    EXPECT(created);
+    EXPECT(pool.users(a) == 1);
+    pool.release(a);
+    EXPECT(pool.users(a) == 0);
+    EXPECT(pool.stats().freeBytes() == ColorBytes);
+
+    // The same key gets the released allocation back, while another format
+    // or size does not.
+    EXPECT(pool.acquire(Color, ColorBytes, created) == a);
+    EXPECT(!created);
+    auto depth = pool.acquire(Depth, DepthBytes, created);
+    EXPECT(created && depth != a);
+    auto small = pool.acquire(ColorSmall, ColorSmallBytes, created);
+    EXPECT(created && small != a && small != depth);
+
+    // A key in use is not shared.
+    auto b = pool.acquire(Color, ColorBytes, created);
+    EXPECT(created && b != a);
+
+    auto &s = pool.stats();
+    EXPECT(s.created == 4);
+    EXPECT(s.reused == 1);
+    EXPECT(s.currentBytes == 2 * ColorBytes + DepthBytes + ColorSmallBytes);
+    EXPECT(s.usedBytes == s.currentBytes);
+    EXPECT(s.peakBytes == s.currentBytes);
+
+    // Of several free allocations, the most recently released one is reused.
+    pool.release(b);
+    pool.release(a);
+    EXPECT(pool.acquire(Color, ColorBytes, created) == a);
+    EXPECT(pool.stats().freeBytes() == ColorBytes);
+}
+
+TEST(resourcePoolTransientAliasing)
+{
+    RP pool;
+    std::vector<RP::Allocation> created;
+
+    // Resources with the same key alias when their pass ranges are
+    // disjoint, also when they are not requested in pass order. Ranges are
+    // inclusive, so sharing a pass is an overlap. Another key never aliases.
+    std::vector<RP::Transient> transients =
+    {
+        transient(Color, ColorBytes, 4, 5),
+        transient(Color, ColorBytes, 0, 1),
+        transient(Color, ColorBytes, 2, 3),
+        transient(Color, ColorBytes, 3, 4),
+        transient(Depth, DepthBytes, 6, 6),
+        transient(ColorSmall, ColorSmallBytes, 7, 7),
+    };
+    auto allocations = pool.acquire(transients, created);
+
+    EXPECT(allocations.size() == transients.size());
+    EXPECT(allocations[0] == allocations[1]);
+    EXPECT(allocations[0] == allocations[2]);
+    EXPECT(allocations[3] != allocations[0]);
+    EXPECT(allocations[4] != allocations[0] && allocations[4] != allocations[3]);
+    EXPECT(allocations[5] != allocations[0] && allocations[5] != allocations[3] && allocations[5] != allocations[4]);
+    EXPECT(created.size() == 4);
+    EXPECT(pool.users(allocations[0]) == 3);
+    EXPECT(pool.users(allocations[3]) == 1);
+
+    auto &s = pool.stats();
+    EXPECT(s.currentBytes == 2 * ColorBytes + DepthBytes + ColorSmallBytes);
+    EXPECT(s.aliasedBytes == 2 * ColorBytes);
+    EXPECT(s.usedBytes == s.currentBytes);
+
+    // A shared allocation is free once every resource has released it.
+    for (size_t i = 0; i < 3; ++i)
+    {
+        EXPECT(pool.users(allocations[0]) == 3 - i);
+        pool.release(allocations[i]);
+    }
+    EXPECT(pool.users(allocations[0]) == 0);
+    EXPECT(s.aliasedBytes == 0);
+    EXPECT(s.freeBytes() == ColorBytes);
+
+    for (size_t i = 3; i < allocations.size(); ++i)
+        pool.release(allocations[i]);
+    EXPECT(s.usedBytes == 0);
+
+    // The next frame reuses the allocations without creating any.
+    created.clear();
+    auto again = pool.acquire(transients, created);
+    EXPECT(created.empty());
+    EXPECT(pool.stats().created == 4);
+    EXPECT(again[0] == again[1] && again[0] == again[2]);
+    EXPECT(std::set<RP::Allocation>(again.begin(), again.end()) ==
+           std::set<RP::Allocation>(allocations.begin(), allocations.end()));
+}
+
+TEST(resourcePoolTrim)
+{
+    RP pool;
+    bool created = false;
+
+    auto a = pool.acquire(Color, ColorBytes, created);
+    auto b = pool.acquire(Depth, DepthBytes, created);
+    auto c = pool.acquire(ColorSmall, ColorSmallBytes, created);
+    auto d = pool.acquire(Color, ColorBytes, created);
+
+    // Allocations in use are never destroyed.
+    EXPECT(pool.trim(0).empty());
+
+    pool.release(b);
+    pool.release(a);
+    pool.release(c);
+    EXPECT(pool.stats().freeBytes() == ColorBytes + DepthBytes + ColorSmallBytes);
+
+    // The least recently released go first, until few enough bytes are free.
+    auto destroyed = pool.trim(ColorSmallBytes);
+    EXPECT(destroyed.size() == 2);
+    EXPECT(destroyed[0] == b && destroyed[1] == a);
+    EXPECT(pool.stats().freeBytes() == ColorSmallBytes);
+    EXPECT(pool.stats().currentBytes == ColorBytes + ColorSmallBytes);
+    EXPECT(pool.stats().peakBytes == 2 * ColorBytes + DepthBytes + ColorSmallBytes);
+
+    // A destroyed allocation is not reused for its old key, but its index is
+    // reused for a new allocation.
+    auto e = pool.acquire(Depth, DepthBytes, created);
+    EXPECT(created);
+    EXPECT(e == a || e == b);
+    EXPECT(pool.users(e) == 1);
+
+    pool.release(d);
+    pool.release(e);
+    EXPECT(pool.trim(0).size() == 3);
+    EXPECT(pool.stats().currentBytes == 0);
+    EXPECT(pool.stats().freeBytes() == 0);
+}
@@ -0,0 +1,113 @@
+#include "Tests.hpp"
+#include "RingAllocator.hpp"
+
+#include <cstdint>
+
+namespace
+{
+    typedef RingAllocator RA;
+
+    const uint32_t A = RA::Alignment;
+}
+
+TEST(ringAllocatorAlignment)
+{
+    EXPECT(RA::alignedSize(1) == A);
+    EXPECT(RA::alignedSize(A) == A);
+    EXPECT(RA::alignedSize(A + 1) == 2 * A);
+
+    // The buffer size is rounded down to whole blocks.
+    RA ring(10 * A + 100);
+    EXPECT(ring.bufferSize() == 10 * A);
+
+    // Requested and allocated sizes. Empty allocations still take a block.
+    uint32_t sizes[][2] = { { 16, A }, { 1, A }, { A, A }, { A + 16, 2 * A }, { 0, A }, { 3 * A - 1, 3 * A } };
+    uint32_t expectedOffset = 0;
+    for (auto &size : sizes)
+    {
+        auto a = ring.allocate(size[0]);
+        EXPECT(a.valid());
+        EXPECT(a.offset == expectedOffset);
+        EXPECT(a.size == size[1]);
+        expectedOffset += a.size;
+    }
+    EXPECT(expectedOffset == 9 * A);
+}
+
+TEST(ringAllocatorDiscard)
+{
+    RA ring(4 * A);
+
+    // Only the first allocation of each frame discards.
+    for (unsigned frame = 0; frame < 3; ++frame)
+    {
+        ring.beginFrame();
+        EXPECT(ring.allocate(16).discard);
+        EXPECT(!ring.allocate(16).discard);
+        EXPECT(!ring.allocate(16).discard);
+    }
+
+    // Running out of space starts over from the beginning with a discard,
+    // after which the frame goes on without one.
+    ring.beginFrame();
+    auto a = ring.allocate(3 * A);
+    EXPECT(a.discard && a.offset == 0);
+    auto b = ring.allocate(2 * A);
+    EXPECT(b.discard && b.offset == 0);
+    auto c = ring.allocate(A);
+    EXPECT(!c.discard && c.offset == 2 * A);
+    auto d = ring.allocate(A);
+    EXPECT(!d.discard && d.offset == 3 * A);
+    auto e = ring.allocate(1);
+    EXPECT(e.discard && e.offset == 0);
+    EXPECT(ring.frameStats().wraps == 2);
+
+    // An allocation that fits exactly does not wrap.
+    ring.beginFrame();
+    EXPECT(ring.allocate(4 * A).valid());
+    EXPECT(ring.frameStats().wraps == 0);
+}
+
+TEST(ringAllocatorTooLarge)
+{
+    RA ring(2 * A);
+    ring.beginFrame();
+    EXPECT(!ring.allocate(2 * A + 1).valid());
+
+    // A failed allocation changes nothing, so the next one still discards.
+    EXPECT(ring.frameStats().allocations == 0);
+    auto a = ring.allocate(A);
+    EXPECT(a.valid() && a.discard && a.offset == 0);
+
+    RA empty;
+    EXPECT(empty.bufferSize() == 0);
+    EXPECT(!empty.allocate(1).valid());
+}
+
+TEST(ringAllocatorStats)
+{
+    RA ring(4 * A);
+    EXPECT(ring.frameStats().frame == 0);
+
+    ring.beginFrame();
+    ring.allocate(16);
+    ring.allocate(A + 1);
+    ring.allocate(2 * A);
+
+    auto &s = ring.frameStats();
+    EXPECT(s.frame == 1);
+    EXPECT(s.allocations == 3);
+    EXPECT(s.bytesWritten == 16 + A + 1 + 2 * A);
+    EXPECT(s.bytesAllocated == A + 2 * A + 2 * A);
+    EXPECT(s.wraps == 1);
+
+    // The completed frame moves to the last frame stats.
+    ring.beginFrame();
+    EXPECT(ring.frameStats().frame == 2);
+    EXPECT(ring.frameStats().allocations == 0);
+    EXPECT(ring.frameStats().bytesAllocated == 0);
+    EXPECT(ring.lastFrameStats().frame == 1);
+    EXPECT(ring.lastFrameStats().allocations == 3);
+    EXPECT(ring.lastFrameStats().bytesAllocated == 5 * A);
+    EXPECT(ring.lastFrameStats().wraps == 1);
+}
@@ -0,0 +1,251 @@
+#include "Tests.hpp"
+
+// The state cache works on Direct3D interfaces, so it is only tested where
+// the Windows SDK headers are available.
+#if defined(_WIN32)
+
+#include "StateCache.hpp"
+
+#include <cstdint>
+#include <vector>
+
+namespace
+{
+    typedef RecordingBackend::Command Command;
+
+    // Just enough of the COM interfaces for the state cache, which only asks
+    // views for their resources. The objects live on the stack, so the
+    // reference counts never delete them.
+    template <typename Interface>
+    class FakeDeviceChild : public Interface
+    {
+    public:
+        HRESULT STDMETHODCALLTYPE QueryInterface(REFIID, void **object) override
+        {
+            *object = nullptr;
+            return E_NOINTERFACE;
+        }
+        ULONG STDMETHODCALLTYPE AddRef() override { return ++references; }
+        ULONG STDMETHODCALLTYPE Release() override { return --references; }
+
+        void STDMETHODCALLTYPE GetDevice(ID3D11Device **device) override { *device = nullptr; }
+        HRESULT STDMETHODCALLTYPE GetPrivateData(REFGUID, UINT *, void *) override { return E_NOTIMPL; }
+        HRESULT STDMETHODCALLTYPE SetPrivateData(REFGUID, UINT, const void *) override { return E_NOTIMPL; }
+        HRESULT STDMETHODCALLTYPE SetPrivateDataInterface(REFGUID, const IUnknown *) override { return E_NOTIMPL; }
+
+    private:
+        ULONG references = 1;
+    };
+
+    class FakeResource : public FakeDeviceChild<ID3D11Resource>
+    {
+    public:
+        void STDMETHODCALLTYPE GetType(D3D11_RESOURCE_DIMENSION *dimension) override
+        {
+            *dimension = D3D11_RESOURCE_DIMENSION_TEXTURE2D;
+        }
+        void STDMETHODCALLTYPE SetEvictionPriority(UINT) override {}
+        UINT STDMETHODCALLTYPE GetEvictionPriority() override { return 0; }
+    };
+
+    template <typename Interface, typename Desc>
+    class FakeView : public FakeDeviceChild<Interface>
+    {
+    public:
+        FakeView(FakeResource &resource) : resource(resource) {}
+
+        void STDMETHODCALLTYPE GetResource(ID3D11Resource **r) override
+        {
+            resource.AddRef();
+            *r = &resource;
+        }
+        void STDMETHODCALLTYPE GetDesc(Desc *desc) override { zero(*desc); }
+
+    private:
+        FakeResource &resource;
+    };
+
+    typedef FakeView<ID3D11ShaderResourceView, D3D11_SHADER_RESOURCE_VIEW_DESC>   FakeSRV;
+    typedef FakeView<ID3D11RenderTargetView, D3D11_RENDER_TARGET_VIEW_DESC>       FakeRTV;
+    typedef FakeView<ID3D11DepthStencilView, D3D11_DEPTH_STENCIL_VIEW_DESC>       FakeDSV;
+    typedef FakeView<ID3D11UnorderedAccessView, D3D11_UNORDERED_ACCESS_VIEW_DESC> FakeUAV;
+
+    // Objects that the state cache only compares, and never calls.
+    template <typename T>
+    T *handle(uintptr_t id)
+    {
+        return reinterpret_cast<T *>(id * 16);
+    }
+
+    std::vector<Command> commands(const RecordingBackend &recording)
+    {
+        std::vector<Command> c;
+        for (auto &r : recording.records())
+            c.push_back(r.command);
+        return c;
+    }
+
+    // Slots set by a recorded SetShaderResources or SetSamplers.
+    unsigned slotCount(const RecordingBackend::Record &r)
+    {
+        return static_cast<unsigned>((r.bytes - 2 * sizeof(UINT)) / sizeof(void *));
+    }
+}
+
+TEST(stateCacheFiltersRedundantBinds)
+{
+    RecordingBackend recording;
+    StateCache cache(recording);
+
+    PipelineState pipeline;
+    zero(pipeline);
+    pipeline.primitiveTopology = D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
+    D3D11_VIEWPORT viewport = { 0, 0, 64, 64, 0, 1 };
+    auto cb = handle<ID3D11Buffer>(1);
+    auto ds = handle<ID3D11DepthStencilState>(2);
+
+    cache.bindPipeline(pipeline);
+    cache.bindPipeline(pipeline);
+    cache.setViewport(viewport);
+    cache.setViewport(viewport);
+    // Another range of the same buffer, or the same range in another stage,
+    // is a change.
+    cache.setConstantBuffer(ShaderStage::PS, 0, cb, 0, 16);
+    cache.setConstantBuffer(ShaderStage::PS, 0, cb, 0, 16);
+    cache.setConstantBuffer(ShaderStage::PS, 0, cb, 16, 16);
+    cache.setConstantBuffer(ShaderStage::VS, 0, cb, 16, 16);
+    cache.setDepthStencilState(ds, 1);
+    cache.setDepthStencilState(ds, 1);
+
+    EXPECT(cache.stats().binds == 10);
+    EXPECT(cache.stats().issued == 6);
+    EXPECT(cache.stats().filtered() == 4);
+    EXPECT(recording.stats().stateChanges() == cache.stats().issued);
+    EXPECT(recording.stats().count(Command::BindPipeline) == 1);
+    EXPECT(recording.stats().count(Command::SetViewport) == 1);
+    EXPECT(recording.stats().count(Command::SetConstantBuffer) == 3);
+    EXPECT(recording.stats().count(Command::SetDepthStencilState) == 1);
+
+    // After invalidating, the same binds are issued again.
+    cache.invalidate();
+    cache.bindPipeline(pipeline);
+    cache.setConstantBuffer(ShaderStage::PS, 0, cb, 16, 16);
+    EXPECT(cache.stats().issued == 8);
+    EXPECT(recording.stats().stateChanges() == 8);
+}
+
+TEST(stateCacheBatchesShaderResources)
+{
+    RecordingBackend recording;
+    StateCache cache(recording);
+
+    FakeResource a, b, c;
+    FakeSRV srvA(a), srvB(b), srvC(c);
+    ID3D11ShaderResourceView *srvs[] = { &srvA, &srvB, &srvC };
+    ID3D11ShaderResourceView *none   = nullptr;
+    ID3D11SamplerState *samplers[]   = { handle<ID3D11SamplerState>(1), handle<ID3D11SamplerState>(2) };
+
+    // Unbinding and rebinding before the draw costs nothing, and the
+    // adjacent slots go out in one call at the draw.
+    cache.setShaderResources(ShaderStage::PS, 0, 1, &srvs[0]);
+    cache.setShaderResources(ShaderStage::PS, 1, 1, &srvs[1]);
+    cache.setShaderResources(ShaderStage::PS, 2, 1, &srvs[2]);
+    cache.setShaderResources(ShaderStage::PS, 1, 1, &none);
+    cache.setShaderResources(ShaderStage::PS, 1, 1, &srvs[1]);
+    cache.setSamplers(ShaderStage::PS, 0, 1, &samplers[0]);
+    cache.setSamplers(ShaderStage::PS, 3, 1, &samplers[1]);
+    EXPECT(recording.records().empty());
+
+    cache.draw(3, 0);
+    std::vector<Command> expected =
+    {
+        Command::SetShaderResources, Command::SetSamplers, Command::SetSamplers, Command::Draw,
+    };
+    EXPECT(commands(recording) == expected);
+    EXPECT(slotCount(recording.records()[0]) == 3);
+    EXPECT(slotCount(recording.records()[1]) == 1);
+    EXPECT(cache.stats().binds == 7);
+    EXPECT(cache.stats().issued == 3);
+
+    // Binding the same views again issues nothing, and changing one slot
+    // issues only that one.
+    recording.reset();
+    cache.setShaderResources(ShaderStage::PS, 0, 3, srvs);
+    cache.draw(3, 0);
+    cache.setShaderResources(ShaderStage::PS, 2, 1, &srvs[0]);
+    cache.drawIndexed(6, 1);
+    expected = { Command::Draw, Command::SetShaderResources, Command::DrawIndexed };
+    EXPECT(commands(recording) == expected);
+    EXPECT(slotCount(recording.records()[1]) == 1);
+
+    // Slots past the shadowed ones are passed through right away.
+    recording.reset();
+    cache.setShaderResources(ShaderStage::PS, StateCache::ShaderResourceSlots, 1, &srvs[0]);
+    EXPECT(recording.stats().count(Command::SetShaderResources) == 1);
+    EXPECT(cache.stats().binds == 10);
+    EXPECT(cache.stats().issued == 5);
+}
+
+TEST(stateCacheUnbindsOutputs)
+{
+    RecordingBackend recording;
+    StateCache cache(recording);
+
+    FakeResource color, shadow;
+    FakeSRV colorSRV(color), shadowSRV(shadow);
+    FakeRTV colorRTV(color);
+    FakeDSV shadowDSV(shadow);
+    FakeUAV colorUAV(color);
+    ID3D11RenderTargetView *rtvs[] = { &colorRTV };
+    ID3D11ShaderResourceView *srvs[] = { &shadowSRV, &colorSRV };
+
+    // Rendering the shadow map again unbinds its view in the runtime, so
+    // binding the view afterwards is not filtered.
+    cache.setRenderTargets(0, nullptr, &shadowDSV);
+    cache.draw(3, 0);
+    cache.setRenderTargets(1, rtvs, nullptr);
+    cache.setShaderResources(ShaderStage::PS, 0, 1, &srvs[0]);
+    cache.draw(3, 0);
+    cache.setRenderTargets(0, nullptr, &shadowDSV);
+    cache.draw(3, 0);
+    cache.setRenderTargets(1, rtvs, nullptr);
+    cache.setShaderResources(ShaderStage::PS, 0, 1, &srvs[0]);
+    cache.draw(3, 0);
+
+    std::vector<Command> expected =
+    {
+        Command::SetRenderTargets, Command::Draw,
+        Command::SetRenderTargets, Command::SetShaderResources, Command::Draw,
+        Command::SetRenderTargets, Command::Draw,
+        Command::SetRenderTargets, Command::SetShaderResources, Command::Draw,
+    };
+    EXPECT(commands(recording) == expected);
+
+    // A deferred bind of a view of a new output is issued before the
+    // output, to keep the order. Binding the UAV also means the same
+    // render targets are bound again afterwards.
+    recording.reset();
+    cache.setShaderResources(ShaderStage::PS, 1, 1, &srvs[1]);
+    cache.setUnorderedAccessView(1, &colorUAV);
+    cache.setRenderTargets(1, rtvs, nullptr);
+    cache.draw(3, 0);
+    expected =
+    {
+        Command::SetShaderResources, Command::SetUnorderedAccessView, Command::SetRenderTargets, Command::Draw,
+    };
+    EXPECT(commands(recording) == expected);
+    EXPECT(slotCount(recording.records()[0]) == 1);
+
+    // The color view was unbound by the UAV, so binding it is issued.
+    recording.reset();
+    cache.setShaderResources(ShaderStage::PS, 1, 1, &srvs[1]);
+    cache.draw(3, 0);
+    expected = { Command::SetShaderResources, Command::Draw };
+    EXPECT(commands(recording) == expected);
+
+    // Every bind above changed the state, so none was filtered.
+    EXPECT(cache.stats().binds == 10);
+    EXPECT(cache.stats().filtered() == 0);
+}
+
+#endif
@@ -0,0 +1,303 @@
+#include "Tests.hpp"
+#include "TangentFrames.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace
+{
+    typedef TangentFrames TF;
+
+    const float Pi = 3.14159265f;
+
+    // Quantizing to 16 bits moves the axes by a few 1e-5.
+    const float QuantizationError = 2e-4f;
+
+    struct Vertex
+    {
+        float position[3];
+        float normal[3];
+        float uv[2];
+    };
+
+    const size_t Stride = sizeof(Vertex) / sizeof(float);
+
+    TF::Mesh mesh(const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices)
+    {
+        TF::Mesh m;
+        m.positions   = vertices[0].position;
+        m.normals     = vertices[0].normal;
+        m.uvs         = vertices[0].uv;
+        m.stride      = Stride;
+        m.vertexCount = vertices.size();
+        m.indices     = indices.data();
+        m.indexCount  = indices.size();
+        return m;
+    }
+
+    float dot(const float a[3], const float b[3])
+    {
+        return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+    }
+
+    void cross(const float a[3], const float b[3], float result[3])
+    {
+        result[0] = a[1] * b[2] - a[2] * b[1];
+        result[1] = a[2] * b[0] - a[0] * b[2];
+        result[2] = a[0] * b[1] - a[1] * b[0];
+    }
+
+    void normalize(float v[3])
+    {
+        float invLength = 1 / std::sqrt(dot(v, v));
+        for (unsigned k = 0; k < 3; ++k)
+            v[k] *= invLength;
+    }
+
+    // Counter-clockwise triangles of a W x H grid of vertices in rows, with
+    // alternating diagonals like generateDisplacedGrid() in SVBRDFOculus.cpp.
+    std::vector<uint32_t> gridIndices(unsigned W, unsigned H)
+    {
+        std::vector<uint32_t> indices;
+        for (unsigned y = 0; y + 1 < H; ++y)
+        {
+            for (unsigned x = 0; x + 1 < W; ++x)
+            {
+                uint32_t A = y * W + x;
+                uint32_t B = A + 1;
+                uint32_t C = A + W;
+                uint32_t D = C + 1;
+
+                uint32_t quad[2][6] = { { A, C, B, B, C, D }, { A, D, B, A, C, D } };
+                indices.insert(indices.end(), quad[(x + y) % 2], quad[(x + y) % 2] + 6);
+            }
+        }
+        return indices;
+    }
+
+    void expectOrthonormal(const TF::Quaternion &q)
+    {
+        float t[3];
+        float n[3];
+        float sign;
+        TF::decode(q, t, n, sign);
+
+        EXPECT_NEAR(dot(t, t), 1.f, QuantizationError);
+        EXPECT_NEAR(dot(n, n), 1.f, QuantizationError);
+        EXPECT_NEAR(dot(t, n), 0.f, QuantizationError);
+        EXPECT(sign == 1 || sign == -1);
+    }
+}
+
+TEST(tangentFrameRoundTrip)
+{
+    uint32_t seed = 1;
+    auto random = [&] ()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1u << 23) - 1;
+    };
+
+    // Random frames, and the ones whose quaternions have w = 0, i.e. the
+    // half turns, where the sign of the bitangent needs the clamped w.
+    std::vector<float> frames;
+    for (unsigned i = 0; i < 1000; ++i)
+    {
+        float n[3] = { random(), random(), random() };
+        float t[3] = { random(), random(), random() };
+        normalize(n);
+        float d = dot(t, n);
+        for (unsigned k = 0; k < 3; ++k)
+            t[k] -= d * n[k];
+        normalize(t);
+        frames.insert(frames.end(), t, t + 3);
+        frames.insert(frames.end(), n, n + 3);
+    }
+
+    float halfTurns[][6] =
+    {
+        { -1, 0, 0,  0, 0, -1 },
+        {  1, 0, 0,  0, 0, -1 },
+        { -1, 0, 0,  0, 1,  0 },
+        {  0, 0, 1,  1, 0,  0 },
+    };
+    for (auto &f : halfTurns)
+        frames.insert(frames.end(), f, f + 6);
+
+    for (size_t i = 0; i < frames.size(); i += 6)
+    {
+        const float *t = &frames[i];
+        const float *n = &frames[i + 3];
+
+        for (float sign : { 1.f, -1.f })
+        {
+            auto q = TF::encode(t, n, sign);
+
+            float decodedT[3];
+            float decodedN[3];
+            float decodedSign;
+            TF::decode(q, decodedT, decodedN, decodedSign);
+
+            EXPECT(decodedSign == sign);
+            EXPECT((q.w < 0) == (sign < 0));
+            for (unsigned k = 0; k < 3; ++k)
+            {
+                EXPECT_NEAR(decodedT[k], t[k], QuantizationError);
+                EXPECT_NEAR(decodedN[k], n[k], QuantizationError);
+            }
+        }
+    }
+
+    // A tangent along the normal still gives some orthonormal frame.
+    float n[3] = { 0, 1, 0 };
+    auto q = TF::encode(n, n, -1);
+    expectOrthonormal(q);
+
+    float decodedT[3];
+    float decodedN[3];
+    float decodedSign;
+    TF::decode(q, decodedT, decodedN, decodedSign);
+    EXPECT_NEAR(decodedN[1], 1.f, QuantizationError);
+    EXPECT(decodedSign == -1);
+}
+
+TEST(tangentFramesMirroredUVs)
+{
+    // A surface curved along y, z = .2 sin(y), whose U is mirrored at
+    // x = N / 2 and V grows with y.
+    static const unsigned N = 8;
+    static const unsigned W = N + 1;
+
+    std::vector<Vertex> vertices;
+    for (unsigned y = 0; y < W; ++y)
+    {
+        for (unsigned x = 0; x < W; ++x)
+        {
+            float fx = static_cast<float>(x);
+            float fy = static_cast<float>(y);
+
+            Vertex v = { { fx, fy, .2f * std::sin(fy) }, { 0, -.2f * std::cos(fy), 1 },
+                         { std::abs(fx - N / 2) / N, fy / N } };
+            normalize(v.normal);
+            vertices.push_back(v);
+        }
+    }
+
+    auto indices = gridIndices(W, W);
+    TF frames(mesh(vertices, indices));
+
+    // Each vertex on the seam is split, as its triangles on either side
+    // have opposite signs.
+    EXPECT(frames.splitVertices().size() == W);
+    for (uint32_t v : frames.splitVertices())
+        EXPECT(v % W == N / 2);
+    EXPECT(frames.frames().size() == vertices.size() + W);
+    EXPECT(frames.indices().size() == indices.size());
+
+    for (auto &q : frames.frames())
+        expectOrthonormal(q);
+
+    for (size_t c = 0; c < indices.size(); ++c)
+    {
+        // U grows towards -x left of the seam, and towards +x right of it.
+        size_t triangle = c / 3;
+        bool left = vertices[indices[triangle * 3]].position[0] + vertices[indices[triangle * 3 + 1]].position[0]
+                  + vertices[indices[triangle * 3 + 2]].position[0] < 3 * N / 2.f;
+        float direction = left ? -1.f : 1.f;
+
+        float t[3];
+        float n[3];
+        float sign;
+        TF::decode(frames.frames()[frames.indices()[c]], t, n, sign);
+
+        const float *normal = vertices[indices[c]].normal;
+        for (unsigned k = 0; k < 3; ++k)
+            EXPECT_NEAR(n[k], normal[k], QuantizationError);
+        EXPECT_NEAR(t[0], direction, QuantizationError);
+
+        // The bitangent follows V, i.e. +y, on both sides.
+        float b[3];
+        cross(n, t, b);
+        EXPECT(b[1] * sign > .9f);
+    }
+}
+
+TEST(tangentFramesMatchDisplacedGrid)
+{
+    // The scalar version of generateDisplacedGrid() in SVBRDFOculus.cpp,
+    // whose frames are analytic: the tangent follows x over the surface and
+    // the bitangent sign is negative.
+    static const unsigned W         = 33;
+    static const unsigned H         = 17;
+    static const float    XDim      = 2;
+    static const float    YDim      = 1;
+    static const float    Magnitude = .5f;
+
+    const float maxX  = static_cast<float>(W - 1);
+    const float maxY  = static_cast<float>(H - 1);
+    const float stepX = 2 * XDim / maxX;
+    const float stepY = 2 * YDim / maxY;
+
+    auto height = [&] (int x, int y)
+    {
+        x = std::max(0, std::min(static_cast<int>(W) - 1, x));
+        y = std::max(0, std::min(static_cast<int>(H) - 1, y));
+        float u = static_cast<float>(x) / maxX;
+        float v = static_cast<float>(y) / maxY;
+        return std::sin(2 * Pi * u) * std::cos(2 * Pi * v) + .5f * u;
+    };
+
+    std::vector<Vertex> vertices;
+    std::vector<TF::Quaternion> expected;
+    for (int y = 0; y < static_cast<int>(H); ++y)
+    {
+        for (int x = 0; x < static_cast<int>(W); ++x)
+        {
+            float u = static_cast<float>(x) / maxX;
+            float v = static_cast<float>(y) / maxY;
+
+            float spanX = x == 0 || x == static_cast<int>(W) - 1 ? 1.f : .5f;
+            float spanY = y == 0 || y == static_cast<int>(H) - 1 ? 1.f : .5f;
+            float dx    = (height(x + 1, y) - height(x - 1, y)) * spanX;
+            float dy    = height(x, y + 1) - height(x, y - 1);
+
+            Vertex vertex = { { (2 * u - 1) * XDim, ((1 - v) * 2 - 1) * YDim, Magnitude * height(x, y) },
+                              { -dx * stepY * Magnitude, dy * stepX * Magnitude * spanY, stepX * stepY },
+                              { u, v } };
+            normalize(vertex.normal);
+            vertices.push_back(vertex);
+
+            float tangent[3] = { stepX, 0, dx * Magnitude };
+            normalize(tangent);
+            expected.push_back(TF::encode(tangent, vertex.normal, -1));
+        }
+    }
+
+    TF frames(mesh(vertices, gridIndices(W, H)));
+    EXPECT(frames.splitVertices().empty());
+    EXPECT(frames.frames().size() == expected.size());
+
+    // The averaged triangle tangents differ from the central differences
+    // by the curvature over a quad.
+    float maxAngle = 0;
+    for (size_t i = 0; i < expected.size(); ++i)
+    {
+        float t[3];
+        float n[3];
+        float sign;
+        TF::decode(frames.frames()[i], t, n, sign);
+
+        float expectedT[3];
+        float expectedN[3];
+        float expectedSign;
+        TF::decode(expected[i], expectedT, expectedN, expectedSign);
+
+        EXPECT(sign == expectedSign);
+        for (unsigned k = 0; k < 3; ++k)
+            EXPECT_NEAR(n[k], expectedN[k], QuantizationError);
+        maxAngle = std::max(maxAngle, std::acos(std::min(1.f, dot(t, expectedT))));
+    }
+    EXPECT(maxAngle < .02f);
+}
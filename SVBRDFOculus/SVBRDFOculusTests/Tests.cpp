@@ -0,0 +1,60 @@
+#include "Tests.hpp"
+
+#include <cstdio>
+#include <vector>
+
+namespace
+{
+    struct Test
+    {
+        const char *name;
+        TestFunction f;
+    };
+
+    // Constructed on first use, as the registrations are static objects of
+    // other translation units.
+    std::vector<Test> &tests()
+    {
+        static std::vector<Test> t;
+        return t;
+    }
+
+    unsigned failures = 0;
+}
+
+TestRegistration::TestRegistration(const char *name, TestFunction f)
+{
+    Test t = { name, f };
+    tests().emplace_back(t);
+}
+
+void expect(bool condition, const char *expression, const char *file, int line)
+{
+    if (!condition)
+    {
+        printf("%s(%d): failed: %s\n", file, line, expression);
+        ++failures;
+    }
+}
+
+int main()
+{
+    unsigned failedTests = 0;
+
+    for (auto &t : tests())
+    {
+        unsigned before = failures;
+        t.f();
+
+        bool passed = failures == before;
+        printf("%-40s %s\n", t.name, passed ? "ok" : "FAILED");
+        if (!passed)
+            ++failedTests;
+    }
+
+    printf("%u / %u tests passed.\n",
+           static_cast<unsigned>(tests().size()) - failedTests,
+           static_cast<unsigned>(tests().size()));
+
+    return failedTests == 0 ? 0 : 1;
+}
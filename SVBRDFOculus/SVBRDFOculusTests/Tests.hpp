@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cmath>
+
+// A minimal test runner for the parts of the renderer that do not need a
+// device. Each TEST() registers itself, and the failed EXPECT()s of every
+// test are reported before the runner returns a nonzero exit code.
+
+typedef void (*TestFunction)();
+
+struct TestRegistration
+{
+    TestRegistration(const char *name, TestFunction f);
+};
+
+void expect(bool condition, const char *expression, const char *file, int line);
+
+#define TEST(name) \
+    static void name(); \
+    static TestRegistration name##Registration(#name, name); \
+    static void name()
+
+#define EXPECT(condition) \
+    expect((condition), #condition, __FILE__, __LINE__)
+
+#define EXPECT_NEAR(a, b, tolerance) \
+    expect(std::abs((a) - (b)) <= (tolerance), #a " == " #b, __FILE__, __LINE__)